@@ -4,10 +4,104 @@
 #include <vector>          // For storing patterns, files, matches
 #include <regex>           // For regular expression support (-E, -w, -i, -o)
 #include <stdexcept>       // For standard exceptions
-#include <deque>           // For efficient handling of context lines (-A, -B, -C)
+#include <deque>           // For the directory walker's and the worker pool's queues
+#include <list>            // For the files in flight in the -j worker pool
 #include <set>             // Could be used for tracking printed lines (alternative to last_printed_line)
 #include <algorithm>       // For std::transform, std::sort, std::search
 #include <cctype>          // For tolower, isalnum
+#include <chrono>          // For timing pattern compilation (--stats)
+#include <charconv>        // For to_chars (line numbers and counts in the output buffer)
+#include <cstdio>          // For fwrite, fflush on stdout
+#include <climits>         // For INT_MAX
+#include <cstring>         // For memchr, memmove
+#include <string_view>     // For non-owning views into mapped file data
+#include <unordered_map>   // For building the Aho-Corasick trie and indexing DFA states
+#include <bitset>          // For regex byte sets
+#include <thread>          // For the directory walker's threads (-r)
+#include <mutex>           // For the directory walker's work queues
+#include <condition_variable> // For idle walker threads and the searching thread
+#include <atomic>          // For the directory walker's work counters
+#include <memory>          // For unique_ptr
+#include <functional>      // For std::function (output spilling)
+#include <cstdlib>         // For malloc, free (allocation counting builds)
+#include <new>             // For bad_alloc (allocation counting builds)
+#include <cstdint>         // For the fixed-width fields of the index file (--index)
+#include <type_traits>     // For is_trivially_copyable (pattern cache encoding)
+
+// SIMD kernels are compiled per instruction set and selected at runtime
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SCANR_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SCANR_NEON 1
+#include <arm_neon.h>
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+#define SCANR_TARGET(features) __attribute__((target(features)))
+#else
+#define SCANR_TARGET(features)
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>       // For CreateFileMapping/MapViewOfFile
+#include <fcntl.h>         // For _O_BINARY, _O_RDONLY
+#include <io.h>            // For _open, _read, _setmode, _isatty
+#include <direct.h>        // For _getcwd, _chdir (--serve)
+#else
+#include <cerrno>          // For EINTR
+#include <fcntl.h>         // For open
+#include <sys/mman.h>      // For mmap, madvise
+#include <sys/stat.h>      // For fstat, fstatat
+#include <unistd.h>        // For read, close, isatty
+#include <dirent.h>        // For DT_* entry types, readdir
+#include <poll.h>          // For poll (--follow)
+#include <signal.h>        // For ignoring SIGPIPE (--serve)
+#include <sys/socket.h>    // For the local socket of --serve and --connect
+#include <sys/un.h>        // For sockaddr_un
+#ifdef __linux__
+#include <sys/inotify.h>   // For watching followed files (--follow)
+#include <sys/syscall.h>   // For SYS_getdents64, SYS_io_uring_setup
+#if __has_include(<linux/io_uring.h>) && defined(SYS_io_uring_setup)
+#define SCANR_IO_URING 1
+#include <linux/io_uring.h> // For the io_uring ring layout (async reads)
+#endif
+#endif
+#endif
+
+#include "scanr_decompress.h" // The gzip, zstd and LZ4 decoders (compressed inputs)
+
+// How files that look binary (a NUL byte in the first block) are searched
+enum class BinaryFiles {
+    kBinary,       // Report "binary file matches" at the first match instead of printing lines
+    kWithoutMatch, // -I: Treat them as not matching, without searching them
+    kText          // -a: Search them as text
+};
+
+// Encodings announced by a byte order mark at the start of the input. Text without one is
+// searched as the bytes it is (ASCII, UTF-8 or any other single-byte encoding).
+enum class TextEncoding {
+    kUtf8,    // No byte order mark, or the UTF-8 one (which is then skipped)
+    kUtf16LE, // FF FE: Windows' "Unicode" files (PowerShell transcripts, .reg exports)
+    kUtf16BE  // FE FF
+};
+
+// --index: what to do with the trigram index of the searched directories
+enum class IndexMode {
+    kNone,  // No index: read every file
+    kBuild, // --index build DIR...: Write (or refresh) the index of each DIR, search nothing
+    kUse    // --index use: Only search the files the index cannot rule out
+};
+
+class FileCache;
 
 // Structure to hold the parsed command-line options and settings
 struct Settings {
@@ -20,611 +114,8690 @@ struct Settings {
     bool use_extended_regex = false; // -E: Treat pattern as an Extended Regular Expression
     bool match_whole_word = false;   // -w: Match only whole words
     bool only_matching = false;      // -o: Print only the matched parts of lines
+    bool json = false;               // --json: Print JSON Lines events (file, line, offset, text, spans) instead of text
+    bool match_spans = false;        // Not an option: matching finds every match span of a line (-o, --json)
     int lines_after = 0;             // -A n: Print n lines of trailing context
     int lines_before = 0;            // -B n: Print n lines of leading context
+    bool use_mmap = true;            // --no-mmap: Read files through the streaming path instead of mapping them
+    bool async_io = true;            // --no-async-io: Open and read every file on the thread that searches it
+    bool decompress = true;          // --no-decompress: Search gzip, zstd and LZ4 files as they are
+    bool line_buffered = false;      // --line-buffered: Flush output after every line
+    bool show_stats = false;         // --stats: Report run statistics on standard error
+    bool use_std_regex = false;      // --regex-engine=std: Run every regex through std::regex
+    bool recursive = false;          // -r: Search directories recursively
+    bool follow_symlinks = false;    // -R: Like -r, following symbolic links
+    int jobs = 0;                    // -j N: Files searched in parallel (0 = one per hardware thread)
+    bool unordered = false;          // --unordered: Print each file's output as soon as it is done
+    BinaryFiles binary_files = BinaryFiles::kBinary; // --binary-files=TYPE, -a, -I
+    std::vector<std::string> include_globs;     // --include=GLOB: Only search files whose name matches
+    std::vector<std::string> exclude_globs;     // --exclude=GLOB: Skip files whose name matches
+    std::vector<std::string> exclude_dir_globs; // --exclude-dir=GLOB: Skip directories whose name matches (-r)
+    bool use_ignore_files = false;   // --gitignore: Skip what .gitignore and .ignore files exclude (-r)
+    long long max_count = -1;        // -m NUM: Stop reading a file after NUM selected lines (-1 = no limit)
+    bool quiet = false;              // -q: Print nothing; stop everything at the first selected line
+    IndexMode index_mode = IndexMode::kNone; // --index=MODE: Build or use the trigram index of the directories
+    std::string index_file;          // --index-file=PATH: Index location (default: .scanr-index in the directory)
+    std::string pattern_cache;       // --pattern-cache=DIR: Keep compiled pattern sets in DIR
+    bool follow = false;             // --follow: Keep searching what is appended to the files
+    FileCache* file_cache = nullptr; // Not an option: files a --serve process keeps mapped between queries
+    unsigned chunk_threads = 1;      // Not an option: threads splitting one large file (the -j threads when no pool runs)
     std::vector<std::string> patterns; // List of patterns to search for
     std::vector<std::string> files;    // List of input files to process
 };
 
-// --- Function Prototypes ---
-void print_usage();
-bool parse_arguments(int argc, char* argv[], Settings& settings);
-void process_stream(std::istream& input, const std::string& filename, const Settings& settings, bool show_filename_prefix);
-std::vector<std::regex> compile_patterns(const Settings& settings);
-bool regex_matches(const std::string& line, const std::vector<std::regex>& regex_patterns, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions);
-bool simple_matches(const std::string& line, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions);
-bool is_word_boundary(const std::string& line, size_t pos);
-size_t find_insensitive(const std::string& haystack, const std::string& needle, size_t pos);
+// -q: set by the first selected line of any input. Once it is set, every search, the
+// directory walk and the worker pool stop, and the exit status reports the match.
+static std::atomic<bool> quiet_match_found{false};
+
+// Flat binary encoding of compiled pattern tables, for the pattern cache (--pattern-cache).
+// Values are stored in native byte order, as they are in memory; vectors are a count
+// followed by their elements.
+class CacheWriter {
+public:
+    template <typename T> void put(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values are written as bytes");
+        data_.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+    template <typename T> void put_vector(const std::vector<T>& values) {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values are written as bytes");
+        put<uint64_t>(values.size());
+        data_.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+    void put_string(std::string_view text) {
+        put<uint64_t>(text.size());
+        data_.append(text.data(), text.size());
+    }
+    void put_strings(const std::vector<std::string>& strings) {
+        put<uint64_t>(strings.size());
+        for (const auto& text : strings) put_string(text);
+    }
+    const std::string& data() const { return data_; }
 
+private:
+    std::string data_;
+};
 
-// --- Main Function ---
-int main(int argc, char* argv[]) {
-    Settings settings;
+// Reads what a CacheWriter wrote. Every count is checked against the bytes left, so a
+// truncated or foreign file makes a get fail instead of reading past the end.
+class CacheReader {
+public:
+    CacheReader(const char* data, size_t size) : at_(data), end_(data + size) {}
 
-    // 1. Parse Command Line Arguments
-    if (!parse_arguments(argc, argv, settings)) {
-        return 1; // Exit if parsing failed
+    template <typename T> bool get(T& value) {
+        if (static_cast<size_t>(end_ - at_) < sizeof(T)) return false;
+        std::memcpy(&value, at_, sizeof(T));
+        at_ += sizeof(T);
+        return true;
+    }
+    template <typename T> bool get_vector(std::vector<T>& values) {
+        uint64_t count;
+        if (!get(count) || count > static_cast<size_t>(end_ - at_) / sizeof(T)) return false;
+        values.resize(static_cast<size_t>(count));
+        if (count > 0) std::memcpy(values.data(), at_, static_cast<size_t>(count) * sizeof(T));
+        at_ += count * sizeof(T);
+        return true;
+    }
+    // Booleans are read as bytes and only 0 and 1 accepted
+    bool get_flags(bool* flags, size_t count) {
+        if (static_cast<size_t>(end_ - at_) < count) return false;
+        for (size_t k = 0; k < count; ++k) {
+            unsigned char byte = static_cast<unsigned char>(at_[k]);
+            if (byte > 1) return false;
+            flags[k] = byte != 0;
+        }
+        at_ += count;
+        return true;
     }
+    bool get_string(std::string& text) {
+        uint64_t size;
+        if (!get(size) || size > static_cast<size_t>(end_ - at_)) return false;
+        text.assign(at_, static_cast<size_t>(size));
+        at_ += size;
+        return true;
+    }
+    bool get_strings(std::vector<std::string>& strings) {
+        uint64_t count;
+        if (!get(count) || count > static_cast<size_t>(end_ - at_) / sizeof(uint64_t)) return false;
+        strings.resize(static_cast<size_t>(count));
+        for (auto& text : strings) {
+            if (!get_string(text)) return false;
+        }
+        return true;
+    }
+    bool at_end() const { return at_ == end_; }
 
-    // Ensure at least one pattern was provided
-    if (settings.patterns.empty()) {
-        std::cerr << "scanr: No pattern provided." << std::endl;
-        print_usage();
-        return 1;
+private:
+    const char* at_;
+    const char* end_;
+};
+
+// Single-literal substring search. A SIMD filter (AVX2 or SSE2 chosen at runtime, NEON on
+// ARM) compares two rare bytes of the needle at their offsets for 16-32 candidate positions
+// at once, and only positions passing both are verified. Under ignore_case the needle is
+// folded once and the filter compares both cases of each rare byte, so no per-byte tolower.
+class LiteralSearcher {
+public:
+    // Needle data shared with the instruction-set specific kernels
+    struct Needle {
+        std::string bytes;            // Folded to lower case under ignore_case
+        size_t rare_offset[2] = {0, 0};
+        unsigned char rare_byte[2][2] = {}; // [which rare byte][lower, upper case variant]
+    };
+
+    void build(std::string_view needle, bool ignore_case);
+    size_t size() const { return needle_.bytes.size(); }
+
+    // Position of the first occurrence at or after 'from', or npos
+    size_t find(std::string_view haystack, size_t from) const {
+        if (from > haystack.size() || haystack.size() - from < needle_.bytes.size()) return std::string_view::npos;
+        return kernel_(needle_, reinterpret_cast<const unsigned char*>(haystack.data()), haystack.size(), from);
     }
 
-    // Determine if regex engine is needed (simplifies -i, -w, -o)
-    if (settings.match_whole_word || settings.ignore_case || settings.only_matching) {
-         settings.use_extended_regex = true; // Force regex use for simplicity/correctness
+private:
+    using Kernel = size_t (*)(const Needle&, const unsigned char*, size_t, size_t);
+    Needle needle_;
+    Kernel kernel_ = nullptr;
+};
+
+// Finds occurrences of a set of literal strings in a single pass over the text.
+// All sets use an Aho-Corasick automaton over byte classes: states get dense DFA rows,
+// shallowest first, while they fit in the memory budget, and deeper states of very large
+// sets fall back to sparse edges plus failure links. Small sets additionally get a
+// Teddy-style SIMD fingerprint scan that finds candidate positions 16 bytes at a time.
+class MultiLiteralMatcher {
+public:
+    struct Hit {
+        size_t start;
+        size_t length;
+        size_t pattern; // Index into the literal list given to build()
+    };
+
+    // Empty literals are skipped (they never match, as in simple mode)
+    void build(const std::vector<std::string>& literals, bool ignore_case);
+    bool empty() const { return literal_count_ == 0; }
+
+    // Start of an occurrence at or after 'from' such that no other occurrence ends earlier
+    // (so it lies in the first line containing any match), or npos. Sets *length if given.
+    size_t find(std::string_view text, size_t from, size_t* length = nullptr) const;
+
+    // Every occurrence of every literal in 'text', overlapping ones included, ordered by end
+    void find_all(std::string_view text, std::vector<Hit>& hits) const;
+
+    // Write the built tables to the pattern cache, and read them back instead of building.
+    // The SIMD scanners depend on the CPU and are set up again on load.
+    void save(CacheWriter& writer) const;
+    bool load(CacheReader& reader);
+
+private:
+    static constexpr int kMaxDenseEntries = 4 * 1024 * 1024; // 16 MiB of DFA transitions
+    static constexpr size_t kMaxTeddyLiterals = 64;
+
+    struct TeddyTables {
+        int fingerprint_length = 0;           // Leading bytes of every literal that are fingerprinted
+        unsigned char low_nibbles[3][16] = {};  // Bucket bitmask per low nibble, per leading byte
+        unsigned char high_nibbles[3][16] = {}; // Bucket bitmask per high nibble, per leading byte
+        std::vector<size_t> buckets[8];       // Literal ids per bucket
+    };
+
+    void build_scanners();
+    bool valid() const;
+    size_t find_automaton(std::string_view text, size_t from, size_t* length) const;
+    size_t find_teddy(std::string_view text, size_t from, size_t* length, size_t* resume) const;
+    bool verify(std::string_view text, size_t pos, size_t id) const;
+    int next_state(int state, unsigned char byte) const { return next_state_class(state, byte_class_[byte]); }
+    int next_state_class(int state, int cls) const;
+
+    bool ignore_case_ = false;
+    size_t literal_count_ = 0;
+    std::vector<std::string> literals_; // Indexed by id; folded to lower case under ignore_case
+    std::vector<size_t> ids_;           // Literal ids that take part in matching (non-empty)
+
+    // Aho-Corasick automaton (state 0 is the root)
+    unsigned char byte_class_[256] = {}; // 0 = byte occurs in no literal
+    int class_count_ = 1;
+    bool first_byte_[256] = {};           // Bytes a literal can start with (root skip loop)
+    std::vector<int> dense_row_;          // Offset of a state's row in dense_, or -1 if sparse
+    std::vector<int> dense_;              // row + class -> state
+    std::vector<int> edge_begin_;         // Sparse states: edges are [begin[s], begin[s+1])
+    std::vector<unsigned char> edge_class_;
+    std::vector<int> edge_target_;
+    std::vector<int> fail_;
+    std::vector<int> dict_;               // Nearest state on the failure chain with outputs, or -1
+    std::vector<int> output_begin_;       // Literal ids ending at a state: [begin[s], begin[s+1])
+    std::vector<size_t> outputs_;
+    std::vector<int> match_length_;       // Length of some literal ending at a state, 0 if none
+
+    bool use_teddy_ = false;
+    TeddyTables teddy_;
+    LiteralSearcher single_; // Used by find() when there is exactly one literal
+};
+
+// One instruction of a compiled regex program (a Thompson NFA)
+struct RegexInst {
+    enum Op : unsigned char { kByteSet, kSplit, kJump, kAssert, kMatch };
+    enum Assertion : unsigned char { kLineBegin, kLineEnd, kWordBoundary, kNotWordBoundary };
+
+    Op op = kMatch;
+    unsigned char assertion = 0; // kAssert
+    unsigned char padding[2] = {}; // Spelled out so a cached program is the same bytes on every run
+    int x = 0;                   // kSplit: preferred branch; kJump: target
+    int y = 0;                   // kSplit: the other branch
+    int set = 0;                 // kByteSet: index into the program's byte sets; kMatch: pattern number
+};
+
+struct RegexNode;
+
+// Per-thread search state for one RegexProgram: its lazily built DFA and the Pike VM
+// thread lists. Kept out of the program itself so a compiled pattern stays read-only.
+struct RegexCache {
+    static constexpr int kUnknown = -1;   // Transition not computed yet
+    static constexpr int kMatch = -2;     // A match ends before the byte is consumed
+    static constexpr int kLineBreak = -3; // The '\n' entry of every state
+
+    // DFA states are sets of NFA instructions plus the context the assertions look at.
+    // A state's key holds its flags byte followed by its instruction indices.
+    std::unordered_map<std::string, int> state_index;
+    std::vector<const std::string*> state_keys;
+    std::vector<int> transitions;       // state * class count + class -> next state * class count, or one of the above
+    std::vector<signed char> end_match; // Per state: matches at end of line? (-1 = not computed)
+    int start_state = -1;               // Always 0; states are numbered as they are created
+    size_t memory = 0;                  // Approximate bytes held by the states above
+    size_t scanned = 0;                 // Bytes run through the DFA, for the reset heuristic
+    size_t scanned_at_reset = 0;
+    bool gave_up = false;               // The DFA thrashed its cache; only the Pike VM is used
+
+    // A collecting cache (RegexProgram::matching_patterns) does not stop at a match: the
+    // patterns whose matches end on a transition, or at the end of the line, are recorded
+    bool collect = false;
+    std::vector<int> transition_matches;       // Aligned with transitions: index into match_lists, or -1
+    std::vector<int> end_matches;              // Per state: index into match_lists, -1 for none (-2 = not computed)
+    std::vector<std::vector<int>> match_lists; // Pattern numbers
+    std::vector<int> matched;                  // Patterns the last closure reached
+    std::vector<unsigned char> seen;           // Per pattern, while collecting one line
+
+    // Scratch for closures and the Pike VM
+    std::vector<int> stack;
+    std::vector<unsigned> mark;
+    unsigned generation = 0;
+    std::vector<int> kernel;
+    std::string key;
+    struct ThreadList {
+        std::vector<int> dense;      // Instructions in priority order
+        std::vector<size_t> start;   // Match start of the thread at dense[i]
+        std::vector<int> sparse;     // Instruction -> index into dense
+        size_t size = 0;
+    } threads[2];
+};
+
+// A set of regular expressions compiled for scanr's own engine, which runs in time linear
+// in the input for every pattern. The patterns are alternatives of one Thompson NFA whose
+// match instructions carry the pattern number, so a single pass over a line checks all of
+// them. Whether a line matches is answered by a DFA built lazily from the NFA and cached
+// (bounded in size: it is flushed when full, and abandoned for the Pike VM if it keeps
+// thrashing). Match spans for -o come from a Pike VM simulation of each matching pattern's
+// part of the NFA with ECMAScript's leftmost-first priorities, so results equal std::regex's.
+class RegexProgram {
+public:
+    // Add an ECMAScript pattern as pattern number pattern_count(). Returns false, leaving
+    // the program as it was, if it uses syntax this engine does not implement
+    // (backreferences, lookahead, unusual escapes, ...) or that std::regex may reject; such
+    // patterns are left to std::regex.
+    bool add(const std::string& pattern, bool ignore_case);
+
+    // Join the added patterns into one program. Called once, after the last add().
+    void finish();
+
+    size_t pattern_count() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+    // True if any pattern matches somewhere in 'line'
+    bool matches(std::string_view line, RegexCache& cache) const;
+
+    // The numbers of the patterns that match somewhere in 'line', ascending, in one pass.
+    // 'cache' must be a collecting one (RegexCache::collect) used for nothing else.
+    void matching_patterns(std::string_view line, RegexCache& cache, std::vector<int>& patterns) const;
+
+    // Start of the first line of 'buffer' at or after 'from' (a line start) that contains
+    // a match, or npos. Lines are split on '\n' exactly as search_lines splits them.
+    size_t find_line(std::string_view buffer, size_t from, RegexCache& cache) const;
+
+    // Write a finished program to the pattern cache, and read one back instead of adding
+    // and finishing its patterns
+    void save(CacheWriter& writer) const;
+    bool load(CacheReader& reader);
+
+    // Options of find(), after the std::regex_constants flags they stand for
+    static constexpr unsigned kContinuous = 1; // match_continuous: the match must start at 'from'
+    static constexpr unsigned kNotNull = 2;    // match_not_null: the match must not be empty
+    static constexpr unsigned kPrevAvail = 4;  // match_prev_avail: 'from' is not the start of the text
+
+    // Leftmost-first match of pattern number 'pattern' in 'line' starting at or after 'from'.
+    // 'line' is the whole line; with kPrevAvail anchors and word boundaries see the
+    // characters before 'from'.
+    bool find(std::string_view line, size_t from, unsigned flags, int pattern, size_t& match_start, size_t& match_end, RegexCache& cache) const;
+
+private:
+    static constexpr size_t kMaxInstructions = 20000;
+    static constexpr size_t kCacheLimit = 4 * 1024 * 1024; // Bytes of DFA states per cache
+
+    enum StateFlags : unsigned char { kAtLineBegin = 1, kAfterWordChar = 2 };
+
+    bool emit(const std::vector<RegexNode>& nodes, int index);
+    bool valid() const;
+    static bool assertion_holds(unsigned char assertion, bool at_begin, bool prev_word, bool at_end, bool next_word);
+    int dfa_state(RegexCache& cache, unsigned char flags) const;
+    void dfa_reset(RegexCache& cache) const;
+    bool dfa_closure(RegexCache& cache, int state, bool at_end, unsigned char byte) const;
+    int dfa_transition(RegexCache& cache, int state, int cls) const;
+    bool dfa_end_match(RegexCache& cache, int state) const;
+    int dfa_match_list(RegexCache& cache) const;
+    void pike_add(RegexCache& cache, RegexCache::ThreadList& list, int first, size_t start, std::string_view line, size_t text_begin, size_t pos) const;
+    bool pike_search(std::string_view line, size_t from, unsigned flags, int entry, size_t& match_start, size_t& match_end, RegexCache& cache) const;
+    void prepare(RegexCache& cache) const;
+
+    std::vector<RegexInst> insts_;
+    std::vector<int> entries_;            // First instruction of each pattern
+    int entry_ = 0;                       // Entry point of the whole set: splits into every pattern
+    std::vector<std::bitset<256>> sets_;  // Byte sets of the kByteSet instructions
+    std::unordered_map<std::string, int> set_ids_; // Byte set -> index into sets_, while adding patterns
+    size_t pattern_begin_ = 0;            // First instruction of the pattern being added
+    unsigned char byte_class_[256] = {};  // Bytes no instruction or assertion tells apart share a class
+    unsigned char class_byte_[256] = {};  // A representative byte per class
+    int class_count_ = 1;
+    int newline_class_ = 0;               // '\n' is always a class of its own
+    unsigned char flag_mask_ = 0;         // State flags the program's assertions depend on
+};
+
+
+struct MatchScratch;
+
+// Pattern set compiled once in main and shared read-only by every input (and thread).
+// Searching through a const CompiledMatcher never modifies it.
+struct CompiledMatcher {
+    RegexProgram regexes;                   // Regex patterns run by scanr's own engine, as one program
+    std::vector<std::regex> regex_patterns; // Regex patterns left to std::regex (unsupported syntax, --regex-engine=std)
+    std::vector<std::string> regex_sources; // The source of each of those, as compiled (the pattern cache stores them)
+    MultiLiteralMatcher literals;           // Patterns that are plain literals
+    MultiLiteralMatcher regex_prefilter;    // Literals every regex match contains (empty if unknown for some pattern)
+    size_t regex_prefilter_size = 0;        // Number of those literals, reported by --stats
+    std::vector<std::string> required_literals; // Every match of any pattern contains one of these...
+    bool required_literals_known = false;       // ...if known for every pattern (--index narrows the files with them)
+    static constexpr size_t kMinPrefilterLength = 3; // Shortest required literal worth prefiltering the DFA with
+    static constexpr size_t kMaxCaseVariants = 64;   // Spellings of one -i literal the literal engine takes; longer ones go to the regex engine
+    double compile_ms = 0;                  // Time spent compiling, reported by --stats
+    bool from_cache = false;                // Loaded from the pattern cache instead of compiled
+
+    // The required literals encoded as UTF-16, one engine per byte order, so UTF-16 text is
+    // scanned without decoding it. Built when the first such file turns up (most runs see
+    // none) and shared read-only from then on.
+    struct Utf16Literals {
+        std::once_flag built[2];
+        bool usable[2] = {false, false};
+        MultiLiteralMatcher literals[2];
+    };
+    std::unique_ptr<Utf16Literals> utf16 = std::make_unique<Utf16Literals>();
+
+    // Check one line against the pattern set, filling match_positions as the matchers do
+    bool matches(std::string_view line, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions, MatchScratch& scratch) const;
+    // The same, timing each engine it runs for --stats
+    template <class Stats>
+    bool matches(std::string_view line, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions, MatchScratch& scratch, Stats stats) const;
+
+    // Literal engine that finds every line of UTF-16 text in 'encoding' that can match (and
+    // possibly more), or nullptr if the patterns have no required literals to look for
+    const MultiLiteralMatcher* utf16_required(TextEncoding encoding, const Settings& settings) const;
+};
+
+// Search counters for --stats. Every searching thread counts into the instance in its
+// MatchScratch and adds it to the run's totals when it is done, so counting takes no lock.
+// Times are thread time: with -j, the phases of all threads add up.
+struct SearchStats {
+    enum Phase {
+        kRead,     // Opening and mapping files, reading blocks
+        kScan,     // Finding candidate lines in whole buffers (literal automata, DFA, prefilter)
+        kLiteral,  // simple_matches on candidate lines
+        kRegex,    // scanr's regex engine on candidate lines
+        kStdRegex, // std::regex on candidate lines
+        kOutput,   // Context bookkeeping and printing
+        kPhaseCount
+    };
+    unsigned long long files = 0;          // Inputs searched
+    unsigned long long unreadable = 0;     // Files that could not be opened
+    unsigned long long binary_skipped = 0; // Binary files passed over (--binary-files=without-match)
+    unsigned long long lines = 0;          // Lines in the text searched
+    unsigned long long candidates = 0;     // Lines the scan could not rule out
+    unsigned long long selected = 0;       // Candidate lines that matched
+    unsigned long long read_ahead_files = 0; // Files read ahead (not timed: the reads overlap the search)
+    unsigned long long read_ahead_bytes = 0;
+    unsigned long long decompressed_files = 0; // Compressed inputs searched as their text
+    unsigned long long decompressed_bytes = 0; // Text they decompressed to (as far as it was read)
+    unsigned long long calls[kPhaseCount] = {};
+    unsigned long long bytes[kPhaseCount] = {};
+    unsigned long long nanoseconds[kPhaseCount] = {};
+
+    void merge(const SearchStats& other);
+    // Add 'counts' to the totals of the run (and reset it); totals() reads them
+    static void publish(SearchStats& counts);
+    static SearchStats totals();
+    // Start the totals again from zero (every query of a --serve process is a run)
+    static void reset();
+};
+
+// The collectors the search loops are instantiated with. NoStats, used unless --stats asks
+// for counts, has nothing but empty inline members, so its loops compile to what they are
+// without instrumentation; CountStats counts into a thread's SearchStats.
+struct NoStats {
+    static constexpr bool kEnabled = false;
+    struct Timer {};
+    Timer time(SearchStats::Phase, size_t, unsigned = 1) { return {}; }
+    void count(unsigned long long SearchStats::*, unsigned long long = 1) {}
+    void count_bytes(SearchStats::Phase, size_t) {}
+};
+
+class CountStats {
+public:
+    static constexpr bool kEnabled = true;
+    explicit CountStats(SearchStats& stats) : stats_(stats) {}
+
+    // Adds the time until it goes out of scope to one phase, with 'calls' calls over 'size' bytes
+    class Timer {
+    public:
+        Timer(SearchStats& stats, SearchStats::Phase phase) : stats_(stats), phase_(phase), start_(std::chrono::steady_clock::now()) {}
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        ~Timer() {
+            auto elapsed = std::chrono::steady_clock::now() - start_;
+            stats_.nanoseconds[phase_] += static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+
+    private:
+        SearchStats& stats_;
+        SearchStats::Phase phase_;
+        std::chrono::steady_clock::time_point start_;
+    };
+    Timer time(SearchStats::Phase phase, size_t size, unsigned calls = 1) {
+        stats_.calls[phase] += calls;
+        stats_.bytes[phase] += size;
+        return Timer(stats_, phase);
     }
+    void count(unsigned long long SearchStats::* counter, unsigned long long amount = 1) { stats_.*counter += amount; }
+    void count_bytes(SearchStats::Phase phase, size_t size) { stats_.bytes[phase] += size; }
 
-    // Pre-compile regex patterns if regex will be used
-    std::vector<std::regex> regex_patterns;
-    if (settings.use_extended_regex) {
-        try {
-            regex_patterns = compile_patterns(settings);
-        } catch (const std::regex_error& e) {
-            std::cerr << "scanr: Invalid regular expression: " << e.what() << " (Pattern: " << e.what() /* Might not show pattern */ << ")" << std::endl;
-            return 1;
+private:
+    SearchStats& stats_;
+};
+
+// Mutable matching state for one thread of searching (DFA caches and scratch buffers).
+// CompiledMatcher stays read-only; every searching thread owns one of these.
+struct MatchScratch {
+    MatchScratch() { regex_patterns.collect = true; }
+
+    RegexCache regex;          // CompiledMatcher::regexes: line tests, and the Pike VM for -o spans
+    RegexCache regex_patterns; // CompiledMatcher::regexes: which patterns match an -o line
+    std::vector<int> patterns;
+
+    // Per-line results, kept so that matching a line allocates nothing once they have grown
+    std::vector<std::pair<size_t, size_t>> positions;        // {start, length} of the line's matches
+    std::vector<std::pair<size_t, size_t>> engine_positions; // One engine's matches, before merging
+    std::vector<MultiLiteralMatcher::Hit> hits;              // simple_matches under -w/-o
+    std::cmatch regex_match;                                 // regex_matches
+    std::string utf8_line;                                   // search_utf16: the candidate line, decoded
+
+    bool collect_stats = false; // --stats: the search loops count into 'stats'
+    SearchStats stats;
+};
+
+// Compiled pattern sets kept on disk (--pattern-cache=DIR), so that a large pattern file
+// that rarely changes is not compiled again on every run. An entry is named after a hash of
+// everything compilation depends on (the patterns, and -E, -i, -w and the regex engine) and
+// holds that key in full, so a changed pattern file just misses. It stores the output of
+// build_matcher: scanr's regex program, the literal engines' automata and the required
+// literals. Patterns left to std::regex are stored as source and compiled on load, and a
+// regex program's lazy DFA is built while searching, so neither is part of an entry.
+class PatternCache {
+public:
+    explicit PatternCache(const Settings& settings);
+
+    // Everything compiling the patterns of 'settings' depends on (also the key of the
+    // pattern sets a --serve process keeps)
+    static std::string key(const Settings& settings);
+
+    const std::string& path() const { return path_; }
+
+    // Fill 'matcher' from the entry for these settings; false if there is none, or it is
+    // not a valid entry of this version: a bad checksum, a table index out of range or a
+    // stored std::regex source that no longer compiles all count as a miss, after which
+    // the caller compiles the patterns and store() replaces the entry
+    bool load(CompiledMatcher& matcher) const;
+    // Write the entry; false (after printing a warning) if that fails
+    bool store(const CompiledMatcher& matcher) const;
+
+private:
+    static constexpr char kMagic[8] = {'S', 'C', 'A', 'N', 'R', 'P', 'A', 'T'};
+    static constexpr uint32_t kVersion = 3; // 2: -i patterns carry their Unicode case variants; 3: checksum, in the key
+
+    static uint64_t checksum(const char* data, size_t size);
+
+    const Settings& settings_;
+    std::string key_;  // Everything the compiled result depends on
+    std::string path_; // DIR/<hash of the key>.scanr-patterns
+};
+
+// Read-only memory mapping of a regular file (the fast path for on-disk inputs)
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Map the whole file. Returns false if it cannot be opened or is not a regular
+    // file (pipes, devices, directories), in which case the caller falls back to streaming.
+    // Small files are read into memory instead: for them a mapping costs more than a copy.
+    bool open(const std::string& filename);
+    void close();
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    // Mapped rather than read: its pages are only read as they are touched
+    bool mapped() const { return data_ != nullptr && data_ != contents_.data(); }
+
+private:
+    static constexpr size_t kReadLimit = 64 * 1024; // Largest file read rather than mapped
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    std::vector<char> contents_; // Small files
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
+
+// Compressed formats, recognized by their first bytes
+enum class Compression { kNone, kGzip, kZstd, kLz4 };
+
+// Decompresses a gzip, zstd or LZ4 input on a thread of its own, so that decoding overlaps
+// with the search, which reads the text through read() as it would read a pipe. The
+// compressed bytes come from memory (a mapped file) or from a descriptor, read as the
+// decoder needs them; nothing is written to a temporary file. An input in memory that holds
+// several independent frames (concatenated files, or what parallel and seekable zstd
+// writers produce) has its frames decoded on up to 'threads' threads, handed on in order.
+class Decompressor {
+public:
+    static constexpr size_t kMagicSize = 4;
+
+    // The format of an input that starts with 'head' (kNone if it is not compressed, or if
+    // fewer than kMagicSize bytes cannot tell)
+    static Compression detect(const char* head, size_t size);
+    // Whether 'head' is the start of a magic number, so more bytes are needed to tell
+    static bool could_be_compressed(const char* head, size_t size);
+
+    // Decompress the 'size' bytes at 'data', which stay valid meanwhile
+    Decompressor(Compression format, const char* data, size_t size, unsigned threads);
+    // Decompress what is left to read from 'fd', after the 'head_size' bytes read from it already
+    Decompressor(Compression format, int fd, const char* head, size_t head_size);
+    ~Decompressor();
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    // Up to 'size' bytes of the text, waiting for the decoder if need be; 0 at its end
+    size_t read(char* buffer, size_t size);
+    // Once read() has returned 0: why the text ended early ("" if it did not)
+    std::string error() const { return drained_ ? error_ : std::string(); }
+    // Bytes of text read so far
+    unsigned long long size() const { return size_; }
+
+private:
+    static constexpr size_t kMaxBlocks = 8; // Pieces of text decoded ahead of the search
+
+    void decode(); // The decoding thread
+    void decode_frames(const std::vector<std::pair<size_t, size_t>>& frames);
+    bool push(std::vector<char>&& text); // False once the search has stopped reading
+
+    Compression format_;
+    std::unique_ptr<ByteSource> source_;
+    const char* data_ = nullptr; // The input, if it is in memory
+    size_t data_size_ = 0;
+    unsigned threads_ = 1;
+    std::mutex mutex_;
+    std::condition_variable ready_cv_; // Text was queued, or decoding ended
+    std::condition_variable space_cv_; // Text was taken, or the search stopped reading
+    std::deque<std::vector<char>> queue_;
+    bool finished_ = false; // The decoder is done; the queue may still hold text
+    bool closing_ = false;  // The search stopped reading
+    std::string error_;     // Set by the decoder before it finishes
+    std::vector<char> current_; // The piece of text read() hands out
+    size_t current_used_ = 0;
+    bool drained_ = false;
+    unsigned long long size_ = 0;
+    std::thread thread_;
+};
+
+// Reads a file descriptor (or a Decompressor's text) in large fixed-size blocks and exposes
+// the complete lines of each block in place, so lines are sliced from the block (with the
+// libc's vectorized memchr) instead of copied out one at a time. The partial line at the
+// end of a block is carried over to the front of the next one.
+class BlockReader {
+public:
+    static constexpr size_t kBlockSize = 256 * 1024;
+
+    // 'head' holds the first bytes of the input, read from 'fd' already
+    explicit BlockReader(int fd, std::string_view head = {}) : fd_(fd), buffer_(std::max(kBlockSize, head.size())), head_(!head.empty()) {
+        std::memcpy(buffer_.data(), head.data(), head.size());
+        filled_ = head.size();
+    }
+    explicit BlockReader(Decompressor& source) : source_(&source), buffer_(kBlockSize) {}
+
+    // Read the next block. Returns false once the input is exhausted and nothing is left.
+    bool fill();
+
+    // Complete lines of the current block (each terminated by '\n'); at end of input this
+    // also includes the final unterminated line.
+    const char* data() const { return buffer_.data(); }
+    size_t size() const { return lines_end_; }
+    // Where data() is in the input
+    unsigned long long offset() const { return offset_; }
+
+private:
+    int fd_ = -1;
+    Decompressor* source_ = nullptr; // Read instead of fd_, if set
+    std::vector<char> buffer_;
+    size_t filled_ = 0;    // Bytes of valid data in buffer_
+    size_t lines_end_ = 0; // End of the complete lines handed out by the last fill()
+    unsigned long long offset_ = 0;
+    bool head_ = false;    // buffer_ starts with bytes no fill() has looked at
+    bool eof_ = false;
+};
+
+// A set of glob patterns compiled into one automaton: each glob becomes an anchored regex
+// of the combined RegexProgram, so a name is checked against all of them in one DFA pass.
+// '*', '?', '[...]' and '\' escapes work as in the shell. Path globs (.gitignore rules)
+// are matched against relative paths: there '*' and '?' stop at '/', and '**' spans
+// directories. File names compare case-insensitively on Windows.
+class GlobSet {
+public:
+    // Returns false, leaving the set as it was, if the glob is malformed (such as [z-a])
+    bool add(const std::string& glob, bool path);
+    void finish() { program_.finish(); }
+    bool empty() const { return program_.empty(); }
+
+    // True if any glob matches the whole of 'name'
+    bool matches(std::string_view name, RegexCache& cache) const { return program_.matches(name, cache); }
+
+    // The globs matching 'name', ascending. 'cache' must be a collecting one.
+    void matching(std::string_view name, RegexCache& cache, std::vector<int>& globs) const { program_.matching_patterns(name, cache, globs); }
+
+private:
+    RegexProgram program_;
+};
+
+// The --include, --exclude and --exclude-dir globs, matched against base names
+class FileFilter {
+public:
+    // Per-thread matching state
+    struct Scratch {
+        RegexCache include;
+        RegexCache exclude;
+        RegexCache exclude_dir;
+    };
+
+    // Throws std::invalid_argument for a malformed glob
+    explicit FileFilter(const Settings& settings);
+
+    bool use_ignore_files() const { return use_ignore_files_; }
+    bool filters_files() const { return !include_.empty() || !exclude_.empty(); }
+
+    bool file_allowed(std::string_view name, Scratch& scratch) const {
+        return (include_.empty() || include_.matches(name, scratch.include)) &&
+               (exclude_.empty() || !exclude_.matches(name, scratch.exclude));
+    }
+    bool directory_allowed(std::string_view name, Scratch& scratch) const {
+        return exclude_dir_.empty() || !exclude_dir_.matches(name, scratch.exclude_dir);
+    }
+
+private:
+    GlobSet include_;
+    GlobSet exclude_;
+    GlobSet exclude_dir_;
+    bool use_ignore_files_;
+};
+
+// The rules of the .gitignore and .ignore files of one directory (--gitignore), with
+// .ignore read last so that its rules take precedence. Rules hold for everything below the
+// directory; deeper rule sets are consulted first, and within one the last matching rule
+// decides, so '!' rules can re-include what an earlier rule excluded.
+struct IgnoreRules {
+    struct Rule {
+        bool negated = false;        // '!pattern'
+        bool directory_only = false; // 'pattern/'
+    };
+
+    // Read the ignore files of 'directory' (named with a trailing separator, as the walker
+    // names it). Returns nullptr if it has none with any rule.
+    static std::shared_ptr<const IgnoreRules> load(const std::string& directory, std::shared_ptr<const IgnoreRules> parent, size_t thread_count);
+
+    // Does the innermost matching rule of this set or those above exclude 'path'?
+    bool excludes(const std::string& path, bool is_directory, size_t thread, std::vector<int>& scratch) const;
+
+    std::string base;                       // The directory, as load() was given it
+    GlobSet globs;                          // One per rule, matched against paths relative to base
+    std::vector<Rule> rules;
+    std::shared_ptr<const IgnoreRules> parent;
+    mutable std::vector<RegexCache> caches; // One collecting cache per walker thread
+};
+
+// Parallel directory tree enumeration for -r/-R. Directories are work items in per-thread
+// deques: a thread takes the newest item of its own deque and, when that runs dry, steals
+// the oldest item of another thread's, so big subtrees spread over all threads. The walk
+// keeps going in the background while the files found are searched.
+// Whatever order the threads read directories in, files are handed out in one fixed order:
+// depth first, each directory's entries sorted by name, a subdirectory's files in its place
+// among them. Every directory read becomes a node of the tree, and next() walks that tree,
+// waiting at a directory no thread has read yet, so an unchanged tree is listed the same way
+// on every run (and with any number of threads).
+class DirectoryWalker {
+public:
+    // 'follow_symlinks': -R, descend into symbolic links (reparse points on Windows) too.
+    // Files and directories 'filter' rejects are skipped without being opened.
+    DirectoryWalker(bool follow_symlinks, unsigned thread_count, const FileFilter& filter);
+    ~DirectoryWalker();
+    DirectoryWalker(const DirectoryWalker&) = delete;
+    DirectoryWalker& operator=(const DirectoryWalker&) = delete;
+
+    // Walk the tree under 'root' (a directory; "" is the current directory, whose entries
+    // are then named without a leading "./")
+    void start(const std::string& root);
+
+    // Next regular file found, or a directory that could not be read ('unreadable').
+    // Blocks until one is available; returns false once the walk is complete.
+    bool next(std::string& path, bool& unreadable);
+
+    // Abandon the walk: the threads finish the directory they are reading and exit
+    void stop();
+
+private:
+    struct Node;
+    struct Entry {
+        std::string path;
+        bool unreadable = false;
+        std::unique_ptr<Node> directory; // A subdirectory: its entries, once it is read
+    };
+    // A directory of the walk. 'entries' are filled in, sorted, by the thread that reads
+    // it; after 'read' is set only next() touches them.
+    struct Node {
+        std::vector<Entry> entries;
+        std::atomic<bool> read{false};
+    };
+    // Where next() is in the tree: a directory, and its entry to hand out next
+    struct Cursor {
+        Node* node;
+        size_t position;
+        std::unique_ptr<Node>* owner; // Freed once its entries have all been handed out
+    };
+    // -R: the directories above a work item, to stop at symbolic links that loop back
+    struct Ancestor {
+        unsigned long long device;
+        unsigned long long inode;
+        std::shared_ptr<const Ancestor> parent;
+    };
+    struct Directory {
+        std::string path;
+        Node* node = nullptr; // Where its entries go
+        std::shared_ptr<const Ancestor> ancestors; // Only kept with -R
+        std::shared_ptr<const IgnoreRules> ignore; // Innermost ignore rules (--gitignore)
+    };
+    // Per-thread filtering state
+    struct Scratch {
+        FileFilter::Scratch filter;
+        std::vector<int> rules;
+    };
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Directory> directories;
+    };
+
+    void run(size_t self);
+    bool take(size_t self, Directory& directory);
+    void push_directory(size_t self, Directory directory);
+    void read_directory(size_t self, const Directory& directory, std::vector<Entry>& found, Scratch& scratch);
+    void queue_subdirectories(size_t self, std::vector<Entry>& found, const std::shared_ptr<const Ancestor>& ancestors, const std::shared_ptr<const IgnoreRules>& ignore);
+    bool skipped(size_t self, const std::shared_ptr<const IgnoreRules>& ignore, const char* name, const std::string& path, bool is_directory, Scratch& scratch) const;
+    void publish(Node& node, std::vector<Entry>& found);
+
+    bool follow_symlinks_;
+    const FileFilter& filter_;
+    std::vector<std::unique_ptr<WorkQueue>> queues_; // One per thread
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> pending_{0}; // Directories queued or being read
+    std::atomic<size_t> queued_{0};  // Directories waiting in a queue
+    std::atomic<size_t> idle_{0};    // Threads waiting for work
+    std::atomic<bool> stopping_{false};
+    std::mutex idle_mutex_;
+    std::condition_variable idle_cv_;
+
+    std::mutex found_mutex_;
+    std::condition_variable found_cv_; // A directory was read
+    std::unique_ptr<Node> root_;
+    std::vector<Cursor> cursors_;      // next()'s path from the root, innermost last
+};
+
+// On-disk trigram index of a directory tree (--index). It records every file's size and
+// modification time and, per byte trigram (ASCII letters folded to lower case, so -i can use
+// it too), the posting list of the files containing it. A search maps the file and only
+// decodes the posting lists of the trigrams in its required literals: a file that lacks a
+// trigram of every literal cannot match, and is not opened at all unless it has changed
+// since it was indexed.
+//
+// Layout (native byte order, checked on open): Header, then FileEntry per file sorted by
+// path, TrigramEntry per trigram sorted by trigram, the posting lists (file ids as varint
+// deltas) and the relative paths.
+class TrigramIndex {
+public:
+    static constexpr const char* kFileName = ".scanr-index";
+
+    // Where the index of 'root' lives: --index-file, or kFileName in the directory itself
+    static std::string path_for(const std::string& root, const Settings& settings);
+    // 'path' (as the walker names it) relative to the walked 'root'
+    static std::string_view relative(const std::string& root, const std::string& path);
+
+    // Map an index; false if it is missing or not a valid index of this version
+    bool open(const std::string& path);
+    void close() { file_.close(); }
+
+    size_t file_count() const { return static_cast<size_t>(header_.file_count); }
+    // Id of the indexed file at 'relative', or npos
+    size_t find(std::string_view relative) const;
+    // Whether the file is still as it was indexed
+    bool up_to_date(size_t id, unsigned long long size, long long mtime) const;
+    // Mark the files that can hold a match: those containing every trigram of at least one
+    // of 'literals'. Returns false if the literals cannot rule files out (one is shorter
+    // than a trigram)
+    bool candidates(const std::vector<std::string>& literals, std::vector<bool>& result) const;
+
+    // Write the index of every file under 'root' that 'filter' lets through. Files unchanged
+    // since the previous index keep their trigrams from it; only new and changed files are
+    // read. Returns false (after printing an error) if the index cannot be written.
+    static bool build(const std::string& root, const Settings& settings, const FileFilter& filter);
+
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;      // kByteOrder as written
+        uint64_t file_count;
+        uint64_t trigram_count;
+        uint64_t files_offset;
+        uint64_t trigrams_offset;
+        uint64_t postings_offset;
+        uint64_t paths_offset;
+        uint64_t total_size;
+    };
+    struct FileEntry {
+        uint64_t path_offset;     // Into the paths
+        uint64_t path_length;
+        uint64_t size;            // kNotIndexed if the file could not be read
+        int64_t mtime;
+    };
+    struct TrigramEntry {
+        uint32_t trigram;
+        uint32_t file_count;      // Length of the posting list
+        uint64_t postings;        // Offset of the posting list, from postings_offset
+    };
+    static constexpr char kMagic[8] = {'S', 'C', 'A', 'N', 'R', 'I', 'D', 'X'};
+    static constexpr uint32_t kVersion = 2;
+    static constexpr uint32_t kByteOrder = 0x01020304;
+    static constexpr uint64_t kNotIndexed = ~0ull;
+
+    FileEntry file(size_t id) const;
+    TrigramEntry trigram(size_t index) const;
+    std::string_view file_path(const FileEntry& entry) const;
+    // Posting list of 'trigram' (empty if no file contains it)
+    void postings(uint32_t trigram, std::vector<uint32_t>& ids) const;
+    void decode(const TrigramEntry& entry, std::vector<uint32_t>& ids) const;
+
+    MappedFile file_;
+    Header header_{};
+};
+
+// Buffered writer for everything printed to standard output. Prefixes and line text are
+// assembled in one large buffer that is written out only when it fills up, or after every
+// line in line-buffered mode (interactive consoles, --line-buffered). A collecting buffer
+// (one file's output on a -j worker) holds its output until the file is done instead, and
+// only writes it out early when its 'spill' function accepts it.
+class OutputBuffer {
+public:
+    static constexpr size_t kCapacity = 64 * 1024;
+
+    // Offered the error messages and output collected so far; returns true if it wrote them
+    using Spill = std::function<bool(std::string_view errors, std::string_view output)>;
+
+    explicit OutputBuffer(FILE* target) : target_(target) { buffer_.reserve(kCapacity); }
+    explicit OutputBuffer(Spill spill) : target_(nullptr), spill_(std::move(spill)) {}
+    ~OutputBuffer() { flush(); }
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    void set_line_buffered(bool line_buffered) { line_buffered_ = line_buffered; }
+    bool line_buffered() const { return line_buffered_; }
+
+    void write(std::string_view text) {
+        if (buffer_.size() + text.size() > limit_) {
+            flush();
+            if (text.size() > kCapacity && target_ != nullptr) { // Too large to be worth copying
+                std::fwrite(text.data(), 1, text.size(), target_);
+                return;
+            }
         }
-         catch (const std::exception& e) {
-             std::cerr << "scanr: Error compiling regex: " << e.what() << std::endl;
-             return 1;
-         }
+        buffer_.append(text.data(), text.size());
+    }
+
+    void write(char c) {
+        if (buffer_.size() >= limit_) flush();
+        buffer_.push_back(c);
     }
 
+    void write_number(long long value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        write(std::string_view(digits, static_cast<size_t>(result.ptr - digits)));
+    }
 
-    // Determine if filename prefix should be shown (multiple files and not disabled)
-    bool show_filename_prefix = settings.files.size() > 1 && !settings.hide_filenames && !settings.list_filenames && !settings.count_only;
+    // Terminate the current output line
+    void end_line() {
+        write('\n');
+        if (line_buffered_) flush();
+    }
 
-    // 2. Process Input (Standard Input or Files)
-    if (settings.files.empty()) {
-        // Process standard input
-        process_stream(std::cin, "(standard input)", settings, false); // No prefix for stdin
-    } else {
-        // Process each file provided
-        for (const auto& filename : settings.files) {
-            std::ifstream file(filename);
-            if (!file.is_open()) {
-                // Report error but continue with other files unless in modes where errors aren't useful
-                 if (!settings.list_filenames && !settings.count_only) {
-                    std::cerr << "scanr: Cannot open file '" << filename << "'" << std::endl;
-                 }
-                // Consider returning an error code if *any* file fails? Standard grep usually doesn't.
-                continue; // Skip to the next file
+    void flush() {
+        if (target_ == nullptr) {
+            if ((!buffer_.empty() || !errors_.empty()) && spill_(errors_, buffer_)) {
+                buffer_.clear();
+                errors_.clear();
+                limit_ = kCapacity;
+            } else {
+                limit_ = buffer_.size() + kCapacity; // Keep collecting; offer it again later
             }
-            process_stream(file, filename, settings, show_filename_prefix);
-            file.close(); // Good practice to close the file
+            return;
         }
+        if (!buffer_.empty()) {
+            std::fwrite(buffer_.data(), 1, buffer_.size(), target_);
+            buffer_.clear();
+        }
+        std::fflush(target_);
     }
 
-    return 0; // Success
-}
+    // Print an error message to standard error, after the output written before it
+    void error(std::string_view message) {
+        if (target_ == nullptr) {
+            errors_.append(message.data(), message.size()); // Only before a file's output: it could not be opened, or is binary
+            errors_.push_back('\n');
+            return;
+        }
+        flush();
+        std::cerr << message << std::endl;
+    }
 
-// --- Helper Functions ---
+    // Collecting buffer: hand over what was not spilled
+    void take(std::string& errors, std::string& output) {
+        errors.swap(errors_);
+        output.swap(buffer_);
+        errors_.clear();
+        buffer_.clear();
+        limit_ = kCapacity;
+    }
 
-// Print usage instructions to standard error
-void print_usage() {
-    std::cerr << "Usage: scanr [OPTIONS]... PATTERN [FILE]...\n"
-              << "   or: scanr [OPTIONS]... -e PATTERN... [FILE]...\n"
-              << "   or: scanr [OPTIONS]... -f FILE_WITH_PATTERNS [FILE]...\n"
-              << "Search for PATTERN in each FILE or standard input.\n\n"
-              << "Options:\n"
-              << "  -c, --count            Print only a count of matching lines per file\n"
-              << "  -h                     Suppress the prefixing of filenames on output\n"
-              << "  -i                     Ignore case distinctions\n"
-              << "  -l                     Print only names of files containing matches\n"
-              << "  -n                     Prefix each line of output with the line number\n"
-              << "  -v                     Select non-matching lines\n"
-              << "  -e PATTERN             Use PATTERN for matching (can be used multiple times)\n"
-              << "  -f FILE                Obtain patterns from FILE, one per line\n"
-              << "  -E                     Interpret PATTERN as an extended regular expression (ERE)\n"
-              << "  -w                     Match only whole words (forces -E)\n"
-              << "  -o                     Print only the matched parts of lines (forces -E)\n"
-              << "  -A NUM                 Print NUM lines of trailing context\n"
-              << "  -B NUM                 Print NUM lines of leading context\n"
-              << "  -C NUM                 Print NUM lines of output context (equivalent to -A NUM -B NUM)\n"
-              << std::endl;
-}
+private:
+    FILE* target_;
+    Spill spill_;
+    std::string buffer_;
+    std::string errors_; // Collecting buffer only
+    size_t limit_ = kCapacity; // Buffer size at which the next write flushes
+    bool line_buffered_ = false;
+};
 
-// Parse command-line arguments and populate the Settings struct
-bool parse_arguments(int argc, char* argv[], Settings& settings) {
-    std::vector<std::string> pattern_sources; // Temp store for patterns from -e or command line arg
+// The last -B lines seen, kept for leading context. Entries are views into the input (the
+// mapping, or the block being searched), so remembering a line copies nothing; a line is
+// only materialized when it is printed. Before a block is refilled, hold() copies the few
+// lines still needed into storage of the ring's own.
+class ContextRing {
+public:
+    struct Line {
+        long long number;
+        unsigned long long offset; // In the input (--json)
+        std::string_view text;
+    };
 
-    for (int i = 1; i < argc; ++i) {
-        std::string arg = argv[i];
+    explicit ContextRing(size_t capacity) : capacity_(capacity) {}
 
-        if (arg == "--") { // Treat all subsequent arguments as files
-            while (++i < argc) {
-                settings.files.push_back(argv[i]);
-            }
-            break;
+    void push(long long number, unsigned long long offset, std::string_view text) {
+        if (lines_.size() < capacity_) { // Grows with the input, up to -B lines
+            lines_.push_back({number, offset, text});
+            return;
         }
+        lines_[oldest_] = {number, offset, text};
+        if (++oldest_ == capacity_) oldest_ = 0;
+    }
 
-        if (arg.length() > 1 && arg[0] == '-') {
-            // Option handling
-            if (arg == "-c" || arg == "--count") {
-                settings.count_only = true;
-            } else if (arg == "-h") {
-                settings.hide_filenames = true;
-            } else if (arg == "-i") {
-                settings.ignore_case = true;
-            } else if (arg == "-l") {
-                settings.list_filenames = true;
-            } else if (arg == "-n") {
-                settings.show_line_numbers = true;
-            } else if (arg == "-v") {
-                settings.invert_match = true;
-            } else if (arg == "-E") {
-                settings.use_extended_regex = true;
-            } else if (arg == "-w") {
-                settings.match_whole_word = true;
-            } else if (arg == "-o") {
-                settings.only_matching = true;
-            } else if (arg == "-e") {
-                if (++i < argc) {
-                    pattern_sources.push_back(argv[i]);
-                } else {
-                    std::cerr << "scanr: Option '-e' requires a pattern argument." << std::endl;
-                    return false;
-                }
-            } else if (arg == "-f") {
-                if (++i < argc) {
-                    std::ifstream pattern_file(argv[i]);
-                    if (!pattern_file.is_open()) {
-                        std::cerr << "scanr: Cannot open pattern file '" << argv[i] << "'" << std::endl;
-                        return false;
-                    }
-                    std::string line;
-                    bool added_pattern = false;
-                    while (std::getline(pattern_file, line)) {
-                        // Remove potential trailing newline characters (\r\n or \n)
-                        if (!line.empty() && line.back() == '\r') line.pop_back();
-                         if (!line.empty()) {
-                            settings.patterns.push_back(line);
-                            added_pattern = true;
-                         }
-                    }
-                    pattern_file.close();
-                    if (!added_pattern && pattern_sources.empty() && settings.patterns.empty()) {
-                         std::cerr << "scanr: Warning: Pattern file '" << argv[i] << "' is empty or contains no valid patterns." << std::endl;
-                         // Continue, maybe other patterns were provided
-                    }
-                } else {
-                    std::cerr << "scanr: Option '-f' requires a filename argument." << std::endl;
-                    return false;
+    size_t size() const { return lines_.size(); }
+
+    // Oldest first
+    const Line& operator[](size_t index) const {
+        index += oldest_;
+        return lines_[index < lines_.size() ? index : index - lines_.size()];
+    }
+
+    // The buffer the lines point into is about to change: copy them. At most -B lines per
+    // block, into two strings that are reused from block to block.
+    void hold() {
+        spare_.clear();
+        for (size_t i = 0; i < lines_.size(); ++i) spare_.append((*this)[i].text);
+        held_.swap(spare_); // Swapping short strings moves their bytes: point into held_ afterwards
+        size_t offset = 0;
+        for (size_t i = 0; i < lines_.size(); ++i) {
+            Line& line = lines_[(oldest_ + i) % lines_.size()];
+            line.text = std::string_view(held_.data() + offset, line.text.size());
+            offset += line.text.size();
+        }
+    }
+
+private:
+    size_t capacity_;
+    std::vector<Line> lines_;
+    size_t oldest_ = 0;  // Index of the oldest line once the ring is full
+    std::string held_;   // Text of lines from earlier blocks
+    std::string spare_;
+};
+
+// Output and context bookkeeping for one input, shared by the streaming and mapped backends
+struct StreamContext {
+    StreamContext(const std::string& name, const Settings& s, const CompiledMatcher& m, bool prefix, OutputBuffer& output, MatchScratch& match_scratch)
+        : filename(name), settings(s), matcher(m), show_filename_prefix(prefix), out(output), scratch(match_scratch),
+          cancel(s.quiet ? &quiet_match_found : nullptr), before_lines(static_cast<size_t>(s.lines_before)) {}
+
+    const std::string& filename;
+    const Settings& settings;
+    const CompiledMatcher& matcher;
+    bool show_filename_prefix;
+    OutputBuffer& out;
+    MatchScratch& scratch;
+
+    long long line_number = 0;
+    // -n: lines skipped in bulk from here on are not in line_number yet. Their newlines are
+    // counted once a line's number is needed, and never if no line after them is printed.
+    const char* uncounted = nullptr;
+    long long match_count = 0;
+    bool done = false;   // No more input is needed (-l listed the file, -m or -q is satisfied, a binary file matched)
+    bool listed = false; // -l has printed the filename, so -c prints no count
+    bool binary = false; // The input looks binary: its first output line is reported instead of printed
+    const std::atomic<bool>* cancel = nullptr; // Chunked search: set once another chunk has ended the search
+
+    bool stopped() const { return done || (cancel != nullptr && cancel->load(std::memory_order_relaxed)); }
+    bool at_max_count() const { return settings.max_count >= 0 && match_count >= settings.max_count; }
+    // Bring line_number up to 'end', the start of a line in the same buffer as 'uncounted'
+    void count_skipped(const char* end);
+
+    // The buffer the lines handed to handle_line point into, and where it starts in the
+    // input, for the byte offsets of --json
+    const char* buffer = nullptr;
+    unsigned long long buffer_offset = 0;
+    void set_buffer(const char* data, unsigned long long offset) {
+        buffer = data;
+        buffer_offset = offset;
+    }
+    unsigned long long offset_of(std::string_view line) const {
+        size_t at = static_cast<size_t>(line.data() - buffer);
+        if (line_offsets.empty()) return buffer_offset + at;
+        auto start = std::upper_bound(line_offsets.begin(), line_offsets.end(), std::make_pair(at, ~0ull)) - 1;
+        return start->second;
+    }
+    // UTF-16 input converted whole: where its lines start in the converted buffer and in
+    // the input (empty for other input, whose buffer is the input)
+    std::vector<std::pair<size_t, unsigned long long>> line_offsets;
+
+    // --- Context Handling Variables ---
+    // Recent lines for -B context (views into the input)
+    ContextRing before_lines;
+    // Counter for how many lines to print *after* the current match for -A context
+    int after_lines_to_print = 0;
+    // Track the line number of the last line printed to manage context overlaps/separators
+    long long last_printed_line = -1;
+    // Flag to indicate if a "--" separator needs to be printed before the next output line
+    bool pending_separator = false;
+};
+
+// Locates the lines of a buffer that can match, for search_lines and count_lines.
+// Literal patterns and the regex engine's DFA both find the next line that can match
+// without splitting lines. When the regex patterns have required literals, the literal
+// engine finds their candidate lines instead. Otherwise std::regex has no such search, so
+// with any pattern left to it every line is a candidate. Each engine's next hit is kept
+// until the scan passes it, so no engine rescans the same text.
+class CandidateScan {
+public:
+    CandidateScan(const CompiledMatcher& matcher, const Settings& settings, std::string_view buffer, MatchScratch& scratch);
+
+    // Position at or after 'from' inside the next candidate line, or npos if there is none.
+    // 'confirmed' is set when the engine that found it has already decided that the line
+    // matches, so running the matchers over it again would only repeat the answer.
+    size_t next(size_t from, bool& confirmed);
+
+private:
+    const CompiledMatcher& matcher_;
+    std::string_view buffer_;
+    MatchScratch& scratch_;
+    bool prefilter_;
+    bool every_line_;
+    bool literals_decide_; // A literal hit is a match: no -w boundaries left to check
+    size_t literal_hit_ = 0;
+    size_t regex_hit_ = 0;
+    bool first_scan_ = true;
+};
+
+// Reads files ahead of the search, so that opening and reading the next files overlaps with
+// searching the current one and a slow disk or network share always has several requests
+// to work on. Every searching thread owns one: each -j worker, or the main thread when it
+// searches alone. On Linux opens and reads go through io_uring, submitted in batches with
+// one system call; on Windows reads are overlapped on an I/O completion port (opening a file
+// has no asynchronous form there, so add() opens it). Only regular files up to kMaxFileSize
+// are read: anything else, and any file the reader fails on, comes back unread and takes the
+// usual path, which maps large files and reports errors. The number of files the reader asks
+// for adapts to the device: it grows whenever the search has to wait for a read, and
+// shrinks while reads complete before they are needed. (Doubling instead overshoots on a
+// warm cache, where a wait is short but the extra buffers are not free.)
+class AsyncReader {
+public:
+    static constexpr size_t kMaxFileSize = 256 * 1024;
+    struct File {
+        std::string path;
+        void* tag = nullptr;
+        bool read = false;          // Otherwise the file is left to the usual path
+        std::vector<char> contents; // The whole file, if read
+    };
+
+    AsyncReader() = default;
+    ~AsyncReader() { close(); }
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+
+    // Whether this system has a backend (io_uring can be missing or blocked by a sandbox)
+    static bool available();
+    // Set up the backend's queue; false if it cannot be
+    bool open();
+    void close();
+
+    // Files worth adding now to keep the device busy
+    size_t wanted() const { return depth_ > requests_.size() ? depth_ - requests_.size() : 0; }
+    // Files added and not returned by next() yet
+    size_t in_flight() const { return requests_.size(); }
+    // Start reading a file; next() returns it with 'tag'
+    void add(const std::string& path, void* tag);
+    // The next file, waiting for it if need be: the first one added if 'in_order', else
+    // whichever completes first. False if none is in flight.
+    bool next(File& file, bool in_order);
+
+private:
+    struct Request {
+        File file;
+        size_t filled = 0;
+        bool done = false;
+#ifdef _WIN32
+        struct Overlapped : OVERLAPPED {
+            Overlapped() : OVERLAPPED() {}
+            Request* request = nullptr;
+        } overlapped;
+        HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+        int fd = -1;
+#endif
+    };
+    static constexpr size_t kMinDepth = 2;
+    static constexpr size_t kMaxDepth = 128;
+
+    bool reap(bool wait); // Handle the completions there are (at least one if 'wait'); false on failure
+    void complete(Request* request, bool read);
+
+    size_t depth_ = 8;
+    size_t completed_ = 0; // Requests done and not returned yet
+    std::deque<std::unique_ptr<Request>> requests_; // In the order they were added
+#ifdef SCANR_IO_URING
+    // The submission and completion rings, shared with the kernel
+    io_uring_sqe* next_sqe();
+    void submit_read(Request* request);
+    int ring_ = -1;
+    bool unsupported_ = false; // The kernel lacks the open or read operation (before 5.6)
+    bool failed_ = false;      // io_uring_enter failed: the ring is not touched again
+    void* sq_map_ = nullptr;
+    size_t sq_map_size_ = 0;
+    void* cq_map_ = nullptr;
+    size_t cq_map_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_mask_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned* cq_mask_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned to_submit_ = 0;
+#elif defined(_WIN32)
+    bool start_read(Request* request);
+    HANDLE port_ = nullptr;
+#endif
+};
+
+// Searches files on worker threads for -j. Every file's output is collected in a buffer of
+// its own and written out whole, in input order, so the result is byte-identical to a
+// serial run. The file first in line streams its output straight through once its buffer
+// fills up. With --unordered, files are written in the order they finish instead, and
+// whichever file first fills its buffer streams until it is done.
+class SearchPool {
+public:
+    SearchPool(const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, unsigned thread_count);
+    ~SearchPool() { finish(); }
+    SearchPool(const SearchPool&) = delete;
+    SearchPool& operator=(const SearchPool&) = delete;
+
+    // Queue a file. Blocks while too many files are searched or waiting to be written.
+    void add(const std::string& filename);
+
+    // Queue an error message, printed in order with the files' output
+    void add_error(const std::string& message);
+
+    // Wait for every queued file and write out the rest
+    void finish();
+
+private:
+    struct Task;
+    using TaskList = std::list<std::unique_ptr<Task>>;
+    struct Task {
+        std::string filename;
+        std::string errors;   // Messages for standard error, printed before the output
+        std::string output;
+        bool done = false;
+        TaskList::iterator position; // In tasks_
+    };
+
+    Task* new_task();
+    void run();
+    bool spill(Task* task, std::string_view errors, std::string_view output);
+    void complete(Task* task);
+    void write_task(Task* task);
+    static void write_out(std::string_view errors, std::string_view output);
+
+    const Settings& settings_;
+    const CompiledMatcher& matcher_;
+    bool show_filename_prefix_;
+    bool ordered_;
+    bool line_buffered_;
+    size_t max_pending_;
+
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable work_cv_;        // Workers: a file was queued, or the pool is closing
+    std::condition_variable space_cv_;       // add(): a file was written out
+    TaskList tasks_;                         // Not written out yet, in input order
+    std::deque<Task*> queue_;                // Files no worker has taken yet
+    std::vector<Task*> finished_;            // --unordered: done, waiting for the streaming file
+    Task* streaming_ = nullptr;              // --unordered: the file allowed to write directly
+    bool closing_ = false;
+    bool read_ahead_;                        // Workers read their next files ahead (unless --no-async-io)
+};
+
+// Searches one large mapped file on several threads: the file is cut into newline-aligned
+// chunks, and each is searched like a file of its own, with the context state a serial
+// search would carry into it rebuilt from the lines just before it. The chunks' output is
+// written in order as with SearchPool, so the result is byte-identical to a serial run.
+// Line numbers for -n come from a parallel count of each chunk's newlines.
+class ChunkedSearch {
+public:
+    static constexpr size_t kMinFileSize = 32 << 20;  // Smaller files are searched by one thread
+    static constexpr size_t kMinChunkSize = 4 << 20;
+
+    ChunkedSearch(StreamContext& ctx, const char* data, size_t size, unsigned thread_count);
+
+    // Search the whole buffer and write its output; afterwards ctx holds the totals
+    // (match count, and whether -l listed the file) for finish_stream
+    void run();
+
+private:
+    // Without -n, line numbers are only compared within a chunk and the lines before it, so
+    // every chunk counts from this offset instead of its real first line
+    static constexpr long long kUnnumberedBase = 1LL << 48;
+
+    struct Chunk {
+        size_t begin = 0;
+        size_t end = 0;
+        long long lines_before = 0;  // Line number of the last line before the chunk
+        std::string output;
+        long long match_count = 0;
+        bool listed = false;         // -l: the chunk found a matching line
+        bool leading_gap = false;    // Nothing printed just before: a "--" is due after earlier output
+        bool started = false;        // Some output has been written
+        bool done = false;
+    };
+
+    void search_chunks(MatchScratch& scratch);
+    bool resume_context(StreamContext& ctx, const Chunk& chunk);
+    bool spill(size_t index, std::string_view output);
+    void complete(size_t index);
+    void write_chunk(Chunk& chunk, std::string_view output);
+
+    StreamContext& ctx_;
+    const char* data_;
+    size_t size_;
+    unsigned thread_count_;
+    std::vector<Chunk> chunks_;
+
+    std::mutex mutex_;
+    std::condition_variable space_cv_;  // Workers: a chunk was written out
+    size_t next_chunk_ = 0;             // First chunk no worker has taken yet
+    size_t next_write_ = 0;             // First chunk not written out yet
+    bool wrote_ = false;                // Some chunk's output has been written
+    bool listed_ = false;               // -l: a written chunk listed the file; the rest is dropped
+    std::atomic<bool> cancel_{false};   // -l, -q: some chunk has the answer; the others stop
+};
+
+// Wakes --follow when something changes in the directories of the followed files: inotify
+// on Linux, ReadDirectoryChangesW on Windows. Where neither is available, or a directory
+// cannot be watched, wait() just sleeps and the follower's periodic check finds the change.
+class ChangeWatcher {
+public:
+    ChangeWatcher();
+    ~ChangeWatcher();
+    ChangeWatcher(const ChangeWatcher&) = delete;
+    ChangeWatcher& operator=(const ChangeWatcher&) = delete;
+
+    // Watch a directory, given as the prefix its entries' paths start with ("" is the
+    // current directory, otherwise it ends with a separator). Watching it twice is harmless.
+    void watch(const std::string& directory);
+
+    // Wait up to 'timeout_ms' for changes and add the paths of the entries that changed to
+    // 'changed'. False on a timeout, or if the system lost track of what changed (then
+    // every file may have changed).
+    bool wait(int timeout_ms, std::vector<std::string>& changed);
+
+private:
+    std::vector<std::string> directories_;
+#ifdef __linux__
+    int fd_ = -1;                                      // inotify instance
+    std::unordered_map<int, size_t> watches_;          // Watch descriptor -> index into directories_
+    std::vector<char> events_;
+#elif defined(_WIN32)
+    struct Watch {
+        Watch() : overlapped() {}
+        size_t directory = 0;
+        HANDLE handle = INVALID_HANDLE_VALUE;
+        OVERLAPPED overlapped;
+        std::vector<DWORD> buffer = std::vector<DWORD>(16 * 1024); // FILE_NOTIFY_INFORMATION records
+    };
+    bool start(Watch& watch);
+    HANDLE port_ = nullptr;
+    std::vector<std::unique_ptr<Watch>> watches_;
+#endif
+};
+
+// --follow: after the files have been searched, keep watching them and search only what
+// is appended to them, as "tail -F FILE | scanr" would, for every file at once. Each file
+// keeps its StreamContext between checks, so line numbers, -A and -B context and -m carry
+// over from one appended piece to the next as they do from block to block of a stream.
+// Only complete lines are searched; a last line without its newline waits for it. A file
+// that shrinks, or is replaced under its name (log rotation), is searched again from its
+// start, and a file that disappears is picked up again when it reappears. Under -r, files
+// created later in the directories of the tree are followed from their start too.
+class FileFollower {
+public:
+    FileFollower(const Settings& settings, const CompiledMatcher& matcher, const FileFilter& filter, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch);
+
+    // Search a file named on the command line, and follow it
+    void add_file(const std::string& path);
+    // Search and follow every file of a directory tree (-r)
+    void add_tree(const std::string& root);
+
+    // Search what is appended to the files, until -q has its answer or every file is done
+    // with (-l listed it, -m reached its count, it is binary, compressed or UTF-16)
+    void run();
+
+private:
+    static constexpr size_t kBlockSize = 1 << 20; // Bytes read at a time
+    static constexpr int kPollMs = 1000;          // Every file is checked this often, changed or not
+
+    // What tells a file apart from another one that later takes its name
+    struct Identity {
+        unsigned long long volume = 0;
+        unsigned long long file = 0;
+        bool operator!=(const Identity& other) const { return volume != other.volume || file != other.file; }
+    };
+    struct Followed {
+        std::string path;
+        std::unique_ptr<StreamContext> ctx; // From the file's start; replaced when it is searched again
+        Identity identity;
+        unsigned long long searched = 0;    // Bytes searched: through the last complete line
+        unsigned long long size = 0;        // Size and modification time at the last check
+        long long mtime = 0;
+        bool missing = false;               // Could not be opened at the last check
+        bool finished = false;              // Nothing more to search
+    };
+
+    Followed& follow(const std::string& path);
+    void check(Followed& file);
+    bool search_text(Followed& file, size_t size, bool first);
+    static std::string directory_of(const std::string& path);
+
+    const Settings& settings_;
+    const CompiledMatcher& matcher_;
+    const FileFilter& filter_;
+    FileFilter::Scratch filter_scratch_;
+    bool show_filename_prefix_;
+    OutputBuffer& out_;
+    MatchScratch& scratch_;
+    ChangeWatcher watcher_;
+    std::vector<std::unique_ptr<Followed>> files_;
+    std::unordered_map<std::string, Followed*> by_path_;
+    std::vector<std::string> tree_directories_; // Watched for new files (-r)
+    std::vector<char> buffer_;
+};
+
+// Files a --serve process keeps mapped (or, if small, read into memory) from one query to
+// the next, so that a warm query neither opens nor reads a file that has not changed. An
+// entry is used again while the file has the size and modification time it had when it
+// was mapped; past kMaxBytes, the entries used least recently are dropped.
+class FileCache {
+public:
+    static constexpr unsigned long long kMaxBytes = 1ull << 30;
+
+    // Relative paths of the queries that follow are relative to 'directory'
+    void set_directory(const std::string& directory) { directory_ = directory; }
+
+    // The contents of 'path', mapped again if the file changed; nullptr if it cannot be
+    // mapped (it is then searched as a stream, which reports why it cannot be opened)
+    std::shared_ptr<const MappedFile> open(const std::string& path);
+
+private:
+    struct Entry {
+        std::shared_ptr<const MappedFile> file;
+        unsigned long long size = 0;
+        long long mtime = 0;
+        unsigned long long used = 0; // Value of clock_ when it was last used
+    };
+
+    std::mutex mutex_; // -j workers open files concurrently
+    std::string directory_;
+    std::unordered_map<std::string, Entry> entries_;
+    unsigned long long bytes_ = 0;
+    unsigned long long clock_ = 0;
+};
+
+// --serve: a long-running process that answers searches sent by "scanr --connect" over a
+// local socket (a named pipe on Windows), so that repeated searches with the same patterns
+// pay for starting a process and compiling the patterns once. It keeps the compiled
+// pattern sets, each with the lazily built DFA of its queries, and a FileCache of the
+// files searched. A client sends its working directory, its arguments and its standard
+// streams; the server searches with those streams as its own and replies with the exit
+// status, so output, errors and line buffering are exactly those of a search run by the
+// client itself. Queries are answered one at a time (each can still use -j threads).
+class SearchServer {
+public:
+    // A compiled pattern set and the matching state of the thread that searches with it
+    struct Patterns {
+        CompiledMatcher matcher;
+        MatchScratch scratch;
+        unsigned long long used = 0;
+    };
+
+    // First bytes of every query
+    static constexpr char kMagic[8] = {'S', 'C', 'A', 'N', 'R', 'Q', '0', '1'};
+
+    explicit SearchServer(std::string address) : address_(std::move(address)) {}
+
+    // The address used when --serve or --connect names none
+    static std::string default_address();
+
+    // Answer queries until the process is stopped. Returns 1 if it cannot listen.
+    int run();
+
+    // The pattern set of 'settings', compiled on first use (throws as build_matcher does);
+    // 'compiled' tells whether that was now
+    Patterns& patterns(const Settings& settings, bool& compiled);
+
+private:
+    static constexpr size_t kMaxPatternSets = 16;
+
+    bool listen();
+    int query(const std::vector<std::string>& request);
+
+    std::string address_;
+    FileCache files_;
+    std::unordered_map<std::string, std::unique_ptr<Patterns>> patterns_; // By PatternCache::key
+    unsigned long long clock_ = 0;
+#ifdef _WIN32
+    HANDLE pipe_ = INVALID_HANDLE_VALUE;
+#else
+    int socket_ = -1;
+#endif
+};
+
+// --- Function Prototypes ---
+void print_usage();
+bool parse_arguments(int argc, char* argv[], Settings& settings);
+bool is_interactive_output();
+void search_file(const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch);
+void print_search_stats(const SearchStats& stats);
+void process_stream(int fd, const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch);
+static void process_blocks(BlockReader& reader, const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch);
+template <class Stats> static void process_blocks(BlockReader& reader, const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch, Stats stats);
+static void search_decompressed(Decompressor& source, const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch);
+void search_buffer(const char* data, size_t size, const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch);
+void search_lines(StreamContext& ctx, const char* data, size_t size);
+template <class Stats> static void search_lines(StreamContext& ctx, const char* data, size_t size, Stats stats);
+template <class Stats> static void count_lines(StreamContext& ctx, const char* data, size_t size, Stats stats);
+long long count_newlines(const char* begin, const char* end);
+void handle_line(StreamContext& ctx, std::string_view line, bool is_match, const std::vector<std::pair<size_t, size_t>>& match_positions);
+void write_line(StreamContext& ctx, long long line_number, char separator, std::string_view text);
+void write_json_line(StreamContext& ctx, long long line_number, unsigned long long offset, char separator, std::string_view text, const std::vector<std::pair<size_t, size_t>>* spans);
+void write_json_file(StreamContext& ctx, const long long* count);
+bool write_json_string(OutputBuffer& out, std::string_view text);
+void write_json_base64(OutputBuffer& out, std::string_view bytes);
+void skip_lines(StreamContext& ctx, const char* begin, const char* end);
+static std::string_view make_line(const char* begin, const char* end);
+bool looks_binary(const char* data, size_t size);
+size_t byte_order_mark(const char* data, size_t size, TextEncoding& encoding);
+void search_utf16(StreamContext& ctx, const char* data, size_t size, TextEncoding encoding, size_t bom);
+bool utf16_looks_binary(const char* data, size_t size);
+long long count_utf16_newlines(const char* begin, const char* end, TextEncoding encoding);
+void utf16_to_utf8(const char* data, size_t size, TextEncoding encoding, std::string& text);
+bool utf8_to_utf16(std::string_view text, TextEncoding encoding, std::string& units);
+void finish_stream(StreamContext& ctx);
+CompiledMatcher build_matcher(const Settings& settings);
+bool regex_literal(const std::string& pattern, std::string& literal);
+bool case_variants(std::string_view literal, size_t limit, std::vector<std::string>& variants);
+std::string fold_regex_source(const std::string& pattern);
+std::string escape_regex(std::string_view literal);
+bool regex_required_literals(const std::string& pattern, bool ignore_case, std::vector<std::string>& literals);
+void compile_patterns(const std::vector<std::string>& patterns, const Settings& settings, CompiledMatcher& matcher);
+bool regex_matches(std::string_view line, const std::vector<std::regex>& regex_patterns, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions, MatchScratch& scratch);
+bool program_matches(std::string_view line, const RegexProgram& regexes, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions, MatchScratch& scratch);
+bool simple_matches(std::string_view line, const MultiLiteralMatcher& literals, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions, MatchScratch& scratch);
+bool is_word_boundary(std::string_view line, size_t pos);
+unsigned walker_thread_count();
+unsigned search_thread_count(const Settings& settings);
+bool is_directory(const std::string& path);
+bool file_signature(const std::string& path, unsigned long long& size, long long& mtime);
+bool index_can_narrow(const Settings& settings, const CompiledMatcher& matcher);
+int run_search(Settings& settings, SearchServer* server);
+bool server_option(const char* arg, const char* option, std::string& address);
+bool send_query(const std::string& address, int argc, char* argv[], int& status);
+unsigned long long allocation_count();
+
+
+// --- Main Function ---
+int main(int argc, char* argv[]) {
+    // --serve and --connect come before any other argument: the server takes none, and a
+    // client hands the rest of its command line to the server without parsing it
+    std::string address;
+    if (argc > 1 && server_option(argv[1], "--serve", address)) {
+        if (argc > 2) {
+            std::cerr << "scanr: --serve takes no other arguments" << std::endl;
+            return 1;
+        }
+        if (address.empty()) return 1; // No private place for the default socket (reported)
+        return SearchServer(address).run();
+    }
+    if (argc > 1 && server_option(argv[1], "--connect", address)) {
+        int status;
+        if (send_query(address, argc - 2, argv + 2, status)) return status;
+        --argc; // No server there: search in this process, as without --connect
+        ++argv;
+    }
+
+    Settings settings;
+
+    // 1. Parse Command Line Arguments
+    if (!parse_arguments(argc, argv, settings)) {
+        return 1; // Exit if parsing failed
+    }
+    return run_search(settings, nullptr);
+}
+
+// Everything after parsing the command line: the search itself, or --index build. A
+// --serve process runs it for every query, with 'server' keeping its compiled patterns.
+int run_search(Settings& settings, SearchServer* server) {
+    quiet_match_found = false;
+    SearchStats::reset();
+
+    // --index build: index each directory (the current one by default) and stop there
+    if (settings.index_mode == IndexMode::kBuild) {
+        std::unique_ptr<FileFilter> filter;
+        try {
+            filter = std::make_unique<FileFilter>(settings);
+        } catch (const std::invalid_argument& e) {
+            std::cerr << "scanr: " << e.what() << std::endl;
+            return 1;
+        }
+        std::vector<std::string> roots = settings.files;
+        if (roots.empty()) roots.emplace_back();
+        for (const auto& root : roots) {
+            if (!root.empty() && !is_directory(root)) {
+                std::cerr << "scanr: Cannot index '" << root << "': not a directory" << std::endl;
+                return 1;
+            }
+            if (!TrigramIndex::build(root, settings, *filter)) return 1;
+        }
+        return 0;
+    }
+
+    // Ensure at least one pattern was provided
+    if (settings.patterns.empty()) {
+        std::cerr << "scanr: No pattern provided." << std::endl;
+        print_usage();
+        return 1;
+    }
+
+    // Patterns are read as regular expressions under -i, -w and -o (as with -E). Only the
+    // ones that really use regex syntax go to the regex engine; see build_matcher.
+    if (settings.match_whole_word || settings.ignore_case || settings.only_matching) {
+         settings.use_extended_regex = true;
+    }
+
+    // Compile the pattern set once; every input shares the result
+    CompiledMatcher compiled;
+    SearchServer::Patterns* served = nullptr; // --serve: compiled by this query or an earlier one
+    bool reused = false;
+    try {
+        if (server != nullptr) {
+            bool now;
+            served = &server->patterns(settings, now);
+            reused = !now;
+        } else {
+            compiled = build_matcher(settings);
+        }
+    } catch (const std::regex_error& e) {
+        std::cerr << "scanr: Invalid regular expression: " << e.what() << " (Pattern: " << e.what() /* Might not show pattern */ << ")" << std::endl;
+        return 1;
+    }
+     catch (const std::exception& e) {
+         std::cerr << "scanr: Error compiling regex: " << e.what() << std::endl;
+         return 1;
+     }
+    const CompiledMatcher& matcher = served != nullptr ? served->matcher : compiled;
+
+    // File name filters, compiled once like the patterns; the walker applies them to every
+    // entry before opening anything
+    std::unique_ptr<FileFilter> filter;
+    try {
+        filter = std::make_unique<FileFilter>(settings);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << "scanr: " << e.what() << std::endl;
+        return 1;
+    }
+    FileFilter::Scratch filter_scratch;
+
+    // -m 0 selects no line of any input: there is nothing to read
+    if (settings.max_count == 0) return settings.quiet ? 1 : 0;
+
+
+    // Determine if filename prefix should be shown (multiple files and not disabled).
+    // A recursive search names its files like a search of several.
+    bool several_files = settings.files.size() > 1 ||
+                         (settings.recursive && (settings.files.empty() || is_directory(settings.files[0])));
+    bool show_filename_prefix = several_files && !settings.hide_filenames && !settings.list_filenames && !settings.count_only;
+
+    // All standard output goes through one buffer; consoles get line-at-a-time output
+    OutputBuffer out(stdout);
+    out.set_line_buffered(settings.line_buffered || is_interactive_output());
+    MatchScratch own_scratch;
+    MatchScratch& scratch = served != nullptr ? served->scratch : own_scratch; // A served set keeps its DFA warm
+    scratch.collect_stats = settings.show_stats;
+    scratch.stats = SearchStats();
+#ifdef SCANR_COUNT_ALLOCATIONS
+    unsigned long long allocations_before_search = allocation_count();
+#endif
+
+    // 2. Process Input (Standard Input or Files)
+    if (settings.files.empty() && !settings.recursive) {
+        // Process standard input
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY); // Raw bytes; CRLF is handled when lines are sliced
+#endif
+        process_stream(0, "(standard input)", settings, matcher, false, out, scratch); // No prefix for stdin
+    } else if (settings.follow) {
+        // --follow: search the files, then what is appended to them
+        FileFollower follower(settings, matcher, *filter, show_filename_prefix, out, scratch);
+        std::vector<std::string> inputs = settings.files;
+        if (inputs.empty()) inputs.emplace_back();
+        for (const auto& filename : inputs) {
+            if (settings.recursive && (filename.empty() || is_directory(filename))) {
+                follower.add_tree(filename);
+            } else {
+                follower.add_file(filename);
+            }
+        }
+        follower.run();
+    } else {
+        // Several files are searched in parallel by a pool of workers (-j), in order
+        std::unique_ptr<SearchPool> pool;
+        unsigned threads = search_thread_count(settings);
+        bool several = settings.files.size() > 1 || settings.recursive;
+        if (threads > 1 && several) {
+            pool = std::make_unique<SearchPool>(settings, matcher, show_filename_prefix, threads);
+        } else {
+            settings.chunk_threads = threads; // A single file: large ones are split across the threads instead
+        }
+        // Searching alone, this thread reads its next files ahead and takes them in order
+        AsyncReader reader;
+        bool read_ahead = !pool && several && settings.async_io && settings.use_mmap && settings.file_cache == nullptr && AsyncReader::available() && reader.open();
+        auto search_next = [&] {
+            AsyncReader::File file;
+            if (!reader.next(file, true)) return false;
+            if (quiet_match_found) return true; // -q has its answer: what was read ahead is dropped
+            if (file.read) {
+                if (scratch.collect_stats) {
+                    ++scratch.stats.read_ahead_files;
+                    scratch.stats.read_ahead_bytes += file.contents.size();
                 }
-            } else if (arg == "-A") {
-                 if (++i < argc) {
-                    try {
-                        settings.lines_after = std::stoi(argv[i]);
-                        if (settings.lines_after < 0) throw std::invalid_argument("Negative value");
-                    } catch (const std::exception& e) {
-                        std::cerr << "scanr: Invalid non-negative integer for option '-A': '" << argv[i] << "'" << std::endl;
-                        return false;
+                search_buffer(file.contents.data(), file.contents.size(), file.path, settings, matcher, show_filename_prefix, out, scratch);
+            } else {
+                search_file(file.path, settings, matcher, show_filename_prefix, out, scratch);
+            }
+            return true;
+        };
+        auto drain = [&] { // Search what was read ahead, before anything else is reported
+            while (reader.in_flight() > 0 && search_next()) {}
+        };
+        auto search = [&](const std::string& filename) {
+            if (pool) {
+                pool->add(filename);
+            } else if (read_ahead) {
+                reader.add(filename, nullptr);
+                while (reader.wanted() == 0 && search_next()) {}
+            } else {
+                search_file(filename, settings, matcher, show_filename_prefix, out, scratch);
+            }
+        };
+
+        // Process each file provided; with -r, directories are walked and each file found
+        // is searched as soon as the walk hands it over ("" stands for the current directory)
+        std::vector<std::string> inputs = settings.files;
+        if (inputs.empty()) inputs.emplace_back();
+        struct {
+            size_t trees = 0;      // Directories whose index narrowed the search
+            size_t indexed = 0;    // Files in those indexes
+            size_t candidates = 0; // Indexed files that can match
+            size_t skipped = 0;    // Files not opened
+            size_t changed = 0;    // Ruled out or not indexed, but new or changed since: searched
+        } index_stats;
+        for (const auto& filename : inputs) {
+            if (quiet_match_found) break;
+            if (settings.recursive && (filename.empty() || is_directory(filename))) {
+                // --index use: files the index rules out are skipped unless they changed since
+                TrigramIndex index;
+                std::vector<bool> candidates;
+                bool narrowed = false;
+                if (settings.index_mode == IndexMode::kUse) {
+                    if (!index.open(TrigramIndex::path_for(filename, settings))) {
+                        drain();
+                        out.error("scanr: No index of '" + (filename.empty() ? std::string(".") : filename) + "' (see --index build); searching every file");
+                    } else if (index_can_narrow(settings, matcher)) {
+                        narrowed = index.candidates(matcher.required_literals, candidates);
                     }
-                } else {
-                    std::cerr << "scanr: Option '-A' requires a non-negative integer argument." << std::endl;
-                    return false;
-                }
-            } else if (arg == "-B") {
-                 if (++i < argc) {
-                    try {
-                        settings.lines_before = std::stoi(argv[i]);
-                         if (settings.lines_before < 0) throw std::invalid_argument("Negative value");
-                    } catch (const std::exception& e) {
-                        std::cerr << "scanr: Invalid non-negative integer for option '-B': '" << argv[i] << "'" << std::endl;
-                        return false;
+                    if (settings.show_stats && narrowed) {
+                        ++index_stats.trees;
+                        index_stats.indexed += index.file_count();
+                        index_stats.candidates += static_cast<size_t>(std::count(candidates.begin(), candidates.end(), true));
                     }
-                } else {
-                    std::cerr << "scanr: Option '-B' requires a non-negative integer argument." << std::endl;
-                    return false;
                 }
-            } else if (arg == "-C") {
-                 if (++i < argc) {
-                    try {
-                        int context = std::stoi(argv[i]);
-                        if (context < 0) throw std::invalid_argument("Negative value");
-                        settings.lines_after = context;
-                        settings.lines_before = context;
-                    } catch (const std::exception& e) {
-                        std::cerr << "scanr: Invalid non-negative integer for option '-C': '" << argv[i] << "'" << std::endl;
-                        return false;
+                DirectoryWalker walker(settings.follow_symlinks, walker_thread_count(), *filter);
+                walker.start(filename);
+                std::string path;
+                bool unreadable = false;
+                while (walker.next(path, unreadable)) {
+                    if (quiet_match_found) { // -q has its answer: stop the walk too
+                        walker.stop();
+                        break;
                     }
-                } else {
-                    std::cerr << "scanr: Option '-C' requires a non-negative integer argument." << std::endl;
-                    return false;
-                }
-            } else {
-                // Handle combined short options like -inv
-                for (size_t j = 1; j < arg.length(); ++j) {
-                    switch (arg[j]) {
-                        case 'c': settings.count_only = true; break;
-                        case 'h': settings.hide_filenames = true; break;
-                        case 'i': settings.ignore_case = true; break;
-                        case 'l': settings.list_filenames = true; break;
-                        case 'n': settings.show_line_numbers = true; break;
-                        case 'v': settings.invert_match = true; break;
-                        case 'E': settings.use_extended_regex = true; break;
-                        case 'w': settings.match_whole_word = true; break;
-                        case 'o': settings.only_matching = true; break;
-                        default:
-                            std::cerr << "scanr: Invalid option -- '" << arg[j] << "' in '" << arg << "'" << std::endl;
-                            print_usage();
-                            return false;
+                    if (unreadable) {
+                        std::string message = "scanr: Cannot read directory '" + path + "'";
+                        if (pool) {
+                            pool->add_error(message);
+                        } else {
+                            drain();
+                            out.error(message);
+                        }
+                        continue;
+                    }
+                    if (narrowed) {
+                        size_t id = index.find(TrigramIndex::relative(filename, path));
+                        if (id == std::string_view::npos) {
+                            ++index_stats.changed; // New since the index was built
+                        } else if (!candidates[id]) {
+                            unsigned long long size;
+                            long long mtime;
+                            if (file_signature(path, size, mtime) && index.up_to_date(id, size, mtime)) {
+                                ++index_stats.skipped;
+                                continue;
+                            }
+                            ++index_stats.changed; // Changed since: what the index says no longer holds
+                        }
                     }
+                    search(path);
                 }
+                continue;
             }
-        } else {
-            // Not an option, treat as pattern or filename
-            if (pattern_sources.empty() && settings.patterns.empty()) {
-                // If no patterns loaded from -f or -e yet, this is the main pattern
-                pattern_sources.push_back(arg);
+            // --include and --exclude also apply to the files named on the command line
+            if (filter->filters_files()) {
+#ifdef _WIN32
+                size_t separator = filename.find_last_of("\\/:");
+#else
+                size_t separator = filename.find_last_of('/');
+#endif
+                std::string_view base_name = std::string_view(filename).substr(separator == std::string::npos ? 0 : separator + 1);
+                if (!filter->file_allowed(base_name, filter_scratch)) continue;
+            }
+            search(filename);
+        }
+        drain();
+        if (pool) pool->finish();
+        if (settings.show_stats && settings.index_mode == IndexMode::kUse) {
+            if (index_stats.trees > 0) {
+                std::cerr << "scanr: index: " << index_stats.candidates << " of " << index_stats.indexed << " indexed file(s) can match, "
+                          << index_stats.skipped << " skipped, " << index_stats.changed << " new or changed file(s) searched" << std::endl;
             } else {
-                // Otherwise, it's an input file
-                settings.files.push_back(arg);
+                std::cerr << "scanr: index: not used (no index, -v, -c, or a pattern without a required literal of 3 or more bytes)" << std::endl;
             }
         }
-    }
+    }
+    out.flush();
+
+    if (settings.show_stats) {
+        SearchStats::publish(scratch.stats);
+        print_search_stats(SearchStats::totals());
+        if (reused) {
+            std::cerr << "scanr: " << settings.patterns.size() << " pattern(s) compiled by an earlier query (--serve)" << std::endl;
+        } else {
+            std::cerr << "scanr: " << (matcher.from_cache ? "loaded " : "compiled ") << settings.patterns.size() << " pattern(s) in "
+                      << matcher.compile_ms << " ms" << (matcher.from_cache ? " from the pattern cache" : "") << std::endl;
+        }
+        if (!matcher.regex_patterns.empty()) {
+            std::cerr << "scanr: " << matcher.regex_patterns.size() << " pattern(s) matched with std::regex" << std::endl;
+        }
+        if (matcher.regex_prefilter_size > 0) {
+            std::cerr << "scanr: regex prefilter on " << matcher.regex_prefilter_size << " required literal(s)" << std::endl;
+        }
+#ifdef SCANR_COUNT_ALLOCATIONS
+        std::cerr << "scanr: " << (allocation_count() - allocations_before_search) << " heap allocation(s) while searching" << std::endl;
+#endif
+    }
+
+    // -q reports through the exit status whether any line was selected
+    if (settings.quiet && !quiet_match_found) return 1;
+    return 0; // Success
+}
+
+// --- Helper Functions ---
+
+#ifdef SCANR_COUNT_ALLOCATIONS
+// Debug builds (-DSCANR_COUNT_ALLOCATIONS) count every heap allocation, so --stats can show
+// that searching allocates per file and per buffer at most, never per line
+static std::atomic<unsigned long long> allocations{0};
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size != 0 ? size : 1)) return memory;
+    throw std::bad_alloc();
+}
+
+// GCC flags free() on memory from operator new, not seeing that operator new is malloc here
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+#endif
+
+// Heap allocations made so far (0 unless built with SCANR_COUNT_ALLOCATIONS)
+unsigned long long allocation_count() {
+#ifdef SCANR_COUNT_ALLOCATIONS
+    return allocations.load(std::memory_order_relaxed);
+#else
+    return 0;
+#endif
+}
+
+// Print usage instructions to standard error
+void print_usage() {
+    std::cerr << "Usage: scanr [OPTIONS]... PATTERN [FILE]...\n"
+              << "   or: scanr [OPTIONS]... -e PATTERN... [FILE]...\n"
+              << "   or: scanr [OPTIONS]... -f FILE_WITH_PATTERNS [FILE]...\n"
+              << "Search for PATTERN in each FILE or standard input.\n\n"
+              << "Options:\n"
+              << "  -c, --count            Print only a count of matching lines per file\n"
+              << "  -h                     Suppress the prefixing of filenames on output\n"
+              << "  -i                     Ignore case distinctions\n"
+              << "  -l                     Print only names of files containing matches\n"
+              << "  -n                     Prefix each line of output with the line number\n"
+              << "  -v                     Select non-matching lines\n"
+              << "  -m, --max-count NUM    Stop reading a file after NUM selected lines\n"
+              << "  -q, --quiet            Print nothing; exit with status 0 at the first selected line, 1 if there is none\n"
+              << "  -e PATTERN             Use PATTERN for matching (can be used multiple times)\n"
+              << "  -f FILE                Obtain patterns from FILE, one per line\n"
+              << "  -E                     Interpret PATTERN as an extended regular expression (ERE)\n"
+              << "  -w                     Match only whole words (patterns are read as with -E)\n"
+              << "  -o                     Print only the matched parts of lines (patterns are read as with -E)\n"
+              << "  -r, --recursive        Search directories recursively (the current one if no FILE is given)\n"
+              << "  -R, --dereference-recursive  Like -r, but follow symbolic links\n"
+              << "      --include=GLOB     Search only files whose base name matches GLOB (may be repeated)\n"
+              << "      --exclude=GLOB     Skip files whose base name matches GLOB (may be repeated)\n"
+              << "      --exclude-dir=GLOB Skip directories whose base name matches GLOB when recursing\n"
+              << "      --gitignore        Skip what .gitignore and .ignore files exclude when recursing\n"
+              << "  -A NUM                 Print NUM lines of trailing context\n"
+              << "  -B NUM                 Print NUM lines of leading context\n"
+              << "  -C NUM                 Print NUM lines of output context (equivalent to -A NUM -B NUM)\n"
+              << "      --no-mmap          Read files as streams instead of memory-mapping them\n"
+              << "      --no-async-io      Do not read files ahead of the search threads\n"
+              << "      --no-decompress    Search gzip, zstd and LZ4 files without decompressing them\n"
+              << "      --line-buffered    Flush output after every line\n"
+              << "      --json             Print one JSON object per output line (file, line, offset, text, spans)\n"
+              << "      --stats            Print run statistics to standard error\n"
+              << "  -j NUM                 Search NUM files in parallel (default: one per hardware thread)\n"
+              << "      --unordered        With -j, print each file's output as soon as it is done\n"
+              << "      --regex-engine=ENGINE  Regex engine: 'dfa' (default, linear time) or 'std' (std::regex)\n"
+              << "      --binary-files=TYPE  Files with NUL bytes: 'binary' (default: report a match, print no lines),\n"
+              << "                         'without-match' (skip them) or 'text' (search them as text)\n"
+              << "  -a, --text             Equivalent to --binary-files=text\n"
+              << "  -I                     Equivalent to --binary-files=without-match\n"
+              << "      --index=MODE       'build': write the trigram index of each DIR (scanr --index=build DIR...);\n"
+              << "                         'use': search directories recursively, skipping files the index rules out\n"
+              << "      --index-file=PATH  Keep the index at PATH instead of DIR/.scanr-index (one DIR only)\n"
+              << "      --pattern-cache=DIR  Reuse the compiled patterns stored in DIR, storing them there if missing\n"
+              << "      --follow           After searching the files, keep searching the lines appended to them\n"
+              << "      --serve[=ADDRESS]  Answer searches sent with --connect, keeping patterns compiled and files mapped\n"
+              << "      --connect[=ADDRESS]  (First option) Have the --serve process at ADDRESS run this search;\n"
+              << "                         without one, search here\n"
+              << std::endl;
+}
+
+// Parse command-line arguments and populate the Settings struct
+bool parse_arguments(int argc, char* argv[], Settings& settings) {
+    std::vector<std::string> pattern_sources; // Temp store for patterns from -e or command line arg
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--") { // Treat all subsequent arguments as files
+            while (++i < argc) {
+                settings.files.push_back(argv[i]);
+            }
+            break;
+        }
+
+        if (arg.length() > 1 && arg[0] == '-') {
+            // Option handling
+            if (arg == "-c" || arg == "--count") {
+                settings.count_only = true;
+            } else if (arg == "-h") {
+                settings.hide_filenames = true;
+            } else if (arg == "-i") {
+                settings.ignore_case = true;
+            } else if (arg == "-l") {
+                settings.list_filenames = true;
+            } else if (arg == "-n") {
+                settings.show_line_numbers = true;
+            } else if (arg == "-v") {
+                settings.invert_match = true;
+            } else if (arg == "-E") {
+                settings.use_extended_regex = true;
+            } else if (arg == "-w") {
+                settings.match_whole_word = true;
+            } else if (arg == "-o") {
+                settings.only_matching = true;
+            } else if (arg == "-r" || arg == "--recursive") {
+                settings.recursive = true;
+            } else if (arg == "-R" || arg == "--dereference-recursive") {
+                settings.recursive = true;
+                settings.follow_symlinks = true;
+            } else if (arg == "--no-mmap") {
+                settings.use_mmap = false;
+            } else if (arg == "--no-async-io") {
+                settings.async_io = false;
+            } else if (arg == "--no-decompress") {
+                settings.decompress = false;
+            } else if (arg == "--line-buffered") {
+                settings.line_buffered = true;
+            } else if (arg == "--json") {
+                settings.json = true;
+            } else if (arg == "--follow") {
+                settings.follow = true;
+            } else if (arg == "--stats") {
+                settings.show_stats = true;
+            } else if (arg == "--unordered") {
+                settings.unordered = true;
+            } else if (arg.compare(0, 10, "--include=") == 0) {
+                settings.include_globs.push_back(arg.substr(10));
+            } else if (arg.compare(0, 10, "--exclude=") == 0) {
+                settings.exclude_globs.push_back(arg.substr(10));
+            } else if (arg.compare(0, 14, "--exclude-dir=") == 0) {
+                settings.exclude_dir_globs.push_back(arg.substr(14));
+            } else if (arg == "-q" || arg == "--quiet" || arg == "--silent") {
+                settings.quiet = true;
+            } else if (arg == "-m" || arg == "--max-count") {
+                 if (++i < argc) {
+                    try {
+                        settings.max_count = std::stoll(argv[i]);
+                        if (settings.max_count < 0) throw std::invalid_argument("Negative value");
+                    } catch (const std::exception& e) {
+                        std::cerr << "scanr: Invalid non-negative integer for option '" << arg << "': '" << argv[i] << "'" << std::endl;
+                        return false;
+                    }
+                } else {
+                    std::cerr << "scanr: Option '" << arg << "' requires a non-negative integer argument." << std::endl;
+                    return false;
+                }
+            } else if (arg == "--gitignore") {
+                settings.use_ignore_files = true;
+            } else if (arg == "-a" || arg == "--text") {
+                settings.binary_files = BinaryFiles::kText;
+            } else if (arg == "-I") {
+                settings.binary_files = BinaryFiles::kWithoutMatch;
+            } else if (arg.compare(0, 15, "--binary-files=") == 0) {
+                std::string type = arg.substr(15);
+                if (type == "binary") {
+                    settings.binary_files = BinaryFiles::kBinary;
+                } else if (type == "without-match") {
+                    settings.binary_files = BinaryFiles::kWithoutMatch;
+                } else if (type == "text") {
+                    settings.binary_files = BinaryFiles::kText;
+                } else {
+                    std::cerr << "scanr: Invalid binary files type '" << type << "' (expected 'binary', 'without-match' or 'text')" << std::endl;
+                    return false;
+                }
+            } else if (arg == "-j") {
+                 if (++i < argc) {
+                    try {
+                        settings.jobs = std::stoi(argv[i]);
+                        if (settings.jobs < 1) throw std::invalid_argument("Not positive");
+                    } catch (const std::exception& e) {
+                        std::cerr << "scanr: Invalid positive integer for option '-j': '" << argv[i] << "'" << std::endl;
+                        return false;
+                    }
+                } else {
+                    std::cerr << "scanr: Option '-j' requires a positive integer argument." << std::endl;
+                    return false;
+                }
+            } else if (arg.compare(0, 15, "--regex-engine=") == 0) {
+                std::string engine = arg.substr(15);
+                if (engine == "dfa") {
+                    settings.use_std_regex = false;
+                } else if (engine == "std") {
+                    settings.use_std_regex = true;
+                } else {
+                    std::cerr << "scanr: Invalid regex engine '" << engine << "' (expected 'dfa' or 'std')" << std::endl;
+                    return false;
+                }
+            } else if (arg == "--index" || arg.compare(0, 8, "--index=") == 0) {
+                std::string mode = arg.size() > 7 ? arg.substr(8) : (++i < argc ? argv[i] : "");
+                if (mode == "build") {
+                    settings.index_mode = IndexMode::kBuild;
+                } else if (mode == "use") {
+                    settings.index_mode = IndexMode::kUse;
+                } else {
+                    std::cerr << "scanr: Option '--index' requires 'build' or 'use'" << std::endl;
+                    return false;
+                }
+            } else if (arg.compare(0, 7, "--serve") == 0 || arg.compare(0, 9, "--connect") == 0) {
+                // Taken by main, only as the first argument
+                std::cerr << "scanr: '" << arg << "' must be the first argument" << std::endl;
+                return false;
+            } else if (arg.compare(0, 13, "--index-file=") == 0) {
+                settings.index_file = arg.substr(13);
+            } else if (arg.compare(0, 16, "--pattern-cache=") == 0) {
+                settings.pattern_cache = arg.substr(16);
+                if (settings.pattern_cache.empty()) {
+                    std::cerr << "scanr: Option '--pattern-cache' requires a directory" << std::endl;
+                    return false;
+                }
+            } else if (arg == "-e") {
+                if (++i < argc) {
+                    pattern_sources.push_back(argv[i]);
+                } else {
+                    std::cerr << "scanr: Option '-e' requires a pattern argument." << std::endl;
+                    return false;
+                }
+            } else if (arg == "-f") {
+                if (++i < argc) {
+                    std::ifstream pattern_file(argv[i]);
+                    if (!pattern_file.is_open()) {
+                        std::cerr << "scanr: Cannot open pattern file '" << argv[i] << "'" << std::endl;
+                        return false;
+                    }
+                    std::string line;
+                    bool added_pattern = false;
+                    while (std::getline(pattern_file, line)) {
+                        // Remove potential trailing newline characters (\r\n or \n)
+                        if (!line.empty() && line.back() == '\r') line.pop_back();
+                         if (!line.empty()) {
+                            settings.patterns.push_back(line);
+                            added_pattern = true;
+                         }
+                    }
+                    pattern_file.close();
+                    if (!added_pattern && pattern_sources.empty() && settings.patterns.empty()) {
+                         std::cerr << "scanr: Warning: Pattern file '" << argv[i] << "' is empty or contains no valid patterns." << std::endl;
+                         // Continue, maybe other patterns were provided
+                    }
+                } else {
+                    std::cerr << "scanr: Option '-f' requires a filename argument." << std::endl;
+                    return false;
+                }
+            } else if (arg == "-A") {
+                 if (++i < argc) {
+                    try {
+                        settings.lines_after = std::stoi(argv[i]);
+                        if (settings.lines_after < 0) throw std::invalid_argument("Negative value");
+                    } catch (const std::exception& e) {
+                        std::cerr << "scanr: Invalid non-negative integer for option '-A': '" << argv[i] << "'" << std::endl;
+                        return false;
+                    }
+                } else {
+                    std::cerr << "scanr: Option '-A' requires a non-negative integer argument." << std::endl;
+                    return false;
+                }
+            } else if (arg == "-B") {
+                 if (++i < argc) {
+                    try {
+                        settings.lines_before = std::stoi(argv[i]);
+                         if (settings.lines_before < 0) throw std::invalid_argument("Negative value");
+                    } catch (const std::exception& e) {
+                        std::cerr << "scanr: Invalid non-negative integer for option '-B': '" << argv[i] << "'" << std::endl;
+                        return false;
+                    }
+                } else {
+                    std::cerr << "scanr: Option '-B' requires a non-negative integer argument." << std::endl;
+                    return false;
+                }
+            } else if (arg == "-C") {
+                 if (++i < argc) {
+                    try {
+                        int context = std::stoi(argv[i]);
+                        if (context < 0) throw std::invalid_argument("Negative value");
+                        settings.lines_after = context;
+                        settings.lines_before = context;
+                    } catch (const std::exception& e) {
+                        std::cerr << "scanr: Invalid non-negative integer for option '-C': '" << argv[i] << "'" << std::endl;
+                        return false;
+                    }
+                } else {
+                    std::cerr << "scanr: Option '-C' requires a non-negative integer argument." << std::endl;
+                    return false;
+                }
+            } else {
+                // Handle combined short options like -inv
+                for (size_t j = 1; j < arg.length(); ++j) {
+                    switch (arg[j]) {
+                        case 'c': settings.count_only = true; break;
+                        case 'h': settings.hide_filenames = true; break;
+                        case 'i': settings.ignore_case = true; break;
+                        case 'l': settings.list_filenames = true; break;
+                        case 'n': settings.show_line_numbers = true; break;
+                        case 'v': settings.invert_match = true; break;
+                        case 'E': settings.use_extended_regex = true; break;
+                        case 'w': settings.match_whole_word = true; break;
+                        case 'o': settings.only_matching = true; break;
+                        case 'r': settings.recursive = true; break;
+                        case 'R':
+                            settings.recursive = true;
+                            settings.follow_symlinks = true;
+                            break;
+                        case 'a': settings.binary_files = BinaryFiles::kText; break;
+                        case 'I': settings.binary_files = BinaryFiles::kWithoutMatch; break;
+                        case 'q': settings.quiet = true; break;
+                        default:
+                            std::cerr << "scanr: Invalid option -- '" << arg[j] << "' in '" << arg << "'" << std::endl;
+                            print_usage();
+                            return false;
+                    }
+                }
+            }
+        } else {
+            // Not an option, treat as pattern or filename
+            if (pattern_sources.empty() && settings.patterns.empty()) {
+                // If no patterns loaded from -f or -e yet, this is the main pattern
+                pattern_sources.push_back(arg);
+            } else {
+                // Otherwise, it's an input file
+                settings.files.push_back(arg);
+            }
+        }
+    }
+
+    // --index build takes no pattern: every operand is a directory to index
+    if (settings.index_mode == IndexMode::kBuild) {
+        settings.files.insert(settings.files.begin(), pattern_sources.begin(), pattern_sources.end());
+        pattern_sources.clear();
+    }
+    // The index covers whole trees, so using it searches the directories recursively
+    if (settings.index_mode == IndexMode::kUse) settings.recursive = true;
+    if (!settings.index_file.empty() && settings.files.size() > 1) {
+        std::cerr << "scanr: --index-file can only be used with a single directory" << std::endl;
+        return false;
+    }
+    // A followed file's count would never be final
+    if (settings.follow && settings.count_only && !settings.list_filenames) {
+        std::cerr << "scanr: --follow cannot be used with -c" << std::endl;
+        return false;
+    }
+
+    // Add patterns from -e / command line argument to the main list
+    settings.patterns.insert(settings.patterns.end(), pattern_sources.begin(), pattern_sources.end());
+
+    // Sanity checks and adjustments for conflicting options
+    if (settings.list_filenames || settings.count_only) {
+        // Context options don't make sense with -l or -c
+        settings.lines_after = 0;
+        settings.lines_before = 0;
+        settings.only_matching = false; // -o also doesn't make sense
+    }
+    if (settings.only_matching) {
+         // Context options usually ignored with -o in standard grep
+        settings.lines_after = 0;
+        settings.lines_before = 0;
+    }
+    if (settings.json) {
+        settings.show_line_numbers = true; // Every line event carries its number
+    }
+    settings.match_spans = settings.only_matching || (settings.json && !settings.list_filenames && !settings.count_only);
+
+
+    return true; // Parsing successful
+}
+
+// Build the shared matcher for the whole run (throws std::regex_error on invalid patterns)
+CompiledMatcher build_matcher(const Settings& settings) {
+    auto start = std::chrono::steady_clock::now();
+    CompiledMatcher matcher;
+    std::unique_ptr<PatternCache> cache;
+    if (!settings.pattern_cache.empty()) {
+        cache = std::make_unique<PatternCache>(settings);
+        if (cache->load(matcher)) {
+            matcher.from_cache = true;
+            matcher.compile_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            return matcher;
+        }
+        matcher = CompiledMatcher(); // A partly read entry leaves nothing behind
+    }
+    std::vector<std::string> literal_patterns;
+    std::vector<std::string> regex_sources;
+    if (settings.use_extended_regex) {
+        // Pattern analysis: regexes that only spell out a literal string (common with -i/-w/-o)
+        // are matched by the literal engine, with the same -i, -w and -o semantics
+        for (const auto& pattern : settings.patterns) {
+            std::string literal;
+            if (regex_literal(pattern, literal)) {
+                literal_patterns.push_back(literal);
+            } else {
+                regex_sources.push_back(pattern);
+            }
+        }
+    } else {
+        literal_patterns = settings.patterns; // Simple mode: every pattern is taken literally
+    }
+    if (settings.ignore_case) {
+        // The engines fold ASCII case byte by byte; characters with other case forms (ä/Ä,
+        // ß/ẞ, the Turkish i) are spelled out at compile time instead, as more literals or
+        // as alternations, so nothing is folded per input byte
+        std::vector<std::string> spelled, variants;
+        for (const auto& literal : literal_patterns) {
+            if (case_variants(literal, CompiledMatcher::kMaxCaseVariants, variants)) {
+                spelled.insert(spelled.end(), variants.begin(), variants.end());
+            } else {
+                regex_sources.push_back(escape_regex(literal)); // Too many to list: a regex alternates per character
+            }
+        }
+        literal_patterns.swap(spelled);
+        for (auto& source : regex_sources) source = fold_regex_source(source);
+    }
+    compile_patterns(regex_sources, settings, matcher);
+    matcher.literals.build(literal_patterns, settings.ignore_case);
+    for (const auto& literal : literal_patterns) {
+        if (!literal.empty()) matcher.required_literals.push_back(literal); // Empty literals never match
+    }
+    matcher.compile_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (cache) cache->store(matcher); // Not counted as compile time; a failure only costs the next run
+    return matcher;
+}
+
+// True if the regex 'pattern' matches exactly the string 'literal': no metacharacters other
+// than backslash-escaped punctuation. The empty regex matches everywhere, so it never qualifies.
+bool regex_literal(const std::string& pattern, std::string& literal) {
+    static const char metacharacters[] = "^$\\.*+?()[]{}|";
+    literal.clear();
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        char c = pattern[i];
+        if (c == '\\') {
+            if (i + 1 < pattern.size() && (std::strchr(metacharacters, pattern[i + 1]) != nullptr || pattern[i + 1] == '/')) {
+                literal.push_back(pattern[++i]); // Identity escape such as \. or \(
+                continue;
+            }
+            return false; // Class, anchor or control escape (\d, \b, \n, ...)
+        }
+        if (c == '\0' || std::strchr(metacharacters, c) != nullptr) return false;
+        literal.push_back(c);
+    }
+    return !literal.empty();
+}
+
+bool CompiledMatcher::matches(std::string_view line, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions, MatchScratch& scratch) const {
+    return matches(line, settings, match_positions, scratch, NoStats());
+}
+
+template <class Stats>
+bool CompiledMatcher::matches(std::string_view line, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions, MatchScratch& scratch, Stats stats) const {
+    if (regexes.empty() && regex_patterns.empty()) {
+        [[maybe_unused]] auto timer = stats.time(SearchStats::kLiteral, line.size());
+        return simple_matches(line, literals, settings, match_positions, scratch);
+    }
+
+    // Regex patterns, possibly mixed with literal ones: each engine answers for its own
+    // patterns, the cheapest first, and under -o the spans of all of them are merged
+    match_positions.clear();
+    bool found_match = false;
+    std::vector<std::pair<size_t, size_t>>& engine_positions = scratch.engine_positions;
+    auto collect = [&](bool engine_matched) {
+        if (!engine_matched) return false;
+        found_match = true;
+        match_positions.insert(match_positions.end(), engine_positions.begin(), engine_positions.end());
+        return !settings.match_spans; // One hit decides the line unless -o or --json wants every span
+    };
+    if (!literals.empty()) {
+        [[maybe_unused]] auto timer = stats.time(SearchStats::kLiteral, line.size());
+        if (collect(simple_matches(line, literals, settings, engine_positions, scratch))) return true;
+    }
+    if (!regexes.empty()) {
+        [[maybe_unused]] auto timer = stats.time(SearchStats::kRegex, line.size());
+        if (collect(program_matches(line, regexes, settings, engine_positions, scratch))) return true;
+    }
+    if (!regex_patterns.empty()) {
+        [[maybe_unused]] auto timer = stats.time(SearchStats::kStdRegex, line.size());
+        if (collect(regex_matches(line, regex_patterns, settings, engine_positions, scratch))) return true;
+    }
+    if (settings.match_spans) std::sort(match_positions.begin(), match_positions.end());
+    return found_match;
+}
+
+// Compile regex patterns for scanr's own engine, leaving those it does not support (and all
+// of them under --regex-engine=std) to std::regex
+void compile_patterns(const std::vector<std::string>& patterns, const Settings& settings, CompiledMatcher& matcher) {
+    // Set regex syntax options (ERE is default for std::regex)
+    auto flags = std::regex::ECMAScript; // Default syntax, generally compatible with ERE
+    // Or use std::regex::extended if available and preferred, but ECMAScript is more common now
+    // auto flags = std::regex::extended;
+
+    if (settings.ignore_case) {
+        flags |= std::regex::icase;
+    }
+
+    std::vector<std::string> prefilter, required;
+    bool prefilter_usable = true;
+    size_t shortest = std::string::npos;
+    for (const auto& p_str : patterns) {
+        std::string final_pattern = p_str;
+        if (settings.match_whole_word) {
+            // Wrap with word boundaries (\b).
+            // Note: This is a basic implementation. More complex patterns might interact
+            // unexpectedly with automatically added boundaries.
+            // Check if pattern already starts/ends with word boundary or anchor?
+            bool starts_with_boundary = (final_pattern.length() >= 2 && final_pattern.substr(0, 2) == "\\b") || (final_pattern.length() >= 1 && final_pattern[0] == '^');
+            bool ends_with_boundary = (final_pattern.length() >= 2 && final_pattern.substr(final_pattern.length() - 2) == "\\b") || (final_pattern.length() >= 1 && final_pattern.back() == '$');
+
+            if (!starts_with_boundary) {
+                 final_pattern.insert(0, "\\b");
+            }
+             if (!ends_with_boundary) {
+                 final_pattern.append("\\b");
+             }
+        }
+        // Pattern analysis: the literals a match must contain, gathered for all patterns
+        if (prefilter_usable && regex_required_literals(final_pattern, settings.ignore_case, required)) {
+            prefilter.insert(prefilter.end(), required.begin(), required.end());
+            for (const auto& literal : required) shortest = std::min(shortest, literal.size());
+        } else {
+            prefilter_usable = false;
+        }
+
+        if (!settings.use_std_regex && matcher.regexes.add(final_pattern, settings.ignore_case)) continue;
+        // Add the compiled regex to the list
+        matcher.regex_patterns.emplace_back(final_pattern, flags);
+        matcher.regex_sources.push_back(final_pattern);
+    }
+    matcher.regexes.finish();
+    matcher.required_literals_known = prefilter_usable;
+    if (prefilter_usable) matcher.required_literals = prefilter;
+
+    // Lines without any of the required literals cannot match, so search_lines only hands
+    // the regex engines lines the literal engine finds them in. Against the DFA, which is
+    // linear anyway, only long literals pay off; against std::regex any literal does.
+    size_t min_length = matcher.regex_patterns.empty() ? CompiledMatcher::kMinPrefilterLength : 1;
+    if (prefilter_usable && !patterns.empty() && shortest >= min_length) {
+        std::sort(prefilter.begin(), prefilter.end());
+        prefilter.erase(std::unique(prefilter.begin(), prefilter.end()), prefilter.end());
+        matcher.regex_prefilter.build(prefilter, settings.ignore_case);
+        matcher.regex_prefilter_size = prefilter.size();
+    }
+}
+
+
+// Check if a line matches any pattern using REGEX
+bool regex_matches(std::string_view line, const std::vector<std::regex>& regex_patterns, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions, MatchScratch& scratch) {
+     match_positions.clear();
+     bool found_match = false;
+     std::cmatch& match_result = scratch.regex_match; // Stores details of a single match
+     const char* line_begin = line.data();
+     const char* line_end = line.data() + line.size();
+
+    for (const auto& pattern_regex : regex_patterns) {
+         if (settings.match_spans) {
+             // Find *all* non-overlapping matches, stepping as std::cregex_iterator does (after
+             // an empty match, a non-empty one at the same position first) but reusing one
+             // match object instead of the iterator's own
+             auto flags = std::regex_constants::match_default;
+             bool have_match = std::regex_search(line_begin, line_end, match_result, pattern_regex, flags);
+             while (have_match) {
+                 // Store start position and length of the matched substring
+                 const char* start = match_result[0].first;
+                 const char* end = match_result[0].second;
+                 match_positions.push_back({static_cast<size_t>(start - line_begin), static_cast<size_t>(end - start)});
+                 found_match = true;
+                 if (start == end) {
+                     if (end == line_end) break;
+                     auto retry = flags | std::regex_constants::match_not_null | std::regex_constants::match_continuous;
+                     if (std::regex_search(end, line_end, match_result, pattern_regex, retry)) continue;
+                     ++end;
+                 }
+                 flags |= std::regex_constants::match_prev_avail;
+                 have_match = std::regex_search(end, line_end, match_result, pattern_regex, flags);
+             }
+             // Continue checking other patterns even if matches found for this one in -o mode
+         } else {
+             // Find if *any* match exists using regex_search
+             if (std::regex_search(line_begin, line_end, match_result, pattern_regex)) {
+                 found_match = true;
+                 // Store the first match found (though not strictly needed if not -o)
+                 match_positions.push_back({static_cast<size_t>(match_result.position(0)), static_cast<size_t>(match_result.length(0))});
+                 break; // Found a match with one pattern, no need to check others unless -o
+             }
+         }
+    }
+     // Sort matches by start position if -o is active, for ordered output
+     if (settings.match_spans && !match_positions.empty()) {
+         std::sort(match_positions.begin(), match_positions.end());
+     }
+
+    return found_match;
+}
+
+// Word characters as the regex \w class defines them (letters, digits, underscore)
+static inline bool is_word_char(unsigned char c) {
+    return std::isalnum(c) || c == '_';
+}
+
+// Check if a character position represents a word boundary (for simple_matches -w)
+// True if transition between word and non-word characters, where the positions before
+// the start and after the end count as non-word (the same rule as the regex \b).
+bool is_word_boundary(std::string_view line, size_t pos) {
+    bool pos_is_word = (pos < line.length()) && is_word_char(static_cast<unsigned char>(line[pos]));
+    bool prev_is_word = (pos > 0) && is_word_char(static_cast<unsigned char>(line[pos - 1]));
+    // Boundary if one side is a word character and the other is not
+    return prev_is_word != pos_is_word;
+}
+
+
+// --- Case Folding ---
+
+// ASCII lower-case mapping, as a table built at compile time: one load per byte in the
+// matchers' inner loops, and no dependence on the C locale
+struct AsciiFoldTable {
+    unsigned char lower[256];
+    constexpr AsciiFoldTable() : lower() {
+        for (int c = 0; c < 256; ++c) lower[c] = static_cast<unsigned char>(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+    }
+};
+static constexpr AsciiFoldTable kAsciiFold{};
+
+static inline unsigned char fold_ascii(unsigned char c) {
+    return kAsciiFold.lower[c];
+}
+
+// Simple case folding beyond ASCII: code points first..last (every stride-th) fold to the
+// code point 'delta' away, the smallest member of their case class. Generated from the
+// simple upper, lower and title case mappings of Unicode 14, with two changes: the Turkish
+// dotted capital I (U+0130) joins i, I and the dotless i (U+0131), so Turkish text matches
+// either way, and the Kelvin sign and long s are left out, which would otherwise make
+// every k and s of a pattern expand into variants nobody writes.
+struct CaseFoldRange {
+    char32_t first;
+    char32_t last;
+    unsigned char stride;
+    int delta;
+};
+static constexpr CaseFoldRange kCaseFoldRanges[] = {
+    {0x00E0, 0x00F6, 1, -32}, {0x00F8, 0x00FE, 1, -32}, {0x0101, 0x012F, 2, -1},
+    {0x0130, 0x0130, 1, -231}, {0x0131, 0x0131, 1, -232}, {0x0133, 0x0137, 2, -1},
+    {0x013A, 0x0148, 2, -1}, {0x014B, 0x0177, 2, -1}, {0x0178, 0x0178, 1, -121},
+    {0x017A, 0x017E, 2, -1}, {0x0183, 0x0185, 2, -1}, {0x0188, 0x0188, 1, -1},
+    {0x018C, 0x018C, 1, -1}, {0x0192, 0x0192, 1, -1}, {0x0199, 0x0199, 1, -1},
+    {0x01A1, 0x01A5, 2, -1}, {0x01A8, 0x01A8, 1, -1}, {0x01AD, 0x01AD, 1, -1},
+    {0x01B0, 0x01B0, 1, -1}, {0x01B4, 0x01B6, 2, -1}, {0x01B9, 0x01B9, 1, -1},
+    {0x01BD, 0x01BD, 1, -1}, {0x01C5, 0x01C5, 1, -1}, {0x01C6, 0x01C6, 1, -2},
+    {0x01C8, 0x01C8, 1, -1}, {0x01C9, 0x01C9, 1, -2}, {0x01CB, 0x01CB, 1, -1},
+    {0x01CC, 0x01CC, 1, -2}, {0x01CE, 0x01DC, 2, -1}, {0x01DD, 0x01DD, 1, -79},
+    {0x01DF, 0x01EF, 2, -1}, {0x01F2, 0x01F2, 1, -1}, {0x01F3, 0x01F3, 1, -2},
+    {0x01F5, 0x01F5, 1, -1}, {0x01F6, 0x01F6, 1, -97}, {0x01F7, 0x01F7, 1, -56},
+    {0x01F9, 0x021F, 2, -1}, {0x0220, 0x0220, 1, -130}, {0x0223, 0x0233, 2, -1},
+    {0x023C, 0x023C, 1, -1}, {0x023D, 0x023D, 1, -163}, {0x0242, 0x0242, 1, -1},
+    {0x0243, 0x0243, 1, -195}, {0x0247, 0x024F, 2, -1}, {0x0253, 0x0253, 1, -210},
+    {0x0254, 0x0254, 1, -206}, {0x0256, 0x0257, 1, -205}, {0x0259, 0x0259, 1, -202},
+    {0x025B, 0x025B, 1, -203}, {0x0260, 0x0260, 1, -205}, {0x0263, 0x0263, 1, -207},
+    {0x0268, 0x0268, 1, -209}, {0x0269, 0x0269, 1, -211}, {0x026F, 0x026F, 1, -211},
+    {0x0272, 0x0272, 1, -213}, {0x0275, 0x0275, 1, -214}, {0x0280, 0x0280, 1, -218},
+    {0x0283, 0x0283, 1, -218}, {0x0288, 0x0288, 1, -218}, {0x0289, 0x0289, 1, -69},
+    {0x028A, 0x028B, 1, -217}, {0x028C, 0x028C, 1, -71}, {0x0292, 0x0292, 1, -219},
+    {0x0371, 0x0373, 2, -1}, {0x0377, 0x0377, 1, -1}, {0x0399, 0x0399, 1, -84},
+    {0x039C, 0x039C, 1, -743}, {0x03AC, 0x03AC, 1, -38}, {0x03AD, 0x03AF, 1, -37},
+    {0x03B1, 0x03B8, 1, -32}, {0x03B9, 0x03B9, 1, -116}, {0x03BA, 0x03BB, 1, -32},
+    {0x03BC, 0x03BC, 1, -775}, {0x03BD, 0x03C1, 1, -32}, {0x03C2, 0x03C2, 1, -31},
+    {0x03C3, 0x03CB, 1, -32}, {0x03CC, 0x03CC, 1, -64}, {0x03CD, 0x03CE, 1, -63},
+    {0x03D0, 0x03D0, 1, -62}, {0x03D1, 0x03D1, 1, -57}, {0x03D5, 0x03D5, 1, -47},
+    {0x03D6, 0x03D6, 1, -54}, {0x03D7, 0x03D7, 1, -8}, {0x03D9, 0x03EF, 2, -1},
+    {0x03F0, 0x03F0, 1, -86}, {0x03F1, 0x03F1, 1, -80}, {0x03F3, 0x03F3, 1, -116},
+    {0x03F4, 0x03F4, 1, -92}, {0x03F5, 0x03F5, 1, -96}, {0x03F8, 0x03F8, 1, -1},
+    {0x03F9, 0x03F9, 1, -7}, {0x03FB, 0x03FB, 1, -1}, {0x03FD, 0x03FF, 1, -130},
+    {0x0430, 0x044F, 1, -32}, {0x0450, 0x045F, 1, -80}, {0x0461, 0x0481, 2, -1},
+    {0x048B, 0x04BF, 2, -1}, {0x04C2, 0x04CE, 2, -1}, {0x04CF, 0x04CF, 1, -15},
+    {0x04D1, 0x052F, 2, -1}, {0x0561, 0x0586, 1, -48}, {0x13F8, 0x13FD, 1, -8},
+    {0x1C80, 0x1C80, 1, -6254}, {0x1C81, 0x1C81, 1, -6253}, {0x1C82, 0x1C82, 1, -6244},
+    {0x1C83, 0x1C84, 1, -6242}, {0x1C85, 0x1C85, 1, -6243}, {0x1C86, 0x1C86, 1, -6236},
+    {0x1C87, 0x1C87, 1, -6181}, {0x1C90, 0x1CBA, 1, -3008}, {0x1CBD, 0x1CBF, 1, -3008},
+    {0x1E01, 0x1E95, 2, -1}, {0x1E9B, 0x1E9B, 1, -59}, {0x1E9E, 0x1E9E, 1, -7615},
+    {0x1EA1, 0x1EFF, 2, -1}, {0x1F08, 0x1F0F, 1, -8}, {0x1F18, 0x1F1D, 1, -8},
+    {0x1F28, 0x1F2F, 1, -8}, {0x1F38, 0x1F3F, 1, -8}, {0x1F48, 0x1F4D, 1, -8},
+    {0x1F59, 0x1F5F, 2, -8}, {0x1F68, 0x1F6F, 1, -8}, {0x1F88, 0x1F8F, 1, -8},
+    {0x1F98, 0x1F9F, 1, -8}, {0x1FA8, 0x1FAF, 1, -8}, {0x1FB8, 0x1FB9, 1, -8},
+    {0x1FBA, 0x1FBB, 1, -74}, {0x1FBC, 0x1FBC, 1, -9}, {0x1FBE, 0x1FBE, 1, -7289},
+    {0x1FC8, 0x1FCB, 1, -86}, {0x1FCC, 0x1FCC, 1, -9}, {0x1FD8, 0x1FD9, 1, -8},
+    {0x1FDA, 0x1FDB, 1, -100}, {0x1FE8, 0x1FE9, 1, -8}, {0x1FEA, 0x1FEB, 1, -112},
+    {0x1FEC, 0x1FEC, 1, -7}, {0x1FF8, 0x1FF9, 1, -128}, {0x1FFA, 0x1FFB, 1, -126},
+    {0x1FFC, 0x1FFC, 1, -9}, {0x2126, 0x2126, 1, -7549}, {0x212B, 0x212B, 1, -8294},
+    {0x214E, 0x214E, 1, -28}, {0x2170, 0x217F, 1, -16}, {0x2184, 0x2184, 1, -1},
+    {0x24D0, 0x24E9, 1, -26}, {0x2C30, 0x2C5F, 1, -48}, {0x2C61, 0x2C61, 1, -1},
+    {0x2C62, 0x2C62, 1, -10743}, {0x2C63, 0x2C63, 1, -3814}, {0x2C64, 0x2C64, 1, -10727},
+    {0x2C65, 0x2C65, 1, -10795}, {0x2C66, 0x2C66, 1, -10792}, {0x2C68, 0x2C6C, 2, -1},
+    {0x2C6D, 0x2C6D, 1, -10780}, {0x2C6E, 0x2C6E, 1, -10749}, {0x2C6F, 0x2C6F, 1, -10783},
+    {0x2C70, 0x2C70, 1, -10782}, {0x2C73, 0x2C73, 1, -1}, {0x2C76, 0x2C76, 1, -1},
+    {0x2C7E, 0x2C7F, 1, -10815}, {0x2C81, 0x2CE3, 2, -1}, {0x2CEC, 0x2CEE, 2, -1},
+    {0x2CF3, 0x2CF3, 1, -1}, {0x2D00, 0x2D25, 1, -7264}, {0x2D27, 0x2D27, 1, -7264},
+    {0x2D2D, 0x2D2D, 1, -7264}, {0xA641, 0xA649, 2, -1}, {0xA64A, 0xA64A, 1, -35266},
+    {0xA64B, 0xA64B, 1, -35267}, {0xA64D, 0xA66D, 2, -1}, {0xA681, 0xA69B, 2, -1},
+    {0xA723, 0xA72F, 2, -1}, {0xA733, 0xA76F, 2, -1}, {0xA77A, 0xA77C, 2, -1},
+    {0xA77D, 0xA77D, 1, -35332}, {0xA77F, 0xA787, 2, -1}, {0xA78C, 0xA78C, 1, -1},
+    {0xA78D, 0xA78D, 1, -42280}, {0xA791, 0xA793, 2, -1}, {0xA797, 0xA7A9, 2, -1},
+    {0xA7AA, 0xA7AA, 1, -42308}, {0xA7AB, 0xA7AB, 1, -42319}, {0xA7AC, 0xA7AC, 1, -42315},
+    {0xA7AD, 0xA7AD, 1, -42305}, {0xA7AE, 0xA7AE, 1, -42308}, {0xA7B0, 0xA7B0, 1, -42258},
+    {0xA7B1, 0xA7B1, 1, -42282}, {0xA7B2, 0xA7B2, 1, -42261}, {0xA7B5, 0xA7C3, 2, -1},
+    {0xA7C4, 0xA7C4, 1, -48}, {0xA7C5, 0xA7C5, 1, -42307}, {0xA7C6, 0xA7C6, 1, -35384},
+    {0xA7C8, 0xA7CA, 2, -1}, {0xA7D1, 0xA7D1, 1, -1}, {0xA7D7, 0xA7D9, 2, -1},
+    {0xA7F6, 0xA7F6, 1, -1}, {0xAB53, 0xAB53, 1, -928}, {0xAB70, 0xABBF, 1, -38864},
+    {0xFF41, 0xFF5A, 1, -32}, {0x10428, 0x1044F, 1, -40}, {0x104D8, 0x104FB, 1, -40},
+    {0x10597, 0x105A1, 1, -39}, {0x105A3, 0x105B1, 1, -39}, {0x105B3, 0x105B9, 1, -39},
+    {0x105BB, 0x105BC, 1, -39}, {0x10CC0, 0x10CF2, 1, -64}, {0x118C0, 0x118DF, 1, -32},
+    {0x16E60, 0x16E7F, 1, -32}, {0x1E922, 0x1E943, 1, -34},
+};
+
+// The code point the members of c's case class fold to
+static char32_t case_fold(char32_t c) {
+    if (c < 0x80) return c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+    for (const auto& range : kCaseFoldRanges) {
+        if (c < range.first) break; // Sorted by first code point
+        if (c <= range.last && (c - range.first) % range.stride == 0) return static_cast<char32_t>(static_cast<int>(c) + range.delta);
+    }
+    return c;
+}
+
+// Decode the UTF-8 character at 'pos' into 'code' and advance past it. False (leaving pos
+// alone) if the bytes there are not a valid, shortest-form encoding.
+static bool decode_utf8(std::string_view text, size_t& pos, char32_t& code) {
+    unsigned char lead = static_cast<unsigned char>(text[pos]);
+    size_t length = lead < 0x80 ? 1 : (lead >> 5) == 0x6 ? 2 : (lead >> 4) == 0xE ? 3 : (lead >> 3) == 0x1E ? 4 : 0;
+    if (length == 0 || pos + length > text.size()) return false;
+    char32_t value = length == 1 ? lead : lead & (0x7F >> length);
+    for (size_t k = 1; k < length; ++k) {
+        unsigned char next = static_cast<unsigned char>(text[pos + k]);
+        if ((next & 0xC0) != 0x80) return false;
+        value = (value << 6) | (next & 0x3F);
+    }
+    static const char32_t kMinimum[5] = {0, 0, 0x80, 0x800, 0x10000};
+    if (value < kMinimum[length] || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF)) return false;
+    code = value;
+    pos += length;
+    return true;
+}
+
+static void append_utf8(std::string& text, char32_t code) {
+    if (code < 0x80) {
+        text.push_back(static_cast<char>(code));
+    } else if (code < 0x800) {
+        text.push_back(static_cast<char>(0xC0 | (code >> 6)));
+        text.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else if (code < 0x10000) {
+        text.push_back(static_cast<char>(0xE0 | (code >> 12)));
+        text.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+        text.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else {
+        text.push_back(static_cast<char>(0xF0 | (code >> 18)));
+        text.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+        text.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+        text.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+}
+
+// The spellings of code point c under -i that ASCII folding does not already cover: every
+// member of its case class, c first, with ASCII letters in lower case only (the matchers
+// fold those themselves). Folding is symmetric: i and I have the Turkish İ and ı in their
+// class just as those have i and I, so a pattern's i matches all four. i is the only ASCII
+// letter with members outside ASCII (the Kelvin sign and long s are left out of the
+// table), so every other ASCII character is its own only spelling and compiles to exactly
+// what it did before.
+static void character_variants(char32_t c, std::vector<char32_t>& variants) {
+    if (c < 0x80) {
+        variants.assign(1, fold_ascii(static_cast<unsigned char>(c)));
+        if (variants[0] != 'i') {
+            variants[0] = c;
+            return;
+        }
+    } else {
+        variants.assign(1, c);
+    }
+
+    char32_t folded = case_fold(c);
+    auto add = [&](char32_t member) {
+        if (member < 0x80) member = fold_ascii(static_cast<unsigned char>(member));
+        if (std::find(variants.begin(), variants.end(), member) == variants.end()) variants.push_back(member);
+    };
+    add(folded);
+    for (const auto& range : kCaseFoldRanges) {
+        char32_t member = static_cast<char32_t>(static_cast<int>(folded) - range.delta);
+        if (member >= range.first && member <= range.last && (member - range.first) % range.stride == 0) add(member);
+    }
+}
+
+// Under -i: every spelling of 'literal' the literal engines must look for, given that they
+// fold ASCII themselves (at most 'limit' of them; false if there would be more). Bytes that
+// are not valid UTF-8 are kept as they are.
+bool case_variants(std::string_view literal, size_t limit, std::vector<std::string>& variants) {
+    variants.assign(1, std::string());
+    std::vector<char32_t> spellings;
+    for (size_t pos = 0; pos < literal.size();) {
+        char32_t code;
+        if (!decode_utf8(literal, pos, code)) {
+            for (auto& variant : variants) variant.push_back(literal[pos]);
+            ++pos;
+            continue;
+        }
+        character_variants(code, spellings);
+        if (spellings.size() == 1) {
+            for (auto& variant : variants) append_utf8(variant, code);
+            continue;
+        }
+        if (variants.size() * spellings.size() > limit) return false;
+        std::vector<std::string> grown;
+        grown.reserve(variants.size() * spellings.size());
+        for (const auto& variant : variants) {
+            for (char32_t spelling : spellings) {
+                grown.push_back(variant);
+                append_utf8(grown.back(), spelling);
+            }
+        }
+        variants.swap(grown);
+    }
+    return true;
+}
+
+// Under -i: the bracket expression 'bracket' ("[...]") with the characters its members
+// fold to added, so that [ä] becomes (?:ä|Ä) and [à-ä] lists à to ä in both cases. Both
+// regex engines match bytes and fold only ASCII, so the bracket keeps its ASCII members
+// (escapes, classes and ASCII ranges as written) and every other spelling is a UTF-8
+// alternative after it; a bracket that covers i or I also gets İ and ı. A bracket with
+// nothing to add, a negated one (which, like '.', excludes single bytes) and one with more
+// than kMaxFoldedRange non-ASCII code points in its ranges are copied as they are.
+static std::string fold_bracket(std::string_view bracket) {
+    static constexpr char32_t kMaxFoldedRange = 512;
+    size_t pos = 1;
+    if (pos < bracket.size() && bracket[pos] == '^') return std::string(bracket);
+    size_t end = bracket.size() - 1; // The closing ']'
+    if (end <= pos || bracket[end] != ']') return std::string(bracket);
+
+    std::string ascii;              // The members kept in the bracket, as written
+    std::vector<char32_t> members;  // Members outside ASCII
+    bool covers_i = false;          // i or I is a member (classes like \\w and [:alpha:] are ASCII only)
+    char32_t range_size = 0;
+    auto hex = [](char32_t c) {
+        char text[8];
+        std::snprintf(text, sizeof(text), "\\x%02X", static_cast<unsigned>(c));
+        return std::string(text);
+    };
+    // One member: a character (its code point in 'code', -1 if it is a class), its text in 'text'
+    auto atom = [&](size_t& at, long& code, std::string& text) {
+        size_t start = at;
+        code = -1;
+        if (bracket[at] == '\\' && at + 1 < end) {
+            char e = bracket[at + 1];
+            at += 2;
+            if (std::strchr("dDwWsS", e) != nullptr) {
+                // A class: ASCII only, as in the engines
+            } else if ((e == 'x' || e == 'u') && at + (e == 'x' ? 2 : 4) <= end) {
+                size_t digits = e == 'x' ? 2 : 4;
+                code = std::strtol(std::string(bracket.substr(at, digits)).c_str(), nullptr, 16);
+                at += digits;
+            } else {
+                static const char kControls[] = "fnrtvb";
+                static const char kValues[] = "\f\n\r\t\v\b";
+                const char* control = std::strchr(kControls, e);
+                code = control != nullptr ? kValues[control - kControls] : static_cast<unsigned char>(e);
+            }
+        } else if (bracket[at] == '[' && at + 1 < end && std::strchr(":.=", bracket[at + 1]) != nullptr) {
+            size_t close = bracket.find(std::string{bracket[at + 1], ']'}, at + 2);
+            at = close == std::string_view::npos ? end : close + 2; // [:alpha:] and the like: ASCII classes too
+        } else {
+            char32_t decoded;
+            size_t next = at;
+            if (decode_utf8(bracket.substr(0, end), next, decoded)) {
+                code = static_cast<long>(decoded);
+                at = next;
+            } else {
+                ++at; // A byte that is not UTF-8 stays a byte
+            }
+        }
+        text.assign(bracket, start, at - start);
+    };
+
+    while (pos < end) {
+        long low, high;
+        std::string low_text, high_text;
+        atom(pos, low, low_text);
+        bool range = low >= 0 && pos + 1 < end && bracket[pos] == '-';
+        if (!range) {
+            if (low < 0x80) {
+                ascii += low_text;
+                covers_i |= low == 'i' || low == 'I';
+            } else {
+                members.push_back(static_cast<char32_t>(low));
+            }
+            continue;
+        }
+        ++pos; // '-'
+        atom(pos, high, high_text);
+        if (high < low) return std::string(bracket); // A class or a reversed range: std::regex's error to report
+        if (high < 0x80) {
+            ascii += low_text + "-" + high_text;
+            covers_i |= (low <= 'i' && high >= 'i') || (low <= 'I' && high >= 'I');
+            continue;
+        }
+        if (low < 0x80) {
+            ascii += low_text + "-" + hex(0x7F);
+            covers_i |= low <= 'i';
+            low = 0x80;
+        }
+        range_size += static_cast<char32_t>(high - low + 1);
+        if (range_size > kMaxFoldedRange) return std::string(bracket);
+        for (long code = low; code <= high; ++code) members.push_back(static_cast<char32_t>(code));
+    }
+    if (members.empty() && !covers_i) return std::string(bracket);
+
+    // Every spelling of the members, and i's for a bracket that matches it
+    if (covers_i) members.push_back('i');
+    std::vector<char32_t> spellings, alternatives;
+    for (char32_t member : members) {
+        character_variants(member, spellings);
+        for (char32_t spelling : spellings) {
+            if (spelling < 0x80) {
+                if (spelling == 'i' && covers_i) continue;
+                ascii += hex(spelling);
+                covers_i |= spelling == 'i';
+            } else if (std::find(alternatives.begin(), alternatives.end(), spelling) == alternatives.end()) {
+                alternatives.push_back(spelling);
+            }
+        }
+    }
+    std::string folded = "(?:";
+    if (!ascii.empty()) folded += "[" + ascii + "]";
+    for (char32_t alternative : alternatives) {
+        if (folded.size() > 3) folded += '|';
+        append_utf8(folded, alternative);
+    }
+    return folded + ")";
+}
+
+// Under -i: the regex 'pattern' with every character that has spellings beyond its ASCII
+// cases written as a group of all of them, (?:ä|Ä), so both regex engines fold it with
+// nothing but their ASCII case handling. Bracket expressions get the same spellings for
+// their members (fold_bracket); escapes are copied as they are.
+std::string fold_regex_source(const std::string& pattern) {
+    std::string folded;
+    std::vector<char32_t> spellings;
+    for (size_t pos = 0; pos < pattern.size();) {
+        char c = pattern[pos];
+        if (c == '\\') {
+            folded += c;
+            if (++pos < pattern.size()) folded += pattern[pos++];
+            continue;
+        }
+        if (c == '[') {
+            // Up to the closing ']': a ']' right after '[' or '[^' closes an empty set
+            // in ECMAScript, and "[:alpha:]" style classes nest
+            size_t end = pos + 1;
+            if (end < pattern.size() && pattern[end] == '^') ++end;
+            while (end < pattern.size() && pattern[end] != ']') {
+                if (pattern[end] == '\\') {
+                    end += 2;
+                } else if (pattern[end] == '[' && end + 1 < pattern.size() && std::strchr(":.=", pattern[end + 1]) != nullptr) {
+                    size_t close = pattern.find(std::string{pattern[end + 1], ']'}, end + 2);
+                    end = close == std::string::npos ? pattern.size() : close + 2;
+                } else {
+                    ++end;
+                }
+            }
+            end = std::min(end + 1, pattern.size());
+            folded += fold_bracket(std::string_view(pattern).substr(pos, end - pos));
+            pos = end;
+            continue;
+        }
+        char32_t code;
+        size_t next = pos;
+        if (!decode_utf8(pattern, next, code)) {
+            folded += c;
+            ++pos;
+            continue;
+        }
+        character_variants(code, spellings);
+        if (spellings.size() == 1) {
+            folded.append(pattern, pos, next - pos);
+        } else {
+            folded += "(?:";
+            for (size_t i = 0; i < spellings.size(); ++i) {
+                if (i > 0) folded += '|';
+                append_utf8(folded, spellings[i]);
+            }
+            folded += ')';
+        }
+        pos = next;
+    }
+    return folded;
+}
+
+// A regex matching exactly the string 'literal'
+std::string escape_regex(std::string_view literal) {
+    std::string escaped;
+    for (char c : literal) {
+        if (std::strchr("^$\\.*+?()[]{}|", c) != nullptr && c != '\0') escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+// --- Literal Search Engines ---
+
+// Runtime CPU feature detection for the SIMD search kernels
+struct CpuFeatures {
+    bool sse2 = false;
+    bool ssse3 = false;
+    bool avx2 = false;
+};
+
+static CpuFeatures detect_cpu_features() {
+    CpuFeatures features;
+#if defined(SCANR_X86)
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    features.sse2 = (info[3] & (1 << 26)) != 0;
+    features.ssse3 = (info[2] & (1 << 9)) != 0;
+    bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+    if (max_leaf >= 7 && os_saves_ymm) {
+        __cpuidex(info, 7, 0);
+        features.avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    features.sse2 = __builtin_cpu_supports("sse2");
+    features.ssse3 = __builtin_cpu_supports("ssse3");
+    features.avx2 = __builtin_cpu_supports("avx2");
+#endif
+#endif
+    return features;
+}
+
+static const CpuFeatures& cpu_features() {
+    static const CpuFeatures features = detect_cpu_features();
+    return features;
+}
+
+// Index of the lowest set bit of a non-zero mask
+static inline int lowest_set_bit(unsigned long long bits) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+// Rough frequency rank of a byte in typical text and logs (higher is more common); used to
+// pick the needle bytes least likely to cause false candidates
+static int byte_frequency_rank(unsigned char c) {
+    static const char by_frequency[] = "etaoinsrhldcumfpgwybvkxjqz"; // English letter order
+    if (c == ' ') return 255;
+    if (c == '\0') return 255; // Needles with NUL bytes are UTF-16 text, where every other byte is one
+    if (c >= 'a' && c <= 'z') return 250 - static_cast<int>(std::strchr(by_frequency, c) - by_frequency) * 3;
+    if (c >= '0' && c <= '9') return 190;
+    if (c >= 'A' && c <= 'Z') return 120 + (250 - static_cast<int>(std::strchr(by_frequency, c - 'A' + 'a') - by_frequency) * 3) / 10;
+    if (std::strchr(".,:;=/-_()\"'[]<>", c) != nullptr && c != 0) return 180;
+    if (c == '\t' || c == '\r') return 150;
+    if (c >= 0x80) return 60;
+    return 20; // Other control characters and rare punctuation
+}
+
+// Compare the needle against the haystack at 'at' (the needle is already folded under IgnoreCase)
+template <bool IgnoreCase>
+static inline bool needle_matches(const LiteralSearcher::Needle& needle, const unsigned char* at) {
+    if (!IgnoreCase) return std::memcmp(at, needle.bytes.data(), needle.bytes.size()) == 0;
+    for (size_t k = 0; k < needle.bytes.size(); ++k) {
+        if (fold_ascii(at[k]) != static_cast<unsigned char>(needle.bytes[k])) return false;
+    }
+    return true;
+}
+
+// Portable fallback, also used for the tail a vector kernel cannot cover
+template <bool IgnoreCase>
+static size_t literal_find_scalar(const LiteralSearcher::Needle& needle, const unsigned char* haystack, size_t size, size_t from) {
+    size_t last_start = size - needle.bytes.size();
+    const size_t offset = needle.rare_offset[0];
+    for (size_t pos = from; pos <= last_start; ++pos) {
+        if (!IgnoreCase) {
+            // memchr is vectorized by the C library; jump straight to the next rare byte
+            const void* hit = std::memchr(haystack + pos + offset, needle.rare_byte[0][0], last_start - pos + 1);
+            if (hit == nullptr) return std::string_view::npos;
+            pos = static_cast<size_t>(static_cast<const unsigned char*>(hit) - haystack) - offset;
+        } else {
+            unsigned char c = haystack[pos + offset];
+            if (c != needle.rare_byte[0][0] && c != needle.rare_byte[0][1]) continue;
+        }
+        if (needle_matches<IgnoreCase>(needle, haystack + pos)) return pos;
+    }
+    return std::string_view::npos;
+}
+
+#if defined(SCANR_X86)
+template <bool IgnoreCase>
+SCANR_TARGET("sse2")
+static size_t literal_find_sse2(const LiteralSearcher::Needle& needle, const unsigned char* haystack, size_t size, size_t from) {
+    const size_t last_start = size - needle.bytes.size();
+    const unsigned char* first = haystack + needle.rare_offset[0];
+    const unsigned char* second = haystack + needle.rare_offset[1];
+    const __m128i first_lower = _mm_set1_epi8(static_cast<char>(needle.rare_byte[0][0]));
+    const __m128i first_upper = _mm_set1_epi8(static_cast<char>(needle.rare_byte[0][1]));
+    const __m128i second_lower = _mm_set1_epi8(static_cast<char>(needle.rare_byte[1][0]));
+    const __m128i second_upper = _mm_set1_epi8(static_cast<char>(needle.rare_byte[1][1]));
+    size_t pos = from;
+    for (; pos + 15 <= last_start; pos += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first + pos));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(second + pos));
+        __m128i match_a = _mm_cmpeq_epi8(a, first_lower);
+        __m128i match_b = _mm_cmpeq_epi8(b, second_lower);
+        if (IgnoreCase) {
+            match_a = _mm_or_si128(match_a, _mm_cmpeq_epi8(a, first_upper));
+            match_b = _mm_or_si128(match_b, _mm_cmpeq_epi8(b, second_upper));
+        }
+        unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(match_a, match_b)));
+        while (bits != 0) {
+            size_t candidate = pos + static_cast<size_t>(lowest_set_bit(bits));
+            if (needle_matches<IgnoreCase>(needle, haystack + candidate)) return candidate;
+            bits &= bits - 1;
+        }
+    }
+    return literal_find_scalar<IgnoreCase>(needle, haystack, size, pos);
+}
+
+template <bool IgnoreCase>
+SCANR_TARGET("avx2")
+static size_t literal_find_avx2(const LiteralSearcher::Needle& needle, const unsigned char* haystack, size_t size, size_t from) {
+    const size_t last_start = size - needle.bytes.size();
+    const unsigned char* first = haystack + needle.rare_offset[0];
+    const unsigned char* second = haystack + needle.rare_offset[1];
+    const __m256i first_lower = _mm256_set1_epi8(static_cast<char>(needle.rare_byte[0][0]));
+    const __m256i first_upper = _mm256_set1_epi8(static_cast<char>(needle.rare_byte[0][1]));
+    const __m256i second_lower = _mm256_set1_epi8(static_cast<char>(needle.rare_byte[1][0]));
+    const __m256i second_upper = _mm256_set1_epi8(static_cast<char>(needle.rare_byte[1][1]));
+    size_t pos = from;
+    for (; pos + 31 <= last_start; pos += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first + pos));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(second + pos));
+        __m256i match_a = _mm256_cmpeq_epi8(a, first_lower);
+        __m256i match_b = _mm256_cmpeq_epi8(b, second_lower);
+        if (IgnoreCase) {
+            match_a = _mm256_or_si256(match_a, _mm256_cmpeq_epi8(a, first_upper));
+            match_b = _mm256_or_si256(match_b, _mm256_cmpeq_epi8(b, second_upper));
+        }
+        unsigned bits = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(match_a, match_b)));
+        while (bits != 0) {
+            size_t candidate = pos + static_cast<size_t>(lowest_set_bit(bits));
+            if (needle_matches<IgnoreCase>(needle, haystack + candidate)) return candidate;
+            bits &= bits - 1;
+        }
+    }
+    return literal_find_sse2<IgnoreCase>(needle, haystack, size, pos);
+}
+#endif
+
+#if defined(SCANR_NEON)
+template <bool IgnoreCase>
+static size_t literal_find_neon(const LiteralSearcher::Needle& needle, const unsigned char* haystack, size_t size, size_t from) {
+    const size_t last_start = size - needle.bytes.size();
+    const unsigned char* first = haystack + needle.rare_offset[0];
+    const unsigned char* second = haystack + needle.rare_offset[1];
+    const uint8x16_t first_lower = vdupq_n_u8(needle.rare_byte[0][0]);
+    const uint8x16_t first_upper = vdupq_n_u8(needle.rare_byte[0][1]);
+    const uint8x16_t second_lower = vdupq_n_u8(needle.rare_byte[1][0]);
+    const uint8x16_t second_upper = vdupq_n_u8(needle.rare_byte[1][1]);
+    size_t pos = from;
+    for (; pos + 15 <= last_start; pos += 16) {
+        uint8x16_t a = vld1q_u8(first + pos);
+        uint8x16_t b = vld1q_u8(second + pos);
+        uint8x16_t match_a = vceqq_u8(a, first_lower);
+        uint8x16_t match_b = vceqq_u8(b, second_lower);
+        if (IgnoreCase) {
+            match_a = vorrq_u8(match_a, vceqq_u8(a, first_upper));
+            match_b = vorrq_u8(match_b, vceqq_u8(b, second_upper));
+        }
+        // Narrow to 4 bits per lane to get a scalar bitmask of the matching lanes
+        uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(vandq_u8(match_a, match_b)), 4);
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        while (bits != 0) {
+            int lane = lowest_set_bit(bits) / 4;
+            size_t candidate = pos + static_cast<size_t>(lane);
+            if (needle_matches<IgnoreCase>(needle, haystack + candidate)) return candidate;
+            bits &= ~(0xFull << (lane * 4));
+        }
+    }
+    return literal_find_scalar<IgnoreCase>(needle, haystack, size, pos);
+}
+#endif
+
+void LiteralSearcher::build(std::string_view needle, bool ignore_case) {
+    needle_ = Needle();
+    needle_.bytes.assign(needle.data(), needle.size());
+    if (ignore_case) {
+        for (auto& c : needle_.bytes) c = static_cast<char>(fold_ascii(static_cast<unsigned char>(c)));
+    }
+
+    // Pick the two rarest bytes at distinct offsets as the SIMD filter
+    const std::string& bytes = needle_.bytes;
+    for (size_t k = 1; k < bytes.size(); ++k) {
+        if (byte_frequency_rank(static_cast<unsigned char>(bytes[k])) <
+            byte_frequency_rank(static_cast<unsigned char>(bytes[needle_.rare_offset[0]]))) {
+            needle_.rare_offset[0] = k;
+        }
+    }
+    needle_.rare_offset[1] = needle_.rare_offset[0];
+    for (size_t k = 0; k < bytes.size(); ++k) {
+        if (k == needle_.rare_offset[0]) continue;
+        if (needle_.rare_offset[1] == needle_.rare_offset[0] ||
+            byte_frequency_rank(static_cast<unsigned char>(bytes[k])) <
+            byte_frequency_rank(static_cast<unsigned char>(bytes[needle_.rare_offset[1]]))) {
+            needle_.rare_offset[1] = k;
+        }
+    }
+    for (int r = 0; r < 2; ++r) {
+        unsigned char c = bytes.empty() ? 0 : static_cast<unsigned char>(bytes[needle_.rare_offset[r]]);
+        needle_.rare_byte[r][0] = c;
+        needle_.rare_byte[r][1] = (ignore_case && c >= 'a' && c <= 'z') ? static_cast<unsigned char>(c - ('a' - 'A')) : c;
+    }
+
+    if (bytes.empty()) {
+        kernel_ = [](const Needle&, const unsigned char*, size_t, size_t from) { return from; };
+        return;
+    }
+#if defined(SCANR_X86)
+    if (cpu_features().avx2) {
+        kernel_ = ignore_case ? literal_find_avx2<true> : literal_find_avx2<false>;
+    } else if (cpu_features().sse2) {
+        kernel_ = ignore_case ? literal_find_sse2<true> : literal_find_sse2<false>;
+    } else {
+        kernel_ = ignore_case ? literal_find_scalar<true> : literal_find_scalar<false>;
+    }
+#elif defined(SCANR_NEON)
+    kernel_ = ignore_case ? literal_find_neon<true> : literal_find_neon<false>;
+#else
+    kernel_ = ignore_case ? literal_find_scalar<true> : literal_find_scalar<false>;
+#endif
+}
+
+// Teddy candidate scan: the first position at or after 'from' whose leading bytes match the
+// nibble fingerprints of some bucket, with the bucket bitmask in *buckets. When fewer than a
+// full vector of positions remain, returns the first unscanned position with *buckets == 0.
+#if defined(SCANR_X86)
+SCANR_TARGET("ssse3")
+static size_t teddy_candidate_ssse3(const unsigned char (*low)[16], const unsigned char (*high)[16], int fingerprint_length,
+                                    const unsigned char* text, size_t size, size_t from, unsigned* buckets) {
+    const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    __m128i low_tables[3], high_tables[3];
+    for (int j = 0; j < fingerprint_length; ++j) {
+        low_tables[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(low[j]));
+        high_tables[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(high[j]));
+    }
+    size_t pos = from;
+    for (; pos + 16 + fingerprint_length - 1 <= size; pos += 16) {
+        __m128i result = _mm_set1_epi8(static_cast<char>(0xFF));
+        for (int j = 0; j < fingerprint_length; ++j) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos + j));
+            __m128i lo = _mm_and_si128(chunk, nibble_mask);
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(chunk, 4), nibble_mask);
+            result = _mm_and_si128(result, _mm_and_si128(_mm_shuffle_epi8(low_tables[j], lo), _mm_shuffle_epi8(high_tables[j], hi)));
+        }
+        unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(result, _mm_setzero_si128()))) ^ 0xFFFFu;
+        if (bits != 0) {
+            alignas(16) unsigned char lanes[16];
+            _mm_store_si128(reinterpret_cast<__m128i*>(lanes), result);
+            int lane = lowest_set_bit(bits);
+            *buckets = lanes[lane];
+            return pos + static_cast<size_t>(lane);
+        }
+    }
+    *buckets = 0;
+    return pos;
+}
+#endif
+
+#if defined(SCANR_NEON)
+static size_t teddy_candidate_neon(const unsigned char (*low)[16], const unsigned char (*high)[16], int fingerprint_length,
+                                   const unsigned char* text, size_t size, size_t from, unsigned* buckets) {
+    const uint8x16_t nibble_mask = vdupq_n_u8(0x0F);
+    uint8x16_t low_tables[3], high_tables[3];
+    for (int j = 0; j < fingerprint_length; ++j) {
+        low_tables[j] = vld1q_u8(low[j]);
+        high_tables[j] = vld1q_u8(high[j]);
+    }
+    size_t pos = from;
+    for (; pos + 16 + fingerprint_length - 1 <= size; pos += 16) {
+        uint8x16_t result = vdupq_n_u8(0xFF);
+        for (int j = 0; j < fingerprint_length; ++j) {
+            uint8x16_t chunk = vld1q_u8(text + pos + j);
+            uint8x16_t lo = vandq_u8(chunk, nibble_mask);
+            uint8x16_t hi = vshrq_n_u8(chunk, 4);
+            result = vandq_u8(result, vandq_u8(vqtbl1q_u8(low_tables[j], lo), vqtbl1q_u8(high_tables[j], hi)));
+        }
+        // Narrow to 4 bits per lane to get a scalar bitmask of the non-zero lanes
+        uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(vtstq_u8(result, result)), 4);
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        if (bits != 0) {
+            unsigned char lanes[16];
+            vst1q_u8(lanes, result);
+            int lane = lowest_set_bit(bits) / 4;
+            *buckets = lanes[lane];
+            return pos + static_cast<size_t>(lane);
+        }
+    }
+    *buckets = 0;
+    return pos;
+}
+#endif
+
+void MultiLiteralMatcher::build(const std::vector<std::string>& literals, bool ignore_case) {
+    *this = MultiLiteralMatcher();
+    ignore_case_ = ignore_case;
+    literals_ = literals;
+    for (size_t id = 0; id < literals_.size(); ++id) {
+        if (ignore_case_) {
+            std::transform(literals_[id].begin(), literals_[id].end(), literals_[id].begin(),
+                           [](char c) { return static_cast<char>(fold_ascii(static_cast<unsigned char>(c))); });
+        }
+        if (!literals_[id].empty()) ids_.push_back(id);
+    }
+    literal_count_ = ids_.size();
+    if (literal_count_ == 0) return;
+
+    // Byte classes: every byte that occurs in a literal gets its own class, all others share
+    // class 0. Under ignore_case upper-case text bytes map to the class of their lower case.
+    bool used[256] = {};
+    for (size_t id : ids_) {
+        for (unsigned char c : literals_[id]) used[c] = true;
+        unsigned char first = static_cast<unsigned char>(literals_[id][0]);
+        first_byte_[first] = true;
+        if (ignore_case_ && first >= 'a' && first <= 'z') first_byte_[first - ('a' - 'A')] = true;
+    }
+    for (int b = 0; b < 256; ++b) {
+        if (used[b]) byte_class_[b] = static_cast<unsigned char>(class_count_++);
+    }
+    if (ignore_case_) {
+        for (int b = 'A'; b <= 'Z'; ++b) byte_class_[b] = byte_class_[b + ('a' - 'A')];
+    }
+
+    // Trie of all literals
+    std::unordered_map<uint64_t, int> children;
+    std::vector<int> depth{0};
+    std::vector<std::vector<size_t>> own_outputs(1);
+    for (size_t id : ids_) {
+        int state = 0;
+        for (unsigned char c : literals_[id]) {
+            uint64_t key = (static_cast<uint64_t>(state) << 8) | byte_class_[c];
+            auto it = children.find(key);
+            if (it == children.end()) {
+                int child = static_cast<int>(depth.size());
+                depth.push_back(depth[state] + 1);
+                own_outputs.emplace_back();
+                children.emplace(key, child);
+                state = child;
+            } else {
+                state = it->second;
+            }
+        }
+        own_outputs[state].push_back(id);
+    }
+    int state_count = static_cast<int>(depth.size());
+
+    // Sparse edge lists, sorted by (state, class)
+    std::vector<std::pair<uint64_t, int>> edges(children.begin(), children.end());
+    std::sort(edges.begin(), edges.end());
+    edge_begin_.assign(state_count + 1, 0);
+    edge_class_.reserve(edges.size());
+    edge_target_.reserve(edges.size());
+    for (const auto& edge : edges) {
+        edge_begin_[(edge.first >> 8) + 1]++;
+        edge_class_.push_back(static_cast<unsigned char>(edge.first & 0xFF));
+        edge_target_.push_back(edge.second);
+    }
+    for (int s = 0; s < state_count; ++s) edge_begin_[s + 1] += edge_begin_[s];
+    auto child_of = [&](int state, int cls) {
+        for (int e = edge_begin_[state]; e < edge_begin_[state + 1]; ++e) {
+            if (edge_class_[e] == cls) return edge_target_[e];
+        }
+        return -1;
+    };
+
+    // Failure and dictionary links, breadth first so shallower states are always done first
+    fail_.assign(state_count, 0);
+    dict_.assign(state_count, -1);
+    std::vector<int> order{0};
+    for (size_t next = 0; next < order.size(); ++next) {
+        int state = order[next];
+        for (int e = edge_begin_[state]; e < edge_begin_[state + 1]; ++e) {
+            int cls = edge_class_[e];
+            int target = edge_target_[e];
+            int fail = 0;
+            if (state != 0) {
+                for (int f = fail_[state];; f = fail_[f]) {
+                    int g = child_of(f, cls);
+                    if (g >= 0) { fail = g; break; }
+                    if (f == 0) break;
+                }
+            }
+            fail_[target] = fail;
+            dict_[target] = own_outputs[fail].empty() ? dict_[fail] : fail;
+            order.push_back(target);
+        }
+    }
+
+    output_begin_.assign(state_count + 1, 0);
+    match_length_.assign(state_count, 0);
+    for (int s = 0; s < state_count; ++s) {
+        output_begin_[s + 1] = output_begin_[s] + static_cast<int>(own_outputs[s].size());
+        outputs_.insert(outputs_.end(), own_outputs[s].begin(), own_outputs[s].end());
+        if (!own_outputs[s].empty()) match_length_[s] = depth[s];
+    }
+    for (int s : order) {
+        if (match_length_[s] == 0 && dict_[s] >= 0) match_length_[s] = match_length_[dict_[s]];
+    }
+
+    // Dense DFA rows, shallowest states first (where the scan spends nearly all its time).
+    // Rows are filled in breadth-first order, so next_state() on a failure target is final.
+    dense_row_.assign(state_count, -1);
+    size_t dense_states = std::min<size_t>(order.size(), static_cast<size_t>(kMaxDenseEntries / class_count_));
+    dense_.reserve(dense_states * class_count_);
+    for (size_t k = 0; k < dense_states; ++k) {
+        int state = order[k];
+        int row = static_cast<int>(dense_.size());
+        for (int cls = 0; cls < class_count_; ++cls) {
+            int target = child_of(state, cls);
+            if (target < 0) target = (state == 0) ? 0 : next_state_class(fail_[state], cls);
+            dense_.push_back(target);
+        }
+        dense_row_[state] = row;
+    }
+    build_scanners();
+}
+
+// The searchers that run ahead of the automaton: the single-literal kernel and, for small
+// sets, the Teddy fingerprints. Both are picked for this CPU, so they are never cached.
+void MultiLiteralMatcher::build_scanners() {
+    if (literal_count_ == 1) single_.build(literals_[ids_[0]], ignore_case_);
+
+    // Teddy fingerprints for small sets
+    bool simd_available = false;
+#if defined(SCANR_X86)
+    simd_available = cpu_features().ssse3;
+#elif defined(SCANR_NEON)
+    simd_available = true;
+#endif
+    if (simd_available && literal_count_ >= 2 && literal_count_ <= kMaxTeddyLiterals) {
+        size_t shortest = literals_[ids_[0]].size();
+        for (size_t id : ids_) shortest = std::min(shortest, literals_[id].size());
+        teddy_.fingerprint_length = static_cast<int>(std::min<size_t>(3, shortest));
+
+        // Literals with similar prefixes share a bucket, which keeps the fingerprints tight
+        std::vector<size_t> sorted_ids = ids_;
+        std::sort(sorted_ids.begin(), sorted_ids.end(), [&](size_t a, size_t b) { return literals_[a] < literals_[b]; });
+        for (size_t k = 0; k < sorted_ids.size(); ++k) {
+            size_t bucket = k * 8 / sorted_ids.size();
+            size_t id = sorted_ids[k];
+            teddy_.buckets[bucket].push_back(id);
+            for (int j = 0; j < teddy_.fingerprint_length; ++j) {
+                unsigned char c = static_cast<unsigned char>(literals_[id][j]);
+                for (int variant = 0; variant < 2; ++variant) {
+                    teddy_.low_nibbles[j][c & 0x0F] |= static_cast<unsigned char>(1u << bucket);
+                    teddy_.high_nibbles[j][c >> 4] |= static_cast<unsigned char>(1u << bucket);
+                    if (!ignore_case_ || c < 'a' || c > 'z') break;
+                    c = static_cast<unsigned char>(c - ('a' - 'A'));
+                }
+            }
+        }
+        use_teddy_ = true;
+    }
+}
+
+void MultiLiteralMatcher::save(CacheWriter& writer) const {
+    writer.put(ignore_case_);
+    writer.put_strings(literals_);
+    writer.put_vector(ids_);
+    writer.put(byte_class_);
+    writer.put(class_count_);
+    writer.put(first_byte_);
+    writer.put_vector(dense_row_);
+    writer.put_vector(dense_);
+    writer.put_vector(edge_begin_);
+    writer.put_vector(edge_class_);
+    writer.put_vector(edge_target_);
+    writer.put_vector(fail_);
+    writer.put_vector(dict_);
+    writer.put_vector(output_begin_);
+    writer.put_vector(outputs_);
+    writer.put_vector(match_length_);
+}
+
+bool MultiLiteralMatcher::load(CacheReader& reader) {
+    *this = MultiLiteralMatcher();
+    bool loaded = reader.get_flags(&ignore_case_, 1) && reader.get_strings(literals_) && reader.get_vector(ids_) &&
+                  reader.get(byte_class_) && reader.get(class_count_) && reader.get_flags(first_byte_, 256) &&
+                  reader.get_vector(dense_row_) && reader.get_vector(dense_) && reader.get_vector(edge_begin_) &&
+                  reader.get_vector(edge_class_) && reader.get_vector(edge_target_) && reader.get_vector(fail_) &&
+                  reader.get_vector(dict_) && reader.get_vector(output_begin_) && reader.get_vector(outputs_) &&
+                  reader.get_vector(match_length_);
+    if (!loaded) return false;
+    literal_count_ = ids_.size();
+    if (!valid()) {
+        *this = MultiLiteralMatcher();
+        return false;
+    }
+    if (literal_count_ > 0) build_scanners();
+    return true;
+}
+
+// Whether loaded tables are ones build() could have made: every index is in range, the
+// trie edges form a tree, and every transition, failure and dictionary link keeps a state's
+// depth at most one more than the bytes consumed, so no search reads outside its tables or
+// reports a match starting before the text
+bool MultiLiteralMatcher::valid() const {
+    for (size_t id : ids_) {
+        if (id >= literals_.size() || literals_[id].empty()) return false;
+    }
+    if (literal_count_ == 0) {
+        return dense_row_.empty() && dense_.empty() && edge_begin_.empty() && edge_class_.empty() &&
+               edge_target_.empty() && fail_.empty() && dict_.empty() && output_begin_.empty() &&
+               outputs_.empty() && match_length_.empty();
+    }
+    if (class_count_ < 1 || class_count_ > 256) return false;
+    for (unsigned char cls : byte_class_) {
+        if (cls >= class_count_) return false;
+    }
+
+    // Every state but the root is the target of exactly one edge from a shallower state
+    size_t state_count = fail_.size();
+    if (state_count == 0 || state_count > static_cast<size_t>(INT_MAX - 1) ||
+        dense_row_.size() != state_count || dict_.size() != state_count || match_length_.size() != state_count ||
+        edge_begin_.size() != state_count + 1 || output_begin_.size() != state_count + 1 ||
+        edge_class_.size() != edge_target_.size() || edge_begin_[0] != 0 ||
+        static_cast<size_t>(edge_begin_[state_count]) != edge_class_.size()) {
+        return false;
+    }
+    for (size_t s = 0; s < state_count; ++s) {
+        if (edge_begin_[s + 1] < edge_begin_[s]) return false;
+    }
+    std::vector<int> depth(state_count, -1);
+    depth[0] = 0;
+    std::vector<int> order{0};
+    for (size_t next = 0; next < order.size(); ++next) {
+        int state = order[next];
+        for (int e = edge_begin_[state]; e < edge_begin_[state + 1]; ++e) {
+            int target = edge_target_[e];
+            if (edge_class_[e] >= class_count_ || target <= 0 || static_cast<size_t>(target) >= state_count ||
+                depth[target] >= 0) {
+                return false;
+            }
+            depth[target] = depth[state] + 1;
+            order.push_back(target);
+        }
+    }
+    if (order.size() != state_count) return false;
+
+    // Links and dense rows, outputs and match lengths
+    if (fail_[0] != 0 || dense_row_[0] < 0) return false;
+    for (size_t s = 0; s < state_count; ++s) {
+        if (s > 0 && (fail_[s] < 0 || static_cast<size_t>(fail_[s]) >= state_count || depth[fail_[s]] >= depth[s])) return false;
+        if (dict_[s] != -1 && (dict_[s] < 0 || static_cast<size_t>(dict_[s]) >= state_count || depth[dict_[s]] >= depth[s])) return false;
+        if (match_length_[s] < 0 || match_length_[s] > depth[s]) return false;
+        int row = dense_row_[s];
+        if (row != -1) {
+            if (row < 0 || static_cast<size_t>(row) + class_count_ > dense_.size()) return false;
+            for (int cls = 0; cls < class_count_; ++cls) {
+                int target = dense_[static_cast<size_t>(row) + cls];
+                if (target < 0 || static_cast<size_t>(target) >= state_count || depth[target] > depth[s] + 1) return false;
+            }
+        }
+        if (output_begin_[s + 1] < output_begin_[s]) return false;
+    }
+    if (output_begin_[0] != 0 || static_cast<size_t>(output_begin_[state_count]) != outputs_.size()) return false;
+    for (size_t s = 0; s < state_count; ++s) {
+        for (int o = output_begin_[s]; o < output_begin_[s + 1]; ++o) {
+            size_t id = outputs_[o];
+            if (id >= literals_.size() || literals_[id].size() != static_cast<size_t>(depth[s])) return false;
+        }
+    }
+    return true;
+}
+
+int MultiLiteralMatcher::next_state_class(int state, int cls) const {
+    for (;;) {
+        if (dense_row_[state] >= 0) return dense_[dense_row_[state] + cls];
+        for (int e = edge_begin_[state]; e < edge_begin_[state + 1]; ++e) {
+            if (edge_class_[e] == cls) return edge_target_[e];
+        }
+        state = fail_[state]; // The root always has a dense row, so this terminates
+    }
+}
+
+bool MultiLiteralMatcher::verify(std::string_view text, size_t pos, size_t id) const {
+    const std::string& literal = literals_[id];
+    if (pos + literal.size() > text.size()) return false;
+    if (!ignore_case_) return std::memcmp(text.data() + pos, literal.data(), literal.size()) == 0;
+    for (size_t k = 0; k < literal.size(); ++k) {
+        if (fold_ascii(static_cast<unsigned char>(text[pos + k])) != static_cast<unsigned char>(literal[k])) return false;
+    }
+    return true;
+}
+
+size_t MultiLiteralMatcher::find_automaton(std::string_view text, size_t from, size_t* length) const {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(text.data());
+    size_t size = text.size();
+    int state = 0;
+    for (size_t pos = from; pos < size;) {
+        if (state == 0) {
+            // Skip bytes no literal starts with
+            while (pos < size && !first_byte_[bytes[pos]]) ++pos;
+            if (pos == size) break;
+        }
+        state = next_state(state, bytes[pos++]);
+        if (match_length_[state] != 0) {
+            if (length) *length = static_cast<size_t>(match_length_[state]);
+            return pos - static_cast<size_t>(match_length_[state]);
+        }
+    }
+    return std::string_view::npos;
+}
+
+size_t MultiLiteralMatcher::find_teddy(std::string_view text, size_t from, size_t* length, size_t* resume) const {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(text.data());
+    size_t pos = from;
+    for (;;) {
+        unsigned buckets = 0;
+#if defined(SCANR_X86)
+        pos = teddy_candidate_ssse3(teddy_.low_nibbles, teddy_.high_nibbles, teddy_.fingerprint_length, bytes, text.size(), pos, &buckets);
+#elif defined(SCANR_NEON)
+        pos = teddy_candidate_neon(teddy_.low_nibbles, teddy_.high_nibbles, teddy_.fingerprint_length, bytes, text.size(), pos, &buckets);
+#endif
+        if (buckets == 0) {
+            *resume = pos; // Too close to the end for a full vector
+            return std::string_view::npos;
+        }
+        for (int bucket = 0; bucket < 8; ++bucket) {
+            if (!(buckets & (1u << bucket))) continue;
+            for (size_t id : teddy_.buckets[bucket]) {
+                if (verify(text, pos, id)) {
+                    if (length) *length = literals_[id].size();
+                    return pos;
+                }
+            }
+        }
+        ++pos;
+    }
+}
+
+size_t MultiLiteralMatcher::find(std::string_view text, size_t from, size_t* length) const {
+    if (literal_count_ == 0 || from >= text.size()) return std::string_view::npos;
+    if (literal_count_ == 1) {
+        size_t hit = single_.find(text, from);
+        if (hit != std::string_view::npos && length) *length = single_.size();
+        return hit;
+    }
+    if (use_teddy_) {
+        size_t resume = from;
+        size_t hit = find_teddy(text, from, length, &resume);
+        if (hit != std::string_view::npos) return hit;
+        from = resume; // Finish the short tail with the automaton
+    }
+    return find_automaton(text, from, length);
+}
+
+void MultiLiteralMatcher::find_all(std::string_view text, std::vector<Hit>& hits) const {
+    hits.clear();
+    if (literal_count_ == 0) return;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(text.data());
+    size_t size = text.size();
+    int state = 0;
+    for (size_t pos = 0; pos < size;) {
+        if (state == 0) {
+            while (pos < size && !first_byte_[bytes[pos]]) ++pos;
+            if (pos == size) break;
+        }
+        state = next_state(state, bytes[pos++]);
+        // Report the literals ending here: the state's own, then along the dictionary links
+        int s = (output_begin_[state] != output_begin_[state + 1]) ? state : dict_[state];
+        for (; s >= 0; s = dict_[s]) {
+            for (int o = output_begin_[s]; o < output_begin_[s + 1]; ++o) {
+                size_t id = outputs_[o];
+                hits.push_back({pos - literals_[id].size(), literals_[id].size(), id});
+            }
+        }
+    }
+}
+
+// Check if a line matches any pattern using SIMPLE string search (no regex).
+// All patterns are found in one pass over the line by the multi-literal engine.
+bool simple_matches(std::string_view line, const MultiLiteralMatcher& literals, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions, MatchScratch& scratch) {
+    match_positions.clear();
+
+    if (!settings.match_whole_word && !settings.match_spans) {
+        // Any occurrence of any pattern decides the line: first hit wins
+        size_t length = 0;
+        size_t match_start = literals.find(line, 0, &length);
+        if (match_start == std::string_view::npos) return false;
+        match_positions.push_back({match_start, length});
+        return true;
+    }
+
+    // -w and -o look at every occurrence, pattern by pattern in command-line order
+    std::vector<MultiLiteralMatcher::Hit>& hits = scratch.hits;
+    literals.find_all(line, hits);
+    std::sort(hits.begin(), hits.end(), [](const MultiLiteralMatcher::Hit& a, const MultiLiteralMatcher::Hit& b) {
+        return a.pattern != b.pattern ? a.pattern < b.pattern : a.start < b.start;
+    });
+
+    bool found_match_overall = false;
+    size_t current_pattern = SIZE_MAX;
+    size_t next_allowed_start = 0; // Matches of one pattern do not overlap, as with the regex iterator
+    for (const auto& hit : hits) {
+        if (hit.pattern != current_pattern) {
+            current_pattern = hit.pattern;
+            next_allowed_start = 0;
+        }
+        if (hit.start < next_allowed_start) continue;
+        // Check whole word condition if -w is set (boundary before and after the match)
+        if (settings.match_whole_word &&
+            !(is_word_boundary(line, hit.start) && is_word_boundary(line, hit.start + hit.length))) {
+            continue;
+        }
+        found_match_overall = true;
+        match_positions.push_back({hit.start, hit.length});
+        if (!settings.match_spans) {
+            break; // If not -o, finding one match is enough
+        }
+        // If -o, continue after this match with the next occurrence of the same pattern
+        next_allowed_start = hit.start + hit.length;
+    }
+
+     // Sort matches by start position if -o is active
+     if (settings.match_spans && !match_positions.empty()) {
+         std::sort(match_positions.begin(), match_positions.end());
+     }
+
+    return found_match_overall;
+}
+
+
+// --- Regex Engine ---
+
+// Syntax tree node built by RegexParser
+struct RegexNode {
+    enum Kind { kBytes, kConcat, kAlternate, kRepeat, kAssert };
+    Kind kind = kConcat;
+    std::bitset<256> bytes;    // kBytes
+    std::vector<int> children; // Indices into the node list
+    int min = 0;               // kRepeat
+    int max = 0;               // kRepeat; negative means unbounded
+    bool greedy = true;        // kRepeat
+    unsigned char assertion = 0; // kAssert
+};
+
+// Recursive-descent parser for the ECMAScript subset the engine implements. Anything else
+// (backreferences, lookahead, \c, [] ...) or anything std::regex might reject or read
+// differently makes parse() fail, and the pattern goes to std::regex instead.
+class RegexParser {
+public:
+    RegexParser(std::string_view pattern, bool ignore_case) : pattern_(pattern), ignore_case_(ignore_case) {}
+
+    // Root node of the pattern, or -1 if it is not supported
+    int parse() {
+        int root = alternation();
+        if (!ok_ || pos_ != pattern_.size()) return -1; // An unbalanced ')' stops the parse early
+        return root;
+    }
+
+    std::vector<RegexNode> nodes;
+
+private:
+    static constexpr int kMaxDepth = 200;
+    static constexpr int kMaxRepeat = 1000;
+
+    int fail() { ok_ = false; return -1; }
+    bool more() const { return pos_ < pattern_.size(); }
+    char peek() const { return pattern_[pos_]; }
+    int add(RegexNode node) {
+        nodes.push_back(std::move(node));
+        return static_cast<int>(nodes.size()) - 1;
+    }
+
+    int alternation() {
+        if (++depth_ > kMaxDepth) return fail();
+        RegexNode node;
+        node.kind = RegexNode::kAlternate;
+        node.children.push_back(sequence());
+        while (ok_ && more() && peek() == '|') {
+            ++pos_;
+            node.children.push_back(sequence());
+        }
+        --depth_;
+        if (!ok_) return -1;
+        return node.children.size() == 1 ? node.children[0] : add(std::move(node));
+    }
+
+    int sequence() {
+        RegexNode node;
+        node.kind = RegexNode::kConcat; // An empty sequence matches the empty string
+        while (ok_ && more() && peek() != '|' && peek() != ')') {
+            node.children.push_back(repetition());
+        }
+        return add(std::move(node));
+    }
+
+    int repetition() {
+        bool is_assertion = false;
+        int atom_node = atom(is_assertion);
+        if (!ok_ || !more()) return atom_node;
+
+        RegexNode node;
+        node.kind = RegexNode::kRepeat;
+        char c = peek();
+        if (c == '*') { node.min = 0; node.max = -1; ++pos_; }
+        else if (c == '+') { node.min = 1; node.max = -1; ++pos_; }
+        else if (c == '?') { node.min = 0; node.max = 1; ++pos_; }
+        else if (c == '{') { if (!braces(node.min, node.max)) return fail(); }
+        else return atom_node;
+
+        if (is_assertion) return fail(); // Quantified assertions are an error in ECMAScript
+        if (more() && peek() == '?') {
+            node.greedy = false;
+            ++pos_;
+        }
+        if (more() && std::strchr("*+?{", peek()) != nullptr) return fail(); // Stacked quantifiers
+        node.children.push_back(atom_node);
+        return add(std::move(node));
+    }
+
+    // {n}, {n,} or {n,m}
+    bool braces(int& min, int& max) {
+        ++pos_; // '{'
+        if (!number(min)) return false;
+        max = min;
+        if (more() && peek() == ',') {
+            ++pos_;
+            max = -1;
+            if (more() && std::isdigit(static_cast<unsigned char>(peek())) && !number(max)) return false;
+        }
+        if (!more() || peek() != '}') return false;
+        ++pos_;
+        return max < 0 || min <= max;
+    }
+
+    bool number(int& value) {
+        if (!more() || !std::isdigit(static_cast<unsigned char>(peek()))) return false;
+        value = 0;
+        while (more() && std::isdigit(static_cast<unsigned char>(peek()))) {
+            value = value * 10 + (peek() - '0');
+            ++pos_;
+            if (value > kMaxRepeat) return false;
+        }
+        return true;
+    }
+
+    int atom(bool& is_assertion) {
+        char c = pattern_[pos_++];
+        RegexNode node;
+        switch (c) {
+            case '(': {
+                if (more() && peek() == '?') {
+                    if (pos_ + 1 < pattern_.size() && pattern_[pos_ + 1] == ':') pos_ += 2; // (?:...)
+                    else return fail(); // Lookahead
+                }
+                int inner = alternation();
+                if (!ok_ || !more() || peek() != ')') return fail();
+                ++pos_;
+                return inner;
+            }
+            case '[':
+                node.kind = RegexNode::kBytes;
+                if (!bracket(node.bytes)) return fail();
+                return add(std::move(node));
+            case '.':
+                node.kind = RegexNode::kBytes;
+                node.bytes.set();
+                node.bytes.reset('\n');
+                node.bytes.reset('\r');
+                return add(std::move(node));
+            case '^':
+            case '$':
+                is_assertion = true;
+                node.kind = RegexNode::kAssert;
+                node.assertion = c == '^' ? RegexInst::kLineBegin : RegexInst::kLineEnd;
+                return add(std::move(node));
+            case '\\': {
+                if (!more()) return fail();
+                char e = pattern_[pos_++];
+                if (e == 'b' || e == 'B') {
+                    is_assertion = true;
+                    node.kind = RegexNode::kAssert;
+                    node.assertion = e == 'b' ? RegexInst::kWordBoundary : RegexInst::kNotWordBoundary;
+                    return add(std::move(node));
+                }
+                node.kind = RegexNode::kBytes;
+                if (class_escape(e, node.bytes)) return add(std::move(node));
+                int byte = 0;
+                if (!escaped_byte(e, byte)) return fail();
+                literal(static_cast<unsigned char>(byte), node.bytes);
+                return add(std::move(node));
+            }
+            case '*': case '+': case '?': case '{':
+                return fail(); // Nothing to repeat
+            default:
+                node.kind = RegexNode::kBytes;
+                literal(static_cast<unsigned char>(c), node.bytes);
+                return add(std::move(node));
+        }
+    }
+
+    void literal(unsigned char c, std::bitset<256>& bytes) const {
+        bytes.set(c);
+        if (ignore_case_ && fold_ascii(c) >= 'a' && fold_ascii(c) <= 'z') {
+            bytes.set(fold_ascii(c));
+            bytes.set(static_cast<unsigned char>(fold_ascii(c) - ('a' - 'A')));
+        }
+    }
+
+    // \d \D \w \W \s \S (inside or outside brackets)
+    static bool class_escape(char e, std::bitset<256>& bytes) {
+        int (*test)(int) = nullptr;
+        switch (std::tolower(static_cast<unsigned char>(e))) {
+            case 'd': test = [](int c) { return std::isdigit(c); }; break;
+            case 'w': test = [](int c) { return static_cast<int>(is_word_char(static_cast<unsigned char>(c))); }; break;
+            case 's': test = [](int c) { return std::isspace(c); }; break;
+            default: return false;
+        }
+        bool negated = std::isupper(static_cast<unsigned char>(e)) != 0;
+        for (int c = 0; c < 256; ++c) {
+            bool in_class = c < 0x80 && test(c) != 0;
+            if (in_class != negated) bytes.set(static_cast<size_t>(c));
+        }
+        return true;
+    }
+
+    // Character escapes shared by brackets and the top level (\b is handled by the callers)
+    bool escaped_byte(char e, int& byte) {
+        switch (e) {
+            case 'f': byte = '\f'; return true;
+            case 'n': byte = '\n'; return true;
+            case 'r': byte = '\r'; return true;
+            case 't': byte = '\t'; return true;
+            case 'v': byte = '\v'; return true;
+            case 'x': return hex_digits(2, byte);
+            case 'u': return hex_digits(4, byte) && byte < 0x80;
+            default:
+                if (std::isalnum(static_cast<unsigned char>(e))) return false; // \0, \1 (backreference), \c, ...
+                byte = static_cast<unsigned char>(e); // Identity escape
+                return true;
+        }
+    }
+
+    bool hex_digits(int count, int& value) {
+        value = 0;
+        for (int i = 0; i < count; ++i) {
+            if (!more() || !std::isxdigit(static_cast<unsigned char>(peek()))) return false;
+            char h = pattern_[pos_++];
+            value = value * 16 + (std::isdigit(static_cast<unsigned char>(h)) ? h - '0' : std::tolower(static_cast<unsigned char>(h)) - 'a' + 10);
+        }
+        return true;
+    }
+
+    // Bracket expression after the '['
+    bool bracket(std::bitset<256>& bytes) {
+        bool negated = more() && peek() == '^';
+        if (negated) ++pos_;
+        if (!more() || peek() == ']') return false; // [] and [^] are left to std::regex
+
+        while (true) {
+            if (!more()) return false;
+            if (peek() == ']') {
+                ++pos_;
+                break;
+            }
+            int low = 0;
+            bool is_class = false;
+            if (!bracket_atom(bytes, low, is_class)) return false;
+            bool range = more() && peek() == '-' && pos_ + 1 < pattern_.size() && pattern_[pos_ + 1] != ']';
+            if (is_class) {
+                if (range) return false; // [\d-z] is an error
+                continue;
+            }
+            if (!range) {
+                bytes.set(static_cast<size_t>(low));
+                continue;
+            }
+            ++pos_; // '-'
+            int high = 0;
+            std::bitset<256> unused;
+            if (!bracket_atom(unused, high, is_class) || is_class) return false;
+            if (low > high || high >= 0x80) return false; // Bytes above ASCII are signed chars to std::regex
+            for (int c = low; c <= high; ++c) bytes.set(static_cast<size_t>(c));
+        }
+
+        if (ignore_case_) {
+            for (int c = 'a'; c <= 'z'; ++c) {
+                size_t upper = static_cast<size_t>(c - ('a' - 'A'));
+                if (bytes.test(static_cast<size_t>(c)) || bytes.test(upper)) {
+                    bytes.set(static_cast<size_t>(c));
+                    bytes.set(upper);
+                }
+            }
+        }
+        if (negated) bytes.flip();
+        return true;
+    }
+
+    // One bracket element: a single byte (in 'byte') or a class added to 'bytes'
+    bool bracket_atom(std::bitset<256>& bytes, int& byte, bool& is_class) {
+        is_class = false;
+        char c = pattern_[pos_++];
+        if (c == '\\') {
+            if (!more()) return false;
+            char e = pattern_[pos_++];
+            if (class_escape(e, bytes)) {
+                is_class = true;
+                return true;
+            }
+            if (e == 'b') {
+                byte = '\b';
+                return true;
+            }
+            return escaped_byte(e, byte);
+        }
+        if (c == '[' && more() && (peek() == ':' || peek() == '.' || peek() == '=')) {
+            if (peek() != ':') return false; // Collating elements and equivalence classes
+            size_t close = pattern_.find(":]", pos_ + 1);
+            if (close == std::string_view::npos) return false;
+            std::string_view name = pattern_.substr(pos_ + 1, close - pos_ - 1);
+            pos_ = close + 2;
+            is_class = true;
+            return posix_class(name, bytes);
+        }
+        byte = static_cast<unsigned char>(c);
+        return true;
+    }
+
+    static bool posix_class(std::string_view name, std::bitset<256>& bytes) {
+        static const struct { const char* name; int (*test)(int); } classes[] = {
+            {"alnum", [](int c) { return std::isalnum(c); }}, {"alpha", [](int c) { return std::isalpha(c); }},
+            {"blank", [](int c) { return static_cast<int>(c == ' ' || c == '\t'); }}, {"cntrl", [](int c) { return std::iscntrl(c); }},
+            {"digit", [](int c) { return std::isdigit(c); }}, {"graph", [](int c) { return std::isgraph(c); }},
+            {"lower", [](int c) { return std::islower(c); }}, {"print", [](int c) { return std::isprint(c); }},
+            {"punct", [](int c) { return std::ispunct(c); }}, {"space", [](int c) { return std::isspace(c); }},
+            {"upper", [](int c) { return std::isupper(c); }}, {"xdigit", [](int c) { return std::isxdigit(c); }},
+        };
+        for (const auto& entry : classes) {
+            if (name != entry.name) continue;
+            for (int c = 0; c < 0x80; ++c) {
+                if (entry.test(c)) bytes.set(static_cast<size_t>(c));
+            }
+            return true;
+        }
+        return false;
+    }
+
+    std::string_view pattern_;
+    bool ignore_case_;
+    size_t pos_ = 0;
+    int depth_ = 0;
+    bool ok_ = true;
+};
+
+// --- Required Literals ---
+
+// What the literal analysis knows about a regex node. If 'exact', 'strings' are all the
+// strings the node can match; otherwise every match contains one of them (an empty list,
+// or one holding "", means nothing is required).
+struct LiteralSet {
+    bool exact = false;
+    std::vector<std::string> strings;
+};
+
+static constexpr size_t kMaxLiteralSetSize = 64;     // Larger sets stop growing
+static constexpr size_t kMaxRequiredLiteral = 256;    // Longer literals stop growing
+static constexpr size_t kMaxLiteralSetRepeats = 16;   // Copies of a repeated node spelled out
+
+// Length of the shortest string of the set: how selective it is as a prefilter
+static size_t literal_set_score(const std::vector<std::string>& strings) {
+    if (strings.empty()) return 0;
+    size_t shortest = strings[0].size();
+    for (const auto& s : strings) shortest = std::min(shortest, s.size());
+    return shortest;
+}
+
+// Keep the more selective of two required sets: longer shortest string, then fewer strings
+static void keep_better_literals(std::vector<std::string>& best, const std::vector<std::string>& candidate) {
+    size_t score = literal_set_score(candidate);
+    if (score == 0) return;
+    size_t best_score = literal_set_score(best);
+    if (score > best_score || (score == best_score && candidate.size() < best.size())) best = candidate;
+}
+
+// Every concatenation of a string of 'left' and one of 'right'; false if that gets too big
+static bool cross_literals(const std::vector<std::string>& left, const std::vector<std::string>& right, std::vector<std::string>& out) {
+    if (left.size() * right.size() > kMaxLiteralSetSize) return false;
+    std::vector<std::string> product;
+    for (const auto& l : left) {
+        for (const auto& r : right) {
+            if (l.size() + r.size() > kMaxRequiredLiteral) return false;
+            product.push_back(l + r);
+        }
+    }
+    std::sort(product.begin(), product.end());
+    product.erase(std::unique(product.begin(), product.end()), product.end());
+    out = std::move(product);
+    return true;
+}
+
+static LiteralSet analyze_literals(const std::vector<RegexNode>& nodes, int index, bool ignore_case) {
+    const RegexNode& node = nodes[static_cast<size_t>(index)];
+    LiteralSet result;
+    switch (node.kind) {
+        case RegexNode::kBytes: {
+            // A small set of bytes is a set of one-byte strings. Under -i the parser closed
+            // every set under ASCII case, and the prefilter folds case too, so a letter
+            // stands for both of its cases.
+            for (int c = 0; c < 256; ++c) {
+                if (!node.bytes.test(static_cast<size_t>(c))) continue;
+                if (ignore_case && fold_ascii(static_cast<unsigned char>(c)) != c && node.bytes.test(fold_ascii(static_cast<unsigned char>(c)))) continue;
+                if (result.strings.size() == 4) return LiteralSet(); // Too broad to be worth it
+                result.strings.emplace_back(1, static_cast<char>(c));
+            }
+            result.exact = true;
+            return result;
+        }
+        case RegexNode::kAssert:
+            result.exact = true; // Zero-width: matches only ""
+            result.strings.emplace_back();
+            return result;
+        case RegexNode::kConcat: {
+            // Adjacent exact parts are multiplied out into one run; the best run or required
+            // set of an inexact part is what the concatenation requires
+            std::vector<std::string> run(1);
+            std::vector<std::string> best;
+            bool exact = true;
+            for (int child : node.children) {
+                LiteralSet part = analyze_literals(nodes, child, ignore_case);
+                if (part.exact && cross_literals(run, part.strings, run)) continue;
+                exact = false;
+                keep_better_literals(best, run);
+                if (part.exact) {
+                    run = part.strings;
+                } else {
+                    keep_better_literals(best, part.strings);
+                    run.assign(1, std::string());
+                }
+            }
+            if (exact) {
+                result.exact = true;
+                result.strings = std::move(run);
+            } else {
+                keep_better_literals(best, run);
+                result.strings = std::move(best);
+            }
+            return result;
+        }
+        case RegexNode::kAlternate: {
+            // Every match is a match of some alternative, so it contains one of that
+            // alternative's strings: the union is required, if each alternative requires some
+            result.exact = true;
+            for (int child : node.children) {
+                LiteralSet part = analyze_literals(nodes, child, ignore_case);
+                if (!part.exact && literal_set_score(part.strings) == 0) return LiteralSet();
+                result.exact = result.exact && part.exact;
+                result.strings.insert(result.strings.end(), part.strings.begin(), part.strings.end());
+            }
+            std::sort(result.strings.begin(), result.strings.end());
+            result.strings.erase(std::unique(result.strings.begin(), result.strings.end()), result.strings.end());
+            if (result.strings.size() > kMaxLiteralSetSize) return LiteralSet();
+            if (!result.exact && literal_set_score(result.strings) == 0) return LiteralSet();
+            return result;
+        }
+        case RegexNode::kRepeat: {
+            if (node.max == 0) {
+                result.exact = true;
+                result.strings.emplace_back();
+                return result;
+            }
+            LiteralSet part = analyze_literals(nodes, node.children[0], ignore_case);
+            if (node.min == 0) {
+                if (node.max == 1 && part.exact && part.strings.size() < kMaxLiteralSetSize) { // x? is x or ""
+                    result = std::move(part);
+                    result.strings.emplace_back();
+                    std::sort(result.strings.begin(), result.strings.end());
+                    result.strings.erase(std::unique(result.strings.begin(), result.strings.end()), result.strings.end());
+                }
+                return result; // Otherwise nothing is required
+            }
+            if (!part.exact) return part; // At least one copy: what it requires is required
+            // The first 'min' copies are spelled out; further ones make the set inexact
+            std::vector<std::string> run(1);
+            bool complete = static_cast<size_t>(node.min) <= kMaxLiteralSetRepeats;
+            for (int i = 0; complete && i < node.min; ++i) complete = cross_literals(run, part.strings, run);
+            if (!complete) {
+                result.strings = std::move(part.strings);
+                return result;
+            }
+            result.exact = node.min == node.max;
+            result.strings = std::move(run);
+            return result;
+        }
+    }
+    return result;
+}
+
+// Literals one of which occurs in every match of the regex 'pattern' (a prefix, an inner
+// literal or a set of alternatives), for a prefilter that spares the regex engines most
+// lines. Under -i they are in lower case and meant to be searched case-insensitively.
+// Returns false if no such set is known (the pattern can match an empty string, uses
+// syntax the analysis does not know, or only requires very broad byte sets).
+bool regex_required_literals(const std::string& pattern, bool ignore_case, std::vector<std::string>& literals) {
+    literals.clear();
+    RegexParser parser(pattern, ignore_case);
+    int root = parser.parse();
+    if (root < 0) return false;
+    LiteralSet set = analyze_literals(parser.nodes, root, ignore_case);
+    if (literal_set_score(set.strings) == 0) return false;
+    literals = std::move(set.strings);
+    return true;
+}
+
+bool RegexProgram::add(const std::string& pattern, bool ignore_case) {
+    RegexParser parser(pattern, ignore_case);
+    int root = parser.parse();
+    if (root < 0) return false;
+
+    pattern_begin_ = insts_.size();
+    size_t sets_before = sets_.size();
+    if (!emit(parser.nodes, root)) {
+        insts_.resize(pattern_begin_);
+        sets_.resize(sets_before);
+        for (auto it = set_ids_.begin(); it != set_ids_.end();) {
+            it = static_cast<size_t>(it->second) >= sets_before ? set_ids_.erase(it) : std::next(it);
+        }
+        return false;
+    }
+    RegexInst match;
+    match.op = RegexInst::kMatch;
+    match.set = static_cast<int>(entries_.size());
+    insts_.push_back(match);
+    entries_.push_back(static_cast<int>(pattern_begin_));
+    return true;
+}
+
+void RegexProgram::finish() {
+    set_ids_.clear();
+    if (entries_.empty()) return;
+
+    // The entry point tries the patterns in order: split p0, L1; L1: split p1, L2; ...
+    entry_ = entries_[0];
+    if (entries_.size() > 1) {
+        entry_ = static_cast<int>(insts_.size());
+        for (size_t i = 0; i + 1 < entries_.size(); ++i) {
+            RegexInst split;
+            split.op = RegexInst::kSplit;
+            split.x = entries_[i];
+            split.y = i + 2 < entries_.size() ? static_cast<int>(insts_.size()) + 1 : entries_[i + 1];
+            insts_.push_back(split);
+        }
+    }
+
+    // Split the bytes into classes no byte set (nor the \b word test) tells apart
+    flag_mask_ = 0;
+    for (const auto& inst : insts_) {
+        if (inst.op != RegexInst::kAssert) continue;
+        flag_mask_ |= inst.assertion == RegexInst::kLineBegin ? kAtLineBegin : 0;
+        flag_mask_ |= (inst.assertion == RegexInst::kWordBoundary || inst.assertion == RegexInst::kNotWordBoundary) ? kAfterWordChar : 0;
+    }
+    std::vector<std::bitset<256>> splitters = sets_;
+    splitters.emplace_back();
+    splitters.back().set('\n');
+    if (flag_mask_ & kAfterWordChar) {
+        std::bitset<256> word;
+        for (int c = 0; c < 256; ++c) word[static_cast<size_t>(c)] = is_word_char(static_cast<unsigned char>(c));
+        splitters.push_back(word);
+    }
+    std::memset(byte_class_, 0, sizeof(byte_class_));
+    class_count_ = 1;
+    for (const auto& set : splitters) {
+        int remap[256][2];
+        std::memset(remap, -1, sizeof(remap));
+        int count = 0;
+        for (int c = 0; c < 256; ++c) {
+            int& id = remap[byte_class_[c]][set.test(static_cast<size_t>(c)) ? 1 : 0];
+            if (id < 0) id = count++;
+            byte_class_[c] = static_cast<unsigned char>(id);
+        }
+        class_count_ = count;
+    }
+    for (int c = 255; c >= 0; --c) class_byte_[byte_class_[c]] = static_cast<unsigned char>(c);
+    newline_class_ = byte_class_[static_cast<unsigned char>('\n')];
+}
+
+void RegexProgram::save(CacheWriter& writer) const {
+    writer.put_vector(insts_);
+    writer.put_vector(entries_);
+    writer.put(entry_);
+    writer.put_vector(sets_);
+    writer.put(byte_class_);
+    writer.put(class_byte_);
+    writer.put(class_count_);
+    writer.put(newline_class_);
+    writer.put(flag_mask_);
+}
+
+bool RegexProgram::load(CacheReader& reader) {
+    *this = RegexProgram();
+    bool loaded = reader.get_vector(insts_) && reader.get_vector(entries_) && reader.get(entry_) && reader.get_vector(sets_) &&
+                  reader.get(byte_class_) && reader.get(class_byte_) && reader.get(class_count_) && reader.get(newline_class_) &&
+                  reader.get(flag_mask_);
+    if (loaded && valid()) return true;
+    *this = RegexProgram();
+    return false;
+}
+
+// Whether a loaded program is one finish() could have made: every jump, byte set, match
+// and entry point is in range, instructions that fall through have a successor, and the
+// byte classes cover 0..class_count_-1 with '\n' alone in the class recorded for it
+bool RegexProgram::valid() const {
+    if (entries_.empty()) return insts_.empty() && sets_.empty() && entry_ == 0;
+    if (insts_.size() > static_cast<size_t>(INT_MAX)) return false;
+    int inst_count = static_cast<int>(insts_.size());
+    auto in_range = [&](int target) { return target >= 0 && target < inst_count; };
+    for (int i = 0; i < inst_count; ++i) {
+        const RegexInst& inst = insts_[static_cast<size_t>(i)];
+        switch (inst.op) {
+            case RegexInst::kByteSet:
+                if (inst.set < 0 || static_cast<size_t>(inst.set) >= sets_.size() || i + 1 >= inst_count) return false;
+                break;
+            case RegexInst::kSplit:
+                if (!in_range(inst.x) || !in_range(inst.y)) return false;
+                break;
+            case RegexInst::kJump:
+                if (!in_range(inst.x)) return false;
+                break;
+            case RegexInst::kAssert:
+                if (inst.assertion > RegexInst::kNotWordBoundary || i + 1 >= inst_count) return false;
+                break;
+            case RegexInst::kMatch:
+                if (inst.set < 0 || static_cast<size_t>(inst.set) >= entries_.size()) return false;
+                break;
+            default:
+                return false;
+        }
+    }
+    if (!in_range(entry_)) return false;
+    for (int entry : entries_) {
+        if (!in_range(entry)) return false;
+    }
+    if (class_count_ < 1 || class_count_ > 256 || (flag_mask_ & ~(kAtLineBegin | kAfterWordChar)) != 0) return false;
+    for (unsigned char cls : byte_class_) {
+        if (cls >= class_count_) return false;
+    }
+    for (int cls = 0; cls < class_count_; ++cls) {
+        if (byte_class_[class_byte_[cls]] != cls) return false;
+    }
+    if (newline_class_ != byte_class_[static_cast<unsigned char>('\n')]) return false;
+    for (int c = 0; c < 256; ++c) {
+        if (c != '\n' && byte_class_[c] == newline_class_) return false;
+    }
+    return true;
+}
+
+bool RegexProgram::emit(const std::vector<RegexNode>& nodes, int index) {
+    if (insts_.size() - pattern_begin_ > kMaxInstructions) return false; // Huge counted repetitions stay with std::regex
+    const RegexNode& node = nodes[static_cast<size_t>(index)];
+    RegexInst inst;
+    switch (node.kind) {
+        case RegexNode::kBytes: {
+            auto found = set_ids_.emplace(node.bytes.to_string(), static_cast<int>(sets_.size()));
+            if (found.second) sets_.push_back(node.bytes);
+            inst.op = RegexInst::kByteSet;
+            inst.set = found.first->second;
+            insts_.push_back(inst);
+            return true;
+        }
+        case RegexNode::kConcat:
+            for (int child : node.children) {
+                if (!emit(nodes, child)) return false;
+            }
+            return true;
+        case RegexNode::kAlternate: {
+            // split L1, L2; L1: first; jump end; L2: split ... ; last; end:
+            std::vector<size_t> jumps;
+            for (size_t i = 0; i + 1 < node.children.size(); ++i) {
+                size_t split = insts_.size();
+                inst.op = RegexInst::kSplit;
+                inst.x = static_cast<int>(split) + 1;
+                insts_.push_back(inst);
+                if (!emit(nodes, node.children[i])) return false;
+                jumps.push_back(insts_.size());
+                inst.op = RegexInst::kJump;
+                insts_.push_back(inst);
+                insts_[split].y = static_cast<int>(insts_.size());
+            }
+            if (!emit(nodes, node.children.back())) return false;
+            for (size_t jump : jumps) insts_[jump].x = static_cast<int>(insts_.size());
+            return true;
+        }
+        case RegexNode::kRepeat: {
+            int child = node.children[0];
+            for (int i = 0; i < node.min; ++i) {
+                if (!emit(nodes, child)) return false;
+            }
+            // Optional copies: each split either enters the next copy or leaves the repetition
+            std::vector<size_t> splits;
+            size_t loop = insts_.size();
+            int optional = node.max < 0 ? 1 : node.max - node.min;
+            for (int i = 0; i < optional; ++i) {
+                splits.push_back(insts_.size());
+                inst.op = RegexInst::kSplit;
+                insts_.push_back(inst);
+                if (!emit(nodes, child)) return false;
+            }
+            if (node.max < 0) {
+                inst.op = RegexInst::kJump;
+                inst.x = static_cast<int>(loop);
+                insts_.push_back(inst);
+            }
+            int exit = static_cast<int>(insts_.size());
+            for (size_t split : splits) {
+                int body = static_cast<int>(split) + 1;
+                insts_[split].x = node.greedy ? body : exit;
+                insts_[split].y = node.greedy ? exit : body;
+            }
+            return insts_.size() - pattern_begin_ <= kMaxInstructions;
+        }
+        case RegexNode::kAssert:
+            inst.op = RegexInst::kAssert;
+            inst.assertion = node.assertion;
+            insts_.push_back(inst);
+            return true;
+    }
+    return false;
+}
+
+bool RegexProgram::assertion_holds(unsigned char assertion, bool at_begin, bool prev_word, bool at_end, bool next_word) {
+    switch (assertion) {
+        case RegexInst::kLineBegin: return at_begin;
+        case RegexInst::kLineEnd: return at_end;
+        case RegexInst::kWordBoundary: return prev_word != next_word;
+        default: return prev_word == next_word;
+    }
+}
+
+// Size the scratch buffers for this program the first time a cache is used with it
+void RegexProgram::prepare(RegexCache& cache) const {
+    if (cache.mark.size() == insts_.size()) return;
+    cache.mark.assign(insts_.size(), 0);
+    cache.generation = 0;
+    for (auto& list : cache.threads) {
+        list.dense.assign(insts_.size(), 0);
+        list.start.assign(insts_.size(), 0);
+        list.sparse.assign(insts_.size(), 0);
+        list.size = 0;
+    }
+    dfa_reset(cache);
+}
+
+void RegexProgram::dfa_reset(RegexCache& cache) const {
+    cache.state_index.clear();
+    cache.state_keys.clear();
+    cache.transitions.clear();
+    cache.end_match.clear();
+    cache.transition_matches.clear();
+    cache.end_matches.clear();
+    cache.match_lists.clear();
+    cache.memory = 0;
+    cache.kernel.clear();
+    cache.start_state = dfa_state(cache, kAtLineBegin & flag_mask_);
+}
+
+// Intern the state made of cache.kernel (sorted) and 'flags'. A full cache is flushed first;
+// if that happens with too little input scanned since the last flush, the DFA is abandoned.
+int RegexProgram::dfa_state(RegexCache& cache, unsigned char flags) const {
+    std::string& key = cache.key;
+    key.assign(1, static_cast<char>(flags));
+    key.append(reinterpret_cast<const char*>(cache.kernel.data()), cache.kernel.size() * sizeof(int));
+    auto found = cache.state_index.find(key);
+    if (found != cache.state_index.end()) return found->second;
+
+    if (cache.memory > kCacheLimit) {
+        if (cache.scanned - cache.scanned_at_reset < 10 * cache.state_keys.size()) cache.gave_up = true;
+        cache.scanned_at_reset = cache.scanned;
+        std::vector<int> kernel = cache.kernel;
+        dfa_reset(cache);
+        cache.kernel = std::move(kernel);
+        key.assign(1, static_cast<char>(flags));
+        key.append(reinterpret_cast<const char*>(cache.kernel.data()), cache.kernel.size() * sizeof(int));
+    }
+
+    int id = static_cast<int>(cache.state_keys.size());
+    auto inserted = cache.state_index.emplace(key, id);
+    cache.state_keys.push_back(&inserted.first->first);
+    cache.transitions.resize(cache.transitions.size() + static_cast<size_t>(class_count_), RegexCache::kUnknown);
+    cache.transitions[static_cast<size_t>(id) * static_cast<size_t>(class_count_) + static_cast<size_t>(newline_class_)] = RegexCache::kLineBreak;
+    cache.end_match.push_back(-1);
+    cache.memory += key.size() * 2 + static_cast<size_t>(class_count_) * sizeof(int) + 64;
+    if (cache.collect) {
+        cache.transition_matches.resize(cache.transitions.size(), -1);
+        cache.end_matches.push_back(-2);
+        cache.memory += static_cast<size_t>(class_count_) * sizeof(int);
+    }
+    return id;
+}
+
+// Epsilon closure of a state (plus the entry point: the search is unanchored) in the
+// context of the next byte, or of the end of the line. Collects the instructions reached
+// by consuming the byte into cache.kernel; returns true if a match is reached first. A
+// collecting cache also gets the patterns whose matches were reached in cache.matched.
+bool RegexProgram::dfa_closure(RegexCache& cache, int state, bool at_end, unsigned char byte) const {
+    if (++cache.generation == 0) {
+        std::fill(cache.mark.begin(), cache.mark.end(), 0u);
+        cache.generation = 1;
+    }
+    const std::string& key = *cache.state_keys[static_cast<size_t>(state)];
+    unsigned char flags = static_cast<unsigned char>(key[0]);
+    bool at_begin = (flags & kAtLineBegin) != 0;
+    bool prev_word = (flags & kAfterWordChar) != 0;
+    bool next_word = !at_end && is_word_char(byte);
+
+    auto& stack = cache.stack;
+    stack.clear();
+    for (size_t offset = key.size(); offset > 1; offset -= sizeof(int)) {
+        int pc;
+        std::memcpy(&pc, key.data() + offset - sizeof(int), sizeof(int));
+        stack.push_back(pc);
+    }
+    stack.push_back(entry_);
+
+    bool matched = false;
+    cache.kernel.clear();
+    cache.matched.clear();
+    while (!stack.empty()) {
+        int pc = stack.back();
+        stack.pop_back();
+        if (cache.mark[static_cast<size_t>(pc)] == cache.generation) continue;
+        cache.mark[static_cast<size_t>(pc)] = cache.generation;
+        const RegexInst& inst = insts_[static_cast<size_t>(pc)];
+        switch (inst.op) {
+            case RegexInst::kByteSet:
+                if (!at_end && sets_[static_cast<size_t>(inst.set)].test(byte)) cache.kernel.push_back(pc + 1);
+                break;
+            case RegexInst::kSplit:
+                stack.push_back(inst.y);
+                stack.push_back(inst.x);
+                break;
+            case RegexInst::kJump:
+                stack.push_back(inst.x);
+                break;
+            case RegexInst::kAssert:
+                if (assertion_holds(inst.assertion, at_begin, prev_word, at_end, next_word)) stack.push_back(pc + 1);
+                break;
+            case RegexInst::kMatch:
+                matched = true;
+                if (cache.collect) cache.matched.push_back(inst.set);
+                break;
+        }
+    }
+    std::sort(cache.kernel.begin(), cache.kernel.end());
+    cache.kernel.erase(std::unique(cache.kernel.begin(), cache.kernel.end()), cache.kernel.end());
+    return matched;
+}
+
+// Compute and cache the transition out of 'state' on byte class 'cls'. Returns the next
+// state (as an index, while the table holds it pre-multiplied by the class count) or kMatch.
+// A collecting cache never returns kMatch; the patterns matched are left in cache.matched.
+int RegexProgram::dfa_transition(RegexCache& cache, int state, int cls) const {
+    size_t entry = static_cast<size_t>(state) * static_cast<size_t>(class_count_) + static_cast<size_t>(cls);
+    unsigned char byte = class_byte_[cls];
+    if (dfa_closure(cache, state, false, byte) && !cache.collect) {
+        cache.transitions[entry] = RegexCache::kMatch;
+        return RegexCache::kMatch;
+    }
+    int list = cache.matched.empty() ? -1 : dfa_match_list(cache);
+    size_t states_before = cache.state_keys.size();
+    int next = dfa_state(cache, (is_word_char(byte) ? kAfterWordChar : 0) & flag_mask_);
+    if (cache.state_keys.size() >= states_before) { // Otherwise the cache was flushed and 'state' is gone
+        cache.transitions[entry] = next * class_count_;
+        if (cache.collect) cache.transition_matches[entry] = list;
+    }
+    return next;
+}
+
+// Store cache.matched as a new match list of a collecting cache
+int RegexProgram::dfa_match_list(RegexCache& cache) const {
+    cache.match_lists.push_back(cache.matched);
+    cache.memory += cache.matched.size() * sizeof(int) + 32;
+    return static_cast<int>(cache.match_lists.size()) - 1;
+}
+
+bool RegexProgram::dfa_end_match(RegexCache& cache, int state) const {
+    signed char& known = cache.end_match[static_cast<size_t>(state)];
+    if (known < 0) known = dfa_closure(cache, state, true, 0) ? 1 : 0;
+    return known != 0;
+}
+
+bool RegexProgram::matches(std::string_view line, RegexCache& cache) const {
+    prepare(cache);
+    size_t start, end;
+    if (cache.gave_up) return pike_search(line, 0, 0, entry_, start, end, cache);
+
+    const unsigned char* text = reinterpret_cast<const unsigned char*>(line.data());
+    size_t scanned_before = cache.scanned;
+    int row = 0; // The start state
+    for (size_t i = 0; i < line.size(); ++i) {
+        int cls = byte_class_[text[i]];
+        int next = cache.transitions[static_cast<size_t>(row + cls)];
+        if (next < 0) {
+            if (next == RegexCache::kMatch) return true;
+            cache.scanned = scanned_before + i;
+            int state = dfa_transition(cache, row / class_count_, cls);
+            if (state == RegexCache::kMatch) return true;
+            if (cache.gave_up) return pike_search(line, 0, 0, entry_, start, end, cache);
+            next = state * class_count_;
+        }
+        row = next;
+    }
+    cache.scanned = scanned_before + line.size();
+    return dfa_end_match(cache, row / class_count_);
+}
+
+void RegexProgram::matching_patterns(std::string_view line, RegexCache& cache, std::vector<int>& patterns) const {
+    prepare(cache);
+    patterns.clear();
+    size_t start, end;
+    auto pike_patterns = [&]() {
+        patterns.clear();
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            if (pike_search(line, 0, 0, entries_[i], start, end, cache)) patterns.push_back(static_cast<int>(i));
+        }
+    };
+    if (cache.gave_up) return pike_patterns();
+
+    // Run the whole line through the collecting DFA, stopping early once every pattern is seen
+    cache.seen.assign(entries_.size(), 0);
+    size_t unseen = entries_.size();
+    auto note = [&](const std::vector<int>& matched) {
+        for (int pattern : matched) {
+            unsigned char& seen = cache.seen[static_cast<size_t>(pattern)];
+            if (!seen) {
+                seen = 1;
+                --unseen;
+            }
+        }
+    };
+    const unsigned char* text = reinterpret_cast<const unsigned char*>(line.data());
+    size_t scanned_before = cache.scanned;
+    int row = 0; // The start state
+    size_t i = 0;
+    for (; i < line.size() && unseen > 0; ++i) {
+        int cls = byte_class_[text[i]];
+        size_t entry = static_cast<size_t>(row + cls);
+        int next = cache.transitions[entry];
+        if (next < 0) {
+            cache.scanned = scanned_before + i;
+            int state = dfa_transition(cache, row / class_count_, cls);
+            if (cache.gave_up) return pike_patterns();
+            note(cache.matched);
+            next = state * class_count_;
+        } else if (cache.transition_matches[entry] >= 0) {
+            note(cache.match_lists[static_cast<size_t>(cache.transition_matches[entry])]);
+        }
+        row = next;
+    }
+    cache.scanned = scanned_before + i;
+    if (unseen > 0) {
+        int& known = cache.end_matches[static_cast<size_t>(row / class_count_)];
+        if (known == -2) {
+            dfa_closure(cache, row / class_count_, true, 0);
+            known = cache.matched.empty() ? -1 : dfa_match_list(cache);
+        }
+        if (known >= 0) note(cache.match_lists[static_cast<size_t>(known)]);
+    }
+    for (size_t p = 0; p < entries_.size(); ++p) {
+        if (cache.seen[p]) patterns.push_back(static_cast<int>(p));
+    }
+}
+
+size_t RegexProgram::find_line(std::string_view buffer, size_t from, RegexCache& cache) const {
+    prepare(cache);
+    size_t size = buffer.size();
+    if (from >= size) return std::string_view::npos;
+    if (cache.gave_up) return from; // Every line is a candidate for the Pike VM
+
+    const unsigned char* text = reinterpret_cast<const unsigned char*>(buffer.data());
+    const int* table = cache.transitions.data();
+    size_t scanned_base = cache.scanned - from;
+    size_t line_start = from;
+    int row = 0; // The start state
+    for (size_t i = from; i < size; ++i) {
+        unsigned char c = text[i];
+        int next = table[row + byte_class_[c]];
+#ifdef _WIN32
+        if (c == '\r' && (i + 1 == size || text[i + 1] == '\n')) { // make_line drops the '\r' of CRLF
+            ++i;
+            next = RegexCache::kLineBreak;
+        }
+#endif
+        if (next >= 0) {
+            row = next;
+            continue;
+        }
+        if (next == RegexCache::kLineBreak) {
+            if (dfa_end_match(cache, row / class_count_)) {
+                cache.scanned = scanned_base + i;
+                return line_start;
+            }
+            line_start = i + 1;
+            row = 0;
+            continue;
+        }
+        cache.scanned = scanned_base + i;
+        if (next == RegexCache::kMatch) return line_start;
+        int state = dfa_transition(cache, row / class_count_, byte_class_[c]);
+        if (state == RegexCache::kMatch || cache.gave_up) return line_start;
+        table = cache.transitions.data();
+        row = state * class_count_;
+    }
+    cache.scanned = scanned_base + size;
+    if (line_start < size && dfa_end_match(cache, row / class_count_)) return line_start; // Final line without a terminator
+    return std::string_view::npos;
+}
+
+// Add a thread and everything reachable from it without consuming input, in priority
+// order (preferred branches first). Instructions already in the list keep their earlier,
+// higher-priority thread. A loop iteration that matched nothing does not die when it gets
+// back to the loop head but goes on to the loop's exit, which is where a backtracking
+// std::regex ends up after retrying the empty iteration.
+void RegexProgram::pike_add(RegexCache& cache, RegexCache::ThreadList& list, int first, size_t start, std::string_view line, size_t text_begin, size_t pos) const {
+    auto in_list = [&list](int pc) {
+        size_t slot = static_cast<size_t>(list.sparse[static_cast<size_t>(pc)]);
+        return slot < list.size && list.dense[slot] == pc;
+    };
+    auto& stack = cache.stack;
+    stack.clear();
+    stack.push_back(first);
+    while (!stack.empty()) {
+        int pc = stack.back();
+        stack.pop_back();
+        const RegexInst& inst = insts_[static_cast<size_t>(pc)];
+        if (inst.op == RegexInst::kJump) { // Not recorded: every cycle also passes a split
+            int target = inst.x;
+            if (target < pc && in_list(target)) { // Empty iteration of the loop at 'target'
+                const RegexInst& head = insts_[static_cast<size_t>(target)];
+                target = head.x == target + 1 ? head.y : head.x;
+            }
+            stack.push_back(target);
+            continue;
+        }
+        if (in_list(pc)) continue;
+        list.sparse[static_cast<size_t>(pc)] = static_cast<int>(list.size);
+        list.dense[list.size] = pc;
+        list.start[list.size] = start;
+        ++list.size;
+
+        if (inst.op == RegexInst::kSplit) {
+            stack.push_back(inst.y);
+            stack.push_back(inst.x);
+        } else if (inst.op == RegexInst::kAssert) {
+            bool prev_word = pos > text_begin && is_word_char(static_cast<unsigned char>(line[pos - 1]));
+            bool next_word = pos < line.size() && is_word_char(static_cast<unsigned char>(line[pos]));
+            if (assertion_holds(inst.assertion, pos == text_begin, prev_word, pos == line.size(), next_word)) stack.push_back(pc + 1);
+        }
+    }
+}
+
+// Pike VM: all threads advance in lockstep, one byte at a time, ordered by priority. A new
+// thread starts at each position until a match is found; a match cuts off every thread of
+// lower priority, and the search ends when the higher-priority ones have died out.
+bool RegexProgram::pike_search(std::string_view line, size_t from, unsigned flags, int entry, size_t& match_start, size_t& match_end, RegexCache& cache) const {
+    bool continuous = (flags & kContinuous) != 0;
+    bool not_null = (flags & kNotNull) != 0;
+    size_t text_begin = (flags & kPrevAvail) ? 0 : from;
+    RegexCache::ThreadList* current = &cache.threads[0];
+    RegexCache::ThreadList* next = &cache.threads[1];
+    current->size = 0;
+    bool matched = false;
+    for (size_t pos = from;; ++pos) {
+        if (!matched && (!continuous || pos == from)) pike_add(cache, *current, entry, pos, line, text_begin, pos);
+        if (current->size == 0 && (matched || continuous || pos >= line.size())) break;
+
+        next->size = 0;
+        for (size_t i = 0; i < current->size; ++i) {
+            int pc = current->dense[i];
+            const RegexInst& inst = insts_[static_cast<size_t>(pc)];
+            if (inst.op == RegexInst::kByteSet) {
+                if (pos < line.size() && sets_[static_cast<size_t>(inst.set)].test(static_cast<unsigned char>(line[pos]))) {
+                    pike_add(cache, *next, pc + 1, current->start[i], line, text_begin, pos + 1);
+                }
+            } else if (inst.op == RegexInst::kMatch) {
+                if (not_null && current->start[i] == pos) continue;
+                matched = true;
+                match_start = current->start[i];
+                match_end = pos;
+                break;
+            }
+        }
+        std::swap(current, next);
+        if (pos >= line.size()) break;
+    }
+    return matched;
+}
+
+bool RegexProgram::find(std::string_view line, size_t from, unsigned flags, int pattern, size_t& match_start, size_t& match_end, RegexCache& cache) const {
+    prepare(cache);
+    return pike_search(line, from, flags, entries_[static_cast<size_t>(pattern)], match_start, match_end, cache);
+}
+
+// Check if a line matches any pattern with scanr's own regex engine: one DFA pass over the
+// line covers every pattern. Under -o a second pass tells which patterns match, and every
+// match of each of those is collected, stepping through the line the way
+// std::regex_iterator does: after an empty match a non-empty one at the same position is
+// tried first, and match_prev_avail only applies once the iterator has made a regular search.
+bool program_matches(std::string_view line, const RegexProgram& regexes, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions, MatchScratch& scratch) {
+    match_positions.clear();
+    RegexCache& cache = scratch.regex;
+    if (!regexes.matches(line, cache)) return false;
+    if (!settings.match_spans) return true;
+
+    regexes.matching_patterns(line, scratch.regex_patterns, scratch.patterns);
+    for (int pattern : scratch.patterns) {
+        size_t start = 0, end = 0;
+        unsigned prev_avail = 0;
+        bool have_match = regexes.find(line, 0, 0, pattern, start, end, cache);
+        while (have_match) {
+            match_positions.push_back({start, end - start});
+            size_t resume = end;
+            if (start == end) {
+                if (resume == line.size()) break;
+                unsigned retry = RegexProgram::kContinuous | RegexProgram::kNotNull | prev_avail;
+                if (regexes.find(line, resume, retry, pattern, start, end, cache)) continue;
+                ++resume;
+            }
+            prev_avail = RegexProgram::kPrevAvail;
+            have_match = regexes.find(line, resume, prev_avail, pattern, start, end, cache);
+        }
+    }
+    std::sort(match_positions.begin(), match_positions.end());
+    return true;
+}
+
+
+// --- Pattern Cache ---
+
+constexpr char PatternCache::kMagic[8];
+
+// The key covers the pattern text, the options compilation reads, and the layout of the
+// cached tables in this build
+std::string PatternCache::key(const Settings& settings) {
+    std::string key = "scanr pattern cache " + std::to_string(kVersion) + "\n";
+    key += settings.use_extended_regex ? 'E' : '-';
+    key += settings.ignore_case ? 'i' : '-';
+    key += settings.match_whole_word ? 'w' : '-';
+    key += settings.use_std_regex ? 's' : '-';
+    key += static_cast<char>(sizeof(size_t));
+    key += static_cast<char>(sizeof(RegexInst));
+    key += static_cast<char>(sizeof(std::bitset<256>));
+    for (const auto& pattern : settings.patterns) {
+        uint64_t size = pattern.size();
+        key.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        key += pattern;
+    }
+    return key;
+}
+
+PatternCache::PatternCache(const Settings& settings) : settings_(settings), key_(key(settings)) {
+    // FNV-1a names the entry; the full key inside it decides whether it is the right one
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : key_) hash = (hash ^ c) * 1099511628211ull;
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+#ifdef _WIN32
+    bool separated = settings.pattern_cache.back() == '\\' || settings.pattern_cache.back() == '/';
+    path_ = settings.pattern_cache + (separated ? "" : "\\") + name + ".scanr-patterns";
+#else
+    bool separated = settings.pattern_cache.back() == '/';
+    path_ = settings.pattern_cache + (separated ? "" : "/") + name + ".scanr-patterns";
+#endif
+}
+
+// A 64-bit hash of the entry's body, eight bytes at a time. It catches a torn or bit-flipped
+// file before any table is read; it is not meant to stand up to a deliberate forgery, which
+// the range checks of the loaders deal with.
+uint64_t PatternCache::checksum(const char* data, size_t size) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ size;
+    auto mix = [&](uint64_t word) {
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    };
+    size_t pos = 0;
+    for (; pos + 8 <= size; pos += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + pos, 8);
+        mix(word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + pos, size - pos);
+    mix(tail);
+    return hash ^ (hash >> 29);
+}
+
+bool PatternCache::load(CompiledMatcher& matcher) const {
+    MappedFile file;
+    if (!file.open(path_)) return false;
+    CacheReader header(file.data(), file.size());
+    char magic[8];
+    uint32_t version;
+    uint64_t sum;
+    size_t header_size = sizeof(kMagic) + sizeof(version) + sizeof(sum);
+    bool loaded = header.get(magic) && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0 &&
+                  header.get(version) && version == kVersion && header.get(sum) &&
+                  sum == checksum(file.data() + header_size, file.size() - header_size);
+    if (loaded) {
+        CacheReader reader(file.data() + header_size, file.size() - header_size);
+        std::string key;
+        loaded = reader.get_string(key) && key == key_ &&
+                 reader.get_flags(&matcher.required_literals_known, 1) && reader.get_strings(matcher.required_literals) &&
+                 reader.get(matcher.regex_prefilter_size) && matcher.regexes.load(reader) &&
+                 matcher.literals.load(reader) && matcher.regex_prefilter.load(reader) &&
+                 reader.get_strings(matcher.regex_sources) && reader.at_end();
+    }
+    file.close();
+    if (!loaded) return false;
+
+    auto flags = std::regex::ECMAScript;
+    if (settings_.ignore_case) flags |= std::regex::icase;
+    try {
+        for (const auto& source : matcher.regex_sources) matcher.regex_patterns.emplace_back(source, flags);
+    } catch (const std::regex_error&) {
+        return false;
+    }
+    return true;
+}
+
+bool PatternCache::store(const CompiledMatcher& matcher) const {
+    CacheWriter writer;
+    writer.put_string(key_);
+    writer.put(matcher.required_literals_known);
+    writer.put_strings(matcher.required_literals);
+    writer.put(matcher.regex_prefilter_size);
+    matcher.regexes.save(writer);
+    matcher.literals.save(writer);
+    matcher.regex_prefilter.save(writer);
+    writer.put_strings(matcher.regex_sources);
+    CacheWriter header;
+    header.put(kMagic);
+    header.put(kVersion);
+    header.put(checksum(writer.data().data(), writer.data().size()));
+
+    // Written under a name of this process's own, then moved in place, so a concurrent run
+    // never maps a half-written entry
+#ifdef _WIN32
+    CreateDirectoryA(settings_.pattern_cache.c_str(), nullptr);
+    std::string temporary_path = path_ + "." + std::to_string(GetCurrentProcessId()) + ".tmp";
+#else
+    mkdir(settings_.pattern_cache.c_str(), 0777);
+    std::string temporary_path = path_ + "." + std::to_string(getpid()) + ".tmp";
+#endif
+    {
+        std::ofstream output(temporary_path, std::ios::binary | std::ios::trunc);
+        output.write(header.data().data(), static_cast<std::streamsize>(header.data().size()));
+        output.write(writer.data().data(), static_cast<std::streamsize>(writer.data().size()));
+        output.close();
+        if (!output) {
+            std::cerr << "scanr: Cannot write pattern cache '" << path_ << "'" << std::endl;
+            std::remove(temporary_path.c_str());
+            return false;
+        }
+    }
+#ifdef _WIN32
+    bool moved = MoveFileExA(temporary_path.c_str(), path_.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool moved = std::rename(temporary_path.c_str(), path_.c_str()) == 0;
+#endif
+    if (!moved) {
+        std::cerr << "scanr: Cannot write pattern cache '" << path_ << "'" << std::endl;
+        std::remove(temporary_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// --- File Filters ---
+
+// Translate a glob into an anchored regex for RegexProgram
+static std::string glob_to_regex(const std::string& glob, bool path) {
+    static const char* const kSpecial = "\\^$.|?*+()[]{}";
+    const char* any = path ? "[^/]" : ".";
+    std::string regex = "^";
+    auto literal = [&](char c) {
+        if (c != '\0' && std::strchr(kSpecial, c) != nullptr) regex += '\\';
+        regex += c;
+    };
+    for (size_t i = 0; i < glob.size(); ++i) {
+        char c = glob[i];
+        if (c == '*') {
+            if (path && i + 1 < glob.size() && glob[i + 1] == '*') {
+                ++i;
+                if ((i == 1 || glob[i - 2] == '/') && i + 1 < glob.size() && glob[i + 1] == '/') {
+                    regex += "(.*/)?"; // "**/": any number of leading directories
+                    ++i;
+                } else {
+                    regex += ".*";     // "/**": everything inside
+                }
+            } else {
+                regex += any;
+                regex += '*';
+            }
+        } else if (c == '?') {
+            regex += any;
+        } else if (c == '[') {
+            // A bracket expression runs to the next ']' (one right after '[' or '[!' is a member)
+            size_t end = i + 1;
+            if (end < glob.size() && (glob[end] == '!' || glob[end] == '^')) ++end;
+            if (end < glob.size() && glob[end] == ']') ++end;
+            while (end < glob.size() && glob[end] != ']') ++end;
+            if (end >= glob.size()) {
+                literal(c); // No closing bracket: a plain '['
+                continue;
+            }
+            size_t member = i + 1;
+            regex += '[';
+            if (glob[member] == '!' || glob[member] == '^') {
+                regex += path ? "^/" : "^";
+                ++member;
+            }
+            for (; member < end; ++member) {
+                char d = glob[member];
+                if (d == '\\' || d == '[' || d == ']' || d == '^') regex += '\\';
+                regex += d;
+            }
+            regex += ']';
+            i = end;
+        } else if (c == '\\' && i + 1 < glob.size()) {
+            literal(glob[++i]);
+        } else {
+            literal(c);
+        }
+    }
+    regex += '$';
+    return regex;
+}
+
+bool GlobSet::add(const std::string& glob, bool path) {
+#ifdef _WIN32
+    constexpr bool kIgnoreCase = true;  // File names are case-insensitive
+#else
+    constexpr bool kIgnoreCase = false;
+#endif
+    return program_.add(glob_to_regex(glob, path), kIgnoreCase);
+}
+
+FileFilter::FileFilter(const Settings& settings) : use_ignore_files_(settings.use_ignore_files) {
+    auto compile = [](GlobSet& set, const std::vector<std::string>& globs) {
+        for (const auto& glob : globs) {
+            if (!set.add(glob, false)) throw std::invalid_argument("Invalid glob '" + glob + "'");
+        }
+        set.finish();
+    };
+    compile(include_, settings.include_globs);
+    compile(exclude_, settings.exclude_globs);
+    compile(exclude_dir_, settings.exclude_dir_globs);
+}
+
+std::shared_ptr<const IgnoreRules> IgnoreRules::load(const std::string& directory, std::shared_ptr<const IgnoreRules> parent, size_t thread_count) {
+    std::shared_ptr<IgnoreRules> loaded;
+    for (const char* name : {".gitignore", ".ignore"}) {
+        std::ifstream file(directory + name, std::ios::binary);
+        if (!file.is_open()) continue;
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            // Trailing spaces do not count unless escaped
+            while (!line.empty() && line.back() == ' ' && !(line.size() >= 2 && line[line.size() - 2] == '\\')) line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            Rule rule;
+            if (line[0] == '!') {
+                rule.negated = true;
+                line.erase(0, 1);
+            }
+            if (!line.empty() && line.back() == '/') {
+                rule.directory_only = true;
+                line.pop_back();
+            }
+            if (line.empty()) continue;
+            // A rule with a '/' before its end is relative to this directory; one without
+            // matches a name at any depth below it
+            std::string glob = line.find('/') == std::string::npos ? "**/" + line : line[0] == '/' ? line.substr(1) : line;
+            if (!loaded) loaded = std::make_shared<IgnoreRules>();
+            if (!loaded->globs.add(glob, true)) continue; // Git ignores malformed rules too
+            loaded->rules.push_back(rule);
+        }
+    }
+    if (!loaded || loaded->rules.empty()) return nullptr;
+    loaded->globs.finish();
+    loaded->base = directory;
+    loaded->parent = std::move(parent);
+    loaded->caches.resize(thread_count);
+    for (auto& cache : loaded->caches) cache.collect = true;
+    return loaded;
+}
+
+bool IgnoreRules::excludes(const std::string& path, bool is_directory, size_t thread, std::vector<int>& matched) const {
+    for (const IgnoreRules* rules = this; rules != nullptr; rules = rules->parent.get()) {
+#ifdef _WIN32
+        std::string relative = path.substr(rules->base.size());
+        std::replace(relative.begin(), relative.end(), '\\', '/');
+#else
+        std::string_view relative = std::string_view(path).substr(rules->base.size());
+#endif
+        rules->globs.matching(relative, rules->caches[thread], matched);
+        for (size_t i = matched.size(); i-- > 0;) {
+            const Rule& rule = rules->rules[static_cast<size_t>(matched[i])];
+            if (rule.directory_only && !is_directory) continue;
+            return !rule.negated;
+        }
+    }
+    return false;
+}
+
+// --- Directory Walker ---
+
+DirectoryWalker::DirectoryWalker(bool follow_symlinks, unsigned thread_count, const FileFilter& filter)
+    : follow_symlinks_(follow_symlinks), filter_(filter) {
+    for (unsigned i = 0; i < std::max(thread_count, 1u); ++i) queues_.push_back(std::make_unique<WorkQueue>());
+}
+
+DirectoryWalker::~DirectoryWalker() {
+    for (auto& thread : threads_) thread.join();
+}
+
+void DirectoryWalker::start(const std::string& root) {
+    root_ = std::make_unique<Node>();
+    cursors_.push_back({root_.get(), 0, &root_});
+    pending_ = 1;
+    queued_ = 1;
+    queues_[0]->directories.push_back({root, root_.get(), nullptr, nullptr});
+    for (size_t i = 0; i < queues_.size(); ++i) threads_.emplace_back(&DirectoryWalker::run, this, i);
+}
+
+bool DirectoryWalker::next(std::string& path, bool& unreadable) {
+    while (!cursors_.empty()) {
+        Cursor& cursor = cursors_.back();
+        if (!cursor.node->read.load(std::memory_order_acquire)) {
+            std::unique_lock<std::mutex> lock(found_mutex_);
+            found_cv_.wait(lock, [&] { return cursor.node->read.load(std::memory_order_acquire); });
+        }
+        if (cursor.position == cursor.node->entries.size()) {
+            cursor.owner->reset(); // Handed out: its subdirectories are done with too
+            cursors_.pop_back();
+            continue;
+        }
+        Entry& entry = cursor.node->entries[cursor.position++];
+        if (entry.directory != nullptr) {
+            cursors_.push_back({entry.directory.get(), 0, &entry.directory});
+            continue;
+        }
+        path = std::move(entry.path);
+        unreadable = entry.unreadable;
+        return true;
+    }
+    return false;
+}
+
+void DirectoryWalker::run(size_t self) {
+    std::vector<Entry> found;
+    Directory directory;
+    Scratch scratch;
+    while (!stopping_) {
+        if (take(self, directory)) {
+            read_directory(self, directory, found, scratch);
+            publish(*directory.node, found);
+            if (--pending_ == 0) {
+                std::lock_guard<std::mutex> lock(idle_mutex_);
+                idle_cv_.notify_all(); // The walk is complete
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(idle_mutex_);
+        ++idle_;
+        idle_cv_.wait(lock, [this] { return pending_ == 0 || queued_ > 0 || stopping_; });
+        --idle_;
+        if (pending_ == 0 || stopping_) break;
+    }
+}
+
+void DirectoryWalker::stop() {
+    stopping_ = true;
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    idle_cv_.notify_all();
+}
+
+// Newest directory of this thread's own queue (depth first: good locality, small queues),
+// else the oldest one of another thread (near the root: a large subtree to go on with)
+bool DirectoryWalker::take(size_t self, Directory& directory) {
+    if (queued_ == 0) return false;
+    for (size_t i = 0; i < queues_.size(); ++i) {
+        WorkQueue& queue = *queues_[(self + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.directories.empty()) continue;
+        if (i == 0) {
+            directory = std::move(queue.directories.back());
+            queue.directories.pop_back();
+        } else {
+            directory = std::move(queue.directories.front());
+            queue.directories.pop_front();
+        }
+        --queued_;
+        return true;
+    }
+    return false;
+}
+
+void DirectoryWalker::push_directory(size_t self, Directory directory) {
+    ++pending_;
+    {
+        std::lock_guard<std::mutex> lock(queues_[self]->mutex);
+        queues_[self]->directories.push_back(std::move(directory));
+    }
+    ++queued_;
+    if (idle_ > 0) {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        idle_cv_.notify_one();
+    }
+}
+
+// Hand the entries of a directory that was read to next()
+void DirectoryWalker::publish(Node& node, std::vector<Entry>& found) {
+    {
+        std::lock_guard<std::mutex> lock(found_mutex_);
+        node.entries.swap(found);
+        node.read.store(true, std::memory_order_release);
+    }
+    found_cv_.notify_all();
+    found.clear();
+}
+
+// Sort the entries of a directory that was read, then queue its subdirectories in reverse,
+// so that this thread (which takes the newest item of its deque) reads the first of them
+// next: the one next() will wait for first
+void DirectoryWalker::queue_subdirectories(size_t self, std::vector<Entry>& found, const std::shared_ptr<const Ancestor>& ancestors, const std::shared_ptr<const IgnoreRules>& ignore) {
+    std::sort(found.begin(), found.end(), [](const Entry& a, const Entry& b) { return a.path < b.path; });
+    for (auto entry = found.rbegin(); entry != found.rend(); ++entry) {
+        if (entry->directory != nullptr) push_directory(self, {entry->path, entry->directory.get(), ancestors, ignore});
+    }
+}
+
+#ifdef _WIN32
+void DirectoryWalker::read_directory(size_t self, const Directory& item, std::vector<Entry>& found, Scratch& scratch) {
+    const std::string& directory = item.path;
+    std::string prefix = directory.empty() || directory.back() == '\\' || directory.back() == '/' || directory.back() == ':' ? directory : directory + "\\";
+    std::shared_ptr<const IgnoreRules> ignore = item.ignore;
+    if (filter_.use_ignore_files()) {
+        if (auto rules = IgnoreRules::load(prefix, ignore, queues_.size())) ignore = std::move(rules);
+    }
+    WIN32_FIND_DATAA data;
+    // FindExInfoBasic skips the short 8.3 names; the large fetch reads many entries per call
+    HANDLE find = FindFirstFileExA((prefix + "*").c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+    if (find == INVALID_HANDLE_VALUE) {
+        if (GetLastError() != ERROR_FILE_NOT_FOUND) found.push_back({directory.empty() ? "." : directory, true, nullptr});
+        return;
+    }
+    do {
+        const char* name = data.cFileName;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        DWORD attributes = data.dwFileAttributes;
+        // Reparse points (symbolic links, junctions) are only followed with -R; without loop
+        // detection on Windows, a junction cycle under -R is cut off by the path length limit
+        if ((attributes & FILE_ATTRIBUTE_REPARSE_POINT) && !follow_symlinks_) continue;
+        bool is_directory = (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        if (!is_directory && (attributes & FILE_ATTRIBUTE_DEVICE)) continue;
+        std::string path = prefix + name;
+        if (skipped(self, ignore, name, path, is_directory, scratch)) continue;
+        found.push_back({std::move(path), false, is_directory ? std::make_unique<Node>() : nullptr});
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+    queue_subdirectories(self, found, nullptr, ignore);
+}
+#else
+void DirectoryWalker::read_directory(size_t self, const Directory& item, std::vector<Entry>& found, Scratch& scratch) {
+    const std::string& directory = item.path;
+    int fd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        found.push_back({directory.empty() ? "." : directory, true, nullptr});
+        return;
+    }
+    std::shared_ptr<const Ancestor> self_and_ancestors;
+    if (follow_symlinks_) {
+        struct stat info;
+        if (fstat(fd, &info) == 0) {
+            for (const Ancestor* above = item.ancestors.get(); above != nullptr; above = above->parent.get()) {
+                if (above->device == info.st_dev && above->inode == info.st_ino) { // A link back up the tree
+                    ::close(fd);
+                    return;
+                }
+            }
+            self_and_ancestors = std::make_shared<const Ancestor>(Ancestor{static_cast<unsigned long long>(info.st_dev), static_cast<unsigned long long>(info.st_ino), item.ancestors});
+        }
+    }
+    std::string prefix = directory.empty() || directory.back() == '/' ? directory : directory + "/";
+    std::shared_ptr<const IgnoreRules> ignore = item.ignore;
+    if (filter_.use_ignore_files()) {
+        if (auto rules = IgnoreRules::load(prefix, ignore, queues_.size())) ignore = std::move(rules);
+    }
+
+    // Classify an entry from its directory entry type, asking the file system (relative to
+    // the open directory) only when the type is unknown or a link is to be followed
+    auto add = [&](const char* name, unsigned char type) {
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) return;
+        if (type == DT_UNKNOWN || (type == DT_LNK && follow_symlinks_)) {
+            struct stat info;
+            if (fstatat(fd, name, &info, follow_symlinks_ ? 0 : AT_SYMLINK_NOFOLLOW) != 0) return;
+            type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type != DT_DIR && type != DT_REG) return; // Symlinks (without -R), devices, FIFOs and sockets are skipped
+        std::string path = prefix + name;
+        if (skipped(self, ignore, name, path, type == DT_DIR, scratch)) return;
+        found.push_back({std::move(path), false, type == DT_DIR ? std::make_unique<Node>() : nullptr});
+    };
+#ifdef __linux__
+    // getdents64 fills a large buffer per system call, with no DIR stream in between
+    struct LinuxDirent64 {
+        unsigned long long d_ino;
+        long long d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    };
+    alignas(8) char buffer[64 * 1024];
+    for (;;) {
+        long bytes = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (bytes <= 0) break;
+        for (long offset = 0; offset < bytes;) {
+            const LinuxDirent64* entry = reinterpret_cast<const LinuxDirent64*>(buffer + offset);
+            add(entry->d_name, entry->d_type);
+            offset += entry->d_reclen;
+        }
+    }
+    ::close(fd);
+#else
+    DIR* stream = fdopendir(fd);
+    if (stream == nullptr) {
+        ::close(fd);
+        return;
+    }
+    while (const struct dirent* entry = readdir(stream)) add(entry->d_name, entry->d_type);
+    closedir(stream); // Closes fd too
+#endif
+    queue_subdirectories(self, found, self_and_ancestors, ignore);
+}
+#endif
+
+// Filters applied to every entry before it is queued or handed out; the base name is
+// looked at first, the path relative to each ignore file only for what passes
+bool DirectoryWalker::skipped(size_t self, const std::shared_ptr<const IgnoreRules>& ignore, const char* name, const std::string& path, bool is_directory, Scratch& scratch) const {
+    std::string_view base_name(name);
+    if (is_directory) {
+        if (!filter_.directory_allowed(base_name, scratch.filter)) return true;
+        if (filter_.use_ignore_files() && base_name == ".git") return true; // Never part of the work tree
+    } else if (!filter_.file_allowed(base_name, scratch.filter) || base_name == TrigramIndex::kFileName) {
+        return true; // scanr's own index (--index) describes the tree, it is not part of it
+    }
+    return ignore != nullptr && ignore->excludes(path, is_directory, self, scratch.rules);
+}
+
+// Threads for the directory walk: enumeration waits on the file system more than on the CPU
+unsigned walker_thread_count() {
+    unsigned hardware = std::thread::hardware_concurrency();
+    return std::clamp(hardware, 2u, 8u);
+}
+
+bool is_directory(const std::string& path) {
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+// --- Trigram Index ---
+
+constexpr char TrigramIndex::kMagic[8];
+
+// ASCII letters folded to lower case; the index and every lookup see bytes through this
+static unsigned char fold_trigram_byte(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<unsigned char>(c - 'A' + 'a') : c;
+}
+
+// What the walker puts in front of the names under 'root': the root and a separator,
+// unless the root is empty (the current directory) or already ends in one
+static std::string walk_prefix(const std::string& root) {
+#ifdef _WIN32
+    bool separated = root.empty() || root.back() == '\\' || root.back() == '/' || root.back() == ':';
+    return separated ? root : root + "\\";
+#else
+    bool separated = root.empty() || root.back() == '/';
+    return separated ? root : root + "/";
+#endif
+}
+
+std::string TrigramIndex::path_for(const std::string& root, const Settings& settings) {
+    return settings.index_file.empty() ? walk_prefix(root) + kFileName : settings.index_file;
+}
+
+std::string_view TrigramIndex::relative(const std::string& root, const std::string& path) {
+    size_t prefix = walk_prefix(root).size();
+    return prefix <= path.size() ? std::string_view(path).substr(prefix) : std::string_view(path);
+}
+
+bool TrigramIndex::open(const std::string& path) {
+    header_ = Header{};
+    if (!file_.open(path) || file_.size() < sizeof(Header)) return false;
+    Header header;
+    std::memcpy(&header, file_.data(), sizeof(header));
+    uint64_t size = file_.size();
+    bool valid = std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 && header.version == kVersion &&
+                 header.byte_order == kByteOrder && header.total_size == size &&
+                 header.files_offset <= size && header.file_count <= (size - header.files_offset) / sizeof(FileEntry) &&
+                 header.trigrams_offset <= size && header.trigram_count <= (size - header.trigrams_offset) / sizeof(TrigramEntry) &&
+                 header.postings_offset <= size && header.paths_offset <= size;
+    if (!valid) {
+        file_.close();
+        return false;
+    }
+    header_ = header;
+    return true;
+}
+
+TrigramIndex::FileEntry TrigramIndex::file(size_t id) const {
+    FileEntry entry;
+    std::memcpy(&entry, file_.data() + header_.files_offset + id * sizeof(FileEntry), sizeof(entry));
+    return entry;
+}
+
+TrigramIndex::TrigramEntry TrigramIndex::trigram(size_t index) const {
+    TrigramEntry entry;
+    std::memcpy(&entry, file_.data() + header_.trigrams_offset + index * sizeof(TrigramEntry), sizeof(entry));
+    return entry;
+}
+
+std::string_view TrigramIndex::file_path(const FileEntry& entry) const {
+    uint64_t begin = header_.paths_offset + entry.path_offset;
+    if (begin > header_.total_size || entry.path_length > header_.total_size - begin) return {};
+    return std::string_view(file_.data() + begin, static_cast<size_t>(entry.path_length));
+}
+
+size_t TrigramIndex::find(std::string_view relative) const {
+    size_t low = 0, high = file_count();
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (file_path(file(middle)) < relative) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < file_count() && file_path(file(low)) == relative ? low : std::string_view::npos;
+}
+
+bool TrigramIndex::up_to_date(size_t id, unsigned long long size, long long mtime) const {
+    FileEntry entry = file(id);
+    return entry.size != kNotIndexed && entry.size == size && entry.mtime == mtime;
+}
+
+void TrigramIndex::decode(const TrigramEntry& entry, std::vector<uint32_t>& ids) const {
+    ids.clear();
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(file_.data()) + header_.postings_offset + entry.postings;
+    const unsigned char* end = reinterpret_cast<const unsigned char*>(file_.data()) + header_.total_size;
+    uint32_t id = 0;
+    for (uint32_t i = 0; i < entry.file_count && p < end; ++i) {
+        uint32_t delta = 0;
+        for (int shift = 0; p < end; shift += 7) {
+            unsigned char byte = *p++;
+            delta |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        id = i == 0 ? delta : id + delta;
+        if (id >= header_.file_count) break; // Damaged list: ignore the rest
+        ids.push_back(id);
+    }
+}
+
+void TrigramIndex::postings(uint32_t value, std::vector<uint32_t>& ids) const {
+    size_t low = 0, high = static_cast<size_t>(header_.trigram_count);
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (trigram(middle).trigram < value) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < header_.trigram_count && trigram(low).trigram == value) {
+        decode(trigram(low), ids);
+    } else {
+        ids.clear();
+    }
+}
+
+bool TrigramIndex::candidates(const std::vector<std::string>& literals, std::vector<bool>& result) const {
+    if (literals.empty()) return false;
+    for (const auto& literal : literals) {
+        if (literal.size() < 3) return false; // No trigram to look up: any file can match it
+    }
+    result.assign(file_count(), false);
+    std::vector<uint32_t> trigrams, matching, ids, both;
+    for (const auto& literal : literals) {
+        trigrams.clear();
+        uint32_t value = 0;
+        for (size_t i = 0; i < literal.size(); ++i) {
+            value = ((value << 8) | fold_trigram_byte(static_cast<unsigned char>(literal[i]))) & 0xFFFFFF;
+            if (i >= 2) trigrams.push_back(value);
+        }
+        std::sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+        // Intersect the posting lists; an empty intersection ends the literal early
+        for (size_t i = 0; i < trigrams.size(); ++i) {
+            postings(trigrams[i], ids);
+            if (i == 0) {
+                matching.swap(ids);
+            } else {
+                both.clear();
+                std::set_intersection(matching.begin(), matching.end(), ids.begin(), ids.end(), std::back_inserter(both));
+                matching.swap(both);
+            }
+            if (matching.empty()) break;
+        }
+        for (uint32_t id : matching) result[id] = true;
+    }
+    return true;
+}
+
+// Size and modification time (nanoseconds on POSIX, 100 ns units on Windows) of a file
+bool file_signature(const std::string& path, unsigned long long& size, long long& mtime) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) return false;
+    size = (static_cast<unsigned long long>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    mtime = static_cast<long long>((static_cast<unsigned long long>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime);
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) return false;
+    size = static_cast<unsigned long long>(info.st_size);
+#ifdef __APPLE__
+    mtime = static_cast<long long>(info.st_mtimespec.tv_sec) * 1000000000LL + info.st_mtimespec.tv_nsec;
+#else
+    mtime = static_cast<long long>(info.st_mtim.tv_sec) * 1000000000LL + info.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+}
+
+// Whether the index can rule files out for this search: only if every selected line holds a
+// required literal, and a file without selected lines prints nothing. Under -v the selected
+// lines are the ones without, and -c prints a count (of 0) for every file.
+bool index_can_narrow(const Settings& settings, const CompiledMatcher& matcher) {
+    return !settings.invert_match && !settings.count_only && matcher.required_literals_known;
+}
+
+bool TrigramIndex::build(const std::string& root, const Settings& settings, const FileFilter& filter) {
+    std::string index_path = path_for(root, settings);
+    std::string temporary_path = index_path + ".tmp";
+
+    // 1. The files of the tree, in path order (which is the order of the file table)
+    struct Item {
+        std::string path;
+        std::string relative;
+        unsigned long long size = kNotIndexed;
+        long long mtime = 0;
+        size_t previous = std::string_view::npos; // Id in the previous index, if unchanged since
+    };
+    std::vector<Item> items;
+    {
+        DirectoryWalker walker(settings.follow_symlinks, walker_thread_count(), filter);
+        walker.start(root);
+        std::string path;
+        bool unreadable = false;
+        while (walker.next(path, unreadable)) {
+            if (unreadable) {
+                std::cerr << "scanr: Cannot read directory '" << path << "'" << std::endl;
+                continue;
+            }
+            if (path == index_path || path == temporary_path) continue;
+            Item item;
+            item.relative = std::string(relative(root, path));
+            item.path = std::move(path);
+            if (!file_signature(item.path, item.size, item.mtime)) item.size = kNotIndexed;
+            items.push_back(std::move(item));
+        }
+    }
+    std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) { return a.relative < b.relative; });
+    if (items.size() > UINT32_MAX) {
+        std::cerr << "scanr: Too many files to index under '" << (root.empty() ? "." : root) << "'" << std::endl;
+        return false;
+    }
+
+    // 2. Files unchanged since the previous index take their trigrams from it
+    TrigramIndex previous;
+    bool have_previous = previous.open(index_path);
+    std::vector<uint32_t> renumbered; // Previous id -> new id (UINT32_MAX: not reused)
+    size_t reused = 0;
+    if (have_previous) {
+        renumbered.assign(previous.file_count(), UINT32_MAX);
+        for (size_t id = 0; id < items.size(); ++id) {
+            Item& item = items[id];
+            size_t old_id = previous.find(item.relative);
+            if (old_id != std::string_view::npos && item.size != kNotIndexed && previous.up_to_date(old_id, item.size, item.mtime)) {
+                item.previous = old_id;
+                renumbered[old_id] = static_cast<uint32_t>(id);
+                ++reused;
+            }
+        }
+    }
+
+    // 3. The new and changed files are read on the -j threads. Postings are collected as
+    // (trigram << 32 | file id) keys, so one sort groups them by trigram in file order.
+    unsigned thread_count = std::max(1u, std::min<unsigned>(search_thread_count(settings), static_cast<unsigned>(std::max<size_t>(items.size(), 1))));
+    std::vector<std::vector<uint64_t>> keys(thread_count);
+    std::atomic<size_t> next_item{0};
+    std::mutex error_mutex;
+    auto index_files = [&](unsigned self) {
+        std::vector<uint64_t> seen(size_t(1) << 18); // One bit per trigram value (2^24)
+        std::vector<uint32_t> found;
+        MappedFile input;
+        std::string decoded;
+        for (size_t id; (id = next_item.fetch_add(1)) < items.size();) {
+            Item& item = items[id];
+            if (item.previous != std::string_view::npos || item.size == kNotIndexed) continue;
+            if (!input.open(item.path)) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                std::cerr << "scanr: Cannot open file '" << item.path << "'" << std::endl;
+                item.size = kNotIndexed; // Searched like a new file until it can be indexed
+                continue;
+            }
+            uint32_t value = 0;
+            size_t run = 0; // Bytes since the last line break (a trigram never spans lines)
+            auto scan = [&](const unsigned char* data, size_t size) {
+                for (size_t i = 0; i < size; ++i) {
+                    unsigned char c = data[i];
+                    if (c == '\n') {
+                        run = 0;
+                        continue;
+                    }
+                    value = ((value << 8) | fold_trigram_byte(c)) & 0xFFFFFF;
+                    if (++run < 3) continue;
+                    uint64_t& word = seen[value >> 6];
+                    uint64_t bit = uint64_t(1) << (value & 63);
+                    if (word & bit) continue;
+                    word |= bit;
+                    found.push_back(value);
+                }
+            };
+            Compression format = settings.decompress ? Decompressor::detect(input.data(), input.size()) : Compression::kNone;
+            if (format != Compression::kNone) {
+                // Compressed files are searched as their text, so their text is indexed. It is
+                // scanned as it is decoded, unless it turns out to be UTF-16.
+                Decompressor source(format, input.data(), input.size(), 1);
+                std::vector<char> block(BlockReader::kBlockSize);
+                std::string text;
+                bool utf16 = false;
+                for (size_t got; (got = source.read(block.data(), block.size())) > 0;) {
+                    if (source.size() == got) {
+                        TextEncoding encoding;
+                        byte_order_mark(block.data(), got, encoding);
+                        utf16 = encoding != TextEncoding::kUtf8;
+                    }
+                    if (utf16) {
+                        text.append(block.data(), got);
+                    } else {
+                        scan(reinterpret_cast<const unsigned char*>(block.data()), got);
+                    }
+                }
+                if (utf16) {
+                    TextEncoding encoding;
+                    size_t bom = byte_order_mark(text.data(), text.size(), encoding);
+                    utf16_to_utf8(text.data() + bom, text.size() - bom, encoding, decoded);
+                    scan(reinterpret_cast<const unsigned char*>(decoded.data()), decoded.size());
+                }
+            } else {
+                TextEncoding encoding;
+                size_t bom = byte_order_mark(input.data(), input.size(), encoding);
+                if (encoding != TextEncoding::kUtf8) {
+                    // UTF-16 files are searched as their UTF-8 decoding, which is what is indexed
+                    utf16_to_utf8(input.data() + bom, input.size() - bom, encoding, decoded);
+                    scan(reinterpret_cast<const unsigned char*>(decoded.data()), decoded.size());
+                } else {
+                    scan(reinterpret_cast<const unsigned char*>(input.data()), input.size());
+                }
+            }
+            input.close();
+            for (uint32_t t : found) {
+                keys[self].push_back((static_cast<uint64_t>(t) << 32) | id);
+                seen[t >> 6] = 0;
+            }
+            found.clear();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < thread_count; ++i) threads.emplace_back(index_files, i);
+    index_files(0);
+    for (auto& thread : threads) thread.join();
+
+    std::vector<uint64_t> all = std::move(keys[0]);
+    for (unsigned i = 1; i < thread_count; ++i) {
+        all.insert(all.end(), keys[i].begin(), keys[i].end());
+        std::vector<uint64_t>().swap(keys[i]);
+    }
+    std::sort(all.begin(), all.end());
+
+    // 4. Assemble the sections. Renumbering keeps the path order, so every posting list of
+    // the previous index is still sorted and merges with the new files' ids trigram by trigram.
+    std::vector<FileEntry> files(items.size());
+    std::string paths;
+    for (size_t id = 0; id < items.size(); ++id) {
+        files[id] = {paths.size(), items[id].relative.size(), items[id].size, items[id].mtime};
+        paths += items[id].relative;
+    }
+    std::vector<TrigramEntry> trigrams;
+    std::string postings;
+    std::vector<uint32_t> old_ids, new_ids, ids;
+    size_t old_count = reused > 0 ? static_cast<size_t>(previous.header_.trigram_count) : 0;
+    size_t next_old = 0, next_new = 0;
+    while (next_old < old_count || next_new < all.size()) {
+        uint32_t old_value = next_old < old_count ? previous.trigram(next_old).trigram : UINT32_MAX;
+        uint32_t new_value = next_new < all.size() ? static_cast<uint32_t>(all[next_new] >> 32) : UINT32_MAX;
+        uint32_t value = std::min(old_value, new_value);
+        old_ids.clear();
+        if (old_value == value) {
+            previous.decode(previous.trigram(next_old++), ids);
+            for (uint32_t old_id : ids) {
+                if (renumbered[old_id] != UINT32_MAX) old_ids.push_back(renumbered[old_id]);
+            }
+        }
+        new_ids.clear();
+        for (; next_new < all.size() && static_cast<uint32_t>(all[next_new] >> 32) == value; ++next_new) {
+            new_ids.push_back(static_cast<uint32_t>(all[next_new]));
+        }
+        ids.clear();
+        std::merge(old_ids.begin(), old_ids.end(), new_ids.begin(), new_ids.end(), std::back_inserter(ids));
+        if (ids.empty()) continue; // Only in files that are gone or changed
+
+        trigrams.push_back({value, static_cast<uint32_t>(ids.size()), postings.size()});
+        uint32_t last = 0;
+        for (uint32_t id : ids) {
+            uint32_t delta = id - last;
+            last = id;
+            do {
+                unsigned char byte = delta & 0x7F;
+                delta >>= 7;
+                postings.push_back(static_cast<char>(delta ? byte | 0x80 : byte));
+            } while (delta);
+        }
+    }
+    previous.close(); // Windows cannot replace a file that is still mapped
+    postings.resize((postings.size() + 7) & ~size_t(7)); // Keep the paths 8-byte aligned
+
+    // 5. Write everything to a temporary file, then move it in place
+    Header header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.byte_order = kByteOrder;
+    header.file_count = files.size();
+    header.trigram_count = trigrams.size();
+    header.files_offset = sizeof(Header);
+    header.trigrams_offset = header.files_offset + files.size() * sizeof(FileEntry);
+    header.postings_offset = header.trigrams_offset + trigrams.size() * sizeof(TrigramEntry);
+    header.paths_offset = header.postings_offset + postings.size();
+    header.total_size = header.paths_offset + paths.size();
+
+    {
+        std::ofstream output(temporary_path, std::ios::binary | std::ios::trunc);
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        output.write(reinterpret_cast<const char*>(files.data()), static_cast<std::streamsize>(files.size() * sizeof(FileEntry)));
+        output.write(reinterpret_cast<const char*>(trigrams.data()), static_cast<std::streamsize>(trigrams.size() * sizeof(TrigramEntry)));
+        output.write(postings.data(), static_cast<std::streamsize>(postings.size()));
+        output.write(paths.data(), static_cast<std::streamsize>(paths.size()));
+        output.close();
+        if (!output) {
+            std::cerr << "scanr: Cannot write index '" << temporary_path << "'" << std::endl;
+            std::remove(temporary_path.c_str());
+            return false;
+        }
+    }
+#ifdef _WIN32
+    bool moved = MoveFileExA(temporary_path.c_str(), index_path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool moved = std::rename(temporary_path.c_str(), index_path.c_str()) == 0;
+#endif
+    if (!moved) {
+        std::cerr << "scanr: Cannot write index '" << index_path << "'" << std::endl;
+        std::remove(temporary_path.c_str());
+        return false;
+    }
+
+    if (settings.show_stats) {
+        std::cerr << "scanr: indexed " << files.size() << " file(s) under '" << (root.empty() ? "." : root) << "' ("
+                  << (files.size() - reused) << " read, " << reused << " unchanged), " << trigrams.size() << " trigram(s), "
+                  << header.total_size << " bytes" << std::endl;
+    }
+    return true;
+}
+
+// --- Asynchronous Reads ---
+
+bool AsyncReader::next(File& file, bool in_order) {
+    if (requests_.empty()) return false;
+    auto ready = [&] {
+        if (in_order) return requests_.front()->done ? requests_.begin() : requests_.end();
+        return std::find_if(requests_.begin(), requests_.end(), [](const std::unique_ptr<Request>& request) { return request->done; });
+    };
+    // A search that finds its reads complete already asks for fewer; one that has to wait
+    // for them asks for more
+    if (!reap(false)) return false;
+    auto found = ready();
+    if (found == requests_.end()) {
+        depth_ = std::min(depth_ + 1, kMaxDepth);
+        do {
+            if (!reap(true)) return false;
+        } while ((found = ready()) == requests_.end());
+    } else if (completed_ > 1 && depth_ > kMinDepth) {
+        --depth_;
+    }
+    file = std::move((*found)->file);
+    requests_.erase(found);
+    --completed_;
+    return true;
+}
+
+void AsyncReader::complete(Request* request, bool read) {
+#ifdef _WIN32
+    if (request->handle != INVALID_HANDLE_VALUE) CloseHandle(request->handle);
+    request->handle = INVALID_HANDLE_VALUE;
+#else
+    if (request->fd >= 0) ::close(request->fd);
+    request->fd = -1;
+#endif
+    request->file.read = read;
+    if (read) {
+        request->file.contents.resize(request->filled); // Shorter if the file shrank meanwhile
+    } else {
+        std::vector<char>().swap(request->file.contents);
+    }
+    request->done = true;
+    ++completed_;
+}
+
+#if defined(SCANR_IO_URING)
+
+bool AsyncReader::available() {
+    static const bool usable = [] {
+        io_uring_params params{};
+        int ring = static_cast<int>(syscall(SYS_io_uring_setup, 1, &params));
+        if (ring < 0) return false;
+        ::close(ring);
+        return true;
+    }();
+    return usable;
+}
+
+bool AsyncReader::open() {
+    io_uring_params params{};
+    ring_ = static_cast<int>(syscall(SYS_io_uring_setup, static_cast<unsigned>(kMaxDepth), &params));
+    if (ring_ < 0) return false;
+    sq_map_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map) sq_map_size_ = cq_map_size_ = std::max(sq_map_size_, cq_map_size_);
+    sq_map_ = mmap(nullptr, sq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQ_RING);
+    cq_map_ = single_map ? sq_map_ : mmap(nullptr, cq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQES);
+    if (sq_map_ == MAP_FAILED || cq_map_ == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size_);
+        if (cq_map_ == MAP_FAILED || cq_map_ == sq_map_) cq_map_ = nullptr;
+        if (sq_map_ == MAP_FAILED) sq_map_ = nullptr;
+        close();
+        return false;
+    }
+    char* sq = static_cast<char*>(sq_map_);
+    char* cq = static_cast<char*>(cq_map_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+    return true;
+}
+
+void AsyncReader::close() {
+    while (completed_ < requests_.size() && reap(true)) {} // The kernel may still write into the buffers
+    requests_.clear();
+    completed_ = 0;
+    if (sqes_ != nullptr) munmap(sqes_, sqes_size_);
+    if (cq_map_ != nullptr && cq_map_ != sq_map_) munmap(cq_map_, cq_map_size_);
+    if (sq_map_ != nullptr) munmap(sq_map_, sq_map_size_);
+    if (ring_ >= 0) ::close(ring_);
+    sqes_ = nullptr;
+    sq_map_ = cq_map_ = nullptr;
+    ring_ = -1;
+}
+
+// The next free submission entry. Each request has at most one entry in flight and the
+// rings hold kMaxDepth, so there always is one.
+io_uring_sqe* AsyncReader::next_sqe() {
+    unsigned tail = *sq_tail_; // Only this thread writes the tail
+    unsigned index = tail & *sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit_;
+    return sqe;
+}
+
+void AsyncReader::add(const std::string& path, void* tag) {
+    requests_.push_back(std::make_unique<Request>());
+    Request* request = requests_.back().get();
+    request->file.path = path;
+    request->file.tag = tag;
+    if (unsupported_ || failed_) {
+        complete(request, false);
+        return;
+    }
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uint64_t>(request->file.path.c_str());
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = reinterpret_cast<uint64_t>(request);
+}
+
+void AsyncReader::submit_read(Request* request) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = request->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(request->file.contents.data() + request->filled);
+    sqe->len = static_cast<unsigned>(request->file.contents.size() - request->filled);
+    sqe->off = request->filled;
+    sqe->user_data = reinterpret_cast<uint64_t>(request);
+}
+
+// One system call submits what add() and earlier completions queued and collects what has
+// completed. An open is checked with fstat (a regular file small enough to read whole) and
+// followed by a read of the whole file, and a short read by a read of the rest.
+//
+// If the system call itself fails, the ring is given up: every file not done yet comes back
+// unread and takes the usual path, and so do the files added later. What the kernel was
+// given may still complete, so those requests (their buffers and descriptors) are kept
+// alive to the end of the process rather than freed under it.
+bool AsyncReader::reap(bool wait) {
+    if (failed_) return true;
+    if (to_submit_ > 0 || wait) {
+        int entered = static_cast<int>(syscall(SYS_io_uring_enter, ring_, to_submit_, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+        if (entered < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) return true; // Try again
+            std::cerr << "scanr: io_uring failed: " << std::strerror(errno) << "; reading files the usual way" << std::endl;
+            failed_ = true;
+            to_submit_ = 0;
+            for (std::unique_ptr<Request>& request : requests_) {
+                if (request->done) continue;
+                auto unread = std::make_unique<Request>();
+                unread->file.path = request->file.path;
+                unread->file.tag = request->file.tag;
+                request.release(); // Deliberately leaked: the kernel may still use it
+                request = std::move(unread);
+                complete(request.get(), false);
+            }
+            return true;
+        }
+        to_submit_ -= std::min(to_submit_, static_cast<unsigned>(entered));
+    }
+
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+        Request* request = reinterpret_cast<Request*>(cqe.user_data);
+        int result = cqe.res;
+        if (result == -EINVAL || result == -EOPNOTSUPP) unsupported_ = true;
+        if (request->fd < 0) { // Opened
+            if (result >= 0) request->fd = result;
+            struct stat st;
+            if (result < 0 || fstat(request->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+                static_cast<unsigned long long>(st.st_size) > kMaxFileSize) {
+                complete(request, false);
+                continue;
+            }
+            request->file.contents.resize(static_cast<size_t>(st.st_size));
+            submit_read(request);
+        } else if (result < 0) {
+            complete(request, false);
+        } else {
+            request->filled += static_cast<size_t>(result);
+            if (result > 0 && request->filled < request->file.contents.size()) {
+                submit_read(request); // A short read: the rest follows
+            } else {
+                complete(request, true);
+            }
+        }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return true;
+}
+
+#elif defined(_WIN32)
+
+bool AsyncReader::available() {
+    return true;
+}
+
+bool AsyncReader::open() {
+    port_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+    return port_ != nullptr;
+}
+
+void AsyncReader::close() {
+    while (completed_ < requests_.size() && reap(true)) {} // The system may still write into the buffers
+    requests_.clear();
+    completed_ = 0;
+    if (port_ != nullptr) CloseHandle(port_);
+    port_ = nullptr;
+}
+
+// Issue the read of whatever the file still lacks; false if it failed right away
+bool AsyncReader::start_read(Request* request) {
+    size_t offset = request->filled;
+    request->overlapped = Request::Overlapped();
+    request->overlapped.request = request;
+    request->overlapped.Offset = static_cast<DWORD>(offset);
+    request->overlapped.OffsetHigh = static_cast<DWORD>(static_cast<unsigned long long>(offset) >> 32);
+    DWORD size = static_cast<DWORD>(request->file.contents.size() - offset);
+    if (ReadFile(request->handle, request->file.contents.data() + offset, size, nullptr, &request->overlapped)) return true;
+    return GetLastError() == ERROR_IO_PENDING; // Either way the completion arrives through the port
+}
+
+void AsyncReader::add(const std::string& path, void* tag) {
+    requests_.push_back(std::make_unique<Request>());
+    Request* request = requests_.back().get();
+    request->file.path = path;
+    request->file.tag = tag;
+    request->handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                  OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    LARGE_INTEGER size;
+    if (request->handle == INVALID_HANDLE_VALUE || GetFileType(request->handle) != FILE_TYPE_DISK || !GetFileSizeEx(request->handle, &size) ||
+        size.QuadPart == 0 || static_cast<unsigned long long>(size.QuadPart) > kMaxFileSize ||
+        CreateIoCompletionPort(request->handle, port_, 0, 0) == nullptr) {
+        complete(request, false);
+        return;
+    }
+    request->file.contents.resize(static_cast<size_t>(size.QuadPart));
+    if (!start_read(request)) complete(request, false);
+}
+
+bool AsyncReader::reap(bool wait) {
+    for (;;) {
+        DWORD transferred = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED* overlapped = nullptr;
+        BOOL ok = GetQueuedCompletionStatus(port_, &transferred, &key, &overlapped, wait ? INFINITE : 0);
+        if (overlapped == nullptr) return wait ? GetLastError() == WAIT_TIMEOUT : true; // Nothing (more) completed
+        wait = false; // One completion was waited for; take the rest that are there
+        Request* request = static_cast<Request::Overlapped*>(overlapped)->request;
+        if (!ok && GetLastError() != ERROR_HANDLE_EOF) {
+            complete(request, false);
+            continue;
+        }
+        request->filled += transferred;
+        if (!ok || transferred == 0 || request->filled >= request->file.contents.size()) {
+            complete(request, true);
+        } else if (!start_read(request)) { // A short read: the rest follows
+            complete(request, false);
+        }
+    }
+}
+
+#else
+
+// No asynchronous backend: every file comes back unread, for the usual path
+bool AsyncReader::available() {
+    return false;
+}
+
+bool AsyncReader::open() {
+    return false;
+}
+
+void AsyncReader::close() {
+    requests_.clear();
+    completed_ = 0;
+}
+
+void AsyncReader::add(const std::string& path, void* tag) {
+    requests_.push_back(std::make_unique<Request>());
+    requests_.back()->file.path = path;
+    requests_.back()->file.tag = tag;
+    complete(requests_.back().get(), false);
+}
+
+bool AsyncReader::reap(bool) {
+    return true; // Everything completed in add()
+}
+
+#endif
+
+// --- Parallel Search ---
+
+SearchPool::SearchPool(const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, unsigned thread_count)
+    : settings_(settings), matcher_(matcher), show_filename_prefix_(show_filename_prefix), ordered_(!settings.unordered),
+      line_buffered_(settings.line_buffered || is_interactive_output()), max_pending_(4 * static_cast<size_t>(thread_count) + 16) {
+    // --no-mmap streams as before, and a --serve process has its files in its cache
+    read_ahead_ = settings.async_io && settings.use_mmap && settings.file_cache == nullptr && AsyncReader::available();
+    for (unsigned i = 0; i < thread_count; ++i) threads_.emplace_back(&SearchPool::run, this);
+}
+
+// Called with mutex_ held
+SearchPool::Task* SearchPool::new_task() {
+    tasks_.push_back(std::make_unique<Task>());
+    Task* task = tasks_.back().get();
+    task->position = std::prev(tasks_.end());
+    return task;
+}
+
+void SearchPool::add(const std::string& filename) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    space_cv_.wait(lock, [this] { return tasks_.size() < max_pending_; });
+    Task* task = new_task();
+    task->filename = filename;
+    queue_.push_back(task);
+    work_cv_.notify_one();
+}
+
+void SearchPool::add_error(const std::string& message) {
+    Task* task;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_cv_.wait(lock, [this] { return tasks_.size() < max_pending_; });
+        task = new_task();
+        task->errors = message + "\n";
+    }
+    complete(task); // Nothing to search: it is written as soon as its turn comes
+}
+
+void SearchPool::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closing_) return;
+        closing_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& thread : threads_) thread.join();
+    std::fflush(stdout);
+}
+
+void SearchPool::run() {
+    MatchScratch scratch; // Per-thread matching state
+    scratch.collect_stats = settings_.show_stats;
+    AsyncReader reader;
+    bool read_ahead = read_ahead_ && reader.open();
+    for (;;) {
+        Task* task = nullptr;
+        AsyncReader::File file;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!read_ahead || reader.in_flight() == 0) {
+                work_cv_.wait(lock, [this] { return !queue_.empty() || closing_; });
+                if (queue_.empty()) break;
+            }
+            if (!read_ahead) {
+                task = queue_.front();
+                queue_.pop_front();
+            } else {
+                // Take what keeps this worker's reads in flight; files are searched as they arrive
+                for (size_t wanted = reader.wanted(); wanted > 0 && !queue_.empty(); --wanted) {
+                    reader.add(queue_.front()->filename, queue_.front());
+                    queue_.pop_front();
+                }
+            }
+        }
+        if (read_ahead) {
+            reader.next(file, false);
+            task = static_cast<Task*>(file.tag);
+        }
+        if (quiet_match_found) { // -q has its answer: the files still queued are not searched
+            complete(task);
+            continue;
+        }
+        OutputBuffer out([this, task](std::string_view errors, std::string_view output) { return spill(task, errors, output); });
+        out.set_line_buffered(line_buffered_);
+        if (file.read) {
+            if (scratch.collect_stats) {
+                ++scratch.stats.read_ahead_files;
+                scratch.stats.read_ahead_bytes += file.contents.size();
+            }
+            search_buffer(file.contents.data(), file.contents.size(), task->filename, settings_, matcher_, show_filename_prefix_, out, scratch);
+        } else {
+            search_file(task->filename, settings_, matcher_, show_filename_prefix_, out, scratch);
+        }
+        out.flush();
+        out.take(task->errors, task->output);
+        complete(task);
+    }
+    if (scratch.collect_stats) SearchStats::publish(scratch.stats);
+}
+
+// A worker's buffer is full (or, line-buffered, a line is complete): write it out directly
+// if its file may stream now
+bool SearchPool::spill(Task* task, std::string_view errors, std::string_view output) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ordered_) {
+        if (tasks_.front().get() != task) return false; // Not first in line: keep collecting
+    } else {
+        if (streaming_ == nullptr) streaming_ = task;
+        if (streaming_ != task) return false;
+    }
+    write_out(errors, output);
+    if (line_buffered_) std::fflush(stdout);
+    return true;
+}
+
+void SearchPool::complete(Task* task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task->done = true;
+    if (ordered_) {
+        while (!tasks_.empty() && tasks_.front()->done) write_task(tasks_.front().get());
+    } else if (streaming_ != nullptr && streaming_ != task) {
+        finished_.push_back(task); // Another file is streaming; this one follows it
+    } else {
+        write_task(task);
+        streaming_ = nullptr;
+        for (Task* waiting : finished_) write_task(waiting);
+        finished_.clear();
+    }
+    if (line_buffered_) std::fflush(stdout);
+    space_cv_.notify_all();
+}
+
+// Write a finished file and drop it. Called with mutex_ held.
+void SearchPool::write_task(Task* task) {
+    write_out(task->errors, task->output);
+    tasks_.erase(task->position);
+}
+
+void SearchPool::write_out(std::string_view errors, std::string_view output) {
+    if (!errors.empty()) {
+        std::fflush(stdout); // Keep the message in order with the output before it
+        std::fwrite(errors.data(), 1, errors.size(), stderr);
+    }
+    if (!output.empty()) std::fwrite(output.data(), 1, output.size(), stdout);
+}
+
+ChunkedSearch::ChunkedSearch(StreamContext& ctx, const char* data, size_t size, unsigned thread_count)
+    : ctx_(ctx), data_(data), size_(size), thread_count_(thread_count) {
+    // A few chunks per thread, so threads that finish early take over the rest
+    size_t chunk_size = std::max(size / (static_cast<size_t>(thread_count) * 4), kMinChunkSize);
+    for (size_t begin = 0; begin < size;) {
+        size_t end = size;
+        if (size - begin > chunk_size) {
+            const void* newline = std::memchr(data + begin + chunk_size - 1, '\n', size - (begin + chunk_size - 1));
+            if (newline != nullptr) end = static_cast<size_t>(static_cast<const char*>(newline) - data) + 1;
+        }
+        Chunk chunk;
+        chunk.begin = begin;
+        chunk.end = end;
+        chunks_.push_back(std::move(chunk));
+        begin = end;
+    }
+}
+
+void ChunkedSearch::run() {
+    const Settings& settings = ctx_.settings;
+    unsigned threads = static_cast<unsigned>(std::min<size_t>(thread_count_, chunks_.size()));
+
+    // -n: each chunk's first line number is the newlines before it, counted in parallel
+    if (settings.show_line_numbers) {
+        std::atomic<size_t> next{0};
+        auto count_lines = [this, &next] {
+            for (size_t i; (i = next.fetch_add(1)) < chunks_.size();) {
+                chunks_[i].lines_before = count_newlines(data_ + chunks_[i].begin, data_ + chunks_[i].end);
+            }
+        };
+        std::vector<std::thread> counters;
+        for (unsigned i = 0; i < threads; ++i) counters.emplace_back(count_lines);
+        for (auto& thread : counters) thread.join();
+        long long lines = ctx_.line_number;
+        for (Chunk& chunk : chunks_) {
+            long long in_chunk = chunk.lines_before;
+            chunk.lines_before = lines;
+            lines += in_chunk;
+        }
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; ++i) {
+        workers.emplace_back([this] {
+            MatchScratch scratch; // Per-thread matching state
+            scratch.collect_stats = ctx_.scratch.collect_stats;
+            search_chunks(scratch);
+            if (scratch.collect_stats) SearchStats::publish(scratch.stats);
+        });
+    }
+    for (auto& thread : workers) thread.join();
+
+    // Totals as a serial search would leave them; the count does not matter once -l listed
+    for (const Chunk& chunk : chunks_) {
+        ctx_.match_count += chunk.match_count;
+        ctx_.listed = ctx_.listed || chunk.listed;
+    }
+    ctx_.done = ctx_.listed || (ctx_.settings.quiet && quiet_match_found);
+}
+
+// Worker loop: take chunks in order, staying at most two per thread ahead of the output
+void ChunkedSearch::search_chunks(MatchScratch& scratch) {
+    const Settings& settings = ctx_.settings;
+    size_t window = 2 * static_cast<size_t>(thread_count_);
+    for (;;) {
+        size_t index;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            space_cv_.wait(lock, [&] { return next_chunk_ >= chunks_.size() || next_chunk_ < next_write_ + window; });
+            if (next_chunk_ >= chunks_.size()) return;
+            index = next_chunk_++;
+        }
+        Chunk& chunk = chunks_[index];
+
+        OutputBuffer out([this, index](std::string_view, std::string_view output) { return spill(index, output); });
+        out.set_line_buffered(ctx_.out.line_buffered());
+        StreamContext ctx(ctx_.filename, settings, ctx_.matcher, ctx_.show_filename_prefix, out, scratch);
+        ctx.cancel = &cancel_;
+        ctx.set_buffer(ctx_.buffer, ctx_.buffer_offset);
+        ctx.line_number = settings.show_line_numbers ? chunk.lines_before : kUnnumberedBase;
+        if (index > 0 && (settings.lines_before > 0 || settings.lines_after > 0)) {
+            chunk.leading_gap = !resume_context(ctx, chunk) && !settings.json; // JSON events have no "--" separators
+        }
+        search_lines(ctx, data_ + chunk.begin, chunk.end - chunk.begin);
+        out.flush();
+        std::string errors; // Searching memory reports none
+        out.take(errors, chunk.output);
+        chunk.match_count = ctx.match_count;
+        chunk.listed = ctx.listed;
+        if (ctx.done) cancel_ = true; // -l and -q need no more input
+        complete(index);
+    }
+}
+
+// Rebuild the context state a serial search would carry into the chunk from the lines just
+// before it: the last -B lines as leading context, and the last output line among the last
+// -A + -B + 1 lines, for trailing context and overlaps. An output line further back leaves
+// no state behind, only a gap before the chunk's first output. Returns whether one was
+// found; if not, a "--" is due before the chunk's first output after any earlier output,
+// which only the writer knows about.
+bool ChunkedSearch::resume_context(StreamContext& ctx, const Chunk& chunk) {
+    const Settings& settings = ctx.settings;
+    size_t window = static_cast<size_t>(settings.lines_before) + static_cast<size_t>(settings.lines_after) + 1;
+
+    // The lines before the chunk, newest first, as {start, end} without the newline
+    std::vector<std::pair<size_t, size_t>> lines;
+    size_t end = chunk.begin - 1; // Chunks start after a newline
+    while (lines.size() < window) {
+        size_t start = end;
+        while (start > 0 && data_[start - 1] != '\n') --start;
+        lines.push_back({start, end});
+        if (start == 0) break;
+        end = start - 1;
+    }
+
+    long long last_line = ctx.line_number;
+    for (size_t i = std::min(lines.size(), static_cast<size_t>(settings.lines_before)); i-- > 0;) {
+        std::string_view line = make_line(data_ + lines[i].first, data_ + lines[i].second);
+        ctx.before_lines.push(last_line - static_cast<long long>(i), ctx.offset_of(line), line);
+    }
+
+    for (size_t i = 0; i < lines.size(); ++i) {
+        std::string_view line = make_line(data_ + lines[i].first, data_ + lines[i].second);
+        if (ctx.matcher.matches(line, settings, ctx.scratch.positions, ctx.scratch) == settings.invert_match) continue;
+        long long output_line = last_line - static_cast<long long>(i);
+        ctx.last_printed_line = std::min(output_line + settings.lines_after, last_line);
+        ctx.after_lines_to_print = static_cast<int>(std::max<long long>(0, settings.lines_after - static_cast<long long>(i)));
+        return true;
+    }
+    return false;
+}
+
+// A worker's buffer is full (or, line-buffered, a line is complete): write it out directly
+// if its chunk is first in line
+bool ChunkedSearch::spill(size_t index, std::string_view output) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index != next_write_) return false;
+    write_chunk(chunks_[index], output);
+    return true;
+}
+
+void ChunkedSearch::complete(size_t index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    chunks_[index].done = true;
+    while (next_write_ < chunks_.size() && chunks_[next_write_].done) {
+        Chunk& chunk = chunks_[next_write_++];
+        write_chunk(chunk, chunk.output);
+        std::string().swap(chunk.output);
+        listed_ = listed_ || chunk.listed;
+    }
+    space_cv_.notify_all();
+}
+
+// Write part of a chunk's output to the file's buffer. Called with mutex_ held.
+void ChunkedSearch::write_chunk(Chunk& chunk, std::string_view output) {
+    if (output.empty() || listed_) return; // After -l listed the file, no more output is due
+    if (!chunk.started && chunk.leading_gap && wrote_) {
+        ctx_.out.write("--");
+        ctx_.out.end_line();
+    }
+    chunk.started = true;
+    wrote_ = true;
+    ctx_.out.write(output);
+    if (ctx_.out.line_buffered()) ctx_.out.flush();
+}
+
+// Worker threads for -j: the number given, or one per hardware thread
+unsigned search_thread_count(const Settings& settings) {
+    if (settings.jobs > 0) return static_cast<unsigned>(settings.jobs);
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// --- Follow Mode ---
+
+ChangeWatcher::ChangeWatcher() {
+#ifdef __linux__
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    events_.resize(64 * 1024);
+#elif defined(_WIN32)
+    port_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+#endif
+}
+
+ChangeWatcher::~ChangeWatcher() {
+#ifdef __linux__
+    if (fd_ >= 0) ::close(fd_);
+#elif defined(_WIN32)
+    for (auto& watch : watches_) {
+        // The pending read writes into the watch's buffer until it is cancelled
+        DWORD bytes;
+        if (CancelIoEx(watch->handle, &watch->overlapped)) GetOverlappedResult(watch->handle, &watch->overlapped, &bytes, TRUE);
+        CloseHandle(watch->handle);
+    }
+    if (port_ != nullptr) CloseHandle(port_);
+#endif
+}
+
+void ChangeWatcher::watch(const std::string& directory) {
+    if (std::find(directories_.begin(), directories_.end(), directory) != directories_.end()) return;
+    directories_.push_back(directory);
+    std::string path = directory.empty() ? std::string(".") : directory;
+#ifdef __linux__
+    if (fd_ < 0) return;
+    // A directory's watch reports the changes of the files in it, including files that
+    // replace a followed one (created, or renamed into the directory)
+    int watch = inotify_add_watch(fd_, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO);
+    if (watch >= 0) watches_[watch] = directories_.size() - 1;
+#elif defined(_WIN32)
+    if (port_ == nullptr) return;
+    auto watch = std::make_unique<Watch>();
+    watch->directory = directories_.size() - 1;
+    watch->handle = CreateFileA(path.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+    if (watch->handle == INVALID_HANDLE_VALUE) return;
+    if (CreateIoCompletionPort(watch->handle, port_, reinterpret_cast<ULONG_PTR>(watch.get()), 0) == nullptr || !start(*watch)) {
+        CloseHandle(watch->handle);
+        return;
+    }
+    watches_.push_back(std::move(watch));
+#endif
+}
+
+#ifdef _WIN32
+bool ChangeWatcher::start(Watch& watch) {
+    return ReadDirectoryChangesW(watch.handle, watch.buffer.data(), static_cast<DWORD>(watch.buffer.size() * sizeof(DWORD)), FALSE,
+                                 FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                 nullptr, &watch.overlapped, nullptr) != 0;
+}
+#endif
+
+bool ChangeWatcher::wait(int timeout_ms, std::vector<std::string>& changed) {
+#ifdef __linux__
+    if (fd_ >= 0 && !watches_.empty()) {
+        pollfd ready = {fd_, POLLIN, 0};
+        if (poll(&ready, 1, timeout_ms) <= 0) return false;
+        bool known = true;
+        for (;;) {
+            ssize_t got = ::read(fd_, events_.data(), events_.size());
+            if (got <= 0) break; // EAGAIN: every event has been read
+            for (size_t pos = 0; pos < static_cast<size_t>(got);) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(events_.data() + pos);
+                pos += sizeof(inotify_event) + event->len;
+                if ((event->mask & IN_Q_OVERFLOW) != 0) known = false; // Events were dropped
+                auto watch = watches_.find(event->wd);
+                if (watch == watches_.end() || event->len == 0) continue;
+                changed.push_back(directories_[watch->second] + event->name);
+            }
+        }
+        return known;
+    }
+#elif defined(_WIN32)
+    if (port_ != nullptr && !watches_.empty()) {
+        DWORD bytes;
+        ULONG_PTR key;
+        OVERLAPPED* overlapped;
+        if (!GetQueuedCompletionStatus(port_, &bytes, &key, &overlapped, static_cast<DWORD>(timeout_ms))) return false;
+        bool known = true;
+        do { // This completion, and any other one already queued
+            Watch& watch = *reinterpret_cast<Watch*>(key);
+            if (bytes == 0) known = false; // The buffer overflowed: the changes are lost
+            const char* record = reinterpret_cast<const char*>(watch.buffer.data());
+            while (bytes > 0) {
+                const FILE_NOTIFY_INFORMATION* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(record);
+                int wide = static_cast<int>(info->FileNameLength / sizeof(WCHAR));
+                int size = WideCharToMultiByte(CP_ACP, 0, info->FileName, wide, nullptr, 0, nullptr, nullptr);
+                std::string name(static_cast<size_t>(size), '\0');
+                WideCharToMultiByte(CP_ACP, 0, info->FileName, wide, &name[0], size, nullptr, nullptr);
+                changed.push_back(directories_[watch.directory] + name);
+                if (info->NextEntryOffset == 0) break;
+                record += info->NextEntryOffset;
+            }
+            if (!start(watch)) known = false;
+        } while (GetQueuedCompletionStatus(port_, &bytes, &key, &overlapped, 0));
+        return known;
+    }
+#endif
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms)); // Nothing to wait on: poll
+    return false;
+}
+
+FileFollower::FileFollower(const Settings& settings, const CompiledMatcher& matcher, const FileFilter& filter, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch)
+    : settings_(settings), matcher_(matcher), filter_(filter), show_filename_prefix_(show_filename_prefix), out_(out), scratch_(scratch) {}
+
+// The directory part of 'path', as the prefix of the paths of its entries
+std::string FileFollower::directory_of(const std::string& path) {
+#ifdef _WIN32
+    size_t separator = path.find_last_of("\\/:");
+#else
+    size_t separator = path.find_last_of('/');
+#endif
+    return separator == std::string::npos ? std::string() : path.substr(0, separator + 1);
+}
+
+FileFollower::Followed& FileFollower::follow(const std::string& path) {
+    files_.push_back(std::make_unique<Followed>());
+    Followed& file = *files_.back();
+    file.path = path;
+    by_path_[path] = &file;
+    watcher_.watch(directory_of(path));
+    return file;
+}
+
+void FileFollower::add_file(const std::string& path) {
+    if (by_path_.count(path) != 0) return; // Named twice
+    // --include and --exclude also apply to the files named on the command line
+    if (filter_.filters_files() && !filter_.file_allowed(std::string_view(path).substr(directory_of(path).size()), filter_scratch_)) return;
+    Followed& file = follow(path);
+    check(file);
+    if (file.missing && !settings_.list_filenames) {
+        out_.error("scanr: Cannot open file '" + path + "'"); // Searched once it appears
+    }
+}
+
+void FileFollower::add_tree(const std::string& root) {
+#ifdef _WIN32
+    std::string prefix = root.empty() || directory_of(root) == root ? root : root + "\\";
+#else
+    std::string prefix = root.empty() || directory_of(root) == root ? root : root + "/";
+#endif
+    tree_directories_.push_back(prefix);
+    watcher_.watch(prefix);
+    DirectoryWalker walker(settings_.follow_symlinks, walker_thread_count(), filter_);
+    walker.start(root);
+    std::string path;
+    bool unreadable = false;
+    while (walker.next(path, unreadable)) {
+        if (unreadable) {
+            out_.error("scanr: Cannot read directory '" + path + "'");
+            continue;
+        }
+        if (by_path_.count(path) != 0) continue;
+        std::string directory = directory_of(path);
+        if (std::find(tree_directories_.begin(), tree_directories_.end(), directory) == tree_directories_.end()) {
+            tree_directories_.push_back(directory);
+        }
+        check(follow(path));
+    }
+}
+
+// Search what was appended to 'file' since its last check, through its last complete line
+void FileFollower::check(Followed& file) {
+    if (file.finished) return;
+
+    // Opened by name every time: after a rotation, the name leads to the new file
+    unsigned long long size = 0;
+    long long mtime = 0;
+    Identity identity;
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(file.path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                nullptr, OPEN_EXISTING, 0, nullptr);
+    bool opened = handle != INVALID_HANDLE_VALUE;
+    BY_HANDLE_FILE_INFORMATION info;
+    bool regular = opened && GetFileType(handle) == FILE_TYPE_DISK && GetFileInformationByHandle(handle, &info) &&
+                   (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0;
+    if (regular) {
+        size = (static_cast<unsigned long long>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+        mtime = static_cast<long long>((static_cast<unsigned long long>(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime);
+        identity = {info.dwVolumeSerialNumber, (static_cast<unsigned long long>(info.nFileIndexHigh) << 32) | info.nFileIndexLow};
+    }
+    auto read_at = [&](unsigned long long offset, char* buffer, size_t count) -> size_t {
+        OVERLAPPED position = {};
+        position.Offset = static_cast<DWORD>(offset);
+        position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD read = 0;
+        if (!ReadFile(handle, buffer, static_cast<DWORD>(std::min<size_t>(count, 1u << 30)), &read, &position)) return 0;
+        return read;
+    };
+    auto close_file = [&] {
+        if (opened) CloseHandle(handle);
+    };
+#else
+    int fd = ::open(file.path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK); // A FIFO must not block the other files
+    bool opened = fd >= 0;
+    struct stat info;
+    bool regular = opened && fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+    if (regular) {
+        size = static_cast<unsigned long long>(info.st_size);
+#ifdef __APPLE__
+        mtime = static_cast<long long>(info.st_mtimespec.tv_sec) * 1000000000LL + info.st_mtimespec.tv_nsec;
+#else
+        mtime = static_cast<long long>(info.st_mtim.tv_sec) * 1000000000LL + info.st_mtim.tv_nsec;
+#endif
+        identity = {static_cast<unsigned long long>(info.st_dev), static_cast<unsigned long long>(info.st_ino)};
+    }
+    auto read_at = [&](unsigned long long offset, char* buffer, size_t count) -> size_t {
+        for (;;) {
+            ssize_t got = pread(fd, buffer, count, static_cast<off_t>(offset));
+            if (got < 0 && errno == EINTR) continue;
+            return got < 0 ? 0 : static_cast<size_t>(got);
+        }
+    };
+    auto close_file = [&] {
+        if (opened) ::close(fd);
+    };
+#endif
+    file.missing = !opened;
+    if (!opened) return; // Gone (rotated away): searched from its start when it reappears
+    if (!regular) {
+        // Nothing is appended to a pipe or device: it is searched once, as without --follow
+        close_file();
+        file.finished = true;
+        search_file(file.path, settings_, matcher_, show_filename_prefix_, out_, scratch_);
+        return;
+    }
+    file.size = size;
+    file.mtime = mtime;
+
+    if (file.ctx != nullptr && (identity != file.identity || size < file.searched)) {
+        out_.error("scanr: '" + file.path + "' was truncated or replaced; searching it again from the start");
+        file.ctx.reset();
+        file.searched = 0;
+    }
+    file.identity = identity;
+    if (file.ctx == nullptr) file.ctx = std::make_unique<StreamContext>(file.path, settings_, matcher_, show_filename_prefix_, out_, scratch_);
+
+    // Read block by block; what follows the last newline is read again next time
+    if (buffer_.size() < kBlockSize) buffer_.resize(kBlockSize);
+    bool first = file.searched == 0; // Nothing searched yet: the first piece decides how the file is searched
+    size_t filled = 0;
+    while (file.searched + filled < size && !file.ctx->stopped()) {
+        size_t got = read_at(file.searched + filled, buffer_.data() + filled, buffer_.size() - filled);
+        if (got == 0) break;
+        filled += got;
+        size_t end = filled;
+        while (end > 0 && buffer_[end - 1] != '\n') --end;
+        if (end == 0) {
+            if (filled == buffer_.size()) buffer_.resize(buffer_.size() * 2); // A single line is longer than the buffer
+            continue;
+        }
+        if (!search_text(file, end, first)) {
+            // Compressed or UTF-16: searched once, as a whole
+            close_file();
+            file.finished = true;
+            file.ctx.reset();
+            search_file(file.path, settings_, matcher_, show_filename_prefix_, out_, scratch_);
+            return;
+        }
+        first = false;
+        std::memmove(buffer_.data(), buffer_.data() + end, filled - end);
+        filled -= end;
+        file.searched += end;
+    }
+    close_file();
+    if (file.ctx->stopped()) file.finished = true; // -l listed it, -m has its lines, a binary file matched, -q
+}
+
+// Search the complete lines at the start of buffer_, the next 'size' bytes of 'file'. The
+// first piece of a file decides how it is searched, as search_buffer does: false if it is
+// compressed or UTF-16, which cannot be searched piece by piece.
+bool FileFollower::search_text(Followed& file, size_t size, bool first) {
+    StreamContext& ctx = *file.ctx;
+    const char* data = buffer_.data();
+    size_t bom = 0;
+    if (first) {
+        TextEncoding encoding;
+        bom = byte_order_mark(data, size, encoding);
+        if ((settings_.decompress && Decompressor::detect(data, size) != Compression::kNone) || encoding != TextEncoding::kUtf8) return false;
+        if (scratch_.collect_stats) ++scratch_.stats.files;
+        if (settings_.binary_files != BinaryFiles::kText && looks_binary(data + bom, size - bom)) {
+            if (settings_.binary_files == BinaryFiles::kWithoutMatch) {
+                if (scratch_.collect_stats) ++scratch_.stats.binary_skipped;
+                ctx.done = true;
+                return true;
+            }
+            ctx.binary = true;
+        }
+    }
+    ctx.set_buffer(data + bom, file.searched + bom);
+    search_lines(ctx, data + bom, size - bom);
+    ctx.before_lines.hold(); // The next piece reuses the buffer the -B lines point into
+    if (!ctx.done) ctx.count_skipped(data + size);
+    return true;
+}
+
+void FileFollower::run() {
+    std::vector<std::string> changed;
+    auto last_check = std::chrono::steady_clock::now();
+    for (;;) {
+        out_.flush(); // What a round found is printed before waiting for more
+        if (quiet_match_found) return;
+        bool following = !tree_directories_.empty() ||
+                         std::any_of(files_.begin(), files_.end(), [](const std::unique_ptr<Followed>& file) { return !file->finished; });
+        if (!following) return;
+
+        changed.clear();
+        bool known = watcher_.wait(kPollMs, changed);
+        std::sort(changed.begin(), changed.end());
+        changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+        for (const auto& path : changed) {
+            auto found = by_path_.find(path);
+            if (found != by_path_.end()) {
+                check(*found->second);
+                continue;
+            }
+            // A new file in a directory of a followed tree is followed from its start
+            std::string directory = directory_of(path);
+            if (std::find(tree_directories_.begin(), tree_directories_.end(), directory) == tree_directories_.end()) continue;
+            if (is_directory(path)) continue; // New directories are not walked
+            if (filter_.filters_files() && !filter_.file_allowed(std::string_view(path).substr(directory.size()), filter_scratch_)) continue;
+            check(follow(path));
+        }
+
+        // Notifications can be late or lost (Windows reports the growth of a file that is
+        // held open late), so every file whose size or time changed is checked now and then
+        auto now = std::chrono::steady_clock::now();
+        if (!known || now - last_check >= std::chrono::milliseconds(kPollMs)) {
+            last_check = now;
+            for (auto& file : files_) {
+                if (file->finished) continue;
+                unsigned long long size = 0;
+                long long mtime = 0;
+                if (!file_signature(file->path, size, mtime)) {
+                    file->missing = true;
+                    continue;
+                }
+                if (file->missing || size != file->size || mtime != file->mtime) check(*file);
+            }
+        }
+    }
+}
+
+// --- Search Server ---
+
+constexpr char SearchServer::kMagic[8];
+
+#ifdef _WIN32
+// The user 'process' runs as (a TOKEN_USER, holding its SID); empty if it cannot be read
+static std::vector<unsigned char> process_user(HANDLE process) {
+    std::vector<unsigned char> user;
+    HANDLE token;
+    if (!OpenProcessToken(process, TOKEN_QUERY, &token)) return user;
+    DWORD size = 0;
+    GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+    user.resize(size);
+    if (size == 0 || !GetTokenInformation(token, TokenUser, user.data(), size, &size)) user.clear();
+    CloseHandle(token);
+    return user;
+}
+
+static PSID user_sid(std::vector<unsigned char>& user) {
+    return reinterpret_cast<TOKEN_USER*>(user.data())->User.Sid;
+}
+
+// Whether 'process' runs as the user this process runs as
+static bool same_user(HANDLE process) {
+    std::vector<unsigned char> user = process_user(process);
+    std::vector<unsigned char> own = process_user(GetCurrentProcess());
+    return !user.empty() && !own.empty() && EqualSid(user_sid(user), user_sid(own));
+}
+#else
+// Whether 'path' is a directory (not a symbolic link to one) of this user's that nobody else
+// may enter, so nobody else can put a socket there or take the place of this user's. With
+// 'create', it is made first if it is missing.
+static bool private_directory(const std::string& path, bool create) {
+    if (create && mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) return false;
+    struct stat info;
+    return lstat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode) && info.st_uid == geteuid() && (info.st_mode & 0777) == 0700;
+}
+#endif
+
+std::string SearchServer::default_address() {
+#ifdef _WIN32
+    const char* user = std::getenv("USERNAME");
+    return std::string("\\\\.\\pipe\\scanr-") + (user != nullptr ? user : "default");
+#else
+    // $XDG_RUNTIME_DIR is private to the user already; without it, a directory of the user's
+    // own under /tmp, never a socket there next to other users' files
+    const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime != nullptr && *runtime != '\0' && private_directory(runtime, false)) return std::string(runtime) + "/scanr.sock";
+    std::string directory = "/tmp/scanr-" + std::to_string(static_cast<unsigned long long>(geteuid()));
+    if (!private_directory(directory, true)) {
+        std::cerr << "scanr: Cannot use '" << directory << "' for the server's socket: it must be a directory of this user's with mode 0700" << std::endl;
+        return std::string();
+    }
+    return directory + "/scanr.sock";
+#endif
+}
+
+// "--serve" or "--connect" ('option'), alone or with "=ADDRESS". An address is the path of
+// a socket, or on Windows the name of a pipe (\\.\pipe\NAME, or just NAME). Without one,
+// 'address' is the default, or empty if there is no safe place for it.
+bool server_option(const char* arg, const char* option, std::string& address) {
+    size_t length = std::strlen(option);
+    if (std::strncmp(arg, option, length) != 0) return false;
+    if (arg[length] == '\0') {
+        address = SearchServer::default_address();
+        return true;
+    }
+    if (arg[length] != '=' || arg[length + 1] == '\0') return false;
+    address = arg + length + 1;
+#ifdef _WIN32
+    if (address.compare(0, 2, "\\\\") != 0) address = "\\\\.\\pipe\\" + address;
+#endif
+    return true;
+}
+
+// A query is SearchServer::kMagic, then (on Windows) the values of the client's three
+// standard handles as 64-bit numbers, then a count of strings and each string as its
+// length and its bytes: the client's working directory, then its arguments. Elsewhere the
+// client's standard descriptors travel with the magic, as SCM_RIGHTS. The reply is the exit
+// status. Numbers are 32 bits unless stated, in the byte order of the machine (client and
+// server run on the same one).
+static void append_query_strings(std::string& message, const std::vector<std::string>& strings) {
+    auto append_size = [&](size_t size) {
+        uint32_t value = static_cast<uint32_t>(size);
+        message.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    append_size(strings.size());
+    for (const auto& text : strings) {
+        append_size(text.size());
+        message += text;
+    }
+}
+
+template <class Read>
+static bool read_query_strings(Read read, std::vector<std::string>& strings) {
+    static constexpr uint32_t kMaxStrings = 1u << 20;
+    static constexpr uint32_t kMaxString = 1u << 30;
+    uint32_t count;
+    if (!read(&count, sizeof(count)) || count > kMaxStrings) return false;
+    strings.resize(count);
+    for (auto& text : strings) {
+        uint32_t size;
+        if (!read(&size, sizeof(size)) || size > kMaxString) return false;
+        text.resize(size);
+        if (size > 0 && !read(&text[0], size)) return false;
+    }
+    return true;
+}
+
+static std::string current_directory() {
+    std::vector<char> buffer(4096);
+#ifdef _WIN32
+    while (_getcwd(buffer.data(), static_cast<int>(buffer.size())) == nullptr) {
+#else
+    while (getcwd(buffer.data(), buffer.size()) == nullptr) {
+#endif
+        if (errno != ERANGE) return std::string();
+        buffer.resize(buffer.size() * 2);
+    }
+    return buffer.data();
+}
+
+#ifdef _WIN32
+static bool read_pipe(HANDLE pipe, void* data, size_t size) {
+    char* at = static_cast<char*>(data);
+    while (size > 0) {
+        DWORD got = 0;
+        if (!ReadFile(pipe, at, static_cast<DWORD>(std::min<size_t>(size, 1u << 30)), &got, nullptr) || got == 0) return false;
+        at += got;
+        size -= got;
+    }
+    return true;
+}
+
+static bool write_pipe(HANDLE pipe, const void* data, size_t size) {
+    const char* at = static_cast<const char*>(data);
+    while (size > 0) {
+        DWORD written = 0;
+        if (!WriteFile(pipe, at, static_cast<DWORD>(std::min<size_t>(size, 1u << 30)), &written, nullptr) || written == 0) return false;
+        at += written;
+        size -= written;
+    }
+    return true;
+}
+#else
+#ifdef MSG_NOSIGNAL
+static constexpr int kSendFlags = MSG_NOSIGNAL; // A peer that went away is an error, not SIGPIPE
+#else
+static constexpr int kSendFlags = 0;
+#endif
+
+static bool read_socket(int fd, void* data, size_t size) {
+    char* at = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t got = ::read(fd, at, size);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        at += got;
+        size -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+static bool write_socket(int fd, const void* data, size_t size) {
+    const char* at = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = ::send(fd, at, size, kSendFlags);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        at += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+static bool socket_address(const std::string& path, sockaddr_un& address) {
+    std::memset(&address, 0, sizeof(address));
+    if (path.size() >= sizeof(address.sun_path)) return false;
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// Whether the process at the other end of the connection 'fd' runs as this user: a server
+// answers nobody else, and a client hands its streams, directory and arguments to nobody else
+static bool peer_is_this_user(int fd) {
+#ifdef __linux__
+    ucred peer;
+    socklen_t size = sizeof(peer);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &size) == 0 && peer.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == geteuid();
+#endif
+}
+
+static int connect_socket(const std::string& path) {
+    sockaddr_un address;
+    if (!socket_address(path, address)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+bool SearchServer::listen() {
+#ifdef _WIN32
+    // Only this user may open the pipe (its DACL allows nobody else): queries read files with
+    // the server's rights
+    std::vector<unsigned char> user = process_user(GetCurrentProcess());
+    DWORD acl_size = user.empty() ? 0 : static_cast<DWORD>(sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) + GetLengthSid(user_sid(user)));
+    std::vector<unsigned char> acl(acl_size);
+    SECURITY_DESCRIPTOR descriptor;
+    if (user.empty() || !InitializeAcl(reinterpret_cast<ACL*>(acl.data()), acl_size, ACL_REVISION) ||
+        !AddAccessAllowedAce(reinterpret_cast<ACL*>(acl.data()), ACL_REVISION, GENERIC_ALL, user_sid(user)) ||
+        !InitializeSecurityDescriptor(&descriptor, SECURITY_DESCRIPTOR_REVISION) ||
+        !SetSecurityDescriptorDacl(&descriptor, TRUE, reinterpret_cast<ACL*>(acl.data()), FALSE)) {
+        std::cerr << "scanr: Cannot restrict '" << address_ << "' to this user" << std::endl;
+        return false;
+    }
+    SECURITY_ATTRIBUTES attributes = {sizeof(attributes), &descriptor, FALSE};
+    // One instance, connected to one client at a time: the next clients wait for it
+    pipe_ = CreateNamedPipeA(address_.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                             PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, 64 * 1024, 64 * 1024, 0, &attributes);
+    if (pipe_ == INVALID_HANDLE_VALUE) {
+        if (GetLastError() == ERROR_ACCESS_DENIED) {
+            std::cerr << "scanr: A server is already listening on '" << address_ << "'" << std::endl;
+        } else {
+            std::cerr << "scanr: Cannot listen on '" << address_ << "'" << std::endl;
+        }
+        return false;
+    }
+#else
+    sockaddr_un address;
+    if (!socket_address(address_, address)) {
+        std::cerr << "scanr: Socket path too long: '" << address_ << "'" << std::endl;
+        return false;
+    }
+    int running = connect_socket(address_);
+    if (running >= 0) {
+        ::close(running);
+        std::cerr << "scanr: A server is already listening on '" << address_ << "'" << std::endl;
+        return false;
+    }
+    struct stat info;
+    if (lstat(address_.c_str(), &info) == 0) {
+        if (!S_ISSOCK(info.st_mode)) {
+            std::cerr << "scanr: Cannot listen on '" << address_ << "': not a socket" << std::endl;
+            return false;
+        }
+        ::unlink(address_.c_str()); // Left behind by a server that was stopped
+    }
+    socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(077); // Only this user may connect: queries read files with the server's rights
+    bool bound = socket_ >= 0 && bind(socket_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || ::listen(socket_, 64) != 0) {
+        std::cerr << "scanr: Cannot listen on '" << address_ << "'" << std::endl;
+        return false;
+    }
+    signal(SIGPIPE, SIG_IGN); // A client that goes away while its output is written must not stop the server
+#endif
+    return true;
+}
+
+int SearchServer::run() {
+    if (!listen()) return 1;
+    std::cerr << "scanr: Serving searches on '" << address_ << "'" << std::endl;
+
+    // The server's own standard streams, put back after every query
+#ifdef _WIN32
+    int saved[3] = {_dup(0), _dup(1), _dup(2)};
+#else
+    int saved[3] = {dup(0), dup(1), dup(2)};
+#endif
+    std::vector<std::string> request;
+    for (;;) {
+        int streams[3] = {-1, -1, -1}; // The client's, as descriptors of this process
+        bool valid = false;
+#ifdef _WIN32
+        if (!ConnectNamedPipe(pipe_, nullptr) && GetLastError() != ERROR_PIPE_CONNECTED) continue;
+        auto read = [this](void* data, size_t size) { return read_pipe(pipe_, data, size); };
+        char magic[sizeof(kMagic)];
+        uint64_t handles[3];
+        valid = read(magic, sizeof(magic)) && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0 && read(handles, sizeof(handles)) &&
+                read_query_strings(read, request);
+        // The client's handles are duplicated from the client process into this one
+        ULONG client = 0;
+        HANDLE process = valid && GetNamedPipeClientProcessId(pipe_, &client) ? OpenProcess(PROCESS_DUP_HANDLE, FALSE, client) : nullptr;
+        for (int k = 0; k < 3; ++k) {
+            HANDLE local;
+            if (process != nullptr && DuplicateHandle(process, reinterpret_cast<HANDLE>(static_cast<uintptr_t>(handles[k])), GetCurrentProcess(), &local, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+                streams[k] = _open_osfhandle(reinterpret_cast<intptr_t>(local), k == 0 ? _O_RDONLY | _O_BINARY : _O_TEXT);
+                if (streams[k] < 0) CloseHandle(local);
+            }
+            if (streams[k] < 0) streams[k] = _open("NUL", k == 0 ? _O_RDONLY : _O_WRONLY); // The client has no such stream
+        }
+        if (process != nullptr) CloseHandle(process);
+#else
+        int connection = accept(socket_, nullptr, nullptr);
+        if (connection < 0) continue;
+        if (!peer_is_this_user(connection)) {
+            ::close(connection); // Another user: the socket's permissions should have kept it out
+            continue;
+        }
+        // The client's descriptors come with the magic
+        char magic[sizeof(kMagic)];
+        iovec data = {magic, sizeof(magic)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(streams))];
+        msghdr message = {};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t got = recvmsg(connection, &message, MSG_WAITALL);
+        for (cmsghdr* header = got > 0 ? CMSG_FIRSTHDR(&message) : nullptr; header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS && header->cmsg_len == CMSG_LEN(sizeof(streams))) {
+                std::memcpy(streams, CMSG_DATA(header), sizeof(streams));
+            }
+        }
+        auto read = [connection](void* buffer, size_t size) { return read_socket(connection, buffer, size); };
+        valid = got == static_cast<ssize_t>(sizeof(magic)) && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0 &&
+                streams[0] >= 0 && streams[1] >= 0 && streams[2] >= 0 && read_query_strings(read, request);
+#endif
+        int status = 1;
+        if (valid) {
+            std::fflush(stdout);
+            std::fflush(stderr);
+            for (int k = 0; k < 3; ++k) {
+#ifdef _WIN32
+                _dup2(streams[k], k);
+#else
+                dup2(streams[k], k);
+#endif
+            }
+            status = query(request);
+            std::fflush(stdout); // Whatever the query left in the buffers goes to the client
+            std::fflush(stderr);
+            std::cerr.flush();
+            for (int k = 0; k < 3; ++k) {
+#ifdef _WIN32
+                _dup2(saved[k], k);
+#else
+                dup2(saved[k], k);
+#endif
+            }
+        }
+        uint32_t reply = static_cast<uint32_t>(status);
+#ifdef _WIN32
+        for (int stream : streams) {
+            if (stream >= 0) _close(stream);
+        }
+        write_pipe(pipe_, &reply, sizeof(reply));
+        FlushFileBuffers(pipe_);
+        DisconnectNamedPipe(pipe_);
+#else
+        for (int stream : streams) {
+            if (stream >= 0) ::close(stream);
+        }
+        write_socket(connection, &reply, sizeof(reply));
+        ::close(connection);
+#endif
+    }
+}
+
+// Run one query, with the client's standard streams in place of the server's
+int SearchServer::query(const std::vector<std::string>& request) {
+    if (request.empty()) return 1;
+    const std::string& directory = request[0];
+#ifdef _WIN32
+    bool entered = _chdir(directory.c_str()) == 0;
+#else
+    bool entered = chdir(directory.c_str()) == 0;
+#endif
+    if (!entered) {
+        std::cerr << "scanr: Cannot change to directory '" << directory << "'" << std::endl;
+        return 1;
+    }
+    files_.set_directory(directory);
+
+    // The arguments as main receives them; argv[0] (the working directory here) is not read
+    std::vector<std::string> arguments = request;
+    std::vector<char*> argv;
+    for (auto& argument : arguments) argv.push_back(&argument[0]);
+    argv.push_back(nullptr);
+    Settings settings;
+    settings.file_cache = &files_;
+    try {
+        if (!parse_arguments(static_cast<int>(arguments.size()), argv.data(), settings)) return 1;
+        if (settings.follow) {
+            std::cerr << "scanr: --follow cannot be used with --connect" << std::endl; // It would hold the server forever
+            return 1;
+        }
+        return run_search(settings, this);
+    } catch (const std::exception& e) {
+        std::cerr << "scanr: " << e.what() << std::endl; // The query fails; the server goes on
+        return 1;
+    }
+}
+
+SearchServer::Patterns& SearchServer::patterns(const Settings& settings, bool& compiled) {
+    std::string key = PatternCache::key(settings);
+    auto found = patterns_.find(key);
+    compiled = found == patterns_.end();
+    if (compiled) {
+        if (patterns_.size() >= kMaxPatternSets) { // Make room: drop the set used least recently
+            patterns_.erase(std::min_element(patterns_.begin(), patterns_.end(), [](const auto& a, const auto& b) { return a.second->used < b.second->used; }));
+        }
+        auto entry = std::make_unique<Patterns>();
+        entry->matcher = build_matcher(settings); // Throws on invalid patterns, keeping nothing
+        found = patterns_.emplace(std::move(key), std::move(entry)).first;
+    }
+    found->second->used = ++clock_;
+    return *found->second;
+}
+
+// --connect: hand the search to the server at 'address' and wait for its exit status. False
+// if no server answers there, in which case nothing has been sent or printed.
+bool send_query(const std::string& address, int argc, char* argv[], int& status) {
+    std::vector<std::string> strings;
+    strings.push_back(current_directory());
+    for (int i = 0; i < argc; ++i) strings.emplace_back(argv[i]);
+    std::string message;
+    bool sent, answered;
+    uint32_t reply = 1;
+#ifdef _WIN32
+    HANDLE pipe;
+    for (;;) {
+        pipe = CreateFileA(address.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (pipe != INVALID_HANDLE_VALUE) break;
+        // Busy with another query: wait for it to take the next one
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeA(address.c_str(), NMPWAIT_WAIT_FOREVER)) return false;
+    }
+    // A pipe of that name made by another user (before the server made its own) gets nothing
+    ULONG server = 0;
+    HANDLE process = GetNamedPipeServerProcessId(pipe, &server) ? OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, server) : nullptr;
+    bool trusted = process != nullptr && same_user(process);
+    if (process != nullptr) CloseHandle(process);
+    if (!trusted) {
+        CloseHandle(pipe);
+        std::cerr << "scanr: The server at '" << address << "' does not run as this user; nothing was sent to it" << std::endl;
+        status = 1;
+        return true;
+    }
+    message.assign(SearchServer::kMagic, sizeof(SearchServer::kMagic));
+    for (DWORD stream : {STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE}) {
+        uint64_t handle = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(GetStdHandle(stream)));
+        message.append(reinterpret_cast<const char*>(&handle), sizeof(handle));
+    }
+    append_query_strings(message, strings);
+    sent = write_pipe(pipe, message.data(), message.size());
+    answered = sent && read_pipe(pipe, &reply, sizeof(reply));
+    CloseHandle(pipe);
+#else
+    int fd = connect_socket(address);
+    if (fd < 0) return false;
+    if (!peer_is_this_user(fd)) { // Whoever made the socket, its server must be this user's
+        ::close(fd);
+        std::cerr << "scanr: The server at '" << address << "' does not run as this user; nothing was sent to it" << std::endl;
+        status = 1;
+        return true;
+    }
+    int streams[3];
+    int null_fd = -1; // Stands in for a standard descriptor this process does not have
+    for (int k = 0; k < 3; ++k) {
+        if (fcntl(k, F_GETFD) < 0 && null_fd < 0) null_fd = ::open("/dev/null", O_RDWR);
+        streams[k] = fcntl(k, F_GETFD) >= 0 ? k : null_fd;
+    }
+    iovec data = {const_cast<char*>(SearchServer::kMagic), sizeof(SearchServer::kMagic)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(streams))] = {};
+    msghdr header = {};
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    cmsghdr* rights = CMSG_FIRSTHDR(&header);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(streams));
+    std::memcpy(CMSG_DATA(rights), streams, sizeof(streams));
+    if (sendmsg(fd, &header, kSendFlags) != static_cast<ssize_t>(sizeof(SearchServer::kMagic))) {
+        if (null_fd >= 0) ::close(null_fd);
+        ::close(fd);
+        return false;
+    }
+    if (null_fd >= 0) ::close(null_fd);
+    append_query_strings(message, strings);
+    sent = write_socket(fd, message.data(), message.size());
+    answered = sent && read_socket(fd, &reply, sizeof(reply));
+    ::close(fd);
+#endif
+    if (!answered) {
+        std::cerr << "scanr: The server at '" << address << "' did not finish the search" << std::endl;
+        status = 1;
+        return true;
+    }
+    status = static_cast<int>(reply);
+    return true;
+}
+
+// --- File Cache ---
+
+std::shared_ptr<const MappedFile> FileCache::open(const std::string& path) {
+    // Relative paths are cached under the directory of the query that searched them
+#ifdef _WIN32
+    bool absolute = (path.size() > 1 && path[1] == ':') || (!path.empty() && (path[0] == '\\' || path[0] == '/'));
+#else
+    bool absolute = !path.empty() && path[0] == '/';
+#endif
+    std::string key = absolute ? path : directory_ + '\0' + path;
+    unsigned long long size = 0;
+    long long mtime = 0;
+    bool exists = file_signature(path, size, mtime);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = entries_.find(key);
+        if (found != entries_.end()) {
+            if (exists && found->second.size == size && found->second.mtime == mtime) {
+                found->second.used = ++clock_;
+                return found->second.file;
+            }
+            bytes_ -= found->second.size; // Changed or gone: mapped again below
+            entries_.erase(found);
+        }
+    }
+    if (!exists) return nullptr;
+    auto file = std::make_shared<MappedFile>();
+    if (!file->open(path)) return nullptr;
+    if (file->size() != size) return file; // Changed while it was mapped: searched, not kept
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry& entry = entries_[key];
+    bytes_ -= entry.size; // Another thread may have mapped it meanwhile
+    entry = {file, size, mtime, ++clock_};
+    bytes_ += size;
+    while (bytes_ > kMaxBytes && entries_.size() > 1) {
+        auto oldest = std::min_element(entries_.begin(), entries_.end(), [](const auto& a, const auto& b) { return a.second.used < b.second.used; });
+        bytes_ -= oldest->second.size;
+        entries_.erase(oldest); // Searches still using it keep their mapping until they are done
+    }
+    return file;
+}
+
+// --- Run Statistics ---
+
+void SearchStats::merge(const SearchStats& other) {
+    files += other.files;
+    unreadable += other.unreadable;
+    binary_skipped += other.binary_skipped;
+    lines += other.lines;
+    candidates += other.candidates;
+    selected += other.selected;
+    read_ahead_files += other.read_ahead_files;
+    read_ahead_bytes += other.read_ahead_bytes;
+    decompressed_files += other.decompressed_files;
+    decompressed_bytes += other.decompressed_bytes;
+    for (int phase = 0; phase < kPhaseCount; ++phase) {
+        calls[phase] += other.calls[phase];
+        bytes[phase] += other.bytes[phase];
+        nanoseconds[phase] += other.nanoseconds[phase];
+    }
+}
+
+static std::mutex search_stats_mutex;
+static SearchStats search_stats_total;
+
+void SearchStats::publish(SearchStats& counts) {
+    std::lock_guard<std::mutex> lock(search_stats_mutex);
+    search_stats_total.merge(counts);
+    counts = SearchStats();
+}
+
+SearchStats SearchStats::totals() {
+    std::lock_guard<std::mutex> lock(search_stats_mutex);
+    return search_stats_total;
+}
+
+void SearchStats::reset() {
+    std::lock_guard<std::mutex> lock(search_stats_mutex);
+    search_stats_total = SearchStats();
+}
+
+// The --stats report on the search itself: what was read, and where the time went. Each
+// phase shows its time, how often it ran and its throughput over the bytes it was given.
+void print_search_stats(const SearchStats& stats) {
+    static const char* const kPhaseNames[SearchStats::kPhaseCount] = {"read", "scan", "literal match", "regex match", "std::regex match", "output"};
+    char line[256];
+    std::snprintf(line, sizeof(line), "scanr: searched %llu input(s), %llu bytes, %llu line(s); %llu unreadable, %llu binary file(s) skipped\n",
+                  stats.files, stats.bytes[SearchStats::kScan], stats.lines, stats.unreadable, stats.binary_skipped);
+    std::cerr << line;
+    std::snprintf(line, sizeof(line), "scanr: %llu candidate line(s), %llu matched (%.1f%%)\n", stats.candidates, stats.selected,
+                  stats.candidates > 0 ? 100.0 * static_cast<double>(stats.selected) / static_cast<double>(stats.candidates) : 0.0);
+    std::cerr << line;
+    if (stats.read_ahead_files > 0) {
+        std::snprintf(line, sizeof(line), "scanr: read ahead: %llu file(s), %llu bytes\n", stats.read_ahead_files, stats.read_ahead_bytes);
+        std::cerr << line;
+    }
+    if (stats.decompressed_files > 0) {
+        std::snprintf(line, sizeof(line), "scanr: decompressed: %llu file(s), %llu bytes of text\n", stats.decompressed_files, stats.decompressed_bytes);
+        std::cerr << line;
+    }
+    for (int phase = 0; phase < SearchStats::kPhaseCount; ++phase) {
+        if (stats.calls[phase] == 0) continue;
+        double ms = static_cast<double>(stats.nanoseconds[phase]) / 1e6;
+        int length = std::snprintf(line, sizeof(line), "scanr: %s: %.3f ms, %llu call(s)", kPhaseNames[phase], ms, stats.calls[phase]);
+        if (stats.nanoseconds[phase] > 0 && stats.bytes[phase] > 0) {
+            double mb_per_s = static_cast<double>(stats.bytes[phase]) * 1e3 / static_cast<double>(stats.nanoseconds[phase]);
+            std::snprintf(line + length, sizeof(line) - static_cast<size_t>(length), ", %.1f MB/s", mb_per_s);
+        }
+        std::cerr << line << std::endl;
+    }
+}
+
+// --- Input Backends ---
+
+bool MappedFile::open(const std::string& filename) {
+    close();
+#ifdef _WIN32
+    file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER file_size;
+    if (GetFileType(file_) != FILE_TYPE_DISK || !GetFileSizeEx(file_, &file_size) ||
+        static_cast<unsigned long long>(file_size.QuadPart) > static_cast<unsigned long long>(SIZE_MAX)) {
+        close();
+        return false;
+    }
+    size_ = static_cast<size_t>(file_size.QuadPart);
+    if (size_ == 0) return true; // Empty files cannot be mapped, but are trivially searchable
+    if (size_ <= kReadLimit) {
+        contents_.resize(size_);
+        DWORD read = 0;
+        if (!ReadFile(file_, contents_.data(), static_cast<DWORD>(size_), &read, nullptr)) {
+            close();
+            return false;
+        }
+        CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+        size_ = read; // The file may have shrunk since its size was taken
+        data_ = contents_.data();
+        return true;
+    }
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_ == nullptr) {
+        close();
+        return false;
+    }
+    data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    if (data_ == nullptr) {
+        close();
+        return false;
+    }
+    // The view stays valid without the handles, which a --serve process would otherwise
+    // hold for every file it keeps mapped
+    CloseHandle(mapping_);
+    CloseHandle(file_);
+    mapping_ = nullptr;
+    file_ = INVALID_HANDLE_VALUE;
+#else
+    fd_ = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) return false;
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || !S_ISREG(st.st_mode) ||
+        static_cast<unsigned long long>(st.st_size) > static_cast<unsigned long long>(SIZE_MAX)) {
+        close();
+        return false;
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ == 0) return true; // Empty files cannot be mapped, but are trivially searchable
+    if (size_ <= kReadLimit) {
+        contents_.resize(size_);
+        size_t filled = 0;
+        while (filled < contents_.size()) {
+            ssize_t got = ::read(fd_, contents_.data() + filled, contents_.size() - filled);
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0) {
+                close();
+                return false;
+            }
+            if (got == 0) break; // The file shrank since its size was taken
+            filled += static_cast<size_t>(got);
+        }
+        ::close(fd_);
+        fd_ = -1;
+        size_ = filled;
+        data_ = contents_.data();
+        return true;
+    }
+    void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (addr == MAP_FAILED) {
+        close();
+        return false;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(addr, size_, MADV_SEQUENTIAL); // Hint aggressive read-ahead; the buffer is scanned front to back
+#endif
+    data_ = static_cast<const char*>(addr);
+    ::close(fd_); // The mapping stays valid without it (see above)
+    fd_ = -1;
+#endif
+    return true;
+}
+
+void MappedFile::close() {
+    bool mapped = data_ != nullptr && data_ != contents_.data();
+#ifdef _WIN32
+    if (mapped) UnmapViewOfFile(data_);
+    if (mapping_ != nullptr) CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+    mapping_ = nullptr;
+    file_ = INVALID_HANDLE_VALUE;
+#else
+    if (mapped) munmap(const_cast<char*>(data_), size_);
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+#endif
+    data_ = nullptr;
+    size_ = 0;
+    contents_.clear();
+}
+
+// True if standard output is a console/terminal rather than a file or pipe
+bool is_interactive_output() {
+#ifdef _WIN32
+    return _isatty(_fileno(stdout)) != 0;
+#else
+    return isatty(STDOUT_FILENO) != 0;
+#endif
+}
+
+// Search one named file: memory-map it when possible, otherwise stream it
+void search_file(const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch) {
+    if (settings.use_mmap) {
+        MappedFile mapped;
+        std::shared_ptr<const MappedFile> cached; // --serve: kept mapped from query to query
+        auto open = [&]() -> const MappedFile* {
+            if (settings.file_cache != nullptr) {
+                cached = settings.file_cache->open(filename);
+                return cached.get();
+            }
+            return mapped.open(filename) ? &mapped : nullptr;
+        };
+        const MappedFile* file;
+        if (scratch.collect_stats) {
+            auto start = std::chrono::steady_clock::now();
+            file = open();
+            scratch.stats.nanoseconds[SearchStats::kRead] += static_cast<unsigned long long>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            ++scratch.stats.calls[SearchStats::kRead];
+            scratch.stats.bytes[SearchStats::kRead] += file != nullptr && !file->mapped() ? file->size() : 0;
+        } else {
+            file = open();
+        }
+        if (file != nullptr) {
+            search_buffer(file->data(), file->size(), filename, settings, matcher, show_filename_prefix, out, scratch);
+            return;
+        }
+    }
+
+    // Fallback: pipes, devices, unmappable files, or --no-mmap
+#ifdef _WIN32
+    int fd = _open(filename.c_str(), _O_RDONLY | _O_BINARY | _O_SEQUENTIAL);
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd < 0) {
+        if (scratch.collect_stats) ++scratch.stats.unreadable;
+        // Report error but continue with other files unless in modes where errors aren't useful
+         if (!settings.list_filenames && !settings.count_only) {
+            out.error("scanr: Cannot open file '" + filename + "'");
+         }
+        // Consider returning an error code if *any* file fails? Standard grep usually doesn't.
+        return; // Skip to the next file
+    }
+    process_stream(fd, filename, settings, matcher, show_filename_prefix, out, scratch);
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+bool BlockReader::fill() {
+    // Carry the partial last line over to the front of the buffer
+    size_t carry = filled_ - lines_end_;
+    if (lines_end_ > 0 && carry > 0) {
+        std::memmove(buffer_.data(), buffer_.data() + lines_end_, carry);
+    }
+    filled_ = carry;
+    offset_ += lines_end_;
+    lines_end_ = 0;
+    if (eof_) return false;
+
+    // Read until the block holds at least one complete line (or the input ends).
+    // Pipes return whatever is available, so interactive producers are not held back
+    // until a whole block has accumulated.
+    size_t scanned = carry; // Bytes already known to contain no newline
+    if (head_) { // The head may hold a whole line: hand it out before waiting for more
+        head_ = false;
+        for (size_t i = filled_; i > 0; --i) {
+            if (buffer_[i - 1] == '\n') {
+                lines_end_ = i;
+                return true;
+            }
+        }
+    }
+    for (;;) {
+        if (filled_ == buffer_.size()) {
+            buffer_.resize(buffer_.size() * 2); // A single line is longer than the block
+        }
+        long long got;
+        if (source_ != nullptr) {
+            got = static_cast<long long>(source_->read(buffer_.data() + filled_, buffer_.size() - filled_));
+        } else {
+#ifdef _WIN32
+            got = _read(fd_, buffer_.data() + filled_, static_cast<unsigned>(std::min<size_t>(buffer_.size() - filled_, INT_MAX)));
+#else
+            got = ::read(fd_, buffer_.data() + filled_, buffer_.size() - filled_);
+            if (got < 0 && errno == EINTR) continue;
+#endif
+        }
+        if (got <= 0) {
+            // End of input (read errors end the stream the same way)
+            eof_ = true;
+            lines_end_ = filled_;
+            return filled_ > 0;
+        }
+        filled_ += static_cast<size_t>(got);
+
+        // Locate the last newline of the new data; everything up to it is complete lines
+        for (size_t i = filled_; i > scanned; --i) {
+            if (buffer_[i - 1] == '\n') {
+                lines_end_ = i;
+                return true;
+            }
+        }
+        scanned = filled_;
+    }
+}
+
+// Text-mode reads on Windows drop the '\r' of CRLF line endings; a mapped buffer
+// sees the raw bytes, so strip it there to keep matching and output identical.
+static std::string_view make_line(const char* begin, const char* end) {
+#ifdef _WIN32
+    if (end > begin && end[-1] == '\r') --end;
+#endif
+    return std::string_view(begin, static_cast<size_t>(end - begin));
+}
+
+// Binary probe, as grep does it: a NUL byte near the start of the input. Text never
+// contains one, while executables, archives and databases nearly always do early on.
+bool looks_binary(const char* data, size_t size) {
+    constexpr size_t kProbeSize = 32 * 1024;
+    return size > 0 && std::memchr(data, '\0', std::min(size, kProbeSize)) != nullptr;
+}
+
+// Search an in-memory buffer (the memory-mapped backend). Candidate matches are located
+// across the whole buffer first; line boundaries are only resolved around them, and the
+// lines in between are skipped in bulk. A compressed file is searched as a stream of its
+// decompressed text instead.
+void search_buffer(const char* data, size_t size, const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch) {
+    Compression format = settings.decompress ? Decompressor::detect(data, size) : Compression::kNone;
+    if (format != Compression::kNone) { // Streamed from the decoder: the text is never held whole
+        Decompressor source(format, data, size, settings.chunk_threads);
+        search_decompressed(source, filename, settings, matcher, show_filename_prefix, out, scratch);
+        return;
+    }
+    StreamContext ctx(filename, settings, matcher, show_filename_prefix, out, scratch);
+    if (scratch.collect_stats) ++scratch.stats.files;
+    TextEncoding encoding;
+    size_t bom = byte_order_mark(data, size, encoding);
+    if (encoding != TextEncoding::kUtf8) {
+        search_utf16(ctx, data + bom, size - bom, encoding, bom);
+        finish_stream(ctx);
+        return;
+    }
+    data += bom; // A UTF-8 byte order mark is not part of the first line
+    size -= bom;
+    ctx.set_buffer(data, bom);
+    if (settings.binary_files != BinaryFiles::kText && looks_binary(data, size)) {
+        if (settings.binary_files == BinaryFiles::kWithoutMatch) {
+            if (scratch.collect_stats) ++scratch.stats.binary_skipped;
+            finish_stream(ctx); // No matching lines: -c reports 0
+            return;
+        }
+        ctx.binary = true; // Ends at the first match (unless -c counts them all), kept on one thread
+    }
+    if (settings.chunk_threads > 1 && size >= ChunkedSearch::kMinFileSize && !ctx.binary && settings.max_count < 0) {
+        ChunkedSearch(ctx, data, size, settings.chunk_threads).run();
+    } else {
+        search_lines(ctx, data, size);
+    }
+    finish_stream(ctx);
+}
+
+CandidateScan::CandidateScan(const CompiledMatcher& matcher, const Settings& settings, std::string_view buffer, MatchScratch& scratch)
+    : matcher_(matcher), buffer_(buffer), scratch_(scratch),
+      prefilter_(!matcher.regex_prefilter.empty()),
+      every_line_(!matcher.regex_patterns.empty() && !prefilter_),
+      literals_decide_(!settings.match_whole_word) {}
+
+size_t CandidateScan::next(size_t from, bool& confirmed) {
+    confirmed = false;
+    if (every_line_) return from;
+    size_t candidate = std::string_view::npos;
+    if (!matcher_.literals.empty()) {
+        if (first_scan_ || (literal_hit_ != std::string_view::npos && literal_hit_ < from)) literal_hit_ = matcher_.literals.find(buffer_, from);
+        candidate = literal_hit_;
+        confirmed = literals_decide_ && candidate != std::string_view::npos;
+    }
+    if (prefilter_ || !matcher_.regexes.empty()) {
+        if (first_scan_ || (regex_hit_ != std::string_view::npos && regex_hit_ < from)) {
+            regex_hit_ = prefilter_ ? matcher_.regex_prefilter.find(buffer_, from) : matcher_.regexes.find_line(buffer_, from, scratch_.regex);
+        }
+        // The DFA only reports lines it has matched, until it gives up and leaves every line
+        // to the Pike VM; prefilter hits are merely lines holding a required literal
+        bool regex_decides = !prefilter_ && !scratch_.regex.gave_up;
+        if (regex_hit_ < candidate) {
+            candidate = regex_hit_;
+            confirmed = regex_decides;
+        } else if (regex_hit_ == candidate && candidate != std::string_view::npos) {
+            confirmed = confirmed || regex_decides;
+        }
+    }
+    first_scan_ = false;
+    return candidate;
+}
+
+// Search a run of lines held in memory (a whole mapped file, or the complete lines of one
+// block). Context state carries over in 'ctx', so consecutive calls behave like one input.
+void search_lines(StreamContext& ctx, const char* data, size_t size) {
+    if (ctx.scratch.collect_stats) {
+        search_lines(ctx, data, size, CountStats(ctx.scratch.stats));
+    } else {
+        search_lines(ctx, data, size, NoStats());
+    }
+}
+
+template <class Stats>
+static void search_lines(StreamContext& ctx, const char* data, size_t size, Stats stats) {
+    const Settings& settings = ctx.settings;
+    if constexpr (Stats::kEnabled) stats.count(&SearchStats::lines, static_cast<unsigned long long>(count_newlines(data, data + size)) + (size > 0 && data[size - 1] != '\n'));
+    if (settings.count_only && !settings.list_filenames && !settings.quiet && !(settings.invert_match && settings.max_count >= 0)) {
+        count_lines(ctx, data, size, stats);
+        return;
+    }
+    const CompiledMatcher& matcher = ctx.matcher;
+    CandidateScan scan(matcher, settings, std::string_view(data, size), ctx.scratch);
+
+    // Only the candidate lines are split off and matched; the lines before each are skipped in bulk
+    size_t pos = 0;
+    while (pos < size && !ctx.stopped()) {
+        bool confirmed;
+        size_t candidate;
+        {
+            [[maybe_unused]] auto timer = stats.time(SearchStats::kScan, 0);
+            candidate = scan.next(pos, confirmed);
+        }
+        if (candidate == std::string_view::npos) {
+            [[maybe_unused]] auto timer = stats.time(SearchStats::kOutput, size - pos, 0);
+            skip_lines(ctx, data + pos, data + size); // No more hits: the rest of the buffer is non-matching
+            break;
+        }
+
+        // Resolve the line around the candidate
+        size_t line_start = candidate;
+        while (line_start > pos && data[line_start - 1] != '\n') --line_start;
+        {
+            [[maybe_unused]] auto timer = stats.time(SearchStats::kOutput, line_start - pos, 0);
+            skip_lines(ctx, data + pos, data + line_start);
+        }
+        if (ctx.stopped()) break;
+        const char* newline = static_cast<const char*>(std::memchr(data + candidate, '\n', size - candidate));
+        const char* line_end = newline ? newline : data + size;
 
-    // Add patterns from -e / command line argument to the main list
-    settings.patterns.insert(settings.patterns.end(), pattern_sources.begin(), pattern_sources.end());
+        std::string_view line = make_line(data + line_start, line_end);
+        std::vector<std::pair<size_t, size_t>>& match_positions = ctx.scratch.positions; // {start_pos, length} for -o
+        bool is_match = matcher.matches(line, settings, match_positions, ctx.scratch, stats);
+        stats.count(&SearchStats::candidates);
+        stats.count(&SearchStats::selected, is_match);
+        {
+            [[maybe_unused]] auto timer = stats.time(SearchStats::kOutput, line.size());
+            handle_line(ctx, line, is_match, match_positions);
+        }
 
-    // Sanity checks and adjustments for conflicting options
-    if (settings.list_filenames || settings.count_only) {
-        // Context options don't make sense with -l or -c
-        settings.lines_after = 0;
-        settings.lines_before = 0;
-        settings.only_matching = false; // -o also doesn't make sense
-    }
-    if (settings.only_matching) {
-         // Context options usually ignored with -o in standard grep
-        settings.lines_after = 0;
-        settings.lines_before = 0;
+        pos = newline ? static_cast<size_t>(newline - data) + 1 : size;
     }
+    stats.count_bytes(SearchStats::kScan, size);
+}
 
+// -c without -l or -q: only the number of selected lines is wanted, so no line is ever
+// materialized and no line number kept. After each hit the scan jumps past the end of its
+// line, which counts the line once however many hits it holds; a line is only matched
+// again when the engine that found it cannot vouch for it (-w, a prefilter hit, std::regex).
+// Under -v the selected lines are all lines but the matching ones, so the text between hits
+// is never looked at beyond one count of its newlines.
+template <class Stats>
+static void count_lines(StreamContext& ctx, const char* data, size_t size, Stats stats) {
+    const Settings& settings = ctx.settings;
+    CandidateScan scan(ctx.matcher, settings, std::string_view(data, size), ctx.scratch);
 
-    return true; // Parsing successful
+    long long matching = 0;
+    size_t pos = 0;
+    while (pos < size && !ctx.stopped()) {
+        bool confirmed;
+        size_t candidate;
+        {
+            [[maybe_unused]] auto timer = stats.time(SearchStats::kScan, 0);
+            candidate = scan.next(pos, confirmed);
+        }
+        if (candidate == std::string_view::npos) break;
+        const char* newline = static_cast<const char*>(std::memchr(data + candidate, '\n', size - candidate));
+        const char* line_end = newline ? newline : data + size;
+
+        if (!confirmed) {
+            size_t line_start = candidate;
+            while (line_start > pos && data[line_start - 1] != '\n') --line_start;
+            confirmed = ctx.matcher.matches(make_line(data + line_start, line_end), settings, ctx.scratch.positions, ctx.scratch, stats);
+        }
+        stats.count(&SearchStats::candidates);
+        stats.count(&SearchStats::selected, confirmed);
+        if (confirmed) {
+            ++matching;
+            if (!settings.invert_match && settings.max_count >= 0 && ctx.match_count + matching >= settings.max_count) {
+                ctx.done = true; // -m NUM lines counted: the rest of the input is not needed
+                break;
+            }
+        }
+        pos = newline ? static_cast<size_t>(newline - data) + 1 : size;
+    }
+
+    if (settings.invert_match) {
+        // Every buffer ends at a line end, except for a final line without a terminator
+        long long lines = count_newlines(data, data + size) + (size > 0 && data[size - 1] != '\n' ? 1 : 0);
+        matching = lines - matching;
+    }
+    ctx.match_count += matching;
+    stats.count_bytes(SearchStats::kScan, size);
 }
 
-// Compile string patterns into std::regex objects
-std::vector<std::regex> compile_patterns(const Settings& settings) {
-    std::vector<std::regex> regex_patterns;
-    // Set regex syntax options (ERE is default for std::regex)
-    auto flags = std::regex::ECMAScript; // Default syntax, generally compatible with ERE
-    // Or use std::regex::extended if available and preferred, but ECMAScript is more common now
-    // auto flags = std::regex::extended;
+// Number of '\n' bytes in [begin, end): a compare per vector whose lanes are summed as byte
+// counters (up to 255 vectors at a time) and then added up with a sum of absolute
+// differences, instead of a loop that stops at every newline
+static long long count_newlines_scalar(const char* begin, const char* end) {
+    long long count = 0;
+    for (; begin < end; ++begin) count += *begin == '\n';
+    return count;
+}
 
-    if (settings.ignore_case) {
-        flags |= std::regex::icase;
+#if defined(SCANR_X86)
+SCANR_TARGET("sse2")
+static long long count_newlines_sse2(const char* begin, const char* end) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    long long count = 0;
+    while (end - begin >= 16) {
+        size_t vectors = std::min<size_t>(static_cast<size_t>(end - begin) / 16, 255);
+        __m128i counters = _mm_setzero_si128();
+        for (size_t i = 0; i < vectors; ++i, begin += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(block, newline)); // A match is -1
+        }
+        __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
     }
+    return count + count_newlines_scalar(begin, end);
+}
 
-    for (const auto& p_str : settings.patterns) {
-        std::string final_pattern = p_str;
-        if (settings.match_whole_word) {
-            // Wrap with word boundaries (\b).
-            // Note: This is a basic implementation. More complex patterns might interact
-            // unexpectedly with automatically added boundaries.
-            // Check if pattern already starts/ends with word boundary or anchor?
-            bool starts_with_boundary = (final_pattern.length() >= 2 && final_pattern.substr(0, 2) == "\\b") || (final_pattern.length() >= 1 && final_pattern[0] == '^');
-            bool ends_with_boundary = (final_pattern.length() >= 2 && final_pattern.substr(final_pattern.length() - 2) == "\\b") || (final_pattern.length() >= 1 && final_pattern.back() == '$');
+SCANR_TARGET("avx2")
+static long long count_newlines_avx2(const char* begin, const char* end) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    long long count = 0;
+    while (end - begin >= 32) {
+        size_t vectors = std::min<size_t>(static_cast<size_t>(end - begin) / 32, 255);
+        __m256i counters = _mm256_setzero_si256();
+        for (size_t i = 0; i < vectors; ++i, begin += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(block, newline));
+        }
+        __m256i sums = _mm256_sad_epu8(counters, _mm256_setzero_si256());
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+        count += _mm_cvtsi128_si32(half) + _mm_extract_epi16(half, 4);
+    }
+    return count + count_newlines_scalar(begin, end); // Under 32 bytes; not the SSE2 kernel (see json_plain_run_avx2)
+}
+#endif
 
-            if (!starts_with_boundary) {
-                 final_pattern.insert(0, "\\b");
-            }
-             if (!ends_with_boundary) {
-                 final_pattern.append("\\b");
-             }
+#if defined(SCANR_NEON)
+static long long count_newlines_neon(const char* begin, const char* end) {
+    const uint8x16_t newline = vdupq_n_u8('\n');
+    long long count = 0;
+    while (end - begin >= 16) {
+        size_t vectors = std::min<size_t>(static_cast<size_t>(end - begin) / 16, 255);
+        uint8x16_t counters = vdupq_n_u8(0);
+        for (size_t i = 0; i < vectors; ++i, begin += 16) {
+            uint8x16_t block = vld1q_u8(reinterpret_cast<const uint8_t*>(begin));
+            counters = vsubq_u8(counters, vceqq_u8(block, newline));
         }
-        // Add the compiled regex to the list
-        regex_patterns.emplace_back(final_pattern, flags);
+        count += vaddlvq_u8(counters);
     }
-    return regex_patterns;
+    return count + count_newlines_scalar(begin, end);
 }
+#endif
 
+long long count_newlines(const char* begin, const char* end) {
+#if defined(SCANR_X86)
+    static const auto kernel = cpu_features().avx2 ? count_newlines_avx2 : cpu_features().sse2 ? count_newlines_sse2 : count_newlines_scalar;
+    return kernel(begin, end);
+#elif defined(SCANR_NEON)
+    return count_newlines_neon(begin, end);
+#else
+    return count_newlines_scalar(begin, end);
+#endif
+}
 
-// Check if a line matches any pattern using REGEX
-bool regex_matches(const std::string& line, const std::vector<std::regex>& regex_patterns, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions) {
-     match_positions.clear();
-     bool found_match = false;
-     std::smatch match_result; // Stores details of a single match
+void StreamContext::count_skipped(const char* end) {
+    if (uncounted == nullptr) return;
+    line_number += count_newlines(uncounted, end);
+    uncounted = nullptr;
+}
 
-    for (const auto& pattern_regex : regex_patterns) {
-         if (settings.only_matching) {
-             // Find *all* non-overlapping matches using an iterator
-             auto words_begin = std::sregex_iterator(line.begin(), line.end(), pattern_regex);
-             auto words_end = std::sregex_iterator();
+// Advance over lines known not to match. Only lines that can produce output are handled
+// one by one: every line under -v, pending -A context, and the last -B lines that may be
+// needed as leading context. The rest just advance the line counter.
+void skip_lines(StreamContext& ctx, const char* begin, const char* end) {
+    const Settings& settings = ctx.settings;
+    static const std::vector<std::pair<size_t, size_t>> no_positions;
 
-             for (std::sregex_iterator i = words_begin; i != words_end; ++i) {
-                 std::smatch match = *i;
-                 // Store start position and length of the matched substring
-                 match_positions.push_back({static_cast<size_t>(match.position(0)), static_cast<size_t>(match.length(0))});
-                 found_match = true;
-             }
-             // Continue checking other patterns even if matches found for this one in -o mode
-         } else {
-             // Find if *any* match exists using regex_search
-             if (std::regex_search(line, match_result, pattern_regex)) {
-                 found_match = true;
-                 // Store the first match found (though not strictly needed if not -o)
-                 match_positions.push_back({static_cast<size_t>(match_result.position(0)), static_cast<size_t>(match_result.length(0))});
-                 break; // Found a match with one pattern, no need to check others unless -o
-             }
-         }
+    while (begin < end && !ctx.stopped() && (settings.invert_match || ctx.after_lines_to_print > 0)) {
+        const char* newline = static_cast<const char*>(std::memchr(begin, '\n', static_cast<size_t>(end - begin)));
+        const char* line_end = newline ? newline : end;
+        handle_line(ctx, make_line(begin, line_end), false, no_positions);
+        begin = newline ? newline + 1 : end;
     }
-     // Sort matches by start position if -o is active, for ordered output
-     if (settings.only_matching && !match_positions.empty()) {
-         std::sort(match_positions.begin(), match_positions.end());
-     }
+    if (begin >= end || ctx.stopped()) return;
 
-    return found_match;
+    // Find the start of the last -B lines of the range
+    const char* tail = end;
+    if (settings.lines_before > 0) {
+        tail = (end[-1] == '\n') ? end - 1 : end; // The last line's own terminator does not start a new line
+        int lines = 0;
+        while (tail > begin) {
+            if (tail[-1] == '\n' && ++lines == settings.lines_before) break;
+            --tail;
+        }
+    }
+
+    // Everything before the tail consists of complete lines. Under -n their newlines are
+    // counted later, if at all. Otherwise only whether lines were skipped matters (it makes
+    // a gap before the next context output), so the run counts as one line.
+    if (begin < tail) {
+        if (!settings.show_line_numbers) {
+            ++ctx.line_number;
+        } else if (ctx.uncounted == nullptr) {
+            ctx.uncounted = begin;
+        }
+    }
+
+    while (tail < end) {
+        const char* newline = static_cast<const char*>(std::memchr(tail, '\n', static_cast<size_t>(end - tail)));
+        const char* line_end = newline ? newline : end;
+        handle_line(ctx, make_line(tail, line_end), false, no_positions);
+        tail = newline ? newline + 1 : end;
+    }
 }
 
-// Check if a character position represents a word boundary (for simple_matches -w)
-// True if transition between alphanumeric and non-alphanumeric, or at start/end.
-bool is_word_boundary(const std::string& line, size_t pos) {
-    if (line.empty()) return true; // Empty line has boundaries everywhere?
+// Process a single input stream (file or stdin) through the block reader
+void process_stream(int fd, const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch) {
+    // The first bytes tell whether the input is compressed. Reading stops as soon as they
+    // cannot be a magic number, so a line typed into a pipe is not held back.
+    char head[Decompressor::kMagicSize];
+    size_t head_size = 0;
+    while (settings.decompress && head_size < sizeof(head) && Decompressor::could_be_compressed(head, head_size)) {
+#ifdef _WIN32
+        int got = _read(fd, head + head_size, static_cast<unsigned>(sizeof(head) - head_size));
+#else
+        ssize_t got = ::read(fd, head + head_size, sizeof(head) - head_size);
+        if (got < 0 && errno == EINTR) continue;
+#endif
+        if (got <= 0) break;
+        head_size += static_cast<size_t>(got);
+    }
+    Compression format = settings.decompress ? Decompressor::detect(head, head_size) : Compression::kNone;
+    if (format != Compression::kNone) {
+        Decompressor source(format, fd, head, head_size);
+        search_decompressed(source, filename, settings, matcher, show_filename_prefix, out, scratch);
+        return;
+    }
+    BlockReader reader(fd, std::string_view(head, head_size));
+    process_blocks(reader, filename, settings, matcher, show_filename_prefix, out, scratch);
+}
 
-    bool pos_is_alnum = (pos < line.length()) && std::isalnum(static_cast<unsigned char>(line[pos]));
+// Search the text of a compressed input as it is decompressed, through a block reader as
+// if it came from a pipe. A corrupt or truncated input is searched as far as it decodes.
+static void search_decompressed(Decompressor& source, const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch) {
+    BlockReader reader(source);
+    process_blocks(reader, filename, settings, matcher, show_filename_prefix, out, scratch);
+    if (scratch.collect_stats) {
+        ++scratch.stats.decompressed_files;
+        scratch.stats.decompressed_bytes += source.size();
+    }
+    std::string error = source.error(); // Only once the text was read to its end
+    if (!error.empty()) out.error("scanr: " + filename + ": " + error);
+}
 
-    if (pos == 0) {
-        return pos_is_alnum; // Boundary if first char is alphanumeric
-    } else if (pos == line.length()) {
-        bool prev_is_alnum = std::isalnum(static_cast<unsigned char>(line[pos - 1]));
-        return prev_is_alnum; // Boundary if last char was alphanumeric
+static void process_blocks(BlockReader& reader, const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch) {
+    if (scratch.collect_stats) {
+        process_blocks(reader, filename, settings, matcher, show_filename_prefix, out, scratch, CountStats(scratch.stats));
     } else {
-        bool prev_is_alnum = std::isalnum(static_cast<unsigned char>(line[pos - 1]));
-        // Boundary if one side is alphanumeric and the other is not
-        return prev_is_alnum != pos_is_alnum;
+        process_blocks(reader, filename, settings, matcher, show_filename_prefix, out, scratch, NoStats());
     }
 }
 
+template <class Stats>
+static void process_blocks(BlockReader& reader, const std::string& filename, const Settings& settings, const CompiledMatcher& matcher, bool show_filename_prefix, OutputBuffer& out, MatchScratch& scratch, Stats stats) {
+    StreamContext ctx(filename, settings, matcher, show_filename_prefix, out, scratch);
+    stats.count(&SearchStats::files);
+
+    // One read of the next block (a pair of time stamps under --stats, nothing more otherwise)
+    auto fill = [&] {
+        [[maybe_unused]] auto timer = stats.time(SearchStats::kRead, 0);
+        bool filled = reader.fill();
+        if (filled) stats.count_bytes(SearchStats::kRead, reader.size());
+        return filled;
+    };
+    if (!fill()) { // Empty input
+        finish_stream(ctx);
+        return;
+    }
+
+    // The first block holds the byte order mark, if there is one. The block reader splits
+    // lines on single '\n' bytes, so UTF-16 input is read whole and searched in memory.
+    TextEncoding encoding;
+    size_t bom = byte_order_mark(reader.data(), reader.size(), encoding);
+    if (encoding != TextEncoding::kUtf8) {
+        std::string text;
+        do {
+            text.append(reader.data(), reader.size());
+        } while (fill());
+        search_utf16(ctx, text.data() + bom, text.size() - bom, encoding, bom);
+        finish_stream(ctx);
+        return;
+    }
+
+    // The first block decides whether the input is binary
+    if (settings.binary_files != BinaryFiles::kText && looks_binary(reader.data() + bom, reader.size() - bom)) {
+        if (settings.binary_files == BinaryFiles::kWithoutMatch) {
+            stats.count(&SearchStats::binary_skipped);
+            finish_stream(ctx);
+            return;
+        }
+        ctx.binary = true;
+    }
 
-// Case-insensitive string search helper
-size_t find_insensitive(const std::string& haystack, const std::string& needle, size_t pos = 0) {
-    if (needle.empty()) return pos; // Match empty needle immediately
-    auto it = std::search(
-        haystack.begin() + pos, haystack.end(), // Range to search in
-        needle.begin(), needle.end(),           // Range to search for
-        [](unsigned char ch1, unsigned char ch2) { return std::tolower(ch1) == std::tolower(ch2); } // Comparison predicate
-    );
-    return (it == haystack.end()) ? std::string::npos : std::distance(haystack.begin(), it);
+    // --- Main Block Processing Loop ---
+    do {
+        ctx.set_buffer(reader.data() + bom, reader.offset() + bom);
+        search_lines(ctx, reader.data() + bom, reader.size() - bom, stats);
+        ctx.before_lines.hold(); // The next fill reuses the block the -B lines point into
+        if (!ctx.done) ctx.count_skipped(reader.data() + reader.size()); // ... and the uncounted lines
+        bom = 0;
+    } while (!ctx.done && fill());
+
+    finish_stream(ctx);
 }
 
+// Apply the output and context rules to one input line, given its match result
+void handle_line(StreamContext& ctx, std::string_view line, bool is_match, const std::vector<std::pair<size_t, size_t>>& match_positions) {
+    const Settings& settings = ctx.settings;
+    OutputBuffer& out = ctx.out;
 
-// Check if a line matches any pattern using SIMPLE string search (no regex)
-bool simple_matches(const std::string& line, const Settings& settings, std::vector<std::pair<size_t, size_t>>& match_positions) {
-    match_positions.clear();
-    bool found_match_overall = false;
+    // Determine if this line should be printed based on match status and -v (invert).
+    // After -m NUM selected lines, the rest only serve as trailing context.
+    bool output_this_line = (is_match != settings.invert_match) && !ctx.at_max_count();
 
-    for (const auto& pattern : settings.patterns) {
-        if (pattern.empty()) continue; // Skip empty patterns
+    // A line that is neither printed nor kept as context needs no number: after lines
+    // skipped uncounted, it joins them
+    if (output_this_line || settings.lines_before > 0 || settings.lines_after > 0) ctx.count_skipped(line.data());
+    long long line_number = ctx.uncounted != nullptr ? 0 : ++ctx.line_number;
 
-        size_t current_pos = 0;
-        bool found_match_this_pattern = false;
+    // --- Output Logic ---
 
-        while (current_pos < line.length()) {
-             size_t match_start;
-             // Find next occurrence of the pattern
-             if (settings.ignore_case) {
-                 match_start = find_insensitive(line, pattern, current_pos);
-             } else {
-                 match_start = line.find(pattern, current_pos);
-             }
+    if (output_this_line) {
+        // This line is considered a match for output purposes
+        ctx.match_count++;
 
-            if (match_start == std::string::npos) {
-                break; // No more occurrences of this pattern found
+        // Handle -q (quiet): the answer is known, for this input and every other one
+        if (settings.quiet) {
+            quiet_match_found = true;
+            ctx.done = true;
+            return;
+        }
+
+        // Handle -l (list filenames): print filename once and stop processing this file
+        if (settings.list_filenames) {
+            if (settings.json) {
+                write_json_file(ctx, nullptr);
+            } else {
+                out.write(ctx.filename);
             }
+            out.end_line();
+            // Optimization: Stop reading this file now. Clear 'done' to match GNU grep exactly (reads whole file).
+            ctx.listed = true;
+            ctx.done = true;
+            return;
+        }
 
-            // Check whole word condition if -w is set
-             bool word_match_ok = true;
-             if (settings.match_whole_word) {
-                 // Check boundary before the match and after the match
-                 bool start_boundary_ok = is_word_boundary(line, match_start);
-                 bool end_boundary_ok = is_word_boundary(line, match_start + pattern.length());
-                 word_match_ok = start_boundary_ok && end_boundary_ok;
-             }
+        // Handle -c (count only): increment count and continue to next line (up to -m)
+        if (settings.count_only) {
+            ctx.done = ctx.at_max_count();
+            return;
+        }
+
+        // A binary input only reports that it matches, and needs no more reading
+        if (ctx.binary) {
+            out.error("scanr: " + ctx.filename + ": binary file matches");
+            ctx.done = true;
+            return;
+        }
 
-             if (word_match_ok) {
-                 // Match is valid (considering -w)
-                 found_match_overall = true;
-                 found_match_this_pattern = true;
-                 match_positions.push_back({match_start, pattern.length()});
+        // --- Context and Regular Output ---
 
-                 if (!settings.only_matching) {
-                     // If not -o, finding one match for this pattern is enough
-                     goto next_pattern; // Exit inner loop and check next pattern
+        // Determine if a separator is needed (gap since last printed line)
+         if ((settings.lines_before > 0 || settings.lines_after > 0) && !settings.json && ctx.last_printed_line != -1 && line_number > ctx.last_printed_line + 1) {
+             ctx.pending_separator = true; // Mark that a separator is needed before the next output
+         }
+
+        // 1. Print Leading Context (-B, -C)
+        if (settings.lines_before > 0) {
+             for (size_t i = 0; i < ctx.before_lines.size(); ++i) {
+                 const ContextRing::Line& buffered_line = ctx.before_lines[i];
+                 // Only print buffered lines that haven't already been printed
+                 if (buffered_line.number > ctx.last_printed_line) {
+                      if (ctx.pending_separator) {
+                         out.write("--");
+                         out.end_line();
+                         ctx.pending_separator = false; // Separator printed
+                      }
+                     // Print the buffered line with appropriate prefixes
+                     if (settings.json) {
+                         write_json_line(ctx, buffered_line.number, buffered_line.offset, '-', buffered_line.text, nullptr);
+                     } else {
+                         write_line(ctx, buffered_line.number, '-', buffered_line.text); // Use '-' separator for context
+                     }
+                     ctx.last_printed_line = buffered_line.number; // Update last printed line number
                  }
-                 // If -o, continue searching for more occurrences of *this* pattern
-                 // Advance position to search after the start of the current match
-                 // (to handle overlapping matches correctly if needed, though simple find won't overlap itself)
-                 current_pos = match_start + 1; // Or match_start + pattern.length() if non-overlapping needed
+             }
+             // Clear the buffer? No, keep it sliding.
+        }
 
-             } else {
-                 // Word boundary check failed, advance search position past this potential match
-                 current_pos = match_start + 1;
+        // 2. Print the Matching Line (or parts for -o)
+         if (line_number > ctx.last_printed_line) { // Ensure the matching line itself wasn't printed as context
+             if (ctx.pending_separator) {
+                 out.write("--");
+                 out.end_line();
+                 ctx.pending_separator = false;
              }
-        } // End while searching for current pattern
 
-        next_pattern:; // Label for goto
-         if (found_match_overall && !settings.only_matching) {
-             break; // Found a match with one pattern, stop checking others if not -o
+             // Choose output format based on --json and -o
+             if (settings.json) {
+                 // One event for the line, with the spans -o would print
+                 write_json_line(ctx, line_number, ctx.offset_of(line), ':', line, &match_positions);
+             } else if (settings.only_matching) {
+                 // Print only the matched parts, each on a new line
+                 for (const auto& match_pos : match_positions) {
+                     write_line(ctx, line_number, ':', line.substr(match_pos.first, match_pos.second));
+                 }
+             } else {
+                 // Print the whole line
+                 write_line(ctx, line_number, ':', line); // Use ':' separator for match line
+             }
+             ctx.last_printed_line = line_number; // Update last printed line number
          }
 
-    } // End for each pattern
 
-     // Sort matches by start position if -o is active
-     if (settings.only_matching && !match_positions.empty()) {
-         std::sort(match_positions.begin(), match_positions.end());
-     }
+        // 3. Set up Trailing Context (-A, -C)
+        // Set the counter for how many subsequent lines need to be printed
+        ctx.after_lines_to_print = settings.lines_after;
 
-    return found_match_overall;
-}
+    } else {
+        // Line did *not* match (or matched but -v is active)
+        // Check if it needs to be printed as part of trailing context (-A, -C)
+        if (ctx.after_lines_to_print > 0) {
+             if (line_number > ctx.last_printed_line) { // Avoid re-printing if already printed
+                  if (ctx.pending_separator) {
+                     // Separator might be needed if the previous block ended,
+                     // and this is the first line of trailing context.
+                     out.write("--");
+                     out.end_line();
+                     ctx.pending_separator = false;
+                  }
+                 // Print the context line with appropriate prefixes
+                 if (settings.json) {
+                     write_json_line(ctx, line_number, ctx.offset_of(line), '-', line, nullptr);
+                 } else {
+                     write_line(ctx, line_number, '-', line); // Use '-' separator for context
+                 }
+                 ctx.last_printed_line = line_number; // Update last printed line number
+             }
+            ctx.after_lines_to_print--; // Decrement the counter
+        }
+    }
 
+    // --- Update Context Buffer ---
+    // Remember the current line in the 'before' ring for potential future use (the ring
+    // keeps only the last lines_before of them)
+    if (settings.lines_before > 0) {
+        ctx.before_lines.push(line_number, ctx.offset_of(line), line);
+    }
 
-// Process a single input stream (file or stdin)
-void process_stream(std::istream& input, const std::string& filename, const Settings& settings, bool show_filename_prefix) {
-    std::string line;
-    long long line_number = 0;
-    long long match_count = 0;
-    bool filename_printed_for_l = false; // Track if filename printed for -l mode
+    // -m NUM: the input is done once the last selected line's trailing context is out
+    if (ctx.at_max_count() && ctx.after_lines_to_print == 0) ctx.done = true;
+}
 
-    // --- Context Handling Variables ---
-    // Buffer to store recent lines for -B context
-    std::deque<std::pair<long long, std::string>> before_buffer;
-    // Counter for how many lines to print *after* the current match for -A context
-    int after_lines_to_print = 0;
-    // Track the line number of the last line printed to manage context overlaps/separators
-    long long last_printed_line = -1;
-    // Flag to indicate if a "--" separator needs to be printed before the next output line
-    bool pending_separator = false;
+// Print one output line: optional "filename" and "line number" prefixes, each followed by
+// the separator (':' for matches, '-' for context), then the text
+void write_line(StreamContext& ctx, long long line_number, char separator, std::string_view text) {
+    OutputBuffer& out = ctx.out;
+    if (ctx.show_filename_prefix) {
+        out.write(ctx.filename);
+        out.write(separator);
+    }
+    if (ctx.settings.show_line_numbers) {
+        out.write_number(line_number);
+        out.write(separator);
+    }
+    out.write(text);
+    out.end_line();
+}
 
-    // Re-compile patterns here if needed (passed as arg would be better)
-    std::vector<std::regex> regex_patterns;
-     if (settings.use_extended_regex) {
-         try {
-             regex_patterns = compile_patterns(settings);
-         } catch (const std::regex_error& e) {
-             std::cerr << "scanr: [" << filename << "] Invalid regex: " << e.what() << std::endl;
-             return; // Cannot process this stream
-         }
-          catch (const std::exception& e) {
-             std::cerr << "scanr: [" << filename << "] Error compiling regex: " << e.what() << std::endl;
-             return;
-         }
-     }
+// --- JSON Output ---
 
-    // --- Main Line Processing Loop ---
-    while (std::getline(input, line)) {
-        line_number++;
-        std::vector<std::pair<size_t, size_t>> match_positions; // Stores {start_pos, length} for -o
-        bool is_match;
+// --json writes one JSON object per output line (JSON Lines), so other programs read the
+// fields instead of splitting "file:line:text", which breaks on names holding ':':
+//   {"type":"match","file":"src/a.c","line":12,"offset":3456,"text":"...","spans":[[4,11]]}
+//   {"type":"context","file":"src/a.c","line":13,"offset":3490,"text":"..."}
+// -l prints {"type":"file","file":...} and -c {"type":"count","file":...,"count":N}.
+// "text" is the line without its line end ("\n" or "\r\n"). Offsets are bytes from the
+// start of the input as it is read (of the decompressed text of a compressed file), byte
+// order mark included, for every encoding: a UTF-16 line's offset is where its first code
+// unit is. Spans are [start, end) bytes of the line as UTF-8, the raw bytes of a UTF-8 file.
+// "text" can only hold valid UTF-8, so a line that is not has U+FFFD there for each bad
+// byte, and its raw bytes, which the spans count, in "bytes" (base64), as ripgrep does:
+//   {"type":"match","file":"a.bin","line":3,"offset":80,"text":"caf\ufffd","bytes":"Y2Fm6Q==","spans":[[0,3]]}
 
-        // Perform the matching based on whether regex is used
-        if (settings.use_extended_regex) {
-            is_match = regex_matches(line, regex_patterns, settings, match_positions);
-        } else {
-            is_match = simple_matches(line, settings, match_positions);
+// Print a line event: a match (separator ':') with its spans, or a context line ('-')
+void write_json_line(StreamContext& ctx, long long line_number, unsigned long long offset, char separator, std::string_view text, const std::vector<std::pair<size_t, size_t>>* spans) {
+    OutputBuffer& out = ctx.out;
+    out.write(separator == ':' ? std::string_view("{\"type\":\"match\",\"file\":") : std::string_view("{\"type\":\"context\",\"file\":"));
+    write_json_string(out, ctx.filename);
+    out.write(",\"line\":");
+    out.write_number(line_number);
+    out.write(",\"offset\":");
+    out.write_number(static_cast<long long>(offset));
+    if (!text.empty() && text.back() == '\r') text.remove_suffix(1); // Of a CRLF line end
+    out.write(",\"text\":");
+    if (!write_json_string(out, text)) {
+        out.write(",\"bytes\":");
+        write_json_base64(out, text);
+    }
+    if (spans != nullptr) {
+        out.write(",\"spans\":[");
+        for (size_t i = 0; i < spans->size(); ++i) {
+            const auto& span = (*spans)[i];
+            size_t start = std::min(span.first, text.size()); // A span may take in the '\r'
+            out.write(i == 0 ? "[" : ",[");
+            out.write_number(static_cast<long long>(start));
+            out.write(',');
+            out.write_number(static_cast<long long>(std::min(span.first + span.second, text.size())));
+            out.write(']');
         }
+        out.write(']');
+    }
+    out.write('}');
+    out.end_line();
+}
 
-        // Determine if this line should be printed based on match status and -v (invert)
-        bool output_this_line = (is_match != settings.invert_match);
+// Print the event of -l (no count) or -c, without its line end
+void write_json_file(StreamContext& ctx, const long long* count) {
+    OutputBuffer& out = ctx.out;
+    out.write(count == nullptr ? std::string_view("{\"type\":\"file\",\"file\":") : std::string_view("{\"type\":\"count\",\"file\":"));
+    write_json_string(out, ctx.filename);
+    if (count != nullptr) {
+        out.write(",\"count\":");
+        out.write_number(*count);
+    }
+    out.write('}');
+}
 
-        // --- Output Logic ---
+// Length of the run of bytes at the start of 'data' that a JSON string holds as they are:
+// printable ASCII other than '"' and '\'. The vector kernels test 16 or 32 bytes at a time
+// with one signed compare (which also catches the bytes from 0x80 up, as negative) and two
+// equality tests, so plain text is copied to the output in long runs.
+static size_t json_plain_run_scalar(const char* data, size_t size) {
+    size_t i = 0;
+    while (i < size) {
+        unsigned char c = static_cast<unsigned char>(data[i]);
+        if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\') break;
+        ++i;
+    }
+    return i;
+}
 
-        if (output_this_line) {
-            // This line is considered a match for output purposes
-            match_count++;
+#if defined(SCANR_X86)
+SCANR_TARGET("sse2")
+static size_t json_plain_run_sse2(const char* data, size_t size) {
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(block, space), _mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash)));
+        unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(special));
+        if (bits != 0) return i + static_cast<size_t>(lowest_set_bit(bits));
+    }
+    return i + json_plain_run_scalar(data + i, size - i);
+}
 
-            // Handle -l (list filenames): print filename once and stop processing this file
-            if (settings.list_filenames) {
-                if (!filename_printed_for_l) {
-                    std::cout << filename << std::endl;
-                    filename_printed_for_l = true;
-                }
-                // Optimization: Stop reading this file now. Remove 'return' to match GNU grep exactly (reads whole file).
-                 return;
-            }
+SCANR_TARGET("avx2")
+static size_t json_plain_run_avx2(const char* data, size_t size) {
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i special = _mm256_or_si256(_mm256_cmpgt_epi8(space, block), _mm256_or_si256(_mm256_cmpeq_epi8(block, quote), _mm256_cmpeq_epi8(block, backslash)));
+        unsigned bits = static_cast<unsigned>(_mm256_movemask_epi8(special));
+        if (bits != 0) return i + static_cast<size_t>(lowest_set_bit(bits));
+    }
+    // The rest is tested here too: calling the SSE2 kernel with the upper halves of the
+    // registers in use would stall on the switch between AVX and SSE code, once per string
+    if (i + 16 <= size) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(block, _mm256_castsi256_si128(space)), _mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(quote)), _mm_cmpeq_epi8(block, _mm256_castsi256_si128(backslash))));
+        unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(special));
+        if (bits != 0) return i + static_cast<size_t>(lowest_set_bit(bits));
+        i += 16;
+    }
+    return i + json_plain_run_scalar(data + i, size - i);
+}
+#endif
 
-            // Handle -c (count only): increment count and continue to next line
-            if (settings.count_only) {
-                continue;
+#if defined(SCANR_NEON)
+static size_t json_plain_run_neon(const char* data, size_t size) {
+    const uint8x16_t space = vdupq_n_u8(0x20);
+    const uint8x16_t high = vdupq_n_u8(0x80);
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t block = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+        uint8x16_t special = vorrq_u8(vorrq_u8(vcltq_u8(block, space), vcgeq_u8(block, high)), vorrq_u8(vceqq_u8(block, quote), vceqq_u8(block, backslash)));
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(special), 4)), 0);
+        if (bits != 0) return i + static_cast<size_t>(lowest_set_bit(bits) / 4);
+    }
+    return i + json_plain_run_scalar(data + i, size - i);
+}
+#endif
+
+static size_t json_plain_run(const char* data, size_t size) {
+#if defined(SCANR_X86)
+    static const auto kernel = cpu_features().avx2 ? json_plain_run_avx2 : cpu_features().sse2 ? json_plain_run_sse2 : json_plain_run_scalar;
+    return kernel(data, size);
+#elif defined(SCANR_NEON)
+    return json_plain_run_neon(data, size);
+#else
+    return json_plain_run_scalar(data, size);
+#endif
+}
+
+// Print 'text' as a JSON string. Plain runs go from the input buffer straight into the
+// output buffer; valid UTF-8 is kept as it is, and bytes that are not valid UTF-8 become
+// U+FFFD. Returns false if any did, so the caller can add the raw bytes.
+bool write_json_string(OutputBuffer& out, std::string_view text) {
+    static const char kHex[] = "0123456789abcdef";
+    bool valid = true;
+    out.write('"');
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t run = json_plain_run(text.data() + pos, text.size() - pos);
+        if (run > 0) {
+            out.write(text.substr(pos, run));
+            pos += run;
+            if (pos == text.size()) break;
+        }
+        unsigned char c = static_cast<unsigned char>(text[pos]);
+        if (c >= 0x80) {
+            size_t start = pos;
+            char32_t code;
+            if (decode_utf8(text, pos, code)) {
+                out.write(text.substr(start, pos - start));
+            } else {
+                out.write("\xEF\xBF\xBD");
+                valid = false;
+                ++pos;
             }
+            continue;
+        }
+        switch (c) {
+        case '"': out.write("\\\""); break;
+        case '\\': out.write("\\\\"); break;
+        case '\n': out.write("\\n"); break;
+        case '\r': out.write("\\r"); break;
+        case '\t': out.write("\\t"); break;
+        case '\b': out.write("\\b"); break;
+        case '\f': out.write("\\f"); break;
+        default: {
+            char escape[6] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 15]};
+            out.write(std::string_view(escape, sizeof(escape)));
+        }
+        }
+        ++pos;
+    }
+    out.write('"');
+    return valid;
+}
+
+// Print 'bytes' as a JSON string of their base64 (RFC 4648, padded)
+void write_json_base64(OutputBuffer& out, std::string_view bytes) {
+    static const char kDigits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    out.write('"');
+    for (size_t i = 0; i < bytes.size(); i += 3) {
+        size_t count = std::min<size_t>(3, bytes.size() - i);
+        uint32_t group = 0;
+        for (size_t k = 0; k < 3; ++k) group = (group << 8) | (k < count ? static_cast<unsigned char>(bytes[i + k]) : 0u);
+        char digits[4] = {kDigits[group >> 18], kDigits[(group >> 12) & 63], kDigits[(group >> 6) & 63], kDigits[group & 63]};
+        if (count < 3) digits[3] = '=';
+        if (count < 2) digits[2] = '=';
+        out.write(std::string_view(digits, sizeof(digits)));
+    }
+    out.write('"');
+}
 
-            // --- Context and Regular Output ---
+// --- Decompression ---
 
-            // Determine if a separator is needed (gap since last printed line)
-             if ((settings.lines_before > 0 || settings.lines_after > 0) && last_printed_line != -1 && line_number > last_printed_line + 1) {
-                 pending_separator = true; // Mark that a separator is needed before the next output
-             }
+// The decoders themselves are in scanr_decompress.h; what is here runs them for the search
 
-            // 1. Print Leading Context (-B, -C)
-            if (settings.lines_before > 0) {
-                 for (const auto& buffered_line_pair : before_buffer) {
-                     // Only print buffered lines that haven't already been printed
-                     if (buffered_line_pair.first > last_printed_line) {
-                          if (pending_separator) {
-                             std::cout << "--" << std::endl;
-                             pending_separator = false; // Separator printed
-                          }
-                         // Print the buffered line with appropriate prefixes
-                         if (show_filename_prefix) std::cout << filename << "-"; // Use '-' separator for context
-                         if (settings.show_line_numbers) std::cout << buffered_line_pair.first << "-"; // Use '-' separator for context
-                         std::cout << buffered_line_pair.second << std::endl;
-                         last_printed_line = buffered_line_pair.first; // Update last printed line number
-                     }
-                 }
-                 // Clear the buffer? No, keep it sliding.
+Compression Decompressor::detect(const char* head, size_t size) {
+    if (size < kMagicSize) return Compression::kNone;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(head);
+    if (bytes[0] == 0x1F && bytes[1] == 0x8B && bytes[2] == 8 && (bytes[3] & 0xE0) == 0) return Compression::kGzip;
+    uint32_t magic = load_le32(bytes);
+    if (magic == kZstdMagic || (magic & 0xFFFFFFF0u) == kSkippableMagic) return Compression::kZstd;
+    if (magic == kLz4Magic) return Compression::kLz4;
+    return Compression::kNone;
+}
+
+bool Decompressor::could_be_compressed(const char* head, size_t size) {
+    static constexpr unsigned char kMagics[4][3] = {{0x1F, 0x8B, 0x08}, {0x28, 0xB5, 0x2F}, {0x04, 0x22, 0x4D}, {0x50, 0x2A, 0x4D}};
+    if (size >= kMagicSize) return false;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(head);
+    for (const auto& magic : kMagics) {
+        bool prefix = true;
+        for (size_t i = 0; i < size && prefix; ++i) prefix = (i == 0 && magic[0] == 0x50) ? (bytes[0] & 0xF0) == 0x50 : bytes[i] == magic[i];
+        if (prefix) return true;
+    }
+    return false;
+}
+
+Decompressor::Decompressor(Compression format, const char* data, size_t size, unsigned threads)
+    : format_(format), source_(std::make_unique<ByteSource>(data, size)), data_(data), data_size_(size), threads_(std::max(1u, threads)) {
+    thread_ = std::thread([this] { decode(); });
+}
+
+Decompressor::Decompressor(Compression format, int fd, const char* head, size_t head_size)
+    : format_(format), source_(std::make_unique<ByteSource>(fd, head, head_size)) {
+    thread_ = std::thread([this] { decode(); });
+}
+
+Decompressor::~Decompressor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closing_ = true;
+    }
+    space_cv_.notify_all();
+    thread_.join();
+}
+
+size_t Decompressor::read(char* buffer, size_t size) {
+    while (current_used_ == current_.size()) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_cv_.wait(lock, [this] { return !queue_.empty() || finished_; });
+        if (queue_.empty()) {
+            drained_ = true;
+            return 0;
+        }
+        current_ = std::move(queue_.front());
+        queue_.pop_front();
+        current_used_ = 0;
+        lock.unlock();
+        space_cv_.notify_one();
+    }
+    size_t take = std::min(size, current_.size() - current_used_);
+    std::memcpy(buffer, current_.data() + current_used_, take);
+    current_used_ += take;
+    size_ += take;
+    return take;
+}
+
+bool Decompressor::push(std::vector<char>&& text) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    space_cv_.wait(lock, [this] { return queue_.size() < kMaxBlocks || closing_; });
+    if (closing_) return false;
+    queue_.push_back(std::move(text));
+    lock.unlock();
+    ready_cv_.notify_one();
+    return true;
+}
+
+void Decompressor::decode() {
+    std::vector<std::pair<size_t, size_t>> frames;
+    if (threads_ > 1 && format_ != Compression::kGzip && data_ != nullptr &&
+        split_frames(reinterpret_cast<const unsigned char*>(data_), data_size_, frames) && frames.size() > 1) {
+        decode_frames(frames);
+    } else {
+        DecodeWindow window([this](const char* text, size_t size) { return push(std::vector<char>(text, text + size)); });
+        try {
+            if (format_ == Compression::kGzip) {
+                decode_gzip(*source_, window);
+            } else {
+                decode_zstd_frames(*source_, window);
             }
+            window.finish();
+        } catch (const DecodeStopped&) {
+        } catch (const std::exception& e) {
+            error_ = e.what();
+            try {
+                window.finish(); // The text decoded before the damage is searched
+            } catch (const DecodeStopped&) {
+            }
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished_ = true;
+    }
+    ready_cv_.notify_all();
+}
 
-            // 2. Print the Matching Line (or parts for -o)
-             if (line_number > last_printed_line) { // Ensure the matching line itself wasn't printed as context
-                 if (pending_separator) {
-                     std::cout << "--" << std::endl;
-                     pending_separator = false;
-                 }
+// Independent frames decoded on threads_ threads, at most two per thread ahead of the one
+// the search is reading, and handed on in order
+void Decompressor::decode_frames(const std::vector<std::pair<size_t, size_t>>& frames) {
+    struct Slot {
+        std::vector<char> text;
+        std::string error;
+        bool done = false;
+    };
+    std::vector<Slot> slots(frames.size());
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t next = 0;    // The next frame to decode
+    size_t handed = 0;  // Frames handed on
+    std::atomic<bool> stop{false};
+    size_t ahead = 2 * static_cast<size_t>(threads_);
+    auto work = [&] {
+        for (;;) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return stop || next >= frames.size() || next < handed + ahead; });
+                if (stop || next >= frames.size()) return;
+                index = next++;
+            }
+            std::vector<char> text;
+            std::string error;
+            ByteSource source(data_ + frames[index].first, frames[index].second);
+            DecodeWindow window([&](const char* decoded, size_t size) {
+                text.insert(text.end(), decoded, decoded + size);
+                return !stop;
+            });
+            try {
+                decode_zstd_frames(source, window);
+                window.finish();
+            } catch (const DecodeStopped&) {
+            } catch (const std::exception& e) {
+                error = e.what();
+                try {
+                    window.finish();
+                } catch (const DecodeStopped&) {
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slots[index].text = std::move(text);
+                slots[index].error = std::move(error);
+                slots[index].done = true;
+            }
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threads_; ++i) threads.emplace_back(work);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        std::vector<char> text;
+        std::string error;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return slots[i].done; });
+            text = std::move(slots[i].text);
+            error = std::move(slots[i].error);
+            ++handed;
+        }
+        cv.notify_all();
+        if (!text.empty() && !push(std::move(text))) break;
+        if (!error.empty()) {
+            error_ = error;
+            break;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    for (auto& thread : threads) thread.join();
+}
 
-                 // Choose output format based on -o
-                 if (settings.only_matching) {
-                     // Print only the matched parts, each on a new line
-                     for (const auto& match_pos : match_positions) {
-                         if (show_filename_prefix) std::cout << filename << ":";
-                         if (settings.show_line_numbers) std::cout << line_number << ":";
-                         std::cout << line.substr(match_pos.first, match_pos.second) << std::endl;
-                     }
-                 } else {
-                     // Print the whole line
-                     if (show_filename_prefix) std::cout << filename << ":"; // Use ':' separator for match line
-                     if (settings.show_line_numbers) std::cout << line_number << ":"; // Use ':' separator for match line
-                     std::cout << line << std::endl;
-                 }
-                 last_printed_line = line_number; // Update last printed line number
-             }
+// --- Text Encodings ---
+
+// Length of the byte order mark at the start of 'data' (0 if there is none); 'encoding'
+// is set to the encoding it announces
+size_t byte_order_mark(const char* data, size_t size, TextEncoding& encoding) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    encoding = TextEncoding::kUtf8;
+    if (size >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF) return 3;
+    if (size >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
+        encoding = TextEncoding::kUtf16LE;
+        return 2;
+    }
+    if (size >= 2 && bytes[0] == 0xFE && bytes[1] == 0xFF) {
+        encoding = TextEncoding::kUtf16BE;
+        return 2;
+    }
+    return 0;
+}
 
+// The code unit at 'at' (two bytes)
+static inline unsigned utf16_unit(const char* at, TextEncoding encoding) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(at);
+    return encoding == TextEncoding::kUtf16LE ? bytes[0] | (bytes[1] << 8) : (bytes[0] << 8) | bytes[1];
+}
 
-            // 3. Set up Trailing Context (-A, -C)
-            // Set the counter for how many subsequent lines need to be printed
-            after_lines_to_print = settings.lines_after;
+// The binary probe of looks_binary, for UTF-16: a NUL code unit near the start
+bool utf16_looks_binary(const char* data, size_t size) {
+    constexpr size_t kProbeSize = 32 * 1024;
+    size = std::min(size, kProbeSize) & ~size_t(1);
+    for (size_t i = 0; i < size; i += 2) {
+        if (data[i] == '\0' && data[i + 1] == '\0') return true;
+    }
+    return false;
+}
 
-        } else {
-            // Line did *not* match (or matched but -v is active)
-            // Check if it needs to be printed as part of trailing context (-A, -C)
-            if (after_lines_to_print > 0) {
-                 if (line_number > last_printed_line) { // Avoid re-printing if already printed
-                      if (pending_separator) {
-                         // Separator might be needed if the previous block ended,
-                         // and this is the first line of trailing context.
-                         std::cout << "--" << std::endl;
-                         pending_separator = false;
-                      }
-                     // Print the context line with appropriate prefixes
-                     if (show_filename_prefix) std::cout << filename << "-"; // Use '-' separator for context
-                     if (settings.show_line_numbers) std::cout << line_number << "-"; // Use '-' separator for context
-                     std::cout << line << std::endl;
-                     last_printed_line = line_number; // Update last printed line number
-                 }
-                after_lines_to_print--; // Decrement the counter
+// Number of line feed code units in [begin, end), which starts at a code unit. memchr finds
+// the '\n' byte; it only ends a line in the half of a unit that holds the low byte, with a
+// zero high byte.
+long long count_utf16_newlines(const char* begin, const char* end, TextEncoding encoding) {
+    size_t low = encoding == TextEncoding::kUtf16LE ? 0 : 1;
+    long long count = 0;
+    const char* at = begin;
+    while (at < end) {
+        const char* found = static_cast<const char*>(std::memchr(at, '\n', static_cast<size_t>(end - at)));
+        if (found == nullptr) break;
+        size_t offset = static_cast<size_t>(found - begin);
+        if (offset % 2 == low && utf16_unit(begin + offset - low, encoding) == '\n' && begin + offset - low + 2 <= end) ++count;
+        at = found + 1;
+    }
+    return count;
+}
+
+// Decode UTF-16 into UTF-8, replacing unpaired surrogates with U+FFFD. A trailing odd byte
+// is dropped.
+void utf16_to_utf8(const char* data, size_t size, TextEncoding encoding, std::string& text) {
+    text.clear();
+    text.reserve(size + size / 2);
+    size &= ~size_t(1);
+    for (size_t i = 0; i < size; i += 2) {
+        unsigned code = utf16_unit(data + i, encoding);
+        if (code >= 0xD800 && code <= 0xDBFF && i + 2 < size) {
+            unsigned low = utf16_unit(data + i + 2, encoding);
+            if (low >= 0xDC00 && low <= 0xDFFF) {
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
             }
         }
+        if (code >= 0xD800 && code <= 0xDFFF) code = 0xFFFD;
+        append_utf8(text, code);
+    }
+}
 
-        // --- Update Context Buffer ---
-        // Add the current line to the 'before' buffer for potential future use
-        if (settings.lines_before > 0) {
-            before_buffer.push_back({line_number, line});
-            // Keep the buffer size limited to lines_before
-            if (before_buffer.size() > static_cast<size_t>(settings.lines_before)) {
-                before_buffer.pop_front(); // Remove the oldest line
+// Encode UTF-8 'text' as UTF-16 code units (bytes in 'encoding'). False if 'text' is not
+// valid UTF-8: such a pattern matches decoded text only through the bytes of other
+// characters, which its UTF-16 form would not find.
+bool utf8_to_utf16(std::string_view text, TextEncoding encoding, std::string& units) {
+    units.clear();
+    auto put = [&](unsigned unit) {
+        char high = static_cast<char>(unit >> 8), low = static_cast<char>(unit & 0xFF);
+        units.push_back(encoding == TextEncoding::kUtf16LE ? low : high);
+        units.push_back(encoding == TextEncoding::kUtf16LE ? high : low);
+    };
+    for (size_t i = 0; i < text.size();) {
+        char32_t code;
+        if (!decode_utf8(text, i, code)) return false;
+        if (code >= 0x10000) {
+            put(0xD800 + ((code - 0x10000) >> 10));
+            put(0xDC00 + ((code - 0x10000) & 0x3FF));
+        } else {
+            put(code);
+        }
+    }
+    return true;
+}
+
+const MultiLiteralMatcher* CompiledMatcher::utf16_required(TextEncoding encoding, const Settings& settings) const {
+    size_t which = encoding == TextEncoding::kUtf16BE ? 1 : 0;
+    std::call_once(utf16->built[which], [&] {
+        if (!required_literals_known) return;
+        std::vector<std::string> encoded(required_literals.size());
+        for (size_t i = 0; i < required_literals.size(); ++i) {
+            if (!utf8_to_utf16(required_literals[i], encoding, encoded[i])) return;
+        }
+        // Under -i the literal engine folds the ASCII letters of every byte. Here that also
+        // folds bytes of other characters, which only lets more lines through to be matched.
+        utf16->literals[which].build(encoded, settings.ignore_case);
+        utf16->usable[which] = true;
+    });
+    return utf16->usable[which] ? &utf16->literals[which] : nullptr;
+}
+
+// Search UTF-16 text (after its byte order mark). The required literals of the patterns,
+// encoded as UTF-16, are searched for in the raw bytes, so text without a candidate is never
+// decoded: only the lines around hits are converted to UTF-8, matched and printed. -v and
+// context lines need every line, as do patterns without required literals; then the whole
+// text is converted and searched like a UTF-8 file. The --json offsets are still those of
+// the UTF-16 input, whose byte order mark 'bom' is before 'data'.
+void search_utf16(StreamContext& ctx, const char* data, size_t size, TextEncoding encoding, size_t bom) {
+    const Settings& settings = ctx.settings;
+    size &= ~size_t(1); // A trailing odd byte is not a code unit
+    if (settings.binary_files != BinaryFiles::kText && utf16_looks_binary(data, size)) {
+        if (settings.binary_files == BinaryFiles::kWithoutMatch) return;
+        ctx.binary = true;
+    }
+    const MultiLiteralMatcher* required = ctx.matcher.utf16_required(encoding, settings);
+    if (required == nullptr || settings.invert_match || settings.lines_before > 0 || settings.lines_after > 0) {
+        std::string text;
+        utf16_to_utf8(data, size, encoding, text);
+        ctx.set_buffer(text.data(), 0);
+        if (settings.json) {
+            // Where each line starts in the text and in the input: the '\n' bytes of the
+            // UTF-8 are the line feed units of the UTF-16, one for one
+            ctx.line_offsets.emplace_back(0, bom);
+            size_t unit = 0;
+            for (size_t at = text.find('\n'); at != std::string::npos; at = text.find('\n', at + 1)) {
+                while (utf16_unit(data + unit, encoding) != '\n') unit += 2;
+                unit += 2;
+                ctx.line_offsets.emplace_back(at + 1, bom + unit);
             }
         }
-    } // End while getline loop
+        search_lines(ctx, text.data(), text.size());
+        return;
+    }
+
+    std::string_view units(data, size);
+    std::string& decoded = ctx.scratch.utf8_line;
+    size_t pos = 0;  // Start of the first line not looked at yet
+    size_t from = 0; // Where the literal search resumes
+    while (from < size && !ctx.stopped()) {
+        size_t hit = required->find(units, from);
+        if (hit == std::string_view::npos) break;
+
+        // A hit straddling two code units is no occurrence of the literal, but its line is
+        // matched anyway: the search can then resume after the line without missing a hit
+        size_t line_start = hit & ~size_t(1);
+        while (line_start > pos && utf16_unit(data + line_start - 2, encoding) != '\n') line_start -= 2;
+        ctx.line_number += settings.show_line_numbers ? count_utf16_newlines(data + pos, data + line_start, encoding) : (line_start > pos);
+        size_t line_end = hit & ~size_t(1);
+        while (line_end < size && utf16_unit(data + line_end, encoding) != '\n') line_end += 2;
+
+        utf16_to_utf8(data + line_start, line_end - line_start, encoding, decoded);
+        std::string_view line = make_line(decoded.data(), decoded.data() + decoded.size());
+        ctx.set_buffer(decoded.data(), bom + line_start);
+        bool is_match = ctx.matcher.matches(line, settings, ctx.scratch.positions, ctx.scratch);
+        handle_line(ctx, line, is_match, ctx.scratch.positions);
+        pos = from = std::min(line_end + 2, size);
+    }
+}
 
-    // --- Final Output After Processing Stream ---
-    // Print the total count if -c was specified
-    if (settings.count_only) {
+// --- Final Output After Processing Stream ---
+void finish_stream(StreamContext& ctx) {
+    const Settings& settings = ctx.settings;
+    // Print the total count if -c was specified (-l already reported this input if it listed it)
+    if (settings.count_only && !ctx.listed && !settings.quiet) {
         // Prefix with filename if multiple files were given or if explicitly not hidden
-        if (show_filename_prefix || (settings.files.size() == 1 && !settings.hide_filenames) || filename == "(standard input)") {
-             std::cout << filename << ":";
+        // (a recursive search always names the file a count belongs to)
+        if (settings.json) {
+             write_json_file(ctx, &ctx.match_count);
+        } else {
+            if (ctx.show_filename_prefix || ((settings.files.size() == 1 || settings.recursive) && !settings.hide_filenames) || ctx.filename == "(standard input)") {
+                 ctx.out.write(ctx.filename);
+                 ctx.out.write(':');
+            }
+            ctx.out.write_number(ctx.match_count);
         }
-        std::cout << match_count << std::endl;
+        ctx.out.end_line();
     }
+    // No flush at the file boundary: a recursive search may go through millions of files,
+    // and error messages flush the output before they are printed anyway
 }
@@ -0,0 +1,694 @@
+// scanr_bench: Reproducible benchmark corpora and a fixed query matrix for scanr.
+//
+// The corpora are generated from a fixed seed, so every machine searches the same bytes, and
+// are kept between runs. Each query of the matrix is run against a scanr binary a few times;
+// the results are printed as JSON: throughput (MB/s, lines/s), peak resident memory, output
+// size, and heap allocations per line when scanr is built with -DSCANR_COUNT_ALLOCATIONS.
+// With --compare, an earlier result file is the baseline, and the exit status tells whether
+// any query got slower than --tolerance allows.
+//
+// Build: g++ -std=c++17 -O2 -o scanr_bench scanr_bench.cpp
+#include <iostream>        // For progress and error messages
+#include <fstream>         // For writing corpora and reading result files
+#include <sstream>         // For formatting the JSON report
+#include <iomanip>         // For setprecision
+#include <string>          // For paths and arguments
+#include <string_view>     // For word lists
+#include <vector>          // For queries and timings
+#include <algorithm>       // For std::sort, std::count
+#include <iterator>        // For std::size
+#include <chrono>          // For timing each run
+#include <thread>          // For hardware_concurrency
+#include <filesystem>      // For creating and measuring the corpus tree
+#include <cstdint>         // For uint64_t
+#include <cstdio>          // For snprintf
+#include <cstdlib>         // For strtod, strtoll
+
+#include "scanr_test_support.h" // For Rng and run_child
+
+namespace fs = std::filesystem;
+
+// Bumped whenever the generators change, so stale corpora are regenerated
+constexpr int kCorpusVersion = 1;
+
+// Structure to hold the parsed command-line options
+struct BenchSettings {
+#ifdef _WIN32
+    std::string scanr = "scanr.exe";       // --scanr PATH: Binary under test
+#else
+    std::string scanr = "./scanr";
+#endif
+    std::string corpus_dir = "scanr_bench_corpus"; // --corpus DIR: Where the corpora are kept
+    double scale = 1.0;                    // --scale X: Corpus size factor (1 is about 500 MB)
+    int repeat = 3;                        // --repeat N: Timed runs per query, after one warm-up run
+    int jobs = 0;                          // --jobs N: Pass -j N to scanr (0: scanr's default)
+    std::string output;                    // --output FILE: Write the JSON there instead of stdout
+    std::string compare;                   // --compare FILE: Baseline results to check against
+    double tolerance = 10.0;               // --tolerance PCT: Allowed MB/s loss against the baseline
+};
+
+// One generated input: a file, or a directory searched with -r
+struct Corpus {
+    std::string name;
+    std::string path;
+    unsigned long long bytes = 0;
+    unsigned long long lines = 0;
+    unsigned long long files = 0;
+};
+
+// One entry of the query matrix. "{patterns}" in the arguments stands for the 10k pattern file;
+// the corpus path is appended after them.
+struct Query {
+    std::string name;
+    std::string corpus;
+    std::vector<std::string> args;
+};
+
+// What one run of scanr measured
+struct RunResult {
+    int exit_code = -1;
+    double seconds = 0;
+    unsigned long long output_bytes = 0;
+    unsigned long long peak_rss = 0;       // Bytes (0 if the platform does not report it)
+    long long allocations = -1;            // From --stats; -1 if the build does not count them
+};
+
+// The summary of all runs of one query
+struct QueryResult {
+    const Query* query = nullptr;
+    const Corpus* corpus = nullptr;
+    std::vector<std::string> args;         // As passed to scanr
+    RunResult best;                        // The fastest run
+    double seconds_median = 0;
+    unsigned long long peak_rss = 0;       // Highest of all runs
+};
+
+// Buffered binary file output for the generators
+class CorpusWriter {
+public:
+    explicit CorpusWriter(const std::string& path) : file_(path, std::ios::binary) {}
+    ~CorpusWriter() { flush(); }
+    CorpusWriter(const CorpusWriter&) = delete;
+    CorpusWriter& operator=(const CorpusWriter&) = delete;
+
+    bool ok() const { return static_cast<bool>(file_); }
+    unsigned long long bytes() const { return written_ + buffer_.size(); }
+
+    CorpusWriter& operator<<(std::string_view text) {
+        buffer_.append(text.data(), text.size());
+        if (buffer_.size() >= kFlushSize) flush();
+        return *this;
+    }
+    CorpusWriter& operator<<(char c) {
+        buffer_.push_back(c);
+        return *this;
+    }
+    CorpusWriter& operator<<(unsigned long long number) { return *this << std::string_view(std::to_string(number)); }
+
+    void flush() {
+        file_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+        written_ += buffer_.size();
+        buffer_.clear();
+    }
+
+private:
+    static constexpr size_t kFlushSize = 1 << 20;
+    std::ofstream file_;
+    std::string buffer_;
+    unsigned long long written_ = 0;
+};
+
+// --- Function Prototypes ---
+void print_usage();
+bool parse_arguments(int argc, char* argv[], BenchSettings& settings);
+bool prepare_corpora(const BenchSettings& settings, std::vector<Corpus>& corpora);
+bool generate_corpora(const BenchSettings& settings);
+void generate_log(const std::string& path, unsigned long long target_bytes, uint64_t seed);
+void write_log_line(CorpusWriter& out, Rng& rng);
+void generate_source(const std::string& path, unsigned long long target_bytes, uint64_t seed);
+void write_source_line(CorpusWriter& out, Rng& rng);
+void generate_long_lines(const std::string& path, unsigned long long target_bytes, uint64_t seed);
+void generate_binary_mix(const std::string& path, unsigned long long target_bytes, uint64_t seed);
+void generate_small_files(const std::string& dir, unsigned long long file_count, uint64_t seed);
+void generate_patterns(const std::string& path, size_t count, uint64_t seed);
+void measure_corpus(Corpus& corpus);
+void count_file(const fs::path& path, Corpus& corpus);
+std::vector<Query> query_matrix();
+bool run_query(const BenchSettings& settings, const Query& query, const Corpus& corpus, QueryResult& result);
+bool run_scanr(const std::string& scanr, const std::vector<std::string>& args, const std::string& stderr_path, RunResult& result);
+long long parse_allocations(const std::string& stderr_path);
+std::string format_report(const BenchSettings& settings, const std::vector<Corpus>& corpora, const std::vector<QueryResult>& results);
+std::string json_string(const std::string& text);
+std::string json_number(double value);
+int compare_with_baseline(const std::string& baseline_path, const std::vector<QueryResult>& results, double tolerance);
+
+// --- Main Function ---
+int main(int argc, char* argv[]) {
+    BenchSettings settings;
+    if (!parse_arguments(argc, argv, settings)) {
+        print_usage();
+        return 2;
+    }
+
+    std::vector<Corpus> corpora;
+    if (!prepare_corpora(settings, corpora)) return 2;
+
+    std::vector<Query> queries = query_matrix();
+    std::vector<QueryResult> results;
+    results.reserve(queries.size());
+    bool failed = false;
+    for (const Query& query : queries) {
+        const Corpus* corpus = nullptr;
+        for (const Corpus& candidate : corpora) {
+            if (candidate.name == query.corpus) corpus = &candidate;
+        }
+        QueryResult result;
+        if (corpus == nullptr || !run_query(settings, query, *corpus, result)) return 2;
+        // grep's convention: 0 and 1 are answers (lines selected or not), anything else an error
+        if (result.best.exit_code < 0 || result.best.exit_code > 1) {
+            std::cerr << "scanr_bench: " << query.name << ": scanr exited with status " << result.best.exit_code << std::endl;
+            failed = true;
+        }
+        results.push_back(result);
+    }
+
+    std::string report = format_report(settings, corpora, results);
+    if (settings.output.empty()) {
+        std::cout << report;
+    } else {
+        std::ofstream file(settings.output, std::ios::binary);
+        file << report;
+        if (!file) {
+            std::cerr << "scanr_bench: cannot write '" << settings.output << "'" << std::endl;
+            return 2;
+        }
+    }
+    if (failed) return 2;
+
+    if (!settings.compare.empty()) return compare_with_baseline(settings.compare, results, settings.tolerance);
+    return 0;
+}
+
+// --- Helper Functions ---
+
+void print_usage() {
+    std::cerr << "Usage: scanr_bench [OPTIONS]\n"
+              << "Run scanr over generated corpora and print the results as JSON.\n\n"
+              << "Options:\n"
+              << "  --scanr PATH       scanr binary to measure (default: ./scanr, scanr.exe on Windows)\n"
+              << "  --corpus DIR       Directory of the generated corpora (default: scanr_bench_corpus)\n"
+              << "  --scale X          Corpus size factor; 1 is about 500 MB (default: 1)\n"
+              << "  --repeat N         Timed runs per query, after one warm-up run (default: 3)\n"
+              << "  --jobs N           Pass -j N to scanr (default: scanr's own default)\n"
+              << "  --output FILE      Write the JSON report to FILE instead of standard output\n"
+              << "  --compare FILE     Compare MB/s with an earlier report; exit with status 1 on a regression\n"
+              << "  --tolerance PCT    MB/s loss --compare accepts before calling it a regression (default: 10)\n"
+              << "  --help             Show this help message\n";
+}
+
+bool parse_arguments(int argc, char* argv[], BenchSettings& settings) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help") return false;
+        if (i + 1 >= argc) {
+            std::cerr << "scanr_bench: Unknown option or missing value: '" << arg << "'" << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--scanr") {
+                settings.scanr = value;
+            } else if (arg == "--corpus") {
+                settings.corpus_dir = value;
+            } else if (arg == "--scale") {
+                settings.scale = std::stod(value);
+                if (settings.scale <= 0) throw std::invalid_argument("scale");
+            } else if (arg == "--repeat") {
+                settings.repeat = std::stoi(value);
+                if (settings.repeat < 1) throw std::invalid_argument("repeat");
+            } else if (arg == "--jobs") {
+                settings.jobs = std::stoi(value);
+                if (settings.jobs < 1) throw std::invalid_argument("jobs");
+            } else if (arg == "--output") {
+                settings.output = value;
+            } else if (arg == "--compare") {
+                settings.compare = value;
+            } else if (arg == "--tolerance") {
+                settings.tolerance = std::stod(value);
+                if (settings.tolerance < 0) throw std::invalid_argument("tolerance");
+            } else {
+                std::cerr << "scanr_bench: Unknown option '" << arg << "'" << std::endl;
+                return false;
+            }
+        } catch (const std::exception&) {
+            std::cerr << "scanr_bench: Invalid value for " << arg << ": '" << value << "'" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// --- Corpora ---
+
+// Reuse the corpora of an earlier run when version and scale match; generate them otherwise.
+// The stamp file is written last, so an interrupted generation is redone.
+bool prepare_corpora(const BenchSettings& settings, std::vector<Corpus>& corpora) {
+    std::ostringstream stamp_text;
+    stamp_text << "scanr_bench corpus " << kCorpusVersion << " scale " << settings.scale << "\n";
+    fs::path dir(settings.corpus_dir);
+    fs::path stamp_path = dir / "corpus.stamp";
+
+    std::string existing;
+    {
+        std::ifstream stamp(stamp_path, std::ios::binary);
+        std::getline(stamp, existing, '\0');
+    }
+    if (existing != stamp_text.str()) {
+        std::error_code error;
+        fs::remove_all(dir, error);
+        fs::create_directories(dir, error);
+        if (error) {
+            std::cerr << "scanr_bench: cannot create '" << settings.corpus_dir << "': " << error.message() << std::endl;
+            return false;
+        }
+        std::cerr << "scanr_bench: generating corpora in '" << settings.corpus_dir << "'..." << std::endl;
+        if (!generate_corpora(settings)) return false;
+        std::ofstream stamp(stamp_path, std::ios::binary);
+        stamp << stamp_text.str();
+    }
+
+    for (const char* name : {"logs", "source", "long_lines", "binary_mix", "small_files", "huge"}) {
+        Corpus corpus;
+        corpus.name = name;
+        corpus.path = (dir / (corpus.name == "small_files" ? "small_files" : corpus.name + ".txt")).string();
+        measure_corpus(corpus);
+        if (corpus.files == 0) {
+            std::cerr << "scanr_bench: corpus '" << corpus.path << "' is missing; delete '" << settings.corpus_dir << "' to regenerate it" << std::endl;
+            return false;
+        }
+        corpora.push_back(corpus);
+    }
+    return true;
+}
+
+bool generate_corpora(const BenchSettings& settings) {
+    fs::path dir(settings.corpus_dir);
+    auto size = [&](double mib) { return static_cast<unsigned long long>(mib * settings.scale * 1024 * 1024); };
+
+    // Every corpus has a seed of its own, so changing one generator leaves the others as they were
+    generate_log((dir / "logs.txt").string(), size(64), 1);
+    generate_source((dir / "source.txt").string(), size(32), 2);
+    generate_long_lines((dir / "long_lines.txt").string(), size(32), 3);
+    generate_binary_mix((dir / "binary_mix.txt").string(), size(16), 4);
+    generate_small_files((dir / "small_files").string(), std::max<unsigned long long>(1, static_cast<unsigned long long>(20000 * settings.scale)), 5);
+    generate_log((dir / "huge.txt").string(), size(256), 6);
+    generate_patterns((dir / "patterns_10k.txt").string(), 10000, 7);
+
+    std::error_code error;
+    if (!fs::exists(dir / "patterns_10k.txt", error) || error) {
+        std::cerr << "scanr_bench: writing the corpora failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Word lists shared by the generators
+static const std::string_view kComponents[] = {"auth", "db", "cache", "http", "queue", "scheduler", "storage", "billing"};
+static const std::string_view kUsers[] = {"alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi"};
+static const std::string_view kWords[] = {
+    "request", "completed", "failed", "retrying", "connection", "refused", "timeout", "session",
+    "expired", "warning", "threshold", "exceeded", "cache", "miss", "hit", "write", "read", "flush",
+    "commit", "rollback", "payload", "checksum", "mismatch", "backlog", "worker", "started", "stopped",
+    "token", "renewed", "latency", "slow", "query", "index", "rebuilt", "quota", "limit", "reached",
+    "error", "handled", "upstream", "replica", "lag", "snapshot", "saved", "the", "a", "for", "from", "to"};
+static const std::string_view kIdentifiers[] = {
+    "buffer", "count", "index", "result", "node", "entry", "value", "offset", "length", "state",
+    "config", "handler", "stream", "matcher", "pattern", "line", "context", "reader", "writer", "cache"};
+static const std::string_view kHeaders[] = {"vector", "string", "memory", "algorithm", "map", "cstring", "mutex", "thread"};
+
+// Log-like text: timestamp, level, component, a message, key=value fields, sometimes an HTTP request.
+// Levels are skewed as in real logs: FATAL is rare, ERROR uncommon, INFO everywhere.
+void generate_log(const std::string& path, unsigned long long target_bytes, uint64_t seed) {
+    CorpusWriter out(path);
+    Rng rng(seed);
+    while (out.ok() && out.bytes() < target_bytes) write_log_line(out, rng);
+}
+
+void write_log_line(CorpusWriter& out, Rng& rng) {
+    char stamp[64];
+    std::snprintf(stamp, sizeof(stamp), "2024-%02u-%02u %02u:%02u:%02u.%03u ",
+                  static_cast<unsigned>(1 + rng.below(12)), static_cast<unsigned>(1 + rng.below(28)),
+                  static_cast<unsigned>(rng.below(24)), static_cast<unsigned>(rng.below(60)),
+                  static_cast<unsigned>(rng.below(60)), static_cast<unsigned>(rng.below(1000)));
+    out << std::string_view(stamp);
+
+    size_t level = rng.below(1000);
+    out << (level < 600 ? "INFO" : level < 850 ? "DEBUG" : level < 950 ? "WARN" : level < 998 ? "ERROR" : "FATAL");
+    out << " [" << rng.pick(kComponents) << "] ";
+
+    size_t words = 3 + rng.below(8);
+    for (size_t i = 0; i < words; ++i) {
+        std::string_view word = rng.pick(kWords);
+        if (word == "warning" && rng.one_in(3)) word = "Warning"; // Mixed case for -i
+        out << word << ' ';
+    }
+    out << "user=" << rng.pick(kUsers) << " id=" << static_cast<unsigned long long>(rng.below(1000000));
+    if (rng.one_in(3)) {
+        out << " GET /api/v" << static_cast<unsigned long long>(1 + rng.below(3)) << (rng.one_in(2) ? "/items " : "/orders ")
+            << (rng.one_in(10) ? "500 " : "200 ") << static_cast<unsigned long long>(rng.below(2000)) << "ms";
+    }
+    out << '\n';
+}
+
+// Source-like text: indented statements, braces, includes and comments (some of them TODOs)
+void generate_source(const std::string& path, unsigned long long target_bytes, uint64_t seed) {
+    CorpusWriter out(path);
+    Rng rng(seed);
+    while (out.ok() && out.bytes() < target_bytes) write_source_line(out, rng);
+}
+
+void write_source_line(CorpusWriter& out, Rng& rng) {
+    size_t indent = rng.below(4);
+    for (size_t i = 0; i < indent; ++i) out << "    ";
+    std::string_view a = rng.pick(kIdentifiers), b = rng.pick(kIdentifiers), c = rng.pick(kIdentifiers);
+    switch (rng.below(12)) {
+    case 0: out << "if (" << a << " != nullptr && " << a << "->" << b << "()) {"; break;
+    case 1: out << "return " << a << "_" << b << ";"; break;
+    case 2: out << "for (size_t i = 0; i < " << a << ".size(); ++i) {"; break;
+    case 3: out << "}"; break;
+    case 4: out << (rng.one_in(4) ? "// TODO: " : "// ") << rng.pick(kWords) << ' ' << a << ' ' << rng.pick(kWords); break;
+    case 5: out << a << " = " << b << "(" << c << ", " << a << ");"; break;
+    case 6: out << "#include <" << rng.pick(kHeaders) << ">"; break;
+    case 7: out << "std::vector<int> " << a << "_" << c << ";"; break;
+    case 8: out << "const auto& " << b << " = " << a << "[" << c << "];"; break;
+    case 9: out << "/* " << rng.pick(kWords) << ' ' << rng.pick(kWords) << " */"; break;
+    case 10: break; // Blank line
+    default: out << a << "." << b << "(" << (rng.one_in(2) ? "true" : "false") << ");"; break;
+    }
+    out << '\n';
+}
+
+// Lines of 16 KiB to 256 KiB of words, with a rare "needle" somewhere in them
+void generate_long_lines(const std::string& path, unsigned long long target_bytes, uint64_t seed) {
+    CorpusWriter out(path);
+    Rng rng(seed);
+    while (out.ok() && out.bytes() < target_bytes) {
+        unsigned long long line_end = out.bytes() + 16 * 1024 + rng.below(240 * 1024);
+        while (out.bytes() < line_end) {
+            out << (rng.one_in(20000) ? std::string_view("needle") : rng.pick(kWords)) << ' ';
+        }
+        out << '\n';
+    }
+}
+
+// Log lines interleaved with blobs of random bytes (NULs included), as in a core dump or a
+// database file: scanr detects it as binary from its first block
+void generate_binary_mix(const std::string& path, unsigned long long target_bytes, uint64_t seed) {
+    CorpusWriter out(path);
+    Rng rng(seed);
+    while (out.ok() && out.bytes() < target_bytes) {
+        size_t blob = 256 + rng.below(4096);
+        for (size_t i = 0; i < blob; ++i) {
+            char byte = static_cast<char>(rng.next() & 0xFF);
+            out << (rng.one_in(16) ? '\0' : byte);
+        }
+        size_t lines = 1 + rng.below(32);
+        for (size_t i = 0; i < lines; ++i) write_log_line(out, rng);
+    }
+}
+
+// A source tree of many small files, spread over 100 directories
+void generate_small_files(const std::string& dir, unsigned long long file_count, uint64_t seed) {
+    Rng rng(seed);
+    for (unsigned long long i = 0; i < file_count; ++i) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "dir%03llu", i % 100);
+        fs::path subdir = fs::path(dir) / name;
+        if (i < 100) {
+            std::error_code error;
+            fs::create_directories(subdir, error);
+        }
+        std::snprintf(name, sizeof(name), "file%06llu.%s", i, rng.one_in(2) ? "cpp" : "h");
+        CorpusWriter out((subdir / name).string());
+        unsigned long long target_bytes = 200 + rng.below(8000);
+        while (out.ok() && out.bytes() < target_bytes) write_source_line(out, rng);
+    }
+}
+
+// 10,000 patterns for -f: random lowercase words, plus a few that occur in the logs
+void generate_patterns(const std::string& path, size_t count, uint64_t seed) {
+    CorpusWriter out(path);
+    Rng rng(seed);
+    const std::string_view present[] = {"refused", "quota", "replica lag", "user=heidi", "checksum mismatch"};
+    for (std::string_view word : present) out << word << '\n';
+    for (size_t i = std::size(present); i < count; ++i) {
+        size_t length = 6 + rng.below(7);
+        for (size_t j = 0; j < length; ++j) out << static_cast<char>('a' + rng.below(26));
+        out << '\n';
+    }
+}
+
+void measure_corpus(Corpus& corpus) {
+    std::error_code error;
+    if (fs::is_directory(corpus.path, error)) {
+        for (fs::recursive_directory_iterator it(corpus.path, error), end; !error && it != end; it.increment(error)) {
+            if (it->is_regular_file(error)) count_file(it->path(), corpus);
+        }
+    } else if (fs::is_regular_file(corpus.path, error)) {
+        count_file(corpus.path, corpus);
+    }
+}
+
+// Add one file's bytes and lines (a final line without a terminator counts too)
+void count_file(const fs::path& path, Corpus& corpus) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<char> buffer(1 << 20);
+    char last = '\n';
+    while (file) {
+        file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        size_t got = static_cast<size_t>(file.gcount());
+        if (got == 0) break;
+        corpus.bytes += got;
+        corpus.lines += static_cast<unsigned long long>(std::count(buffer.data(), buffer.data() + got, '\n'));
+        last = buffer[got - 1];
+    }
+    if (last != '\n') ++corpus.lines;
+    ++corpus.files;
+}
+
+// --- Query Matrix ---
+
+// The fixed set of queries every report contains. Names are the keys --compare matches
+// on, so existing entries keep their name and arguments; new ones are appended.
+std::vector<Query> query_matrix() {
+    return {
+        {"literal", "logs", {"timeout"}},
+        {"ignore_case", "logs", {"-i", "warning"}},
+        {"whole_word", "logs", {"-w", "lag"}},
+        {"only_matching", "logs", {"-o", "refused"}},
+        {"multi_pattern", "logs", {"-e", "FATAL", "-e", "refused", "-e", "quota", "-e", "user=heidi"}},
+        {"pattern_file_10k", "logs", {"-f", "{patterns}"}},
+        {"regex_required_literal", "logs", {"-E", "GET /api/v[0-9]+/orders 500"}},
+        {"regex_no_literal", "logs", {"-E", "[0-9]{4}ms$"}},
+        {"context", "logs", {"-C", "3", "FATAL"}},
+        {"count", "logs", {"-c", "error"}},
+        {"count_invert", "logs", {"-c", "-v", "INFO"}},
+        {"line_numbers", "logs", {"-n", "ERROR"}},
+        {"source_word", "source", {"-w", "return"}},
+        {"source_ignore_case", "source", {"-i", "todo"}},
+        {"long_lines", "long_lines", {"needle"}},
+        {"long_lines_only_matching", "long_lines", {"-o", "-E", "need[a-z]+"}},
+        {"binary_default", "binary_mix", {"-c", "checksum"}},
+        {"binary_as_text", "binary_mix", {"-a", "-c", "checksum"}},
+        {"small_files", "small_files", {"-r", "TODO"}},
+        {"small_files_list", "small_files", {"-r", "-l", "nullptr"}},
+        {"small_files_count", "small_files", {"-r", "-c", "TODO"}},
+        {"huge_literal", "huge", {"-n", "timeout"}},
+        {"huge_count", "huge", {"-c", "FATAL"}},
+    };
+}
+
+// --- Running scanr ---
+
+// One untimed run brings the corpus into the page cache and reports the allocation count
+// with --stats; the timed runs follow without it, since --stats instruments the search
+bool run_query(const BenchSettings& settings, const Query& query, const Corpus& corpus, QueryResult& result) {
+    std::string patterns_path = (fs::path(settings.corpus_dir) / "patterns_10k.txt").string();
+    std::string stderr_path = (fs::path(settings.corpus_dir) / "scanr_stderr.txt").string();
+
+    result.query = &query;
+    result.corpus = &corpus;
+    result.args.clear();
+    if (settings.jobs > 0) {
+        result.args.push_back("-j");
+        result.args.push_back(std::to_string(settings.jobs));
+    }
+    for (const std::string& arg : query.args) result.args.push_back(arg == "{patterns}" ? patterns_path : arg);
+    result.args.push_back(corpus.path);
+    std::vector<std::string> warm_up_args = result.args;
+    warm_up_args.insert(warm_up_args.begin(), "--stats");
+
+    std::cerr << "scanr_bench: " << query.name << std::endl;
+    std::vector<double> seconds;
+    long long allocations = -1;
+    for (int run = 0; run <= settings.repeat; ++run) {
+        RunResult measured;
+        if (!run_scanr(settings.scanr, run == 0 ? warm_up_args : result.args, stderr_path, measured)) {
+            std::cerr << "scanr_bench: cannot run '" << settings.scanr << "'" << std::endl;
+            return false;
+        }
+        if (run == 0) { // Warm-up
+            allocations = parse_allocations(stderr_path);
+            continue;
+        }
+        measured.allocations = allocations;
+        seconds.push_back(measured.seconds);
+        result.peak_rss = std::max(result.peak_rss, measured.peak_rss);
+        if (run == 1 || measured.seconds < result.best.seconds) result.best = measured;
+    }
+    std::sort(seconds.begin(), seconds.end());
+    size_t middle = seconds.size() / 2;
+    result.seconds_median = seconds.size() % 2 ? seconds[middle] : (seconds[middle - 1] + seconds[middle]) / 2;
+    return true;
+}
+
+// Run scanr once. Its output goes through a pipe that is drained and counted (a pipe, like a
+// real consumer, and no console: scanr flushes every line when writing to one). Standard
+// error goes to a file, for the --stats lines.
+bool run_scanr(const std::string& scanr, const std::vector<std::string>& args, const std::string& stderr_path, RunResult& result) {
+    ChildResult child;
+    if (!run_child(scanr, args, "", stderr_path, [&](const char*, size_t size) { result.output_bytes += size; }, child)) return false;
+    result.exit_code = child.exit_code;
+    result.seconds = child.seconds;
+    result.peak_rss = child.peak_rss;
+    return true;
+}
+
+// The allocation count from "--stats", which only allocation-counting builds print:
+// "scanr: N heap allocation(s) while searching"
+long long parse_allocations(const std::string& stderr_path) {
+    std::ifstream file(stderr_path, std::ios::binary);
+    std::string line;
+    const std::string marker = " heap allocation(s) while searching";
+    while (std::getline(file, line)) {
+        size_t at = line.find(marker);
+        size_t prefix = line.find("scanr: ");
+        if (at == std::string::npos || prefix == std::string::npos) continue;
+        return std::strtoll(line.c_str() + prefix + 7, nullptr, 10);
+    }
+    return -1;
+}
+
+// --- Report ---
+
+// One object per line inside "results", which keeps the file diffable and lets --compare
+// read it back without a JSON parser
+std::string format_report(const BenchSettings& settings, const std::vector<Corpus>& corpora, const std::vector<QueryResult>& results) {
+    std::ostringstream out;
+    out << "{\n"
+        << "  \"tool\": \"scanr_bench\",\n"
+        << "  \"corpus_version\": " << kCorpusVersion << ",\n"
+        << "  \"scanr\": " << json_string(settings.scanr) << ",\n"
+        << "  \"scale\": " << json_number(settings.scale) << ",\n"
+        << "  \"repeat\": " << settings.repeat << ",\n"
+        << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n"
+        << "  \"corpora\": [\n";
+    for (size_t i = 0; i < corpora.size(); ++i) {
+        const Corpus& corpus = corpora[i];
+        out << "    {\"name\": " << json_string(corpus.name) << ", \"path\": " << json_string(corpus.path)
+            << ", \"bytes\": " << corpus.bytes << ", \"lines\": " << corpus.lines << ", \"files\": " << corpus.files << "}"
+            << (i + 1 < corpora.size() ? ",\n" : "\n");
+    }
+    out << "  ],\n"
+        << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const QueryResult& result = results[i];
+        const Corpus& corpus = *result.corpus;
+        double seconds = std::max(result.best.seconds, 1e-9);
+        out << "    {\"query\": " << json_string(result.query->name) << ", \"corpus\": " << json_string(corpus.name) << ", \"args\": [";
+        for (size_t j = 0; j + 1 < result.args.size(); ++j) { // The corpus path is listed with the corpora
+            out << (j ? ", " : "") << json_string(result.args[j]);
+        }
+        out << "], \"exit_code\": " << result.best.exit_code
+            << ", \"output_bytes\": " << result.best.output_bytes
+            << ", \"seconds_best\": " << json_number(result.best.seconds)
+            << ", \"seconds_median\": " << json_number(result.seconds_median)
+            << ", \"mb_per_s\": " << json_number(static_cast<double>(corpus.bytes) / 1e6 / seconds)
+            << ", \"lines_per_s\": " << json_number(static_cast<double>(corpus.lines) / seconds)
+            << ", \"peak_rss_bytes\": " << result.peak_rss;
+        if (result.best.allocations >= 0) {
+            out << ", \"allocations\": " << result.best.allocations << ", \"allocations_per_line\": "
+                << json_number(static_cast<double>(result.best.allocations) / static_cast<double>(std::max<unsigned long long>(corpus.lines, 1)));
+        } else {
+            out << ", \"allocations\": null, \"allocations_per_line\": null";
+        }
+        out << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n"
+        << "}\n";
+    return out.str();
+}
+
+std::string json_string(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted.push_back('\\');
+            quoted.push_back(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", static_cast<unsigned>(c));
+            quoted += escape;
+        } else {
+            quoted.push_back(c);
+        }
+    }
+    quoted.push_back('"');
+    return quoted;
+}
+
+std::string json_number(double value) {
+    std::ostringstream out;
+    out << std::setprecision(6) << value;
+    return out.str();
+}
+
+// Compare MB/s query by query with an earlier report. Returns the exit status: 1 if any
+// query lost more than 'tolerance' percent, 0 otherwise (queries new since then are skipped).
+int compare_with_baseline(const std::string& baseline_path, const std::vector<QueryResult>& results, double tolerance) {
+    std::ifstream file(baseline_path, std::ios::binary);
+    if (!file) {
+        std::cerr << "scanr_bench: cannot read baseline '" << baseline_path << "'" << std::endl;
+        return 2;
+    }
+    auto field = [](const std::string& line, const std::string& key) {
+        size_t at = line.find("\"" + key + "\": ");
+        return at == std::string::npos ? std::string::npos : at + key.size() + 4;
+    };
+
+    int regressions = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t name_at = field(line, "query");
+        size_t speed_at = field(line, "mb_per_s");
+        if (name_at == std::string::npos || speed_at == std::string::npos || line[name_at] != '"') continue;
+        std::string name = line.substr(name_at + 1, line.find('"', name_at + 1) - name_at - 1);
+        double baseline = std::strtod(line.c_str() + speed_at, nullptr);
+
+        for (const QueryResult& result : results) {
+            if (result.query->name != name || baseline <= 0) continue;
+            double current = static_cast<double>(result.corpus->bytes) / 1e6 / std::max(result.best.seconds, 1e-9);
+            double change = (current - baseline) / baseline * 100;
+            bool regressed = change < -tolerance;
+            std::cerr << "scanr_bench: " << name << ": " << json_number(baseline) << " -> " << json_number(current)
+                      << " MB/s (" << (change >= 0 ? "+" : "") << json_number(change) << "%)" << (regressed ? "  REGRESSION" : "") << std::endl;
+            if (regressed) ++regressions;
+        }
+    }
+    if (regressions > 0) {
+        std::cerr << "scanr_bench: " << regressions << " quer" << (regressions == 1 ? "y" : "ies") << " slower than the baseline by more than "
+                  << json_number(tolerance) << "%" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,1445 @@
+// scanr_decompress.h: The decoders scanr searches compressed inputs with: deflate (gzip
+// members, RFC 1951/1952), zstd frames (RFC 8878) and LZ4 frames, all written for scanr,
+// so that scanr.cpp still builds as one source file without libraries.
+//
+// A decoder reads the compressed bytes from a ByteSource and writes the text into a
+// DecodeWindow, which keeps the history later matches copy from and hands the text on in
+// pieces. Corrupt or truncated input throws std::runtime_error with the reason; checksums
+// are verified as the text is produced. The limits are those of the reference tools:
+// deflate's 32 KiB window, zstd windows up to ZstdDecoder::kMaxWindow (128 MiB) and no
+// dictionaries for either zstd or LZ4.
+//
+// Included by scanr.cpp, which runs the decoders on a thread of their own (Decompressor),
+// and by scanr_decompress_test.cpp, which checks them on their own.
+#ifndef SCANR_DECOMPRESS_H
+#define SCANR_DECOMPRESS_H
+
+#include <string>          // For error messages
+#include <vector>          // For the window and the decoding tables
+#include <stdexcept>       // For runtime_error (corrupt input)
+#include <algorithm>       // For std::min, std::max, std::fill
+#include <functional>      // For std::function (the window's output)
+#include <iterator>        // For std::begin, std::end
+#include <utility>         // For std::pair, std::move
+#include <climits>         // For INT_MAX
+#include <cstddef>         // For size_t
+#include <cstdint>         // For the fixed-width fields of the formats
+#include <cstring>         // For memcpy, memmove, memset
+
+#ifdef _WIN32
+#include <io.h>            // For _read
+#if defined(_MSC_VER)
+#include <intrin.h>        // For _BitScanReverse
+#endif
+#else
+#include <cerrno>          // For EINTR
+#include <unistd.h>        // For read
+#endif
+
+static constexpr uint32_t kZstdMagic = 0xFD2FB528;
+static constexpr uint32_t kLz4Magic = 0x184D2204;
+static constexpr uint32_t kSkippableMagic = 0x184D2A50; // Skippable frames (zstd and LZ4): 0x184D2A50..5F
+
+// Little-endian fields of the compressed formats (scanr runs on little-endian x86 and ARM)
+static inline uint16_t load_le16(const unsigned char* data) {
+    return static_cast<uint16_t>(data[0] | (data[1] << 8));
+}
+
+static inline uint32_t load_le32(const unsigned char* data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint64_t load_le64(const unsigned char* data) {
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// Index of the highest set bit of a non-zero value
+static inline int highest_set_bit(uint32_t value) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, value);
+    return static_cast<int>(index);
+#else
+    return 31 - __builtin_clz(value);
+#endif
+}
+
+[[noreturn]] static void corrupt_input(const char* format) {
+    throw std::runtime_error(std::string("corrupt ") + format + " data");
+}
+
+// Thrown through a decoder when the search has stopped reading its text
+struct DecodeStopped {};
+
+// CRC-32 of gzip members, eight bytes at a time with tables built at compile time
+struct Crc32Table {
+    uint32_t entries[8][256];
+    constexpr Crc32Table() : entries() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320u : 0);
+            entries[0][i] = crc;
+        }
+        for (int table = 1; table < 8; ++table) {
+            for (int i = 0; i < 256; ++i) entries[table][i] = (entries[table - 1][i] >> 8) ^ entries[0][entries[table - 1][i] & 0xFF];
+        }
+    }
+};
+static constexpr Crc32Table kCrc32{};
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char* data, size_t size) {
+    const auto& t = kCrc32.entries;
+    crc = ~crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t low = load_le32(data) ^ crc;
+        uint32_t high = load_le32(data + 4);
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+    }
+    for (; size > 0; ++data, --size) crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
+    return ~crc;
+}
+
+// XXH32, the checksum of LZ4 frames and their headers, computed as the text is produced
+class Xxh32 {
+public:
+    void update(const unsigned char* data, size_t size);
+    uint32_t digest() const;
+    static uint32_t of(const unsigned char* data, size_t size) {
+        Xxh32 hash;
+        hash.update(data, size);
+        return hash.digest();
+    }
+
+private:
+    static constexpr uint32_t kPrime1 = 2654435761u;
+    static constexpr uint32_t kPrime2 = 2246822519u;
+    static constexpr uint32_t kPrime3 = 3266489917u;
+    static constexpr uint32_t kPrime4 = 668265263u;
+    static constexpr uint32_t kPrime5 = 374761393u;
+    static uint32_t rotate(uint32_t value, int bits) { return (value << bits) | (value >> (32 - bits)); }
+    static uint32_t round(uint32_t lane, uint32_t input) { return rotate(lane + input * kPrime2, 13) * kPrime1; }
+    void stripe(const unsigned char* data) {
+        for (int i = 0; i < 4; ++i) lanes_[i] = round(lanes_[i], load_le32(data + 4 * i));
+    }
+
+    uint32_t lanes_[4] = {kPrime1 + kPrime2, kPrime2, 0, 0u - kPrime1};
+    unsigned char pending_[16];
+    size_t pending_size_ = 0;
+    uint64_t length_ = 0;
+};
+
+inline void Xxh32::update(const unsigned char* data, size_t size) {
+    length_ += size;
+    if (pending_size_ > 0) {
+        size_t take = std::min(size, sizeof(pending_) - pending_size_);
+        std::memcpy(pending_ + pending_size_, data, take);
+        pending_size_ += take;
+        data += take;
+        size -= take;
+        if (pending_size_ < sizeof(pending_)) return;
+        stripe(pending_);
+        pending_size_ = 0;
+    }
+    for (; size >= 16; data += 16, size -= 16) stripe(data);
+    std::memcpy(pending_, data, size);
+    pending_size_ = size;
+}
+
+inline uint32_t Xxh32::digest() const {
+    uint32_t hash = length_ >= 16 ? rotate(lanes_[0], 1) + rotate(lanes_[1], 7) + rotate(lanes_[2], 12) + rotate(lanes_[3], 18) : kPrime5;
+    hash += static_cast<uint32_t>(length_);
+    const unsigned char* data = pending_;
+    size_t size = pending_size_;
+    for (; size >= 4; data += 4, size -= 4) hash = rotate(hash + load_le32(data) * kPrime3, 17) * kPrime4;
+    for (; size > 0; ++data, --size) hash = rotate(hash + *data * kPrime5, 11) * kPrime1;
+    hash ^= hash >> 15;
+    hash *= kPrime2;
+    hash ^= hash >> 13;
+    hash *= kPrime3;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// XXH64, whose low 32 bits are the checksum of zstd frames
+class Xxh64 {
+public:
+    void update(const unsigned char* data, size_t size);
+    uint64_t digest() const;
+
+private:
+    static constexpr uint64_t kPrime1 = 11400714785074694791ull;
+    static constexpr uint64_t kPrime2 = 14029467366897019727ull;
+    static constexpr uint64_t kPrime3 = 1609587929392839161ull;
+    static constexpr uint64_t kPrime4 = 9650029242287828579ull;
+    static constexpr uint64_t kPrime5 = 2870177450012600261ull;
+    static uint64_t rotate(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+    static uint64_t round(uint64_t lane, uint64_t input) { return rotate(lane + input * kPrime2, 31) * kPrime1; }
+    static uint64_t merge(uint64_t hash, uint64_t lane) { return (hash ^ round(0, lane)) * kPrime1 + kPrime4; }
+    void stripe(const unsigned char* data) {
+        for (int i = 0; i < 4; ++i) lanes_[i] = round(lanes_[i], load_le64(data + 8 * i));
+    }
+
+    uint64_t lanes_[4] = {kPrime1 + kPrime2, kPrime2, 0, 0ull - kPrime1};
+    unsigned char pending_[32];
+    size_t pending_size_ = 0;
+    uint64_t length_ = 0;
+};
+
+inline void Xxh64::update(const unsigned char* data, size_t size) {
+    length_ += size;
+    if (pending_size_ > 0) {
+        size_t take = std::min(size, sizeof(pending_) - pending_size_);
+        std::memcpy(pending_ + pending_size_, data, take);
+        pending_size_ += take;
+        data += take;
+        size -= take;
+        if (pending_size_ < sizeof(pending_)) return;
+        stripe(pending_);
+        pending_size_ = 0;
+    }
+    for (; size >= 32; data += 32, size -= 32) stripe(data);
+    std::memcpy(pending_, data, size);
+    pending_size_ = size;
+}
+
+inline uint64_t Xxh64::digest() const {
+    uint64_t hash = kPrime5;
+    if (length_ >= 32) {
+        hash = rotate(lanes_[0], 1) + rotate(lanes_[1], 7) + rotate(lanes_[2], 12) + rotate(lanes_[3], 18);
+        for (uint64_t lane : lanes_) hash = merge(hash, lane);
+    }
+    hash += length_;
+    const unsigned char* data = pending_;
+    size_t size = pending_size_;
+    for (; size >= 8; data += 8, size -= 8) hash = rotate(hash ^ round(0, load_le64(data)), 27) * kPrime1 + kPrime4;
+    if (size >= 4) {
+        hash = rotate(hash ^ (static_cast<uint64_t>(load_le32(data)) * kPrime1), 23) * kPrime2 + kPrime3;
+        data += 4;
+        size -= 4;
+    }
+    for (; size > 0; ++data, --size) hash = rotate(hash ^ (*data * kPrime5), 11) * kPrime1;
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// The compressed bytes: a buffer in memory, or a descriptor read as the decoder asks for
+// more. data() points at the next bytes; need() makes sure that enough of them are there.
+class ByteSource {
+public:
+    ByteSource(const char* data, size_t size)
+        : next_(reinterpret_cast<const unsigned char*>(data)), end_(next_ + size) {}
+    ByteSource(int fd, const char* head, size_t size) : fd_(fd), buffer_(head, head + size) {
+        next_ = buffer_.data();
+        end_ = next_ + size;
+    }
+
+    // Whether 'size' bytes are available at data(); false if the input ends first
+    bool need(size_t size) { return available() >= size || fill(size); }
+    const unsigned char* data() const { return next_; }
+    size_t available() const { return static_cast<size_t>(end_ - next_); }
+    void skip(size_t size) { next_ += size; }
+    // Give back the last 'size' bytes taken (at most kLookBehind), which the bit reader of
+    // deflate takes ahead of the end of its stream
+    void unread(size_t size) { next_ -= size; }
+    // Skip 'size' bytes that may not all be read yet; false if the input ends first
+    bool drop(size_t size);
+
+private:
+    static constexpr size_t kReadSize = 256 * 1024;
+    static constexpr size_t kLookBehind = 8;
+    bool fill(size_t size);
+
+    int fd_ = -1;
+    std::vector<unsigned char> buffer_;
+    const unsigned char* next_ = nullptr;
+    const unsigned char* end_ = nullptr;
+    bool eof_ = false;
+};
+
+inline bool ByteSource::fill(size_t size) {
+    if (fd_ < 0 || eof_) return false;
+    // Keep what was not taken yet, and the few bytes before it that unread() may give back
+    size_t taken = static_cast<size_t>(next_ - buffer_.data());
+    size_t back = std::min(taken, kLookBehind);
+    size_t kept = back + available();
+    if (kept > 0) std::memmove(buffer_.data(), buffer_.data() + taken - back, kept); // (No buffer yet without a head)
+    buffer_.resize(std::max(buffer_.size(), back + std::max(size, kReadSize)));
+    size_t filled = kept;
+    while (filled < back + size) {
+#ifdef _WIN32
+        int got = _read(fd_, buffer_.data() + filled, static_cast<unsigned>(std::min<size_t>(buffer_.size() - filled, INT_MAX)));
+#else
+        ssize_t got = ::read(fd_, buffer_.data() + filled, buffer_.size() - filled);
+        if (got < 0 && errno == EINTR) continue;
+#endif
+        if (got <= 0) { // End of input (a read error ends it the same way)
+            eof_ = true;
+            break;
+        }
+        filled += static_cast<size_t>(got);
+    }
+    next_ = buffer_.data() + back;
+    end_ = buffer_.data() + filled;
+    return available() >= size;
+}
+
+inline bool ByteSource::drop(size_t size) {
+    while (size > 0) {
+        if (!need(1)) return false;
+        size_t take = std::min(size, available());
+        skip(take);
+        size -= take;
+    }
+    return true;
+}
+
+static void require(ByteSource& source, size_t size, const char* format) {
+    if (!source.need(size)) throw std::runtime_error(std::string("unexpected end of ") + format + " data");
+}
+
+// Copy 'length' bytes from 'distance' bytes back to 'out'; the two may overlap, which
+// repeats the last 'distance' bytes. Writes up to 7 bytes past the end.
+static inline void copy_match(unsigned char* out, size_t distance, size_t length) {
+    const unsigned char* from = out - distance;
+    if (distance >= 8) {
+        for (size_t i = 0; i < length; i += 8) std::memcpy(out + i, from + i, 8);
+    } else if (distance == 1) {
+        std::memset(out, *from, length);
+    } else {
+        for (size_t i = 0; i < length; ++i) out[i] = from[i];
+    }
+}
+
+// The decompressed text. It is kept in one buffer as the window that matches copy from:
+// the decoders write at reserve() and commit() what they wrote. Every kFlushSize bytes the
+// new text is checksummed and handed to 'output', and once the buffer is full the last
+// window of text moves to its front.
+class DecodeWindow {
+public:
+    enum class Checksum { kNone, kCrc32, kXxh32, kXxh64 };
+    using Output = std::function<bool(const char*, size_t)>; // False: stop decoding
+
+    explicit DecodeWindow(Output output) : output_(std::move(output)) {}
+
+    // A new frame (or gzip member), whose matches reach back at most 'window_size' bytes
+    void start(size_t window_size, Checksum checksum);
+    // Room for 'size' bytes (up to kMaxReserve) at the end of the text, plus kSlack
+    unsigned char* reserve(size_t size) { return pos_ + size <= limit_ ? buffer_.data() + pos_ : make_room(size); }
+    void commit(size_t size) {
+        pos_ += size;
+        produced_ += size;
+    }
+    // Bytes of the frame's text before reserve() that matches may copy from
+    size_t history() const { return static_cast<size_t>(std::min<uint64_t>(std::min<uint64_t>(produced_, pos_), window_size_)); }
+    void put(unsigned char c) {
+        *reserve(1) = c;
+        commit(1);
+    }
+    void append(const unsigned char* data, size_t size);
+    // Append a match; false if 'distance' reaches outside the window
+    bool copy(size_t distance, size_t length);
+    // Bytes of text in the frame so far, and their checksum
+    uint64_t produced() const { return produced_; }
+    uint64_t checksum();
+    // Hand on the text there is
+    void finish() { flush(); }
+
+    static constexpr size_t kMaxReserve = 128 * 1024;
+    static constexpr size_t kSlack = 32;
+
+private:
+    static constexpr size_t kFlushSize = 256 * 1024;
+    unsigned char* make_room(size_t size);
+    void flush();
+    void hash();
+
+    Output output_;
+    std::vector<unsigned char> buffer_;
+    size_t pos_ = 0;     // End of the text
+    size_t emitted_ = 0; // End of the text handed on
+    size_t hashed_ = 0;  // End of the text checksummed
+    size_t limit_ = 0;   // reserve() has room up to here without more work
+    size_t window_size_ = 0;
+    uint64_t produced_ = 0;
+    Checksum checksum_ = Checksum::kNone;
+    uint32_t crc32_ = 0;
+    Xxh32 xxh32_;
+    Xxh64 xxh64_;
+};
+
+inline void DecodeWindow::start(size_t window_size, Checksum checksum) {
+    hash();
+    window_size_ = window_size;
+    produced_ = 0;
+    checksum_ = checksum;
+    crc32_ = 0;
+    xxh32_ = Xxh32();
+    xxh64_ = Xxh64();
+    limit_ = 0; // The next reserve() makes room for the new window
+}
+
+inline unsigned char* DecodeWindow::make_room(size_t size) {
+    flush();
+    if (pos_ + size + kSlack > buffer_.size()) {
+        // Twice the window, so the window moves to the front at most once per window of text
+        size_t capacity = std::max(2 * window_size_, window_size_ + 4 * kFlushSize) + kSlack;
+        if (buffer_.size() >= capacity) {
+            size_t keep = history();
+            std::memmove(buffer_.data(), buffer_.data() + pos_ - keep, keep);
+            pos_ = emitted_ = hashed_ = keep;
+        }
+        buffer_.resize(std::max({buffer_.size(), capacity, pos_ + size + kSlack}));
+    }
+    limit_ = std::min(pos_ + kFlushSize, buffer_.size() - kSlack);
+    return buffer_.data() + pos_;
+}
+
+inline void DecodeWindow::hash() {
+    if (hashed_ == pos_) return;
+    const unsigned char* data = buffer_.data() + hashed_;
+    size_t size = pos_ - hashed_;
+    switch (checksum_) {
+    case Checksum::kNone: break;
+    case Checksum::kCrc32: crc32_ = crc32_update(crc32_, data, size); break;
+    case Checksum::kXxh32: xxh32_.update(data, size); break;
+    case Checksum::kXxh64: xxh64_.update(data, size); break;
+    }
+    hashed_ = pos_;
+}
+
+inline void DecodeWindow::flush() {
+    hash();
+    if (pos_ > emitted_ && !output_(reinterpret_cast<const char*>(buffer_.data() + emitted_), pos_ - emitted_)) throw DecodeStopped();
+    emitted_ = pos_;
+}
+
+inline uint64_t DecodeWindow::checksum() {
+    hash();
+    switch (checksum_) {
+    case Checksum::kCrc32: return crc32_;
+    case Checksum::kXxh32: return xxh32_.digest();
+    case Checksum::kXxh64: return xxh64_.digest();
+    default: return 0;
+    }
+}
+
+inline void DecodeWindow::append(const unsigned char* data, size_t size) {
+    while (size > 0) {
+        size_t chunk = std::min(size, kMaxReserve);
+        std::memcpy(reserve(chunk), data, chunk);
+        commit(chunk);
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+inline bool DecodeWindow::copy(size_t distance, size_t length) {
+    if (distance == 0 || distance > history()) return false;
+    while (length > 0) {
+        size_t chunk = std::min(length, kMaxReserve);
+        copy_match(reserve(chunk), distance, chunk); // The window keeps 'distance' bytes when it moves
+        commit(chunk);
+        length -= chunk;
+    }
+    return true;
+}
+
+// --- Deflate (gzip) ---
+
+// A Huffman code of deflate. Codes of up to kFastBits bits are decoded with one lookup of
+// the next input bits (deflate stores codes bit-reversed, lowest bit first); longer ones,
+// which are rare, are decoded canonically a bit at a time from the counts per length.
+struct InflateCode {
+    static constexpr int kFastBits = 10;
+    struct Entry {
+        uint16_t symbol;
+        uint8_t length; // 0: a longer code, or none
+    };
+    Entry fast[1 << kFastBits];
+    uint16_t counts[16];
+    uint16_t symbols[288];
+
+    // False if the lengths over-subscribe the code
+    bool build(const uint8_t* lengths, int count);
+};
+
+inline bool InflateCode::build(const uint8_t* lengths, int count) {
+    std::fill(std::begin(counts), std::end(counts), 0);
+    for (int i = 0; i < count; ++i) ++counts[lengths[i]];
+    counts[0] = 0;
+    int left = 1;
+    for (int length = 1; length < 16; ++length) {
+        left = (left << 1) - counts[length];
+        if (left < 0) return false;
+    }
+    uint16_t offsets[16];
+    offsets[1] = 0;
+    for (int length = 1; length < 15; ++length) offsets[length + 1] = static_cast<uint16_t>(offsets[length] + counts[length]);
+    for (int i = 0; i < count; ++i) {
+        if (lengths[i] != 0) symbols[offsets[lengths[i]]++] = static_cast<uint16_t>(i);
+    }
+    std::fill(std::begin(fast), std::end(fast), Entry{0, 0});
+    unsigned code = 0;
+    int index = 0;
+    for (int length = 1; length <= kFastBits; ++length) {
+        for (int i = 0; i < counts[length]; ++i, ++code, ++index) {
+            unsigned reversed = 0;
+            for (int bit = 0; bit < length; ++bit) reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+            for (unsigned slot = reversed; slot < (1u << kFastBits); slot += 1u << length) fast[slot] = Entry{symbols[index], static_cast<uint8_t>(length)};
+        }
+        code <<= 1;
+    }
+    return true;
+}
+
+// Decodes one deflate stream (RFC 1951) into the window
+class Inflater {
+public:
+    Inflater(ByteSource& source, DecodeWindow& window) : source_(source), window_(window) {}
+    // Decode up to the final block; the bytes after it are left in the source
+    void run();
+
+private:
+    void refill();
+    uint32_t bits(int count) {
+        if (count_ < count) {
+            refill();
+            if (count_ < count) throw std::runtime_error("unexpected end of gzip data");
+        }
+        uint32_t value = static_cast<uint32_t>(buffer_ & ((uint64_t(1) << count) - 1));
+        buffer_ >>= count;
+        count_ -= count;
+        return value;
+    }
+    int decode(const InflateCode& code) {
+        if (count_ < 15) refill();
+        const InflateCode::Entry& entry = code.fast[buffer_ & ((1u << InflateCode::kFastBits) - 1)];
+        if (entry.length == 0 || entry.length > count_) return decode_slow(code);
+        buffer_ >>= entry.length;
+        count_ -= entry.length;
+        return entry.symbol;
+    }
+    int decode_slow(const InflateCode& code);
+    void stored();
+    void dynamic();
+    void codes(const InflateCode& lengths, const InflateCode& distances);
+
+    ByteSource& source_;
+    DecodeWindow& window_;
+    uint64_t buffer_ = 0; // Input bits not used yet, the next one lowest
+    int count_ = 0;
+    InflateCode lengths_;
+    InflateCode distances_;
+};
+
+inline void Inflater::refill() {
+    while (count_ <= 56) {
+        if (source_.available() >= 8) {
+            int take = (63 - count_) >> 3;
+            buffer_ |= (load_le64(source_.data()) & ((uint64_t(1) << (8 * take)) - 1)) << count_;
+            source_.skip(static_cast<size_t>(take));
+            count_ += 8 * take;
+            return;
+        }
+        if (!source_.need(1)) return;
+        if (source_.available() >= 8) continue;
+        buffer_ |= static_cast<uint64_t>(*source_.data()) << count_;
+        source_.skip(1);
+        count_ += 8;
+    }
+}
+
+inline int Inflater::decode_slow(const InflateCode& code) {
+    int first = 0; // First code of the current length
+    int index = 0; // Its position among the symbols
+    int value = 0;
+    for (int length = 1; length < 16; ++length) {
+        if (length > count_) throw std::runtime_error("unexpected end of gzip data");
+        value |= static_cast<int>((buffer_ >> (length - 1)) & 1);
+        int count = code.counts[length];
+        if (value - first < count) {
+            buffer_ >>= length;
+            count_ -= length;
+            return code.symbols[index + value - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        value <<= 1;
+    }
+    corrupt_input("gzip");
+}
+
+inline void Inflater::run() {
+    static const std::pair<InflateCode, InflateCode>& fixed = *[] {
+        auto* codes = new std::pair<InflateCode, InflateCode>();
+        uint8_t lengths[288];
+        std::fill(lengths, lengths + 144, 8);
+        std::fill(lengths + 144, lengths + 256, 9);
+        std::fill(lengths + 256, lengths + 280, 7);
+        std::fill(lengths + 280, lengths + 288, 8);
+        codes->first.build(lengths, 288);
+        std::fill(lengths, lengths + 30, 5);
+        codes->second.build(lengths, 30);
+        return codes;
+    }();
+    bool last;
+    do {
+        last = bits(1) != 0;
+        switch (bits(2)) {
+        case 0: stored(); break;
+        case 1: codes(fixed.first, fixed.second); break;
+        case 2: dynamic(); break;
+        default: corrupt_input("gzip");
+        }
+    } while (!last);
+    // The whole bytes left in the bit buffer follow the stream
+    source_.unread(static_cast<size_t>(count_ >> 3));
+    buffer_ = 0;
+    count_ = 0;
+}
+
+inline void Inflater::stored() {
+    bits(count_ & 7); // To the next byte boundary
+    uint32_t length = bits(16);
+    if (bits(16) != (~length & 0xFFFF)) corrupt_input("gzip");
+    for (; length > 0 && count_ >= 8; --length) window_.put(static_cast<unsigned char>(bits(8)));
+    while (length > 0) {
+        require(source_, 1, "gzip");
+        size_t take = std::min<size_t>(length, source_.available());
+        window_.append(source_.data(), take);
+        source_.skip(take);
+        length -= static_cast<uint32_t>(take);
+    }
+}
+
+inline void Inflater::dynamic() {
+    static constexpr uint8_t kOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    int literal_count = static_cast<int>(bits(5)) + 257;
+    int distance_count = static_cast<int>(bits(5)) + 1;
+    int code_count = static_cast<int>(bits(4)) + 4;
+    if (literal_count > 286 || distance_count > 30) corrupt_input("gzip");
+    uint8_t lengths[320] = {};
+    for (int i = 0; i < code_count; ++i) lengths[kOrder[i]] = static_cast<uint8_t>(bits(3));
+    InflateCode& length_code = lengths_; // The code lengths' own code; lengths_ is rebuilt below
+    if (!length_code.build(lengths, 19)) corrupt_input("gzip");
+    int count = 0;
+    while (count < literal_count + distance_count) {
+        int symbol = decode(length_code);
+        if (symbol < 16) {
+            lengths[count++] = static_cast<uint8_t>(symbol);
+            continue;
+        }
+        uint8_t value = 0;
+        int repeat;
+        if (symbol == 16) {
+            if (count == 0) corrupt_input("gzip");
+            value = lengths[count - 1];
+            repeat = 3 + static_cast<int>(bits(2));
+        } else if (symbol == 17) {
+            repeat = 3 + static_cast<int>(bits(3));
+        } else {
+            repeat = 11 + static_cast<int>(bits(7));
+        }
+        if (count + repeat > literal_count + distance_count) corrupt_input("gzip");
+        std::fill(lengths + count, lengths + count + repeat, value);
+        count += repeat;
+    }
+    if (lengths[256] == 0) corrupt_input("gzip"); // No end-of-block code
+    if (!lengths_.build(lengths, literal_count) || !distances_.build(lengths + literal_count, distance_count)) corrupt_input("gzip");
+    codes(lengths_, distances_);
+}
+
+inline void Inflater::codes(const InflateCode& lengths, const InflateCode& distances) {
+    static constexpr uint16_t kLengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static constexpr uint8_t kLengthBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static constexpr uint16_t kDistanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+                                                   1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static constexpr uint8_t kDistanceBits[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    for (;;) {
+        int symbol = decode(lengths);
+        if (symbol < 256) {
+            window_.put(static_cast<unsigned char>(symbol));
+        } else if (symbol == 256) {
+            return;
+        } else {
+            symbol -= 257;
+            if (symbol >= 29) corrupt_input("gzip");
+            size_t length = kLengthBase[symbol] + bits(kLengthBits[symbol]);
+            int code = decode(distances);
+            if (code >= 30) corrupt_input("gzip");
+            size_t distance = kDistanceBase[code] + bits(kDistanceBits[code]);
+            if (!window_.copy(distance, length)) corrupt_input("gzip");
+        }
+    }
+}
+
+// The members of a gzip file (RFC 1952), each checked against its CRC-32 and length
+static void decode_gzip(ByteSource& source, DecodeWindow& window) {
+    for (bool first = true;; first = false) {
+        // What follows the last member is ignored unless it is another one, as gzip does
+        // (tape padding, typically)
+        if (!first && (!source.need(2) || source.data()[0] != 0x1F || source.data()[1] != 0x8B)) return;
+        require(source, 10, "gzip");
+        const unsigned char* header = source.data();
+        unsigned flags = header[3];
+        if (header[2] != 8 || (flags & 0xE0) != 0) corrupt_input("gzip");
+        source.skip(10);
+        if (flags & 0x04) { // FEXTRA
+            require(source, 2, "gzip");
+            size_t size = load_le16(source.data());
+            source.skip(2);
+            if (!source.drop(size)) require(source, 1, "gzip");
+        }
+        for (unsigned text_field : {0x08u, 0x10u}) { // FNAME, FCOMMENT: zero-terminated
+            if (!(flags & text_field)) continue;
+            for (;;) {
+                require(source, 1, "gzip");
+                unsigned char c = *source.data();
+                source.skip(1);
+                if (c == 0) break;
+            }
+        }
+        if ((flags & 0x02) && !source.drop(2)) require(source, 1, "gzip"); // FHCRC
+        window.start(32 * 1024, DecodeWindow::Checksum::kCrc32);
+        Inflater(source, window).run();
+        require(source, 8, "gzip");
+        if (load_le32(source.data()) != static_cast<uint32_t>(window.checksum()) ||
+            load_le32(source.data() + 4) != static_cast<uint32_t>(window.produced())) {
+            corrupt_input("gzip");
+        }
+        source.skip(8);
+    }
+}
+
+// --- LZ4 ---
+
+// One LZ4 block: sequences of literals followed by a match, the last with literals only
+static void decode_lz4_block(const unsigned char* data, size_t size, DecodeWindow& window, size_t block_max) {
+    const unsigned char* end = data + size;
+    size_t written = 0;
+    auto extend = [&](size_t& length) {
+        for (unsigned char byte = 255; byte == 255;) {
+            if (data == end) corrupt_input("LZ4");
+            byte = *data++;
+            length += byte;
+        }
+    };
+    for (;;) {
+        if (data == end) corrupt_input("LZ4");
+        unsigned token = *data++;
+        size_t literals = token >> 4;
+        if (literals == 15) extend(literals);
+        if (literals > static_cast<size_t>(end - data) || literals > block_max - written) corrupt_input("LZ4");
+        window.append(data, literals);
+        data += literals;
+        written += literals;
+        if (data == end) return;
+        if (end - data < 2) corrupt_input("LZ4");
+        size_t distance = load_le16(data);
+        data += 2;
+        size_t length = token & 15;
+        if (length == 15) extend(length);
+        length += 4;
+        if (length > block_max - written || !window.copy(distance, length)) corrupt_input("LZ4");
+        written += length;
+    }
+}
+
+// An LZ4 frame: a header, blocks (compressed or stored) and an end mark, with the optional checksums verified
+static void decode_lz4_frame(ByteSource& source, DecodeWindow& window) {
+    require(source, 7, "LZ4");
+    unsigned flags = source.data()[4];
+    unsigned block_descriptor = source.data()[5];
+    if ((flags >> 6) != 1 || (flags & 0x02) || (block_descriptor & 0x8F) || ((block_descriptor >> 4) & 7) < 4) corrupt_input("LZ4");
+    bool block_checksums = (flags & 0x10) != 0;
+    bool content_size = (flags & 0x08) != 0;
+    bool content_checksum = (flags & 0x04) != 0;
+    size_t header_size = 7 + (content_size ? 8 : 0) + ((flags & 0x01) ? 4 : 0);
+    require(source, header_size, "LZ4");
+    const unsigned char* header = source.data();
+    if (((Xxh32::of(header + 4, header_size - 5) >> 8) & 0xFF) != header[header_size - 1]) corrupt_input("LZ4");
+    if (flags & 0x01) throw std::runtime_error("LZ4 dictionaries are not supported");
+    uint64_t expected_size = content_size ? load_le64(header + 6) : 0;
+    size_t block_max = size_t(1) << (8 + 2 * ((block_descriptor >> 4) & 7)); // 64 KiB to 4 MiB
+    source.skip(header_size);
+
+    window.start(64 * 1024, content_checksum ? DecodeWindow::Checksum::kXxh32 : DecodeWindow::Checksum::kNone);
+    for (;;) {
+        require(source, 4, "LZ4");
+        uint32_t size = load_le32(source.data());
+        source.skip(4);
+        if (size == 0) break; // End mark
+        bool stored = (size & 0x80000000u) != 0;
+        size &= 0x7FFFFFFF;
+        if (size > block_max) corrupt_input("LZ4");
+        size_t total = size + (block_checksums ? 4 : 0);
+        require(source, total, "LZ4");
+        const unsigned char* block = source.data();
+        if (block_checksums && Xxh32::of(block, size) != load_le32(block + size)) corrupt_input("LZ4");
+        if (stored) {
+            window.append(block, size);
+        } else {
+            decode_lz4_block(block, size, window, block_max);
+        }
+        source.skip(total);
+    }
+    if (content_checksum) {
+        require(source, 4, "LZ4");
+        if (load_le32(source.data()) != static_cast<uint32_t>(window.checksum())) corrupt_input("LZ4");
+        source.skip(4);
+    }
+    if (content_size && window.produced() != expected_size) corrupt_input("LZ4");
+}
+
+// Where the LZ4 frame at 'data' ends, walking its block sizes without decoding; 0 if it is cut short
+static size_t lz4_frame_size(const unsigned char* data, size_t size) {
+    if (size < 7) return 0;
+    unsigned flags = data[4];
+    size_t at = 7 + ((flags & 0x08) ? 8 : 0) + ((flags & 0x01) ? 4 : 0);
+    for (;;) {
+        if (size < at + 4) return 0;
+        uint32_t block = load_le32(data + at) & 0x7FFFFFFF;
+        at += 4;
+        if (block == 0) break;
+        at += block + ((flags & 0x10) ? 4 : 0);
+    }
+    at += (flags & 0x04) ? 4 : 0;
+    return at <= size ? at : 0;
+}
+
+// --- Zstandard ---
+
+// Reads a bit stream backwards, as zstd writes its entropy-coded streams: from the last
+// byte, whose highest set bit marks the end, towards the first. Reading past the start
+// yields zero bits and leaves position() negative.
+class ReverseBits {
+public:
+    ReverseBits(const unsigned char* data, size_t size) : data_(data), size_(size) {
+        if (size == 0 || data[size - 1] == 0) corrupt_input("zstd");
+        position_ = static_cast<long long>(size - 1) * 8 + highest_set_bit(data[size - 1]);
+    }
+    // The next 'count' bits (at most 32), the first of them highest
+    uint32_t read(int count) {
+        position_ -= count;
+        return bits_at(position_, count);
+    }
+    uint32_t peek(int count) const { return bits_at(position_ - count, count); }
+    void skip(int count) { position_ -= count; }
+    long long position() const { return position_; }
+
+private:
+    uint32_t bits_at(long long position, int count) const {
+        if (count == 0) return 0;
+        if (position < 0) return position + count <= 0 ? 0 : bits_at(0, static_cast<int>(position + count)) << -position;
+        size_t byte = static_cast<size_t>(position >> 3);
+        uint64_t value = 0;
+        std::memcpy(&value, data_ + byte, std::min<size_t>(8, size_ - byte));
+        return static_cast<uint32_t>((value >> (position & 7)) & ((uint64_t(1) << count) - 1));
+    }
+
+    const unsigned char* data_;
+    size_t size_;
+    long long position_; // Bits left to read
+};
+
+// Decodes zstd frames (RFC 8878). One decoder serves one frame at a time: the repeat
+// offsets, the sequence tables and the literals' Huffman table carry over between the
+// blocks of a frame.
+class ZstdDecoder {
+public:
+    ZstdDecoder(ByteSource& source, DecodeWindow& window) : source_(source), window_(window) {}
+    // Decode the frame the source is at
+    void frame();
+    // Where the zstd frame at 'data' ends, walking its block headers without decoding; 0 if it is cut short
+    static size_t frame_size(const unsigned char* data, size_t size);
+
+    static constexpr size_t kMaxWindow = size_t(1) << 27; // As zstd's own default limit
+
+private:
+    struct FseEntry {
+        uint16_t base;  // The next state, before the bits read are added
+        uint8_t symbol;
+        uint8_t bits;
+    };
+    struct FseTable {
+        int log = -1; // -1: none yet
+        std::vector<FseEntry> entries;
+    };
+    struct HuffmanEntry {
+        uint8_t symbol;
+        uint8_t bits;
+    };
+
+    static size_t header_size(const unsigned char* data);
+    static size_t read_counts(const unsigned char* data, size_t size, int max_log, int max_symbol, short* counts, int& log, int& symbols);
+    static void build_table(const short* counts, int symbols, int log, FseTable& table);
+    static const FseTable& predefined(int kind);
+    void block(const unsigned char* data, size_t size);
+    size_t literals(const unsigned char* data, size_t size);
+    size_t huffman_table(const unsigned char* data, size_t size);
+    void huffman_stream(const unsigned char* data, size_t size, unsigned char* out, size_t count);
+    size_t sequence_table(const unsigned char* data, size_t size, int kind, int mode);
+    void sequences(const unsigned char* data, size_t size);
+
+    ByteSource& source_;
+    DecodeWindow& window_;
+    size_t window_size_ = 0;
+    size_t block_max_ = 0;
+    uint64_t repeat_[3] = {1, 4, 8};
+    FseTable tables_[3];              // Literal lengths, offsets, match lengths, when not predefined
+    const FseTable* current_[3] = {}; // The table each uses
+    std::vector<HuffmanEntry> huffman_;
+    int huffman_bits_ = 0; // 0: no Huffman table yet
+    std::vector<unsigned char> literals_;
+    size_t literal_count_ = 0;
+};
+
+// The three kinds of sequence symbols: their predefined distributions (accuracy log 6, 5, 6),
+// largest accuracy log and largest symbol
+enum { kLiteralLengths, kOffsets, kMatchLengths };
+static constexpr int kZstdMaxLog[3] = {9, 8, 9};
+static constexpr int kZstdMaxSymbol[3] = {35, 31, 52};
+static constexpr short kZstdLiteralLengthCounts[36] = {4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 2,
+                                                       2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1, -1, -1, -1, -1};
+static constexpr short kZstdOffsetCounts[29] = {1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1};
+static constexpr short kZstdMatchLengthCounts[53] = {1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+                                                     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1, -1, -1};
+// Literal and match length codes: the value of each code and the extra bits that follow it
+static constexpr uint32_t kZstdLiteralLengthBase[36] = {0,  1,  2,  3,  4,  5,  6,  7,  8,   9,   10,  11,   12,   13,   14,   15,    16,    18,
+                                                        20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536};
+static constexpr uint8_t kZstdLiteralLengthBits[36] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                                       1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+static constexpr uint32_t kZstdMatchLengthBase[53] = {3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14,  15,  16,  17,   18,   19,   20,
+                                                      21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32,  33,  34,  35,   37,   39,   41,
+                                                      43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051, 4099, 8195, 16387, 32771, 65539};
+static constexpr uint8_t kZstdMatchLengthBits[53] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                     0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+
+// Size of the frame header at 'data' (magic number included), from its descriptor byte
+inline size_t ZstdDecoder::header_size(const unsigned char* data) {
+    static constexpr size_t kDictionaryIdSize[4] = {0, 1, 2, 4};
+    static constexpr size_t kContentSizeSize[4] = {0, 2, 4, 8};
+    unsigned descriptor = data[4];
+    bool single_segment = (descriptor & 0x20) != 0;
+    size_t content_size = kContentSizeSize[descriptor >> 6];
+    if (content_size == 0 && single_segment) content_size = 1;
+    return 5 + (single_segment ? 0 : 1) + kDictionaryIdSize[descriptor & 3] + content_size;
+}
+
+inline size_t ZstdDecoder::frame_size(const unsigned char* data, size_t size) {
+    if (size < 5) return 0;
+    size_t at = header_size(data);
+    for (;;) {
+        if (size < at + 3) return 0;
+        uint32_t header = data[at] | (data[at + 1] << 8) | (data[at + 2] << 16);
+        unsigned type = (header >> 1) & 3;
+        if (type == 3) return 0;
+        at += 3 + (type == 1 ? 1 : header >> 3);
+        if (header & 1) break;
+    }
+    at += (data[4] & 0x04) ? 4 : 0;
+    return at <= size ? at : 0;
+}
+
+// Read an FSE table description: the normalized count of each symbol (-1: below one),
+// encoded with as few bits as the counts still possible allow. Returns the bytes it took.
+inline size_t ZstdDecoder::read_counts(const unsigned char* data, size_t size, int max_log, int max_symbol, short* counts, int& log, int& symbols) {
+    size_t position = 0; // In bits
+    auto peek = [&](int count) {
+        uint32_t value = 0;
+        size_t byte = position >> 3;
+        for (size_t i = 0; i < 4 && byte + i < size; ++i) value |= static_cast<uint32_t>(data[byte + i]) << (8 * i);
+        return (value >> (position & 7)) & ((1u << count) - 1);
+    };
+    log = static_cast<int>(peek(4)) + 5;
+    position += 4;
+    if (log > max_log) corrupt_input("zstd");
+    int remaining = (1 << log) + 1;
+    int threshold = 1 << log;
+    int bits = log + 1;
+    int symbol = 0;
+    while (remaining > 1) {
+        if (symbol > max_symbol) corrupt_input("zstd");
+        int max = (2 * threshold - 1) - remaining; // Values below it take one bit less
+        int count = static_cast<int>(peek(bits - 1));
+        if (count < max) {
+            position += static_cast<size_t>(bits - 1);
+        } else {
+            count = static_cast<int>(peek(bits));
+            if (count >= threshold) count -= max;
+            position += static_cast<size_t>(bits);
+        }
+        --count;
+        remaining -= count < 0 ? -count : count;
+        counts[symbol++] = static_cast<short>(count);
+        if (count == 0) { // Runs of zero counts follow as 2-bit repeat flags
+            for (;;) {
+                int repeat = static_cast<int>(peek(2));
+                position += 2;
+                if (symbol + repeat > max_symbol + 1) corrupt_input("zstd");
+                for (int i = 0; i < repeat; ++i) counts[symbol++] = 0;
+                if (repeat != 3) break;
+            }
+        }
+        while (remaining < threshold && threshold > 1) {
+            --bits;
+            threshold >>= 1;
+        }
+    }
+    size_t used = (position + 7) / 8;
+    if (remaining != 1 || used > size) corrupt_input("zstd");
+    symbols = symbol;
+    return used;
+}
+
+// The FSE decoding table of the counts: each symbol takes as many states as its count,
+// spread over the table; symbols below one take a state each at the top
+inline void ZstdDecoder::build_table(const short* counts, int symbols, int log, FseTable& table) {
+    size_t size = size_t(1) << log;
+    table.log = log;
+    table.entries.assign(size, FseEntry{0, 0, 0});
+    uint16_t next[64];
+    size_t high = size - 1;
+    for (int s = 0; s < symbols; ++s) {
+        if (counts[s] == -1) {
+            table.entries[high--].symbol = static_cast<uint8_t>(s);
+            next[s] = 1;
+        } else {
+            next[s] = static_cast<uint16_t>(counts[s]);
+        }
+    }
+    size_t step = (size >> 1) + (size >> 3) + 3;
+    size_t position = 0;
+    for (int s = 0; s < symbols; ++s) {
+        for (int i = 0; i < counts[s]; ++i) {
+            table.entries[position].symbol = static_cast<uint8_t>(s);
+            do {
+                position = (position + step) & (size - 1);
+            } while (position > high);
+        }
+    }
+    if (position != 0) corrupt_input("zstd");
+    for (FseEntry& entry : table.entries) {
+        uint32_t state = next[entry.symbol]++;
+        if (state == 0) corrupt_input("zstd"); // A symbol with states beyond its count
+        int bits = log - highest_set_bit(state);
+        entry.bits = static_cast<uint8_t>(bits);
+        entry.base = static_cast<uint16_t>((state << bits) - size);
+    }
+}
+
+inline const ZstdDecoder::FseTable& ZstdDecoder::predefined(int kind) {
+    static const FseTable* tables = [] {
+        auto* built = new FseTable[3];
+        build_table(kZstdLiteralLengthCounts, 36, 6, built[kLiteralLengths]);
+        build_table(kZstdOffsetCounts, 29, 5, built[kOffsets]);
+        build_table(kZstdMatchLengthCounts, 53, 6, built[kMatchLengths]);
+        return built;
+    }();
+    return tables[kind];
+}
+
+inline void ZstdDecoder::frame() {
+    require(source_, 5, "zstd");
+    size_t size = header_size(source_.data());
+    require(source_, size, "zstd");
+    const unsigned char* header = source_.data();
+    unsigned descriptor = header[4];
+    if (descriptor & 0x08) corrupt_input("zstd"); // Reserved bit
+    bool single_segment = (descriptor & 0x20) != 0;
+    bool checksum = (descriptor & 0x04) != 0;
+    size_t at = 5;
+    uint64_t window = 0;
+    if (!single_segment) {
+        unsigned exponent = header[at] >> 3, mantissa = header[at] & 7;
+        uint64_t base = uint64_t(1) << (10 + exponent);
+        window = base + (base / 8) * mantissa;
+        ++at;
+    }
+    static constexpr size_t kDictionaryIdSize[4] = {0, 1, 2, 4};
+    uint32_t dictionary = 0;
+    for (size_t i = 0; i < kDictionaryIdSize[descriptor & 3]; ++i) dictionary |= static_cast<uint32_t>(header[at++]) << (8 * i);
+    if (dictionary != 0) throw std::runtime_error("zstd dictionaries are not supported");
+    size_t content_size_bytes = size - at;
+    uint64_t content_size = 0;
+    for (size_t i = 0; i < content_size_bytes; ++i) content_size |= static_cast<uint64_t>(header[at + i]) << (8 * i);
+    if (content_size_bytes == 2) content_size += 256;
+    if (single_segment) window = content_size;
+    if (window > kMaxWindow) throw std::runtime_error("zstd window too large");
+    source_.skip(size);
+
+    window_size_ = static_cast<size_t>(window);
+    block_max_ = std::min(window_size_, DecodeWindow::kMaxReserve);
+    window_.start(window_size_, checksum ? DecodeWindow::Checksum::kXxh64 : DecodeWindow::Checksum::kNone);
+    repeat_[0] = 1;
+    repeat_[1] = 4;
+    repeat_[2] = 8;
+    std::fill(std::begin(current_), std::end(current_), nullptr);
+    huffman_bits_ = 0;
+    literals_.resize(block_max_ + DecodeWindow::kSlack);
+    for (bool last = false; !last;) {
+        require(source_, 3, "zstd");
+        const unsigned char* data = source_.data();
+        uint32_t block_header = data[0] | (data[1] << 8) | (data[2] << 16);
+        source_.skip(3);
+        last = (block_header & 1) != 0;
+        size_t block_size = block_header >> 3;
+        if (block_size > block_max_) corrupt_input("zstd");
+        switch ((block_header >> 1) & 3) {
+        case 0: // Raw
+            require(source_, block_size, "zstd");
+            window_.append(source_.data(), block_size);
+            source_.skip(block_size);
+            break;
+        case 1: // One byte, repeated
+            require(source_, 1, "zstd");
+            if (block_size > 0) { // (An empty frame may have no window to reserve in)
+                std::memset(window_.reserve(block_size), *source_.data(), block_size);
+                window_.commit(block_size);
+            }
+            source_.skip(1);
+            break;
+        case 2:
+            require(source_, block_size, "zstd");
+            block(source_.data(), block_size);
+            source_.skip(block_size);
+            break;
+        default: corrupt_input("zstd");
+        }
+    }
+    if (checksum) {
+        require(source_, 4, "zstd");
+        if (load_le32(source_.data()) != static_cast<uint32_t>(window_.checksum())) corrupt_input("zstd");
+        source_.skip(4);
+    }
+    if ((content_size_bytes > 0) && window_.produced() != content_size) corrupt_input("zstd");
+}
+
+inline void ZstdDecoder::block(const unsigned char* data, size_t size) {
+    size_t used = literals(data, size);
+    sequences(data + used, size - used);
+}
+
+// The literals section: stored, one byte repeated, or Huffman-coded in one or four streams.
+// Returns the bytes it took.
+inline size_t ZstdDecoder::literals(const unsigned char* data, size_t size) {
+    if (size < 1) corrupt_input("zstd");
+    unsigned type = data[0] & 3;
+    unsigned size_format = (data[0] >> 2) & 3;
+    if (type < 2) { // Raw or RLE
+        size_t header, count;
+        if ((size_format & 1) == 0) {
+            header = 1;
+            count = data[0] >> 3;
+        } else if (size_format == 1) {
+            header = 2;
+            if (size < 2) corrupt_input("zstd");
+            count = (data[0] >> 4) | (data[1] << 4);
+        } else {
+            header = 3;
+            if (size < 3) corrupt_input("zstd");
+            count = (data[0] >> 4) | (data[1] << 4) | (data[2] << 12);
+        }
+        if (count > block_max_) corrupt_input("zstd");
+        literal_count_ = count;
+        if (type == 0) {
+            if (size < header + count) corrupt_input("zstd");
+            std::memcpy(literals_.data(), data + header, count);
+            return header + count;
+        }
+        if (size < header + 1) corrupt_input("zstd");
+        std::memset(literals_.data(), data[header], count);
+        return header + 1;
+    }
+
+    // Huffman-coded, with a new table or (treeless) the previous block's
+    static constexpr size_t kHeaderSize[4] = {3, 3, 4, 5};
+    static constexpr int kSizeBits[4] = {10, 10, 14, 18};
+    size_t header = kHeaderSize[size_format];
+    if (size < header) corrupt_input("zstd");
+    uint64_t fields = 0;
+    for (size_t i = 0; i < header; ++i) fields |= static_cast<uint64_t>(data[i]) << (8 * i);
+    int bits = kSizeBits[size_format];
+    size_t count = static_cast<size_t>((fields >> 4) & ((uint64_t(1) << bits) - 1));
+    size_t compressed = static_cast<size_t>((fields >> (4 + bits)) & ((uint64_t(1) << bits) - 1));
+    if (count > block_max_ || size < header + compressed) corrupt_input("zstd");
+    const unsigned char* streams = data + header;
+    if (type == 2) {
+        size_t table = huffman_table(streams, compressed);
+        streams += table;
+        compressed -= table;
+    } else if (huffman_bits_ == 0) {
+        corrupt_input("zstd");
+    }
+    literal_count_ = count;
+    if (size_format == 0) {
+        huffman_stream(streams, compressed, literals_.data(), count);
+    } else {
+        if (compressed < 6) corrupt_input("zstd");
+        size_t sizes[4] = {load_le16(streams), load_le16(streams + 2), load_le16(streams + 4), 0};
+        if (sizes[0] + sizes[1] + sizes[2] > compressed - 6) corrupt_input("zstd");
+        sizes[3] = compressed - 6 - sizes[0] - sizes[1] - sizes[2];
+        size_t segment = (count + 3) / 4;
+        if (3 * segment > count) corrupt_input("zstd");
+        const unsigned char* stream = streams + 6;
+        for (int i = 0; i < 4; ++i) {
+            huffman_stream(stream, sizes[i], literals_.data() + i * segment, i < 3 ? segment : count - 3 * segment);
+            stream += sizes[i];
+        }
+    }
+    return header + (streams - (data + header)) + compressed;
+}
+
+// The Huffman table of the literals, from the weights of the symbols: stored four bits
+// each, or FSE-coded. The last symbol's weight is implied. Returns the bytes it took.
+inline size_t ZstdDecoder::huffman_table(const unsigned char* data, size_t size) {
+    if (size < 1) corrupt_input("zstd");
+    unsigned char weights[256];
+    size_t count = 0;
+    size_t used;
+    unsigned header = data[0];
+    if (header >= 128) {
+        count = header - 127;
+        used = 1 + (count + 1) / 2;
+        if (used > size) corrupt_input("zstd");
+        for (size_t i = 0; i < count; ++i) weights[i] = (i % 2 == 0) ? data[1 + i / 2] >> 4 : data[1 + i / 2] & 15;
+    } else {
+        used = 1 + header;
+        if (used > size) corrupt_input("zstd");
+        short counts[64];
+        int log, symbols;
+        size_t description = read_counts(data + 1, header, 6, 12, counts, log, symbols);
+        FseTable table;
+        build_table(counts, symbols, log, table);
+        // Two interleaved states, until the stream runs out
+        ReverseBits bits(data + 1 + description, header - description);
+        uint32_t states[2] = {bits.read(log), bits.read(log)};
+        for (int turn = 0;; turn ^= 1) {
+            if (count >= 254) corrupt_input("zstd");
+            const FseEntry& entry = table.entries[states[turn]];
+            weights[count++] = entry.symbol;
+            states[turn] = entry.base + bits.read(entry.bits);
+            if (bits.position() < 0) {
+                weights[count++] = table.entries[states[turn ^ 1]].symbol;
+                break;
+            }
+        }
+    }
+    uint32_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (weights[i] > 11) corrupt_input("zstd");
+        if (weights[i] > 0) total += uint32_t(1) << (weights[i] - 1);
+    }
+    if (total == 0) corrupt_input("zstd");
+    int max_bits = highest_set_bit(total) + 1;
+    uint32_t left = (uint32_t(1) << max_bits) - total;
+    if (max_bits > 11 || (left & (left - 1)) != 0) corrupt_input("zstd");
+    weights[count++] = static_cast<unsigned char>(highest_set_bit(left) + 1);
+
+    // Codes are assigned from the lowest weight (the longest code) up, in symbol order
+    huffman_.assign(size_t(1) << max_bits, HuffmanEntry{0, 0});
+    uint32_t starts[13] = {};
+    for (size_t i = 0; i < count; ++i) {
+        if (weights[i] > 0) starts[weights[i]] += uint32_t(1) << (weights[i] - 1);
+    }
+    for (uint32_t weight = 1, next = 0; weight <= 12; ++weight) {
+        uint32_t span = starts[weight];
+        starts[weight] = next;
+        next += span;
+    }
+    for (size_t symbol = 0; symbol < count; ++symbol) {
+        unsigned weight = weights[symbol];
+        if (weight == 0) continue;
+        uint32_t span = uint32_t(1) << (weight - 1);
+        HuffmanEntry entry{static_cast<uint8_t>(symbol), static_cast<uint8_t>(max_bits + 1 - static_cast<int>(weight))};
+        std::fill(huffman_.begin() + starts[weight], huffman_.begin() + starts[weight] + span, entry);
+        starts[weight] += span;
+    }
+    huffman_bits_ = max_bits;
+    return used;
+}
+
+inline void ZstdDecoder::huffman_stream(const unsigned char* data, size_t size, unsigned char* out, size_t count) {
+    ReverseBits bits(data, size);
+    const HuffmanEntry* table = huffman_.data();
+    int max_bits = huffman_bits_;
+    for (size_t i = 0; i < count; ++i) {
+        const HuffmanEntry& entry = table[bits.peek(max_bits)];
+        out[i] = entry.symbol;
+        bits.skip(entry.bits);
+    }
+    if (bits.position() != 0) corrupt_input("zstd");
+}
+
+// The table one kind of sequence symbols uses in this block: predefined, a single symbol,
+// described here, or the previous block's. Returns the bytes it took.
+inline size_t ZstdDecoder::sequence_table(const unsigned char* data, size_t size, int kind, int mode) {
+    switch (mode) {
+    case 0:
+        current_[kind] = &predefined(kind);
+        return 0;
+    case 1:
+        if (size < 1 || data[0] > kZstdMaxSymbol[kind]) corrupt_input("zstd");
+        tables_[kind].log = 0;
+        tables_[kind].entries.assign(1, FseEntry{0, data[0], 0});
+        current_[kind] = &tables_[kind];
+        return 1;
+    case 2: {
+        short counts[64];
+        int log, symbols;
+        size_t used = read_counts(data, size, kZstdMaxLog[kind], kZstdMaxSymbol[kind], counts, log, symbols);
+        build_table(counts, symbols, log, tables_[kind]);
+        current_[kind] = &tables_[kind];
+        return used;
+    }
+    default:
+        if (current_[kind] == nullptr) corrupt_input("zstd");
+        return 0;
+    }
+}
+
+// The sequences section, executed straight into the window: each sequence copies literals
+// and then a match from up to a window back
+inline void ZstdDecoder::sequences(const unsigned char* data, size_t size) {
+    if (size < 1) corrupt_input("zstd");
+    size_t count = data[0];
+    size_t at = 1;
+    if (count >= 128) {
+        if (size < 2) corrupt_input("zstd");
+        if (count < 255) {
+            count = ((count - 128) << 8) + data[1];
+            at = 2;
+        } else {
+            if (size < 3) corrupt_input("zstd");
+            count = data[1] + (data[2] << 8) + 0x7F00;
+            at = 3;
+        }
+    }
+    unsigned char* out = window_.reserve(block_max_);
+    size_t history = window_.history();
+    size_t written = 0;
+    size_t literal_at = 0;
+    if (count > 0) {
+        if (size < at + 1) corrupt_input("zstd");
+        unsigned modes = data[at++];
+        if (modes & 3) corrupt_input("zstd");
+        at += sequence_table(data + at, size - at, kLiteralLengths, modes >> 6);
+        at += sequence_table(data + at, size - at, kOffsets, (modes >> 4) & 3);
+        at += sequence_table(data + at, size - at, kMatchLengths, (modes >> 2) & 3);
+        if (at > size) corrupt_input("zstd");
+        const FseEntry* literal_lengths = current_[kLiteralLengths]->entries.data();
+        const FseEntry* offsets = current_[kOffsets]->entries.data();
+        const FseEntry* match_lengths = current_[kMatchLengths]->entries.data();
+        ReverseBits bits(data + at, size - at);
+        uint32_t literal_state = bits.read(current_[kLiteralLengths]->log);
+        uint32_t offset_state = bits.read(current_[kOffsets]->log);
+        uint32_t match_state = bits.read(current_[kMatchLengths]->log);
+        for (size_t i = 0; i < count; ++i) {
+            const FseEntry& literal_entry = literal_lengths[literal_state];
+            const FseEntry& offset_entry = offsets[offset_state];
+            const FseEntry& match_entry = match_lengths[match_state];
+            unsigned offset_code = offset_entry.symbol;
+            if (offset_code > 31 || match_entry.symbol > 52 || literal_entry.symbol > 35) corrupt_input("zstd");
+            uint64_t offset_value = (uint64_t(1) << offset_code) + bits.read(static_cast<int>(offset_code));
+            size_t match_length = kZstdMatchLengthBase[match_entry.symbol] + bits.read(kZstdMatchLengthBits[match_entry.symbol]);
+            size_t literal_length = kZstdLiteralLengthBase[literal_entry.symbol] + bits.read(kZstdLiteralLengthBits[literal_entry.symbol]);
+            if (i + 1 < count) {
+                literal_state = literal_entry.base + bits.read(literal_entry.bits);
+                match_state = match_entry.base + bits.read(match_entry.bits);
+                offset_state = offset_entry.base + bits.read(offset_entry.bits);
+            }
+
+            // Offsets 1 to 3 name the recent offsets (shifted by one after no literals)
+            uint64_t offset;
+            if (offset_value > 3) {
+                offset = offset_value - 3;
+                repeat_[2] = repeat_[1];
+                repeat_[1] = repeat_[0];
+                repeat_[0] = offset;
+            } else {
+                size_t index = static_cast<size_t>(offset_value) - 1 + (literal_length == 0 ? 1 : 0);
+                if (index == 0) {
+                    offset = repeat_[0];
+                } else {
+                    offset = index == 3 ? repeat_[0] - 1 : repeat_[index];
+                    if (index > 1) repeat_[2] = repeat_[1];
+                    repeat_[1] = repeat_[0];
+                    repeat_[0] = offset;
+                }
+            }
+
+            if (literal_length > literal_count_ - literal_at || literal_length + match_length > block_max_ - written) corrupt_input("zstd");
+            std::memcpy(out + written, literals_.data() + literal_at, literal_length);
+            written += literal_length;
+            literal_at += literal_length;
+            if (offset == 0 || offset > history + written || offset > window_size_) corrupt_input("zstd");
+            copy_match(out + written, static_cast<size_t>(offset), match_length);
+            written += match_length;
+        }
+        if (bits.position() != 0) corrupt_input("zstd");
+    } else if (at != size) {
+        corrupt_input("zstd");
+    }
+    size_t rest = literal_count_ - literal_at;
+    if (rest > block_max_ - written) corrupt_input("zstd");
+    std::memcpy(out + written, literals_.data() + literal_at, rest);
+    window_.commit(written + rest);
+}
+
+// Frames of the zstd and LZ4 formats (either may follow the other) and skippable frames
+static void decode_zstd_frames(ByteSource& source, DecodeWindow& window) {
+    while (source.need(1)) {
+        require(source, 4, "zstd");
+        uint32_t magic = load_le32(source.data());
+        if ((magic & 0xFFFFFFF0u) == kSkippableMagic) {
+            require(source, 8, "zstd");
+            size_t size = load_le32(source.data() + 4);
+            source.skip(8);
+            if (!source.drop(size)) require(source, 1, "zstd");
+        } else if (magic == kZstdMagic) {
+            ZstdDecoder(source, window).frame();
+        } else if (magic == kLz4Magic) {
+            decode_lz4_frame(source, window);
+        } else {
+            throw std::runtime_error("unknown frame in compressed data");
+        }
+    }
+}
+
+// The frames of a zstd or LZ4 input in memory, as (offset, size), without skippable ones;
+// false if the input does not split (it is then decoded as one stream, which reports why)
+static bool split_frames(const unsigned char* data, size_t size, std::vector<std::pair<size_t, size_t>>& frames) {
+    for (size_t at = 0; at < size;) {
+        if (size - at < 8) return false;
+        uint32_t magic = load_le32(data + at);
+        size_t frame;
+        if ((magic & 0xFFFFFFF0u) == kSkippableMagic) {
+            frame = 8 + static_cast<size_t>(load_le32(data + at + 4));
+            if (frame > size - at) return false;
+            at += frame;
+            continue;
+        }
+        if (magic == kZstdMagic) {
+            frame = ZstdDecoder::frame_size(data + at, size - at);
+        } else if (magic == kLz4Magic) {
+            frame = lz4_frame_size(data + at, size - at);
+        } else {
+            return false;
+        }
+        if (frame == 0) return false;
+        frames.emplace_back(at, frame);
+        at += frame;
+    }
+    return true;
+}
+
+#endif // SCANR_DECOMPRESS_H
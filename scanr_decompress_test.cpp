@@ -0,0 +1,632 @@
+// scanr_decompress_test: Checks of scanr's own gzip, zstd and LZ4 decoders (scanr_decompress.h).
+//
+// The decoders are run in this process on streams made for each check: ones this program
+// writes itself (stored deflate blocks, raw and RLE zstd blocks, LZ4 blocks from a small
+// greedy encoder), and, where gzip, zstd and lz4 are installed, what those tools write.
+// Every stream must decode to the text it was made from, from memory and from a
+// descriptor; damaged, truncated and over-limit streams must fail with std::runtime_error
+// and nothing else, having produced no more than a prefix of the text. The fuzz check
+// mutates valid streams from a fixed seed; build with -fsanitize=address,undefined to have
+// it check memory safety as well.
+//
+// Build: g++ -std=c++17 -O2 -o scanr_decompress_test scanr_decompress_test.cpp
+// Run:   ./scanr_decompress_test
+#include <iostream>        // For progress and error messages
+#include <fstream>         // For the files the tools read and write
+#include <string>          // For streams and texts
+#include <vector>          // For stream lists
+#include <algorithm>       // For std::min
+#include <filesystem>      // For the scratch directory
+#include <memory>          // For std::unique_ptr
+#include <cstdint>         // For uint64_t
+#include <cstdlib>         // For std::system
+
+#include <fcntl.h>         // For open
+
+#include "scanr_decompress.h"
+#include "scanr_test_support.h" // For Rng and the check tally
+
+namespace fs = std::filesystem;
+
+// Structure to hold the parsed command-line options
+struct TestSettings : CheckOptions {
+    TestSettings() { work_dir = "scanr_decompress_test_work"; }
+    int iterations = 3000;                 // --iterations N: Mutated streams the fuzz check decodes
+};
+
+// Which entry point decodes a stream: gzip members, or zstd/LZ4/skippable frames
+enum class Container { kGzip, kFrames };
+
+// A compressed stream and what it decodes to
+struct Stream {
+    std::string name;
+    Container container;
+    std::string bytes;
+    std::string text;
+};
+
+// What decoding a stream gave: the text up to where it stopped, and why it stopped
+struct Decoded {
+    std::string text;
+    std::string error;       // what() of the std::runtime_error, empty if the stream decoded
+    bool unexpected = false; // Some other exception escaped the decoder
+};
+
+// Runs the checks and keeps the tally
+class Tester : public CheckTally {
+public:
+    explicit Tester(const TestSettings& settings) : settings(settings) {}
+
+    // Path of 'name' inside the scratch directory
+    std::string path(const std::string& name) const;
+
+    // Compress 'text' with an installed tool, run as "COMMAND < input > output" (for example
+    // "gzip -9 -c"); false if the tool is not installed or fails
+    bool compress_with(const std::string& command, const std::string& text, std::string& compressed);
+
+    // The stream decodes to its text, from memory and from a file descriptor
+    void expect_decodes(const Stream& stream);
+    // The stream fails with a std::runtime_error (whose message contains 'reason', if
+    // given) after producing at most a prefix of 'text'
+    void expect_fails(const Stream& stream, const std::string& reason = "");
+
+    const TestSettings& settings;
+
+private:
+    std::vector<std::string> missing_; // Tools found missing, reported once each
+};
+
+// --- Function Prototypes ---
+void print_usage();
+bool parse_arguments(int argc, char* argv[], TestSettings& settings);
+std::vector<Check<Tester>> all_checks();
+Decoded decode(const std::string& bytes, Container container, const std::string& file = "");
+std::string make_text(int kind, size_t size, Rng& rng);
+std::string gzip_stored(const std::string& text, unsigned flags = 0);
+std::string zstd_raw(const std::string& text, int window_log, bool checksum, bool rle, unsigned dictionary_bytes = 0, uint32_t dictionary = 0);
+std::string zstd_skippable(const std::string& payload);
+std::string lz4_frame(const std::string& text, int block_code, bool block_checksums, bool content_size, bool content_checksum);
+std::string lz4_block(const std::string& text);
+const std::vector<Stream>& sample_streams(Tester& tester);
+void check_round_trip(Tester& tester);
+void check_concatenated(Tester& tester);
+void check_corrupt_headers(Tester& tester);
+void check_limits(Tester& tester);
+void check_truncated(Tester& tester);
+void check_fuzz(Tester& tester);
+
+// --- Main Function ---
+int main(int argc, char* argv[]) {
+    TestSettings settings;
+    if (!parse_arguments(argc, argv, settings)) {
+        print_usage();
+        return 2;
+    }
+    if (!prepare_work_dir("scanr_decompress_test", settings.work_dir)) return 2;
+
+    Tester tester(settings);
+    return run_checks("scanr_decompress_test", all_checks(), settings, tester);
+}
+
+// --- Helper Functions ---
+
+void print_usage() {
+    std::cerr << "Usage: scanr_decompress_test [OPTIONS]\n"
+              << "Check scanr's gzip, zstd and LZ4 decoders.\n\n"
+              << "Options:\n"
+              << "  --work DIR         Scratch directory, emptied first (default: scanr_decompress_test_work)\n"
+              << "  --only TEXT        Run only the checks whose name contains TEXT\n"
+              << "  --iterations N     Mutated streams the fuzz check decodes (default: 3000)\n"
+              << "  --help             Show this help message\n";
+}
+
+bool parse_arguments(int argc, char* argv[], TestSettings& settings) {
+    return parse_check_options("scanr_decompress_test", argc, argv, settings, [&](const std::string& arg, const std::string& value) {
+        if (arg != "--iterations") return false;
+        settings.iterations = std::atoi(value.c_str());
+        return true;
+    });
+}
+
+std::string Tester::path(const std::string& name) const {
+    return (fs::path(settings.work_dir) / name).string();
+}
+
+bool Tester::compress_with(const std::string& command, const std::string& text, std::string& compressed) {
+    std::string tool = command.substr(0, command.find(' '));
+    if (std::find(missing_.begin(), missing_.end(), tool) != missing_.end()) return false;
+#ifdef _WIN32
+    std::string quiet = " > nul 2>&1";
+#else
+    std::string quiet = " > /dev/null 2>&1";
+#endif
+    if (std::system((tool + " --version" + quiet).c_str()) != 0) {
+        std::cerr << "scanr_decompress_test: " << tool << " is not installed; skipping the streams it writes" << std::endl;
+        missing_.push_back(tool);
+        return false;
+    }
+    std::string input = path("tool_input"), output = path("tool_output");
+    std::ofstream(input, std::ios::binary | std::ios::trunc) << text;
+    std::string line = command + " < \"" + input + "\" > \"" + output + "\"";
+    if (!expect(std::system(line.c_str()) == 0, line + ": runs")) return false;
+    compressed = read_file(output);
+    return true;
+}
+
+void Tester::expect_decodes(const Stream& stream) {
+    Decoded memory = decode(stream.bytes, stream.container);
+    expect(memory.error.empty() && !memory.unexpected, stream.name + ": decodes" + (memory.error.empty() ? "" : " (" + memory.error + ")"));
+    expect(memory.text == stream.text, stream.name + ": decodes to its text (" + std::to_string(memory.text.size()) + " of " +
+                                           std::to_string(stream.text.size()) + " bytes)");
+    Decoded file = decode(stream.bytes, stream.container, path("stream"));
+    expect(file.error.empty() && file.text == stream.text, stream.name + ": decodes the same from a descriptor");
+}
+
+void Tester::expect_fails(const Stream& stream, const std::string& reason) {
+    Decoded decoded = decode(stream.bytes, stream.container);
+    bool failed = !decoded.error.empty() && !decoded.unexpected;
+    expect(failed, stream.name + ": fails" + (decoded.unexpected ? " (with " + decoded.error + ")" : ""));
+    if (failed && !reason.empty()) {
+        expect(decoded.error.find(reason) != std::string::npos, stream.name + ": reports '" + reason + "', not '" + decoded.error + "'");
+    }
+    expect(stream.text.compare(0, decoded.text.size(), decoded.text) == 0 && decoded.text.size() <= stream.text.size(),
+           stream.name + ": produces at most a prefix of the text");
+}
+
+// Decode with the entry point scanr uses for the container, from memory or, given a file
+// name, from a descriptor on that file
+Decoded decode(const std::string& bytes, Container container, const std::string& file) {
+    Decoded decoded;
+    DecodeWindow window([&](const char* text, size_t size) {
+        decoded.text.append(text, size);
+        return true;
+    });
+    int fd = -1;
+    std::unique_ptr<ByteSource> source;
+    if (file.empty()) {
+        source = std::make_unique<ByteSource>(bytes.data(), bytes.size());
+    } else {
+        std::ofstream(file, std::ios::binary | std::ios::trunc) << bytes;
+#ifdef _WIN32
+        fd = _open(file.c_str(), _O_RDONLY | _O_BINARY);
+#else
+        fd = ::open(file.c_str(), O_RDONLY);
+#endif
+        if (fd < 0) {
+            decoded.error = "cannot open " + file;
+            decoded.unexpected = true;
+            return decoded;
+        }
+        source = std::make_unique<ByteSource>(fd, nullptr, 0);
+    }
+    try {
+        if (container == Container::kGzip) {
+            decode_gzip(*source, window);
+        } else {
+            decode_zstd_frames(*source, window);
+        }
+        window.finish();
+    } catch (const std::runtime_error& e) {
+        decoded.error = e.what();
+        window.finish();
+    } catch (const std::exception& e) {
+        decoded.error = e.what();
+        decoded.unexpected = true;
+    }
+    if (fd >= 0) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        ::close(fd);
+#endif
+    }
+    return decoded;
+}
+
+// Text of one of several kinds: 0 log-like lines, 1 one repeated byte, 2 random bytes,
+// 3 lines that repeat from far back (farther than a deflate or LZ4 window reaches)
+std::string make_text(int kind, size_t size, Rng& rng) {
+    static const char* const kWords[] = {"GET", "/index.html", "200", "timeout", "user=42", "ERROR", "retrying", "ok"};
+    std::string text;
+    text.reserve(size);
+    if (kind == 3) {
+        std::string block = make_text(2, 100 * 1024, rng);
+        while (text.size() < size) text += block.substr(0, std::min(block.size(), size - text.size()));
+        return text;
+    }
+    while (text.size() < size) {
+        if (kind == 1) {
+            text.push_back('x');
+        } else if (kind == 2) {
+            text.push_back(static_cast<char>(rng.below(256)));
+        } else {
+            text += std::to_string(rng.below(100000)) + " ";
+            for (int word = 0; word < 5; ++word) text += std::string(kWords[rng.below(8)]) + " ";
+            text += "\n";
+        }
+    }
+    text.resize(size);
+    return text;
+}
+
+// --- Stream Writers ---
+
+static void put_le(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+}
+
+static const unsigned char* bytes_of(const std::string& text) {
+    return reinterpret_cast<const unsigned char*>(text.data());
+}
+
+// A gzip member of stored deflate blocks, with the header fields 'flags' asks for
+// (FHCRC 0x02, FEXTRA 0x04, FNAME 0x08, FCOMMENT 0x10)
+std::string gzip_stored(const std::string& text, unsigned flags) {
+    std::string out = {'\x1F', '\x8B', '\x08', static_cast<char>(flags), 0, 0, 0, 0, 0, '\x03'};
+    if (flags & 0x04) {
+        put_le(out, 6, 2);
+        out += "ab\x02\x00xy";
+    }
+    if (flags & 0x08) out += std::string("name.txt") + '\0';
+    if (flags & 0x10) out += std::string("a comment") + '\0';
+    if (flags & 0x02) put_le(out, crc32_update(0, bytes_of(out), out.size()) & 0xFFFF, 2);
+    size_t at = 0;
+    do {
+        size_t size = std::min<size_t>(65535, text.size() - at);
+        bool final = at + size == text.size();
+        out.push_back(final ? 1 : 0); // BFINAL, BTYPE 00, then padding to the byte
+        put_le(out, size, 2);
+        put_le(out, ~size & 0xFFFF, 2);
+        out.append(text, at, size);
+        at += size;
+    } while (at < text.size());
+    put_le(out, crc32_update(0, bytes_of(text), text.size()), 4);
+    put_le(out, text.size() & 0xFFFFFFFF, 4);
+    return out;
+}
+
+// A zstd frame of raw blocks (or RLE blocks, for runs of one byte), a window of 2^window_log
+// bytes (0: a single segment with its content size) and optionally a checksum and a
+// dictionary id of 'dictionary_bytes' bytes
+std::string zstd_raw(const std::string& text, int window_log, bool checksum, bool rle, unsigned dictionary_bytes, uint32_t dictionary) {
+    std::string out;
+    put_le(out, kZstdMagic, 4);
+    unsigned dictionary_flag = dictionary_bytes == 4 ? 3 : dictionary_bytes;
+    bool single_segment = window_log == 0;
+    out.push_back(static_cast<char>((3u << 6) | (single_segment ? 0x20 : 0) | (checksum ? 0x04 : 0) | dictionary_flag));
+    if (!single_segment) out.push_back(static_cast<char>((window_log - 10) << 3));
+    put_le(out, dictionary, static_cast<int>(dictionary_bytes));
+    put_le(out, text.size(), 8);
+    size_t block_max = std::min<size_t>(128 * 1024, single_segment ? std::max<size_t>(text.size(), 1) : size_t(1) << window_log);
+    size_t at = 0;
+    do {
+        size_t size = std::min(block_max, text.size() - at);
+        bool last = at + size == text.size();
+        bool run = rle && size > 0 && text.find_first_not_of(text[at], at) >= at + size;
+        put_le(out, (last ? 1 : 0) | ((run ? 1u : 0u) << 1) | (size << 3), 3);
+        out.append(text, at, run ? 1 : size);
+        at += size;
+    } while (at < text.size());
+    if (checksum) {
+        Xxh64 hash;
+        hash.update(bytes_of(text), text.size());
+        put_le(out, hash.digest() & 0xFFFFFFFF, 4);
+    }
+    return out;
+}
+
+// A skippable frame holding 'payload'
+std::string zstd_skippable(const std::string& payload) {
+    std::string out;
+    put_le(out, kSkippableMagic | 0x7, 4);
+    put_le(out, payload.size(), 4);
+    return out + payload;
+}
+
+// An LZ4 frame of independent blocks of at most 64 KiB << 2*(block_code-4), each compressed
+// with lz4_block (or stored, where that is no smaller), with the optional fields asked for
+std::string lz4_frame(const std::string& text, int block_code, bool block_checksums, bool content_size, bool content_checksum) {
+    std::string out;
+    put_le(out, kLz4Magic, 4);
+    std::string descriptor;
+    descriptor.push_back(static_cast<char>((1u << 6) | 0x20 | (block_checksums ? 0x10 : 0) | (content_size ? 0x08 : 0) | (content_checksum ? 0x04 : 0)));
+    descriptor.push_back(static_cast<char>(block_code << 4));
+    if (content_size) put_le(descriptor, text.size(), 8);
+    out += descriptor;
+    out.push_back(static_cast<char>((Xxh32::of(bytes_of(descriptor), descriptor.size()) >> 8) & 0xFF));
+    size_t block_max = size_t(1) << (8 + 2 * block_code);
+    for (size_t at = 0; at < text.size(); at += block_max) {
+        std::string chunk = text.substr(at, block_max);
+        std::string block = lz4_block(chunk);
+        bool stored = block.size() >= chunk.size();
+        if (stored) block = chunk;
+        put_le(out, block.size() | (stored ? 0x80000000u : 0), 4);
+        out += block;
+        if (block_checksums) put_le(out, Xxh32::of(bytes_of(block), block.size()), 4);
+    }
+    put_le(out, 0, 4);
+    if (content_checksum) put_le(out, Xxh32::of(bytes_of(text), text.size()), 4);
+    return out;
+}
+
+// One LZ4 block from a greedy encoder: 4-byte matches found through a hash table, the last
+// five bytes always literals, as the format asks
+std::string lz4_block(const std::string& text) {
+    std::string out;
+    auto put_length = [&](size_t length) {
+        for (; length >= 255; length -= 255) out.push_back('\xFF');
+        out.push_back(static_cast<char>(length));
+    };
+    auto sequence = [&](size_t anchor, size_t literals, size_t offset, size_t length) {
+        size_t match_code = length >= 4 ? length - 4 : 0;
+        out.push_back(static_cast<char>((std::min<size_t>(literals, 15) << 4) | (length >= 4 ? std::min<size_t>(match_code, 15) : 0)));
+        if (literals >= 15) put_length(literals - 15);
+        out.append(text, anchor, literals);
+        if (length < 4) return; // The last sequence: literals only
+        put_le(out, offset, 2);
+        if (match_code >= 15) put_length(match_code - 15);
+    };
+    std::vector<size_t> table(4096, 0); // Position + 1 of the last 4 bytes with each hash
+    size_t anchor = 0, pos = 0;
+    size_t size = text.size();
+    while (size >= 13 && pos + 12 < size) {
+        uint32_t word;
+        std::memcpy(&word, text.data() + pos, 4);
+        uint32_t hash = (word * 2654435761u) >> 20;
+        size_t candidate = table[hash];
+        table[hash] = pos + 1;
+        if (candidate > 0 && pos - (candidate - 1) <= 65535 && std::memcmp(text.data() + candidate - 1, text.data() + pos, 4) == 0) {
+            size_t from = candidate - 1;
+            size_t length = 4;
+            while (pos + length + 5 < size && text[from + length] == text[pos + length]) ++length;
+            sequence(anchor, pos - anchor, pos - from, length);
+            pos += length;
+            anchor = pos;
+            continue;
+        }
+        ++pos;
+    }
+    sequence(anchor, size - anchor, 0, 0);
+    return out;
+}
+
+// Valid streams of every kind there is a writer for, over texts of several kinds and sizes
+// (made once: the tools take a while at their higher levels)
+const std::vector<Stream>& sample_streams(Tester& tester) {
+    static std::vector<Stream> streams;
+    if (!streams.empty()) return streams;
+    Rng rng(27);
+    struct Sample {
+        std::string name;
+        std::string text;
+    };
+    std::vector<Sample> texts = {
+        {"empty", ""},
+        {"one byte", "a"},
+        {"a line", "hello, world\n"},
+        {"log text", make_text(0, 300 * 1024, rng)},
+        {"one byte repeated", make_text(1, 200 * 1024, rng)},
+        {"random bytes", make_text(2, 70 * 1024, rng)},
+        {"far repeats", make_text(3, 1024 * 1024, rng)},
+    };
+    for (const Sample& sample : texts) {
+        const std::string& text = sample.text;
+        streams.push_back({"gzip stored: " + sample.name, Container::kGzip, gzip_stored(text), text});
+        streams.push_back({"gzip stored with all header fields: " + sample.name, Container::kGzip, gzip_stored(text, 0x1E), text});
+        streams.push_back({"zstd raw: " + sample.name, Container::kFrames, zstd_raw(text, 17, true, false), text});
+        streams.push_back({"zstd raw, single segment: " + sample.name, Container::kFrames, zstd_raw(text, 0, false, false), text});
+        streams.push_back({"zstd RLE: " + sample.name, Container::kFrames, zstd_raw(text, 20, true, true), text});
+        streams.push_back({"LZ4 64 KiB blocks: " + sample.name, Container::kFrames, lz4_frame(text, 4, false, false, true), text});
+        streams.push_back({"LZ4 4 MiB blocks, all checksums: " + sample.name, Container::kFrames, lz4_frame(text, 7, true, true, true), text});
+        static const std::pair<const char*, Container> kTools[] = {
+            {"gzip -1 -c", Container::kGzip}, {"gzip -9 -c", Container::kGzip},
+            {"zstd -q -1 -c", Container::kFrames}, {"zstd -q -19 -c", Container::kFrames}, {"zstd -q -3 --no-check -c", Container::kFrames},
+            {"lz4 -q -1 -c", Container::kFrames}, {"lz4 -q -9 -BD -c", Container::kFrames}, {"lz4 -q -BX --content-size -B4 -c", Container::kFrames},
+        };
+        for (const auto& tool : kTools) {
+            std::string compressed;
+            if (tester.compress_with(tool.first, text, compressed)) streams.push_back({std::string(tool.first) + ": " + sample.name, tool.second, compressed, text});
+        }
+    }
+    return streams;
+}
+
+// --- Checks ---
+
+// Every check, in the order they run. Names are what --only selects on.
+std::vector<Check<Tester>> all_checks() {
+    return {
+        {"round_trip", check_round_trip},
+        {"concatenated", check_concatenated},
+        {"corrupt_headers", check_corrupt_headers},
+        {"limits", check_limits},
+        {"truncated", check_truncated},
+        {"fuzz", check_fuzz},
+    };
+}
+
+// Every sample stream decodes to its text, whoever wrote it. zstd --long=27 writes the
+// largest window the decoder takes.
+void check_round_trip(Tester& tester) {
+    for (const Stream& stream : sample_streams(tester)) tester.expect_decodes(stream);
+    Rng rng(2727);
+    std::string text = make_text(3, 3 * 1024 * 1024, rng);
+    std::string compressed;
+    if (tester.compress_with("zstd -q --long=27 -c", text, compressed)) tester.expect_decodes({"zstd --long=27", Container::kFrames, compressed, text});
+}
+
+// Concatenated gzip members and zstd/LZ4 frames decode to the concatenated texts; gzip
+// ignores what follows its members (tape padding), and skippable frames are skipped.
+// split_frames finds the frames the -j decoder hands to separate threads.
+void check_concatenated(Tester& tester) {
+    Rng rng(2728);
+    std::string a = make_text(0, 100 * 1024, rng), b = make_text(2, 50 * 1024, rng), c = make_text(0, 3000, rng);
+
+    std::string members = gzip_stored(a) + gzip_stored("") + gzip_stored(b, 0x08);
+    tester.expect_decodes({"gzip members", Container::kGzip, members, a + b});
+    tester.expect_decodes({"gzip members and zero padding", Container::kGzip, members + std::string(512, '\0'), a + b});
+    std::string first, second;
+    if (tester.compress_with("gzip -6 -c", a, first) && tester.compress_with("gzip -1 -c", b, second)) {
+        tester.expect_decodes({"gzip members from gzip", Container::kGzip, first + second + first, a + b + a});
+    }
+
+    std::string frames = zstd_raw(a, 17, true, false) + zstd_skippable("skipped") + lz4_frame(b, 4, true, true, true) + zstd_raw(c, 0, false, true);
+    tester.expect_decodes({"zstd, skippable and LZ4 frames", Container::kFrames, frames, a + b + c});
+    std::vector<std::pair<size_t, size_t>> parts;
+    bool split = split_frames(bytes_of(frames), frames.size(), parts);
+    tester.expect(split && parts.size() == 3, "split_frames finds the three frames and skips the skippable one");
+    std::string joined;
+    for (const auto& part : parts) joined += decode(frames.substr(part.first, part.second), Container::kFrames).text;
+    tester.expect(joined == a + b + c, "the frames split_frames finds decode one by one to the text");
+    tester.expect(!split_frames(bytes_of(frames), frames.size() - 1, parts), "split_frames rejects a frame cut short");
+
+    if (tester.compress_with("zstd -q -5 -c", a, first) && tester.compress_with("lz4 -q -c", b, second)) {
+        tester.expect_decodes({"zstd and lz4 frames from the tools", Container::kFrames, first + second + first, a + b + a});
+    }
+}
+
+// Damage in headers, block headers and checksums is reported, never decoded through
+void check_corrupt_headers(Tester& tester) {
+    Rng rng(2729);
+    std::string text = make_text(0, 200 * 1024, rng);
+    // The stream with the byte at 'at' set to 'value' fails, after at most a prefix of
+    // 'decodes_to' (the text, or the small text of that stream, or the text as changed too)
+    auto damaged = [&](const std::string& name, Container container, std::string bytes, size_t at, unsigned char value,
+                       const std::string* decodes_to = nullptr) {
+        bytes[at] = static_cast<char>(value);
+        tester.expect_fails({name, container, bytes, decodes_to ? *decodes_to : text});
+    };
+    // The text as it decodes with the stored byte at 'at' of its stream flipped
+    auto flipped = [&](size_t at) {
+        std::string changed = text;
+        changed[at] = static_cast<char>(changed[at] ^ 1);
+        return changed;
+    };
+
+    std::string gzip = gzip_stored(text);
+    damaged("gzip: method 7", Container::kGzip, gzip, 2, 7);
+    damaged("gzip: reserved flag", Container::kGzip, gzip, 3, 0x20);
+    damaged("gzip: reserved block type", Container::kGzip, gzip, 10, 0x07);
+    damaged("gzip: stored length and its complement disagree", Container::kGzip, gzip, 13, 0x12);
+    std::string changed = flipped(1000 - 10 - 5); // After the member header and the block header
+    damaged("gzip: text changed under its CRC-32", Container::kGzip, gzip, 1000, static_cast<unsigned char>(gzip[1000] ^ 1), &changed);
+    damaged("gzip: CRC-32 changed", Container::kGzip, gzip, gzip.size() - 8, static_cast<unsigned char>(gzip[gzip.size() - 8] ^ 1));
+    damaged("gzip: length changed", Container::kGzip, gzip, gzip.size() - 1, static_cast<unsigned char>(gzip[gzip.size() - 1] ^ 1));
+    std::string tool;
+    if (tester.compress_with("gzip -6 -c", text, tool)) {
+        damaged("gzip -6: reserved block type", Container::kGzip, tool, 10, static_cast<unsigned char>(tool[10] | 0x06));
+        damaged("gzip -6: CRC-32 changed", Container::kGzip, tool, tool.size() - 6, static_cast<unsigned char>(tool[tool.size() - 6] ^ 0x40));
+    }
+
+    std::string zstd = zstd_raw(text, 17, true, false);
+    damaged("zstd: reserved descriptor bit", Container::kFrames, zstd, 4, static_cast<unsigned char>(zstd[4] | 0x08));
+    damaged("zstd: unknown magic", Container::kFrames, zstd, 0, 0x29);
+    size_t block = 4 + 1 + 1 + 8;
+    damaged("zstd: reserved block type", Container::kFrames, zstd, block, static_cast<unsigned char>(zstd[block] | 0x06));
+    damaged("zstd: block larger than the window", Container::kFrames, zstd, block + 2, 0xFF);
+    changed = flipped(500 - block - 3);
+    damaged("zstd: text changed under its checksum", Container::kFrames, zstd, 500, static_cast<unsigned char>(zstd[500] ^ 1), &changed);
+    damaged("zstd: checksum changed", Container::kFrames, zstd, zstd.size() - 1, static_cast<unsigned char>(zstd[zstd.size() - 1] ^ 1));
+    if (tester.compress_with("zstd -q -3 -c", text, tool)) {
+        damaged("zstd -3: reserved descriptor bit", Container::kFrames, tool, 4, static_cast<unsigned char>(tool[4] | 0x08));
+        damaged("zstd -3: checksum changed", Container::kFrames, tool, tool.size() - 2, static_cast<unsigned char>(tool[tool.size() - 2] ^ 0x10));
+    }
+
+    std::string lz4 = lz4_frame(text, 4, true, true, true);
+    damaged("LZ4: version 0", Container::kFrames, lz4, 4, static_cast<unsigned char>(lz4[4] & 0x3F));
+    damaged("LZ4: reserved flag", Container::kFrames, lz4, 4, static_cast<unsigned char>(lz4[4] | 0x02));
+    damaged("LZ4: reserved block size bit", Container::kFrames, lz4, 5, static_cast<unsigned char>(lz4[5] | 0x80));
+    damaged("LZ4: block size code 3", Container::kFrames, lz4, 5, 3 << 4);
+    damaged("LZ4: header checksum changed", Container::kFrames, lz4, 14, static_cast<unsigned char>(lz4[14] ^ 1));
+    damaged("LZ4: block larger than the block size", Container::kFrames, lz4, 17, 0x7F);
+    damaged("LZ4: block changed under its checksum", Container::kFrames, lz4, 40, static_cast<unsigned char>(lz4[40] ^ 1));
+    damaged("LZ4: content checksum changed", Container::kFrames, lz4, lz4.size() - 1, static_cast<unsigned char>(lz4[lz4.size() - 1] ^ 1));
+    damaged("LZ4: content size changed", Container::kFrames, lz4, 6, static_cast<unsigned char>(lz4[6] ^ 1));
+    std::string small = "abcdabcdabcdabcdabcd";
+    std::string offset_zero = lz4_frame(small, 4, false, false, false);
+    // The block is "abcd" as literals, then a match 4 back: make it reach before the start, or nowhere
+    tester.expect(offset_zero[11] == 0x47 && offset_zero[16] == 4, "LZ4: the small block has the expected layout");
+    damaged("LZ4: match before the start of the text", Container::kFrames, offset_zero, 16, 9, &small);
+    damaged("LZ4: match at offset 0", Container::kFrames, offset_zero, 16, 0, &small);
+}
+
+// The limits the decoders share with the reference tools: zstd windows up to 128 MiB, and no
+// zstd or LZ4 dictionaries. A dictionary id of 0 means none and is accepted.
+void check_limits(Tester& tester) {
+    std::string text = "a small text\n";
+    tester.expect_decodes({"zstd: 128 MiB window", Container::kFrames, zstd_raw(text, 27, true, false), text});
+    std::string larger = zstd_raw(text, 27, true, false);
+    larger[5] = static_cast<char>(larger[5] | 1); // Mantissa 1: 144 MiB
+    tester.expect_fails({"zstd: 144 MiB window", Container::kFrames, larger, text}, "window too large");
+    tester.expect_fails({"zstd: 256 MiB window", Container::kFrames, zstd_raw(text, 28, true, false), text}, "window too large");
+    tester.expect_fails({"zstd: 2 GiB window", Container::kFrames, zstd_raw(text, 31, true, false), text}, "window too large");
+    for (unsigned bytes : {1u, 2u, 4u}) {
+        std::string name = "zstd: " + std::to_string(bytes) + "-byte dictionary id";
+        tester.expect_fails({name, Container::kFrames, zstd_raw(text, 17, true, false, bytes, 1), text}, "dictionaries are not supported");
+        tester.expect_decodes({name + " of 0", Container::kFrames, zstd_raw(text, 17, true, false, bytes, 0), text});
+    }
+    Rng rng(2730);
+    std::string big = make_text(3, 3 * 1024 * 1024, rng);
+    std::string compressed;
+    if (tester.compress_with("zstd -q --long=28 -c", big, compressed)) {
+        tester.expect_fails({"zstd --long=28", Container::kFrames, compressed, big}, "window too large");
+    }
+
+    std::string lz4 = lz4_frame(text, 4, false, false, false);
+    std::string with_dictionary = lz4.substr(0, 6) + std::string("\x01\x00\x00\x00", 4);
+    with_dictionary[4] = static_cast<char>(with_dictionary[4] | 0x01);
+    with_dictionary.push_back(static_cast<char>((Xxh32::of(bytes_of(with_dictionary) + 4, with_dictionary.size() - 4) >> 8) & 0xFF));
+    with_dictionary += lz4.substr(7);
+    tester.expect_fails({"LZ4: dictionary id", Container::kFrames, with_dictionary, text}, "dictionaries are not supported");
+}
+
+// Every prefix of a stream that is shorter than the stream fails (after at most a prefix
+// of the text): the decoders never take a cut stream for a whole one
+void check_truncated(Tester& tester) {
+    Rng rng(2731);
+    for (const Stream& stream : sample_streams(tester)) {
+        if (stream.bytes.size() > 400 && stream.name.find("log text") == std::string::npos) continue;
+        int failed = 0;
+        // Every prefix of a small stream, 300 of a large one; the empty prefix is an empty
+        // input, which (for zstd and LZ4) is no frames rather than a cut one
+        size_t sizes = std::min<size_t>(stream.bytes.size(), 301);
+        for (size_t k = 1; k < sizes; ++k) {
+            size_t size = stream.bytes.size() <= 301 ? k : 1 + static_cast<size_t>(rng.below(stream.bytes.size() - 1));
+            Decoded decoded = decode(stream.bytes.substr(0, size), stream.container);
+            bool ok = !decoded.error.empty() && !decoded.unexpected && stream.text.compare(0, decoded.text.size(), decoded.text) == 0;
+            if (!ok && failed++ < 3) tester.expect(false, stream.name + ": cut to " + std::to_string(size) + " bytes fails (" + decoded.error + ")");
+        }
+        if (failed == 0) tester.expect(true, stream.name + ": every prefix fails");
+    }
+}
+
+// Mutated streams (bits flipped, bytes changed, inserted or removed, pieces repeated) either
+// decode or fail with std::runtime_error; nothing else escapes the decoders
+void check_fuzz(Tester& tester) {
+    Rng rng(2732);
+    std::vector<Stream> streams;
+    for (const Stream& stream : sample_streams(tester)) {
+        if (stream.bytes.size() <= 64 * 1024) streams.push_back(stream);
+    }
+    int unexpected = 0;
+    for (int iteration = 0; iteration < tester.settings.iterations; ++iteration) {
+        const Stream& stream = streams[static_cast<size_t>(rng.below(streams.size()))];
+        std::string bytes = stream.bytes;
+        int changes = 1 + static_cast<int>(rng.below(4));
+        for (int change = 0; change < changes && !bytes.empty(); ++change) {
+            size_t at = static_cast<size_t>(rng.below(bytes.size()));
+            switch (rng.below(5)) {
+                case 0: bytes[at] = static_cast<char>(bytes[at] ^ (1 << rng.below(8))); break;
+                case 1: bytes[at] = static_cast<char>(rng.below(256)); break;
+                case 2: bytes.insert(at, 1, static_cast<char>(rng.below(256))); break;
+                case 3: bytes.erase(at, 1 + static_cast<size_t>(rng.below(8))); break;
+                default: bytes.insert(at, bytes.substr(static_cast<size_t>(rng.below(bytes.size())), static_cast<size_t>(rng.below(64)))); break;
+            }
+        }
+        Decoded decoded = decode(bytes, stream.container);
+        if (decoded.unexpected && unexpected++ < 5) {
+            tester.expect(false, stream.name + ": mutation " + std::to_string(iteration) + " throws only runtime_error (" + decoded.error + ")");
+        }
+    }
+    if (unexpected == 0) tester.expect(true, std::to_string(tester.settings.iterations) + " mutated streams decode or fail cleanly");
+}
@@ -0,0 +1,397 @@
+// scanr_test: Behavior checks for a scanr binary, on small inputs generated for each check.
+//
+// Every check writes its inputs into a scratch directory, runs scanr on them and compares
+// what it printed (standard output, and the exit status where it matters) with what is
+// expected. Inputs come from a fixed seed, so a failure can be reproduced. A failed check
+// prints what it ran and the first difference; the exit status is 1 if any check failed.
+//
+// Build: g++ -std=c++17 -O2 -o scanr_test scanr_test.cpp
+// Run:   ./scanr_test --scanr ./scanr
+#include <iostream>        // For progress and error messages
+#include <fstream>         // For writing inputs and reading captured output
+#include <sstream>         // For building expected output
+#include <string>          // For paths, arguments and output
+#include <string_view>     // For word lists
+#include <vector>          // For arguments and file lists
+#include <algorithm>       // For std::sort, std::min
+#include <filesystem>      // For the scratch directory
+#include <cstdint>         // For uint64_t
+#include <cstring>         // For memcpy
+
+#include "scanr_test_support.h" // For Rng, run_child and the check tally
+
+namespace fs = std::filesystem;
+
+// Structure to hold the parsed command-line options
+struct TestSettings : CheckOptions {
+    TestSettings() { work_dir = "scanr_test_work"; }
+#ifdef _WIN32
+    std::string scanr = "scanr.exe";       // --scanr PATH: Binary under test
+#else
+    std::string scanr = "./scanr";
+#endif
+};
+
+// What one run of scanr printed
+struct RunOutput {
+    int exit_code = -1;
+    std::string out;
+    std::string err;
+};
+
+// Runs scanr for the checks and keeps the tally
+class Tester : public CheckTally {
+public:
+    explicit Tester(const TestSettings& settings) : settings_(settings) {}
+
+    // Path of 'name' inside the scratch directory, with scanr's separator
+    std::string path(const std::string& name) const;
+    // Write 'contents' to 'name' (in the scratch directory), creating its directories
+    std::string write_file(const std::string& name, const std::string& contents) const;
+
+    // Run scanr with 'args', 'input' as its standard input
+    RunOutput run(const std::vector<std::string>& args, const std::string& input = "") const;
+
+private:
+    const TestSettings& settings_;
+};
+
+// --- Function Prototypes ---
+void print_usage();
+bool parse_arguments(int argc, char* argv[], TestSettings& settings);
+std::vector<Check<Tester>> all_checks();
+bool run_scanr(const std::string& scanr, const std::vector<std::string>& args, const std::string& input_path, const std::string& error_path, RunOutput& result);
+std::string describe(const std::vector<std::string>& args);
+void check_recursive_order(Tester& tester);
+void check_pattern_cache(Tester& tester);
+void check_case_folding(Tester& tester);
+void check_json(Tester& tester);
+
+// --- Main Function ---
+int main(int argc, char* argv[]) {
+    TestSettings settings;
+    if (!parse_arguments(argc, argv, settings)) {
+        print_usage();
+        return 2;
+    }
+    if (!prepare_work_dir("scanr_test", settings.work_dir)) return 2;
+
+    Tester tester(settings);
+    if (tester.run({"--help"}).exit_code < 0) {
+        std::cerr << "scanr_test: cannot run '" << settings.scanr << "'" << std::endl;
+        return 2;
+    }
+    return run_checks("scanr_test", all_checks(), settings, tester);
+}
+
+// --- Helper Functions ---
+
+void print_usage() {
+    std::cerr << "Usage: scanr_test [OPTIONS]\n"
+              << "Check the output of a scanr binary on generated inputs.\n\n"
+              << "Options:\n"
+              << "  --scanr PATH       scanr binary to check (default: ./scanr, scanr.exe on Windows)\n"
+              << "  --work DIR         Scratch directory, emptied first (default: scanr_test_work)\n"
+              << "  --only TEXT        Run only the checks whose name contains TEXT\n"
+              << "  --help             Show this help message\n";
+}
+
+bool parse_arguments(int argc, char* argv[], TestSettings& settings) {
+    return parse_check_options("scanr_test", argc, argv, settings, [&](const std::string& arg, const std::string& value) {
+        if (arg != "--scanr") return false;
+        settings.scanr = value;
+        return true;
+    });
+}
+
+std::string Tester::path(const std::string& name) const {
+    return (fs::path(settings_.work_dir) / fs::path(name).make_preferred()).string();
+}
+
+std::string Tester::write_file(const std::string& name, const std::string& contents) const {
+    std::string file = path(name);
+    std::error_code error;
+    fs::create_directories(fs::path(file).parent_path(), error);
+    std::ofstream(file, std::ios::binary) << contents;
+    return file;
+}
+
+RunOutput Tester::run(const std::vector<std::string>& args, const std::string& input) const {
+    RunOutput result;
+    std::string input_path = write_file("stdin.txt", input);
+    if (!run_scanr(settings_.scanr, args, input_path, path("stderr.txt"), result)) result.exit_code = -1;
+    return result;
+}
+
+std::string describe(const std::vector<std::string>& args) {
+    std::string text = "scanr";
+    for (const std::string& arg : args) text += " '" + arg + "'";
+    return text;
+}
+
+// --- Running scanr ---
+
+// Run scanr once, with standard input read from 'input_path'. Its output is read from a
+// pipe (scanr flushes every line when writing to a console, which a check does not want);
+// standard error goes to 'error_path' and is read back.
+bool run_scanr(const std::string& scanr, const std::vector<std::string>& args, const std::string& input_path, const std::string& error_path, RunOutput& result) {
+    ChildResult child;
+    if (!run_child(scanr, args, input_path, error_path, [&](const char* data, size_t size) { result.out.append(data, size); }, child)) return false;
+    result.exit_code = child.exit_code;
+    result.err = read_file(error_path);
+    return true;
+}
+
+// --- Checks ---
+
+// Every check, in the order they run. Names are what --only selects on.
+std::vector<Check<Tester>> all_checks() {
+    return {
+        {"recursive_order", check_recursive_order},
+        {"pattern_cache", check_pattern_cache},
+        {"case_folding", check_case_folding},
+        {"json", check_json},
+    };
+}
+
+// -r lists a tree depth first with each directory's entries sorted by name, the same way on
+// every run, and -j N prints exactly what -j 1 prints
+void check_recursive_order(Tester& tester) {
+    static const std::string_view kWords[] = {"alpha", "beta", "TODO", "gamma", "delta", "FIXME", "epsilon"};
+    Rng rng(30);
+    std::vector<std::string> matching; // Relative paths of the files holding "TODO"
+    // Three levels of directories, names chosen so that readdir order is not sorted order
+    for (int file = 0; file < 400; ++file) {
+        std::string name;
+        int depth = static_cast<int>(rng.below(4));
+        for (int level = 0; level < depth; ++level) name += "d" + std::to_string(rng.below(6)) + "/";
+        name += "f" + std::to_string(rng.below(1000)) + (rng.one_in(2) ? ".txt" : ".log");
+        std::string text;
+        size_t lines = 1 + rng.below(40);
+        for (size_t line = 0; line < lines; ++line) {
+            for (int word = 0; word < 6; ++word) text += std::string(rng.pick(kWords)) + " ";
+            text += "\n";
+        }
+        tester.write_file("tree/" + name, text);
+    }
+
+    // The expected order, from the test's own walk
+    std::string root = tester.path("tree");
+    std::function<void(const fs::path&)> walk = [&](const fs::path& directory) {
+        std::vector<std::string> names;
+        for (const auto& entry : fs::directory_iterator(directory)) names.push_back(entry.path().filename().string());
+        std::sort(names.begin(), names.end());
+        for (const std::string& name : names) {
+            fs::path entry = directory / name;
+            if (fs::is_directory(entry)) {
+                walk(entry);
+            } else if (read_file(entry.string()).find("TODO") != std::string::npos) {
+                matching.push_back(entry.string());
+            }
+        }
+    };
+    walk(root);
+    std::string expected;
+    for (const std::string& file : matching) expected += file + "\n";
+
+    std::vector<std::string> list = {"-r", "-l", "TODO", root};
+    tester.expect_equal(tester.run(list).out, expected, describe(list) + ": sorted depth-first order");
+
+    const std::vector<std::vector<std::string>> queries = {{"-r", "-n", "TODO"}, {"-r", "-c", "FIXME"}, {"-r", "-C", "1", "gamma delta"}};
+    for (const auto& query : queries) {
+        std::vector<std::string> serial = {"-j", "1"};
+        serial.insert(serial.end(), query.begin(), query.end());
+        serial.push_back(root);
+        std::string baseline = tester.run(serial).out;
+        tester.expect(!baseline.empty(), describe(serial) + ": prints something");
+        for (int run = 0; run < 5; ++run) {
+            tester.expect_equal(tester.run(serial).out, baseline, describe(serial) + ": same output on every run");
+            std::vector<std::string> parallel = serial;
+            parallel[1] = "8";
+            tester.expect_equal(tester.run(parallel).out, baseline, describe(parallel) + ": same output as -j 1");
+        }
+    }
+}
+
+// The entry checksum of --pattern-cache, as scanr computes it over everything after the
+// header (magic, version, checksum: 20 bytes)
+static uint64_t pattern_cache_checksum(const std::string& data, size_t from) {
+    uint64_t size = data.size() - from;
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ size;
+    auto mix = [&](uint64_t word) {
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    };
+    size_t pos = from;
+    for (; pos + 8 <= data.size(); pos += 8) {
+        uint64_t word = 0;
+        std::memcpy(&word, data.data() + pos, 8);
+        mix(word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data.data() + pos, data.size() - pos);
+    mix(tail);
+    return hash ^ (hash >> 29);
+}
+
+// A damaged --pattern-cache entry is a miss: the output is what compiling the patterns
+// gives, and the entry is written again. An entry whose tables were changed behind a valid
+// checksum must not crash scanr either: every index is range-checked on load.
+void check_pattern_cache(Tester& tester) {
+    static const std::string_view kWords[] = {"alpha", "beta 42", "TODO", "fixme", "FIXED", "Gamma", "aa", "delta"};
+    Rng rng(22);
+    std::string text;
+    for (int line = 0; line < 300; ++line) {
+        for (int word = 0; word < 4; ++word) text += std::string(rng.pick(kWords)) + " ";
+        text += "\n";
+    }
+    std::string input = tester.write_file("cache/input.txt", text);
+    std::string directory = tester.path("cache/entries");
+
+    const std::vector<std::vector<std::string>> queries = {
+        {"-n", "-e", "TODO", "-e", "alpha", "-e", "delta"},
+        {"-n", "-E", "-i", "-e", "fix(me|ed)", "-e", "beta [0-9]+", "-e", "(a)\\1", "-e", "gamma"},
+    };
+    for (const auto& query : queries) {
+        std::vector<std::string> plain = query;
+        plain.push_back(input);
+        std::string expected = tester.run(plain).out;
+        tester.expect(!expected.empty(), describe(plain) + ": prints something");
+
+        std::error_code error;
+        fs::remove_all(directory, error);
+        std::vector<std::string> cached = {"--pattern-cache=" + directory};
+        cached.insert(cached.end(), plain.begin(), plain.end());
+        tester.expect_equal(tester.run(cached).out, expected, describe(cached) + ": same output when storing");
+        std::string entry_path;
+        for (const auto& entry : fs::directory_iterator(directory, error)) {
+            if (entry.path().extension() == ".scanr-patterns") entry_path = entry.path().string();
+        }
+        if (!tester.expect(!entry_path.empty(), describe(cached) + ": writes an entry")) continue;
+        const std::string entry = read_file(entry_path);
+        tester.expect_equal(tester.run(cached).out, expected, describe(cached) + ": same output when loading");
+
+        // Damage the checksum catches: truncation, flipped bytes, another version
+        std::vector<std::pair<std::string, std::string>> damaged;
+        damaged.push_back({"empty", ""});
+        damaged.push_back({"header only", entry.substr(0, 20)});
+        damaged.push_back({"truncated", entry.substr(0, entry.size() / 2)});
+        damaged.push_back({"one byte short", entry.substr(0, entry.size() - 1)});
+        damaged.push_back({"one byte more", entry + '\0'});
+        std::string version = entry;
+        version[8] = static_cast<char>(version[8] + 1);
+        damaged.push_back({"other version", version});
+        for (int flip = 0; flip < 20; ++flip) {
+            std::string bytes = entry;
+            size_t at = 20 + static_cast<size_t>(rng.below(entry.size() - 20));
+            bytes[at] = static_cast<char>(bytes[at] ^ (1 << rng.below(8)));
+            damaged.push_back({"bit flipped at " + std::to_string(at), bytes});
+        }
+        for (const auto& damage : damaged) {
+            std::ofstream(entry_path, std::ios::binary | std::ios::trunc) << damage.second;
+            RunOutput result = tester.run(cached);
+            tester.expect_equal(result.out, expected, describe(cached) + ": " + damage.first + " entry: same output");
+            tester.expect(read_file(entry_path) == entry, describe(cached) + ": " + damage.first + " entry: written again");
+        }
+
+        // Tables changed behind a valid checksum: whatever it prints, scanr exits normally
+        for (int forge = 0; forge < 200; ++forge) {
+            std::string bytes = entry;
+            for (int change = 0; change < 1 + static_cast<int>(rng.below(3)); ++change) {
+                size_t at = 20 + static_cast<size_t>(rng.below(entry.size() - 20));
+                bytes[at] = rng.one_in(2) ? static_cast<char>(bytes[at] ^ (1 << rng.below(8))) : static_cast<char>(rng.below(256));
+            }
+            uint64_t sum = pattern_cache_checksum(bytes, 20);
+            std::memcpy(&bytes[12], &sum, sizeof(sum));
+            std::ofstream(entry_path, std::ios::binary | std::ios::trunc) << bytes;
+            RunOutput result = tester.run(cached);
+            tester.expect(result.exit_code >= 0 && result.exit_code <= 2, describe(cached) + ": forged entry " + std::to_string(forge) + ": exits normally");
+        }
+    }
+}
+
+// -i folds both ways: every spelling of a case class in a pattern matches every other one in
+// the text, for literals, regexes and bracket expressions, with either regex engine
+void check_case_folding(Tester& tester) {
+    const std::vector<std::string> lines = {
+        "istanbul", "ISTANBUL", "\xC4\xB0stanbul", "\xC4\xB1stanbul", "stanbul",           // i, I, İ, ı
+        "\xC3\xA4rger", "\xC3\x84RGER", "\xC3\x80rger", "\xC3\xA5rger", "\xA4rger",       // ä, Ä, À, å, a stray byte
+        "stra\xC3\x9F" "e", "STRA\xE1\xBA\x9E" "E", "initialization", "\xC4\xB0N\xC4\xB0T\xC4\xB0" "ALIZAT\xC4\xB1" "ON",
+    };
+    std::string text;
+    for (const std::string& line : lines) text += line + "\n";
+    std::string input = tester.write_file("fold/input.txt", text);
+    auto expect_lines = [&](const std::vector<std::string>& args, const std::vector<size_t>& matching) {
+        std::string expected;
+        for (size_t index : matching) expected += lines[index] + "\n";
+        for (const char* engine : {"--regex-engine=dfa", "--regex-engine=std"}) {
+            std::vector<std::string> run = {engine};
+            run.insert(run.end(), args.begin(), args.end());
+            run.push_back(input);
+            tester.expect_equal(tester.run(run).out, expected, describe(run));
+        }
+    };
+
+    // Each of i, I, İ and ı finds all four, as a literal and in a regex
+    for (std::string i : {"i", "I", "\xC4\xB0", "\xC4\xB1"}) {
+        expect_lines({"-i", i + "stanbul"}, {0, 1, 2, 3});
+        expect_lines({"-i", "-E", "^" + i + "stan(bul)+$"}, {0, 1, 2, 3});
+    }
+    expect_lines({"-i", "initialization"}, {12, 13});
+    expect_lines({"-i", "\xC4\xB0NITIALIZATION"}, {12, 13});
+    // Both directions for the other letters
+    expect_lines({"-i", "\xC3\xA4rger"}, {5, 6});
+    expect_lines({"-i", "\xC3\x84RGER"}, {5, 6});
+    expect_lines({"-i", "STRASSE"}, {});
+    expect_lines({"-i", "stra\xE1\xBA\x9E" "e"}, {10, 11});
+    // Bracket expressions: members, ranges, and ASCII ranges covering i
+    expect_lines({"-i", "-E", "^[\xC3\xA4]rger"}, {5, 6});
+    expect_lines({"-i", "-E", "^[\xC3\x84x]RGER"}, {5, 6});
+    expect_lines({"-i", "-E", "^[\xC3\xA0-\xC3\xA4]rger"}, {5, 6, 7});
+    expect_lines({"-i", "-E", "^[\xC3\x80-\xC3\x84]rger"}, {5, 6, 7});
+    expect_lines({"-i", "-E", "^[a-z]stanbul"}, {0, 1, 2, 3});
+    expect_lines({"-i", "-E", "^[\xC4\xB1]stanbul"}, {0, 1, 2, 3});
+    expect_lines({"-i", "-E", "^[h-j]stanbul"}, {0, 1, 2, 3});
+    expect_lines({"-i", "-E", "^[j-z]stanbul"}, {});
+    expect_lines({"-i", "-E", "^[0-9]stanbul"}, {});
+}
+
+// --json: "text" leaves out the line end, CRLF too; a line that is not valid UTF-8 has its raw
+// bytes in "bytes"; offsets are bytes of the input, byte order mark included, whatever its
+// encoding, and spans are bytes of the line as UTF-8. The same whether the file is mapped,
+// streamed, or (for UTF-16) converted whole because of context.
+void check_json(Tester& tester) {
+    std::string lines[] = {"one timeout", "caf\xE9 timeout", "last timeout"};
+    auto expect_events = [&](const std::string& name, const std::string& contents, const std::string& expected_events) {
+        std::string file = tester.write_file("json/" + name, contents);
+        std::string quoted; // The name as a JSON string
+        for (char c : file) {
+            if (c == '\\' || c == '"') quoted += '\\';
+            quoted += c;
+        }
+        std::string expected;
+        std::istringstream events(expected_events);
+        for (std::string event; std::getline(events, event);) expected += "{\"type\":\"match\",\"file\":\"" + quoted + "\"," + event + "}\n";
+        for (const std::vector<std::string>& options : std::vector<std::vector<std::string>>{{}, {"--no-mmap"}, {"-C", "1"}}) {
+            std::vector<std::string> run = {"--json"};
+            run.insert(run.end(), options.begin(), options.end());
+            run.insert(run.end(), {"timeout", file});
+            tester.expect_equal(tester.run(run).out, expected, describe(run));
+        }
+    };
+
+    std::string utf8 = "\xEF\xBB\xBF" + lines[0] + "\r\n" + lines[1] + "\r\n" + lines[2];
+    expect_events("utf8.txt", utf8,
+                  "\"line\":1,\"offset\":3,\"text\":\"one timeout\",\"spans\":[[4,11]]\n"
+                  "\"line\":2,\"offset\":16,\"text\":\"caf\xEF\xBF\xBD timeout\",\"bytes\":\"Y2Fm6SB0aW1lb3V0\",\"spans\":[[5,12]]\n"
+                  "\"line\":3,\"offset\":30,\"text\":\"last timeout\",\"spans\":[[5,12]]\n");
+
+    std::string utf16 = "\xFF\xFE"; // Little endian; 0xE9 is a valid unit (U+00E9)
+    for (size_t i = 0; i < 3; ++i) {
+        for (char c : lines[i] + (i < 2 ? "\r\n" : "")) utf16 += std::string{c, '\0'};
+    }
+    expect_events("utf16.txt", utf16,
+                  "\"line\":1,\"offset\":2,\"text\":\"one timeout\",\"spans\":[[4,11]]\n"
+                  "\"line\":2,\"offset\":28,\"text\":\"caf\xC3\xA9 timeout\",\"spans\":[[6,13]]\n"
+                  "\"line\":3,\"offset\":56,\"text\":\"last timeout\",\"spans\":[[5,12]]\n");
+}
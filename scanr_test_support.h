@@ -0,0 +1,306 @@
+// scanr_test_support.h: What scanr_bench, scanr_test and scanr_decompress_test share.
+//
+// The seeded generator their inputs come from, running a binary as a child process with its
+// output read from a pipe, and, for the two test programs, the tally of comparisons, the
+// named checks with --only, and the scratch directory of --work. Header-only, so each
+// program still builds from its one source file.
+#ifndef SCANR_TEST_SUPPORT_H
+#define SCANR_TEST_SUPPORT_H
+
+#include <iostream>        // For progress and error messages
+#include <fstream>         // For reading files back
+#include <sstream>         // For read_file
+#include <string>          // For paths, arguments and output
+#include <vector>          // For arguments and checks
+#include <algorithm>       // For std::min
+#include <chrono>          // For timing a child process
+#include <filesystem>      // For the scratch directory
+#include <functional>      // For std::function
+#include <cstdint>         // For uint64_t
+#include <cstddef>         // For size_t
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>       // For CreateProcess, pipes
+#include <psapi.h>         // For GetProcessMemoryInfo (peak working set)
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <cerrno>          // For EINTR
+#include <fcntl.h>         // For open
+#include <unistd.h>        // For fork, execvp, pipe, read
+#include <sys/resource.h>  // For rusage (peak resident set size)
+#include <sys/wait.h>      // For wait4
+#endif
+
+// Small, fast generator with the same sequence on every platform and standard library
+// (std::uniform_int_distribution is not specified bit for bit)
+class Rng {
+public:
+    explicit Rng(uint64_t seed) : state_(seed) {}
+
+    // splitmix64
+    uint64_t next() {
+        uint64_t z = (state_ += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    uint64_t below(uint64_t limit) { return next() % limit; }
+    bool one_in(uint64_t n) { return below(n) == 0; }
+    template <class T, size_t N>
+    const T& pick(const T (&items)[N]) { return items[below(N)]; }
+
+private:
+    uint64_t state_;
+};
+
+// --- Child Processes ---
+
+// What one run of a child process gave
+struct ChildResult {
+    int exit_code = -1;
+    double seconds = 0;                 // From starting it until it has exited
+    unsigned long long peak_rss = 0;    // Bytes (0 if the platform does not report it)
+};
+
+#ifdef _WIN32
+// Quote one argument for CommandLineToArgvW / the MSVC runtime: backslashes are literal
+// unless they precede a quote, in which case they are doubled
+inline std::string quote_argument(const std::string& arg) {
+    if (!arg.empty() && arg.find_first_of(" \t\"") == std::string::npos) return arg;
+    std::string quoted = "\"";
+    size_t backslashes = 0;
+    for (char c : arg) {
+        if (c == '\\') {
+            ++backslashes;
+            continue;
+        }
+        quoted.append(c == '"' ? backslashes * 2 + 1 : backslashes, '\\');
+        backslashes = 0;
+        quoted.push_back(c);
+    }
+    quoted.append(backslashes * 2, '\\');
+    quoted.push_back('"');
+    return quoted;
+}
+#endif
+
+// Run 'program' with 'args' and wait for it. Its standard input is the file 'input_path'
+// (this process's own if that is empty) and its standard error goes to the file
+// 'error_path'. Its standard output goes through a pipe (like a real consumer, and no
+// console, where scanr flushes every line) and is handed to 'output' as it arrives. False if
+// the program could not be started.
+inline bool run_child(const std::string& program, const std::vector<std::string>& args, const std::string& input_path, const std::string& error_path,
+                      const std::function<void(const char*, size_t)>& output, ChildResult& result) {
+#ifdef _WIN32
+    std::string command_line = quote_argument(program);
+    for (const std::string& arg : args) command_line += " " + quote_argument(arg);
+
+    SECURITY_ATTRIBUTES inherit{sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE};
+    HANDLE read_end, write_end;
+    if (!CreatePipe(&read_end, &write_end, &inherit, 0)) return false;
+    SetHandleInformation(read_end, HANDLE_FLAG_INHERIT, 0);
+    HANDLE input_file = input_path.empty() ? INVALID_HANDLE_VALUE
+                                           : CreateFileA(input_path.c_str(), GENERIC_READ, FILE_SHARE_READ, &inherit, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    HANDLE error_file = CreateFileA(error_path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, &inherit, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    STARTUPINFOA startup{};
+    startup.cb = sizeof(startup);
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdInput = input_path.empty() ? GetStdHandle(STD_INPUT_HANDLE) : input_file;
+    startup.hStdOutput = write_end;
+    startup.hStdError = error_file;
+    PROCESS_INFORMATION process{};
+    auto start = std::chrono::steady_clock::now();
+    BOOL created = CreateProcessA(nullptr, command_line.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup, &process);
+    CloseHandle(write_end); // Only the child writes: reads end when it exits
+    if (input_file != INVALID_HANDLE_VALUE) CloseHandle(input_file);
+    if (error_file != INVALID_HANDLE_VALUE) CloseHandle(error_file);
+    if (!created) {
+        CloseHandle(read_end);
+        return false;
+    }
+
+    std::vector<char> buffer(1 << 16);
+    DWORD got = 0;
+    while (ReadFile(read_end, buffer.data(), static_cast<DWORD>(buffer.size()), &got, nullptr) && got > 0) output(buffer.data(), got);
+    CloseHandle(read_end);
+    WaitForSingleObject(process.hProcess, INFINITE);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    DWORD exit_code = 0;
+    GetExitCodeProcess(process.hProcess, &exit_code);
+    result.exit_code = static_cast<int>(exit_code);
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (GetProcessMemoryInfo(process.hProcess, &counters, sizeof(counters))) result.peak_rss = counters.PeakWorkingSetSize;
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+#else
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(program.c_str()));
+    for (const std::string& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    int pipe_fds[2];
+    if (::pipe(pipe_fds) != 0) return false;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        ::close(pipe_fds[0]);
+        ::close(pipe_fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        if (!input_path.empty()) {
+            int input_fd = ::open(input_path.c_str(), O_RDONLY);
+            if (input_fd >= 0) ::dup2(input_fd, STDIN_FILENO);
+        }
+        int error_fd = ::open(error_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ::dup2(pipe_fds[1], STDOUT_FILENO);
+        if (error_fd >= 0) ::dup2(error_fd, STDERR_FILENO);
+        ::close(pipe_fds[0]);
+        ::close(pipe_fds[1]);
+        ::execvp(argv[0], argv.data());
+        ::_exit(127);
+    }
+    ::close(pipe_fds[1]); // Only the child writes: reads end when it exits
+
+    std::vector<char> buffer(1 << 16);
+    for (;;) {
+        ssize_t got = ::read(pipe_fds[0], buffer.data(), buffer.size());
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        output(buffer.data(), static_cast<size_t>(got));
+    }
+    ::close(pipe_fds[0]);
+
+    int status = 0;
+    struct rusage usage {};
+    while (::wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) return false;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    if (result.exit_code == 127) return false; // execvp failed: no such binary
+#ifdef __APPLE__
+    result.peak_rss = static_cast<unsigned long long>(usage.ru_maxrss); // Bytes on macOS
+#else
+    result.peak_rss = static_cast<unsigned long long>(usage.ru_maxrss) * 1024; // KiB elsewhere
+#endif
+#endif
+    return true;
+}
+
+// --- Test Programs ---
+
+inline std::string read_file(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+// The comparisons of a test program, counted by the check they belong to
+class CheckTally {
+public:
+    // Record the outcome of one comparison of the current check
+    bool expect(bool passed, const std::string& what) {
+        ++checks;
+        if (!passed) {
+            ++failures;
+            std::cerr << "FAIL " << check_ << ": " << what << std::endl;
+        }
+        return passed;
+    }
+
+    // On a mismatch, print both sides from the first line that differs
+    bool expect_equal(const std::string& actual, const std::string& expected, const std::string& what) {
+        if (actual == expected) return expect(true, what);
+        size_t differ = 0;
+        while (differ < std::min(actual.size(), expected.size()) && actual[differ] == expected[differ]) ++differ;
+        size_t line = expected.rfind('\n', differ == 0 ? 0 : differ - 1);
+        line = line == std::string::npos ? 0 : line + 1;
+        auto excerpt = [&](const std::string& text) { return text.substr(std::min(line, text.size()), 200); };
+        return expect(false, what + "\n  expected: " + excerpt(expected) + "\n  actual:   " + excerpt(actual));
+    }
+
+    void begin(const std::string& check) { check_ = check; }
+    int checks = 0;
+    int failures = 0;
+
+private:
+    std::string check_;
+};
+
+// The options every test program has
+struct CheckOptions {
+    std::string work_dir; // --work DIR: Scratch directory, emptied first
+    std::string only;     // --only TEXT: Run only the checks whose name contains TEXT
+};
+
+// One named check, run on a test program's Tester (a CheckTally). Names are what --only
+// selects on.
+template <class Tester>
+struct Check {
+    const char* name;
+    std::function<void(Tester&)> run;
+};
+
+// Read "--OPTION VALUE" pairs: --work and --only into 'options', the others handed to
+// 'option' (false: unknown). False on --help or an error ('program' reports which).
+inline bool parse_check_options(const char* program, int argc, char* argv[], CheckOptions& options,
+                                const std::function<bool(const std::string& arg, const std::string& value)>& option) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help") return false;
+        if (i + 1 >= argc) {
+            std::cerr << program << ": Unknown option or missing value: '" << arg << "'" << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--work") {
+            options.work_dir = value;
+        } else if (arg == "--only") {
+            options.only = value;
+        } else if (!option(arg, value)) {
+            std::cerr << program << ": Unknown option '" << arg << "'" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Empty the scratch directory (creating it if needed); false, reported, if that fails
+inline bool prepare_work_dir(const char* program, const std::string& work_dir) {
+    std::error_code error;
+    std::filesystem::remove_all(work_dir, error);
+    std::filesystem::create_directories(work_dir, error);
+    if (error) {
+        std::cerr << program << ": cannot create '" << work_dir << "'" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Run the checks --only selects, then print the tally. Returns the exit status: 1 if any
+// comparison failed.
+template <class Tester>
+int run_checks(const char* program, const std::vector<Check<Tester>>& checks, const CheckOptions& options, Tester& tester) {
+    for (const Check<Tester>& check : checks) {
+        if (!options.only.empty() && std::string(check.name).find(options.only) == std::string::npos) continue;
+        std::cerr << program << ": " << check.name << std::endl;
+        tester.begin(check.name);
+        check.run(tester);
+    }
+    std::cerr << program << ": " << tester.checks << " comparison(s), " << tester.failures << " failed" << std::endl;
+    return tester.failures == 0 ? 0 : 1;
+}
+
+#endif // SCANR_TEST_SUPPORT_H